@@ -0,0 +1,91 @@
+/*
+ * Copyright (C) 2024 CYGNO Collaboration
+ *
+ *
+ * Author: Stefano Piacentini
+ * Created in 2024
+ *
+ */
+
+// Compares the DRS4 correction modes (rotate-on-the-fly vs precomputed LUT) for every
+// instruction set level supported by the CPU, on synthetic V1742 events. Before the timings the two
+// modes are checked to give the same waveforms for every start index cell.
+//
+// usage: drs4bench [nevents]
+// It returns 1 if the two modes differ.
+
+#include "drs4.h"
+#include "cygnosimd.h"
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <vector>
+
+int main(int argc, char **argv) {
+    
+    int nevents = argc > 1 ? std::atoi(argv[1]) : 20000;
+    const unsigned int nch = 8;
+    const unsigned int ncells = 1024;
+    
+    std::mt19937 rng(12345);
+    cygnolib::DRS4Calibration calib(nch, ncells);
+    for(unsigned int ch=0; ch<nch; ch++) {
+        for(unsigned int i=0; i<ncells; i++) {
+            calib.GetCell(ch)[i]    = int(rng()%160) - 60;
+            calib.GetNSample(ch)[i] = -int(rng()%6);
+        }
+    }
+    
+    // a pool of events larger than the caches, with random start index cells
+    const unsigned int npool = 512;
+    cygnolib::AlignedVector<uint16_t> pool(std::size_t(npool)*nch*ncells);
+    for(auto &x : pool) x = 2000 + rng()%100;
+    std::vector<unsigned int> SIC(nevents);
+    for(auto &x : SIC) x = rng()%ncells;
+    
+    cygnolib::SimdLevel supported = cygnolib::GetSupportedSimdLevel();
+    std::cout<<"events: "<<nevents<<", channels: "<<nch<<", cells: "<<ncells<<std::endl;
+    
+    cygnolib::DRS4Calibration rotate(calib), lut(calib);
+    lut.SetMode(cygnolib::DRS4Mode::LUT);
+    
+    for(int level=0; level<=(int)supported; level++) {
+        cygnolib::SetSimdLevel((cygnolib::SimdLevel)level);
+        // a faster mode is only worth timing if it gives the same waveforms
+        for(unsigned int sic=0; sic<ncells; sic++) {
+            const uint16_t *wfs = pool.data() + std::size_t(sic%npool)*nch*ncells;
+            for(unsigned int ch=0; ch<nch; ch++) {
+                std::vector<uint16_t> rotated(wfs + ch*ncells, wfs + (ch+1)*ncells), looked_up(rotated);
+                rotate.Correct(rotated.data(), ch, sic);
+                lut.Correct(looked_up.data(), ch, sic);
+                if(rotated!=looked_up) {
+                    std::cerr<<cygnolib::SimdLevelName(cygnolib::GetSimdLevel())<<": LUT and rotate differ for channel "
+                             <<ch<<", SIC "<<sic<<std::endl;
+                    return 1;
+                }
+            }
+        }
+        for(cygnolib::DRS4Mode mode : {cygnolib::DRS4Mode::Rotate, cygnolib::DRS4Mode::LUT}) {
+            auto start0 = std::chrono::high_resolution_clock::now();
+            calib.SetMode(mode);
+            auto start = std::chrono::high_resolution_clock::now();
+            for(int evt=0; evt<nevents; evt++) {
+                uint16_t *wfs = pool.data() + std::size_t(evt%npool)*nch*ncells;
+                for(unsigned int ch=0; ch<nch; ch++) {
+                    calib.Correct(wfs + ch*ncells, ch, SIC[evt]);
+                }
+            }
+            auto stop = std::chrono::high_resolution_clock::now();
+            double setup = std::chrono::duration<double, std::milli>(start - start0).count();
+            double ns = std::chrono::duration<double, std::nano>(stop - start).count() / (double(nevents)*nch);
+            std::cout<<std::setw(8)<<cygnolib::SimdLevelName(cygnolib::GetSimdLevel())
+                     <<std::setw(8)<<(mode==cygnolib::DRS4Mode::LUT ? "LUT" : "rotate")
+                     <<"  "<<std::fixed<<std::setprecision(1)<<ns<<" ns/channel"
+                     <<"  (setup "<<setup<<" ms)"<<std::endl;
+        }
+    }
+    
+    return 0;
+}
@@ -0,0 +1,52 @@
+# Generates a header with the DRS4 correction tables of the given tags compiled in as
+# constexpr aligned int16 arrays. The text tables are read from input/table_{cell,nsample}_<tag>.txt
+# and have one line of whitespace-separated integers per channel.
+#
+# embed_drs4_tables(<output header> <input dir> <tag> [<tag> ...])
+
+function(embed_drs4_tables output inputdir)
+    set(content "// Generated by cmake/EmbedDRS4Tables.cmake: do not edit.\n\n")
+    string(APPEND content "#ifndef __CYGNO_DRS4_EMBEDDED_TABLES_H__\n#define __CYGNO_DRS4_EMBEDDED_TABLES_H__\n\n")
+    string(APPEND content "#include <cstdint>\n\nnamespace cygnolib {\nnamespace embedded {\n\n")
+    set(entries "")
+    foreach(tag IN LISTS ARGN)
+        foreach(table cell nsample)
+            set(fname "${inputdir}/table_${table}_${tag}.txt")
+            set_property(DIRECTORY APPEND PROPERTY CMAKE_CONFIGURE_DEPENDS "${fname}")
+            file(STRINGS "${fname}" lines)
+            set(values "")
+            set(nchannels 0)
+            set(ncells "")
+            foreach(line IN LISTS lines)
+                string(STRIP "${line}" line)
+                if(line STREQUAL "")
+                    continue()
+                endif()
+                string(REGEX REPLACE "[ \t]+" ";" row "${line}")
+                list(LENGTH row rowcells)
+                if(ncells STREQUAL "")
+                    set(ncells ${rowcells})
+                elseif(NOT rowcells EQUAL ncells)
+                    message(FATAL_ERROR "embed_drs4_tables: rows of different length in ${fname}")
+                endif()
+                string(REPLACE ";" ", " row "${row}")
+                string(APPEND values "    ${row},\n")
+                math(EXPR nchannels "${nchannels} + 1")
+            endforeach()
+            if(table STREQUAL "cell")
+                set(cell_shape "${nchannels}x${ncells}")
+            elseif(NOT cell_shape STREQUAL "${nchannels}x${ncells}")
+                message(FATAL_ERROR "embed_drs4_tables: the ${tag} 'cell' and 'nsample' tables have different shapes")
+            endif()
+            string(APPEND content "alignas(64) constexpr int16_t k${table}_${tag}[${nchannels}*${ncells}] = {\n${values}};\n\n")
+        endforeach()
+        string(APPEND entries "    {\"${tag}\", ${nchannels}, ${ncells}, kcell_${tag}, knsample_${tag}},\n")
+    endforeach()
+    string(APPEND content "struct DRS4Table {\n    const char *tag;\n    unsigned int nchannels;\n    unsigned int ncells;\n")
+    string(APPEND content "    const int16_t *cell;\n    const int16_t *nsample;\n};\n\n")
+    string(APPEND content "constexpr DRS4Table kDRS4Tables[] = {\n${entries}};\n\n")
+    string(APPEND content "}\n}\n\n#endif\n")
+    # configure_file() only touches the header when its content changes (file(CONFIGURE) needs CMake 3.18)
+    file(WRITE "${output}.in" "${content}")
+    configure_file("${output}.in" "${output}" COPYONLY)
+endfunction()
@@ -0,0 +1,146 @@
+/*
+ * Copyright (C) 2024 CYGNO Collaboration
+ *
+ *
+ * Author: Stefano Piacentini
+ * Created in 2024
+ *
+ */
+
+#ifndef __CYGNO_CLUSTERING_H__
+#define __CYGNO_CLUSTERING_H__
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <vector>
+#include "cygnobuffer.h"
+#include "cygnothreads.h"
+#include "zerosuppression.h"
+
+
+namespace cygnolib {
+
+    /**
+     * @class HitClusters
+     * @brief The clusters found among the hits of a HitList
+     * @author CYGNO Collaboration
+     *
+     * @details Every hit has a label, the index of its cluster or -1 if it belongs to none. The
+     * hits of every cluster are also listed, as indices into the HitList in row-major order:
+     * the hits of cluster k are GetHits()[GetOffsets()[k]], ..., GetHits()[GetOffsets()[k+1]-1].
+     *
+     * Clustering algorithms fill the labels (Reset(), then GetLabels()) and call Index() to build
+     * the lists.
+     *
+     */
+    class HitClusters {
+    public:
+        HitClusters() {}
+
+        /**
+         * @brief This method removes all the clusters and sets the labels of nhits hits to -1
+         */
+        void Reset(std::size_t nhits);
+
+        /**
+         * @brief This method builds the hit lists of the clusters from the labels
+         *
+         * @param[in] nclusters number of clusters; labels must be -1 or in [0, nclusters)
+         */
+        void Index(std::size_t nclusters);
+
+        std::size_t GetNClusters() const { return fOffsets.empty() ? 0 : fOffsets.size()-1; }
+
+        /**
+         * @brief This method returns the label of every hit
+         */
+        Span<int32_t> GetLabels() { return Span<int32_t>(fLabels.data(), fLabels.size()); }
+        Span<const int32_t> GetLabels() const { return Span<const int32_t>(fLabels.data(), fLabels.size()); }
+
+        Span<const uint32_t> GetOffsets() const { return Span<const uint32_t>(fOffsets.data(), fOffsets.size()); }
+        Span<const uint32_t> GetHits() const { return Span<const uint32_t>(fHits.data(), fHits.size()); }
+
+        /**
+         * @brief This method returns the indices of the hits of cluster k
+         */
+        Span<const uint32_t> GetCluster(std::size_t k) const {
+            return Span<const uint32_t>(fHits.data() + fOffsets[k], fOffsets[k+1] - fOffsets[k]);
+        }
+        std::size_t GetClusterSize(std::size_t k) const { return fOffsets[k+1] - fOffsets[k]; }
+
+    private:
+        AlignedVector<int32_t> fLabels;
+        AlignedVector<uint32_t> fOffsets;
+        AlignedVector<uint32_t> fHits;
+    };
+
+    /**
+     * @brief Pixel adjacency used by the connected-component labeling
+     */
+    enum class Connectivity {
+        Four  = 4, ///< pixels sharing a side
+        Eight = 8  ///< pixels sharing a side or a corner
+    };
+
+    /**
+     * @class ComponentLabeler
+     * @brief Connected-component labeling of the hits of camera frames
+     * @author CYGNO Collaboration
+     *
+     * @details Adjacent hits are grouped into clusters with a union-find over the runs of
+     * consecutive hits of every row. The frame is split in bands of rows that are labeled in
+     * parallel, each one touching only its own hits, and the union-find trees of neighbouring bands
+     * are then merged along their boundary rows. Clusters are numbered in row-major order of their
+     * first hit, so the result does not depend on the number of threads.
+     *
+     * The work is proportional to the number of hits, not to the size of the frame. The internal
+     * buffers only grow, so one labeler should be reused across frames.
+     *
+     */
+    class ComponentLabeler {
+    public:
+        /**
+         * @brief Constructor.
+         *
+         * @param[in] connectivity pixel adjacency. Default is Connectivity::Eight.
+         * @param[in] nthreads number of threads, the calling one included. Default value is 0 (GetDefaultNThreads()).
+         * @param[in] band_rows number of rows of the bands labeled in parallel. Default value is 64.
+         *
+         */
+        explicit ComponentLabeler(Connectivity connectivity = Connectivity::Eight,
+                                  unsigned int nthreads = 0, unsigned int band_rows = 64);
+
+        Connectivity GetConnectivity() const { return fConnectivity; }
+        unsigned int GetNThreads() const { return fPool ? fPool->GetNThreads()+1 : 1; }
+
+        /**
+         * @brief This method labels the connected components of a list of hits
+         *
+         * @param[in] hits the hits, e.g. from ZeroSuppress()
+         * @param[out] clusters the connected components; every hit belongs to one of them
+         *
+         */
+        void Label(const HitList &hits, HitClusters &clusters);
+
+    private:
+        void ForEachBand(std::size_t nbands, const std::function<void(std::size_t)> &fn);
+        void MergeRows(const HitList &hits, unsigned int upper, unsigned int lower);
+        uint32_t Find(uint32_t x);
+        void Union(uint32_t a, uint32_t b);
+
+        Connectivity fConnectivity;
+        unsigned int fBandRows;
+        std::unique_ptr<WorkerPool> fPool;
+
+        // indexed by the first hit of each run
+        AlignedVector<uint32_t> fParent;
+        AlignedVector<uint32_t> fRunEnd;
+        AlignedVector<uint32_t> fRoot;
+        std::vector<std::size_t> fBandClusters;
+    };
+
+}
+
+#endif
@@ -0,0 +1,296 @@
+/*
+ * Copyright (C) 2024 CYGNO Collaboration
+ *
+ *
+ * Author: Stefano Piacentini
+ * Created in 2024
+ *
+ */
+
+#ifndef __CYGNO_BUFFER_H__
+#define __CYGNO_BUFFER_H__
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+
+namespace cygnolib {
+
+    /**
+     * @brief Default alignment (in bytes) of the cygnolib buffers. It matches the cache line size and
+     * the width of an AVX-512 register.
+     */
+    constexpr std::size_t kBufferAlignment = 64;
+
+    /**
+     * @brief Counters of the heap traffic of the cygnolib buffers
+     *
+     * @details Every allocation and deallocation made through AlignedAllocator is counted, so that
+     * the number of allocations per event of a given code path can be measured by taking the
+     * difference of two snapshots (see GetBufferStats()).
+     */
+    struct BufferStats {
+        uint64_t allocations   = 0; ///< number of calls to AlignedAllocator::allocate
+        uint64_t deallocations = 0; ///< number of calls to AlignedAllocator::deallocate
+        uint64_t bytes         = 0; ///< total number of bytes allocated
+    };
+
+    namespace detail {
+        inline std::atomic<uint64_t> gBufferAllocations{0};
+        inline std::atomic<uint64_t> gBufferDeallocations{0};
+        inline std::atomic<uint64_t> gBufferBytes{0};
+        inline thread_local BufferStats tBufferStats;
+    }
+
+    /**
+     * @brief This function returns a snapshot of the buffer allocation counters
+     *
+     * @return the counters accumulated since the start of the program or the last ResetBufferStats()
+     */
+    inline BufferStats GetBufferStats() {
+        BufferStats stats;
+        stats.allocations   = detail::gBufferAllocations.load(std::memory_order_relaxed);
+        stats.deallocations = detail::gBufferDeallocations.load(std::memory_order_relaxed);
+        stats.bytes         = detail::gBufferBytes.load(std::memory_order_relaxed);
+        return stats;
+    }
+
+    /**
+     * @brief This function returns a snapshot of the buffer allocation counters of the calling thread
+     *
+     * @details Unlike GetBufferStats(), the difference of two snapshots only counts the allocations
+     * made by the calling thread in between, also while other threads are allocating.
+     *
+     * @return the counters accumulated by the calling thread since its start
+     */
+    inline BufferStats GetThreadBufferStats() {
+        return detail::tBufferStats;
+    }
+
+    /**
+     * @brief This function sets the buffer allocation counters to zero
+     */
+    inline void ResetBufferStats() {
+        detail::gBufferAllocations.store(0, std::memory_order_relaxed);
+        detail::gBufferDeallocations.store(0, std::memory_order_relaxed);
+        detail::gBufferBytes.store(0, std::memory_order_relaxed);
+    }
+
+    /**
+     * @class AlignedAllocator
+     * @brief A std::allocator replacement returning memory aligned to Alignment bytes
+     * @author CYGNO Collaboration
+     *
+     * @details The allocator is stateless, so containers using it can be freely moved and swapped.
+     *
+     */
+    template <typename T, std::size_t Alignment = kBufferAlignment>
+    class AlignedAllocator {
+    public:
+        using value_type = T;
+
+        template <typename U>
+        struct rebind {
+            using other = AlignedAllocator<U, Alignment>;
+        };
+
+        AlignedAllocator() noexcept {}
+        template <typename U>
+        AlignedAllocator(const AlignedAllocator<U, Alignment> &) noexcept {}
+
+        T *allocate(std::size_t n) {
+            if (n > std::size_t(-1) / sizeof(T)) throw std::bad_alloc();
+            // std::aligned_alloc requires the size to be a multiple of the alignment
+            std::size_t bytes = (n*sizeof(T) + Alignment - 1) / Alignment * Alignment;
+            void *p = std::aligned_alloc(Alignment, bytes > 0 ? bytes : Alignment);
+            if (!p) throw std::bad_alloc();
+            detail::gBufferAllocations.fetch_add(1, std::memory_order_relaxed);
+            detail::gBufferBytes.fetch_add(bytes, std::memory_order_relaxed);
+            detail::tBufferStats.allocations++;
+            detail::tBufferStats.bytes += bytes;
+            return static_cast<T *>(p);
+        }
+        void deallocate(T *p, std::size_t) noexcept {
+            detail::gBufferDeallocations.fetch_add(1, std::memory_order_relaxed);
+            detail::tBufferStats.deallocations++;
+            std::free(p);
+        }
+    };
+
+    template <typename T, typename U, std::size_t A>
+    bool operator==(const AlignedAllocator<T, A> &, const AlignedAllocator<U, A> &) { return true; }
+    template <typename T, typename U, std::size_t A>
+    bool operator!=(const AlignedAllocator<T, A> &, const AlignedAllocator<U, A> &) { return false; }
+
+    /**
+     * @brief A std::vector whose data are aligned to kBufferAlignment bytes
+     */
+    template <typename T>
+    using AlignedVector = std::vector<T, AlignedAllocator<T>>;
+
+
+    /**
+     * @class Span
+     * @brief A minimal non-owning view over a contiguous array (a subset of C++20 std::span)
+     * @author CYGNO Collaboration
+     *
+     */
+    template <typename T>
+    class Span {
+    public:
+        Span(): fData(nullptr), fSize(0) {}
+        Span(T *data, std::size_t size): fData(data), fSize(size) {}
+        template <typename U>
+        Span(const Span<U> &other): fData(other.data()), fSize(other.size()) {}
+
+        T *data() const { return fData; }
+        std::size_t size() const { return fSize; }
+        bool empty() const { return fSize == 0; }
+        T *begin() const { return fData; }
+        T *end() const { return fData + fSize; }
+        T &operator[](std::size_t i) const { return fData[i]; }
+
+    private:
+        T *fData;
+        std::size_t fSize;
+    };
+
+
+    /**
+     * @class ImageView
+     * @brief A non-owning 2D view over a row-major image
+     * @author CYGNO Collaboration
+     *
+     * @details Rows are stride elements apart in memory. When stride equals the number of columns the
+     * view is contiguous and the whole image can be processed as a single array.
+     *
+     */
+    template <typename T>
+    class ImageView {
+    public:
+        ImageView(): fData(nullptr), fNRows(0), fNColumns(0), fStride(0) {}
+        ImageView(T *data, unsigned int nrows, unsigned int ncolumns, std::size_t stride):
+            fData(data), fNRows(nrows), fNColumns(ncolumns), fStride(stride) {}
+        ImageView(T *data, unsigned int nrows, unsigned int ncolumns):
+            ImageView(data, nrows, ncolumns, ncolumns) {}
+        template <typename U>
+        ImageView(const ImageView<U> &other):
+            fData(other.Data()), fNRows(other.GetNRows()), fNColumns(other.GetNColumns()), fStride(other.GetStride()) {}
+
+        unsigned int GetNRows() const { return fNRows; }
+        unsigned int GetNColumns() const { return fNColumns; }
+        std::size_t GetStride() const { return fStride; }
+        bool IsContiguous() const { return fStride == fNColumns; }
+
+        T *Data() const { return fData; }
+
+        Span<T> Row(unsigned int r) const { return Span<T>(fData + r*fStride, fNColumns); }
+        T &operator()(unsigned int r, unsigned int c) const { return fData[r*fStride + c]; }
+        T &At(unsigned int r, unsigned int c) const {
+            if (r >= fNRows || c >= fNColumns) {
+                throw std::out_of_range("cygnolib::ImageView::At: pixel ("+std::to_string(r)+", "+
+                                        std::to_string(c)+") out of range.");
+            }
+            return (*this)(r, c);
+        }
+
+    private:
+        T *fData;
+        unsigned int fNRows;
+        unsigned int fNColumns;
+        std::size_t fStride;
+    };
+
+
+    /**
+     * @class EventView
+     * @brief A non-owning view over the channels of one digitizer event
+     * @author CYGNO Collaboration
+     *
+     * @details Channel rows are contiguous and stride elements apart in memory, so that
+     * view[ch][samp] addresses the sample samp of the channel ch.
+     *
+     */
+    template <typename T>
+    class EventView {
+    public:
+        EventView(): fData(nullptr), fNChannels(0), fNSamples(0), fStride(0) {}
+        EventView(T *data, unsigned int nchannels, unsigned int nsamples, std::size_t stride):
+            fData(data), fNChannels(nchannels), fNSamples(nsamples), fStride(stride) {}
+        template <typename U>
+        EventView(const EventView<U> &other):
+            fData(other.Data()), fNChannels(other.GetNChannels()), fNSamples(other.GetNSamples()), fStride(other.GetStride()) {}
+
+        unsigned int GetNChannels() const { return fNChannels; }
+        unsigned int GetNSamples() const { return fNSamples; }
+        std::size_t GetStride() const { return fStride; }
+        T *Data() const { return fData; }
+
+        Span<T> operator[](unsigned int ch) const { return Span<T>(fData + ch*fStride, fNSamples); }
+
+    private:
+        T *fData;
+        unsigned int fNChannels;
+        unsigned int fNSamples;
+        std::size_t fStride;
+    };
+
+
+    /**
+     * @class WaveformView
+     * @brief A non-owning strided [event][channel][sample] view over digitizer waveforms
+     * @author CYGNO Collaboration
+     *
+     * @details The waveforms are stored in a single array; each channel row holds nsamples
+     * contiguous samples. view[evt][ch][samp], view(evt, ch, samp) and view.Channel(evt, ch) are all
+     * equivalent ways to reach the data.
+     *
+     */
+    template <typename T>
+    class WaveformView {
+    public:
+        WaveformView(): fData(nullptr), fNEvents(0), fNChannels(0), fNSamples(0), fChannelStride(0), fEventStride(0) {}
+        WaveformView(T *data, unsigned int nevents, unsigned int nchannels, unsigned int nsamples):
+            fData(data), fNEvents(nevents), fNChannels(nchannels), fNSamples(nsamples),
+            fChannelStride(nsamples), fEventStride(std::size_t(nchannels)*nsamples) {}
+        template <typename U>
+        WaveformView(const WaveformView<U> &other):
+            fData(other.Data()), fNEvents(other.GetNEvents()), fNChannels(other.GetNChannels()), fNSamples(other.GetNSamples()),
+            fChannelStride(other.GetChannelStride()), fEventStride(other.GetEventStride()) {}
+
+        unsigned int GetNEvents() const { return fNEvents; }
+        unsigned int GetNChannels() const { return fNChannels; }
+        unsigned int GetNSamples() const { return fNSamples; }
+        std::size_t GetChannelStride() const { return fChannelStride; }
+        std::size_t GetEventStride() const { return fEventStride; }
+        std::size_t size() const { return fNEvents; }
+        T *Data() const { return fData; }
+
+        EventView<T> operator[](unsigned int evt) const {
+            return EventView<T>(fData + evt*fEventStride, fNChannels, fNSamples, fChannelStride);
+        }
+        Span<T> Channel(unsigned int evt, unsigned int ch) const {
+            return Span<T>(fData + evt*fEventStride + ch*fChannelStride, fNSamples);
+        }
+        T &operator()(unsigned int evt, unsigned int ch, unsigned int samp) const {
+            return fData[evt*fEventStride + ch*fChannelStride + samp];
+        }
+
+    private:
+        T *fData;
+        unsigned int fNEvents;
+        unsigned int fNChannels;
+        unsigned int fNSamples;
+        std::size_t fChannelStride;
+        std::size_t fEventStride;
+    };
+
+}
+
+#endif
@@ -0,0 +1,170 @@
+/*
+ * Copyright (C) 2024 CYGNO Collaboration
+ *
+ *
+ * Author: Stefano Piacentini
+ * Created in 2024
+ *
+ */
+
+#ifndef __CYGNO_INDEX_H__
+#define __CYGNO_INDEX_H__
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "midasio.h"
+
+
+namespace cygnolib {
+
+    /**
+     * @brief Default distance (in uncompressed bytes) between two checkpoints of a MidasIndex
+     */
+    constexpr uint64_t kMidasIndexSpan = 8*1024*1024;
+
+    /**
+     * @class MidasIndex
+     * @brief A random-access index of a MIDAS file, plain or gzip-compressed
+     * @author CYGNO Collaboration
+     *
+     * @details The index holds the offset of every event in the uncompressed stream and, for
+     * .mid.gz files, a list of checkpoints in the style of zlib's zran example: at a deflate block
+     * boundary roughly every span uncompressed bytes it records the compressed and uncompressed
+     * positions, the bit offset and the last 32 KB of output (the inflate window). Starting to
+     * inflate at the checkpoint preceding an event then costs at most span bytes of decompression,
+     * whatever the position of the event in the file (see OpenMidasFile(std::string, const
+     * MidasIndex&, std::size_t)).
+     *
+     * The index can be saved as a sidecar file next to the MIDAS file (see
+     * GetMidasIndexFilename()), which stores the windows compressed and is validated against the
+     * size of the MIDAS file when loaded.
+     *
+     */
+    class MidasIndex {
+    public:
+        /**
+         * @brief A point of the compressed stream where decompression can start
+         */
+        struct Checkpoint {
+            uint64_t out;                       ///< offset in the uncompressed stream
+            uint64_t in;                        ///< offset in the compressed file of the first full byte
+            int bits;                           ///< bits of the byte before in that belong to the next block (0-7)
+            bool member;                        ///< true at the start of a gzip member (no window needed)
+            std::vector<unsigned char> window;  ///< compressed 32 KB inflate window
+        };
+
+        MidasIndex() {}
+
+        /**
+         * @brief This function builds the index by reading the whole file once
+         *
+         * @param[in] filename name of the MIDAS file (.mid or .mid.gz)
+         * @param[in] span distance between checkpoints in uncompressed bytes. Default is kMidasIndexSpan.
+         *
+         * @return the index
+         */
+        static MidasIndex Build(std::string filename, uint64_t span = kMidasIndexSpan);
+
+        /**
+         * @brief This function loads an index written by Save()
+         */
+        static MidasIndex Load(std::string indexfilename);
+
+        /**
+         * @brief This function loads the sidecar index of a MIDAS file, building (and saving) it if
+         * it is missing or does not match the file
+         *
+         * @param[in] filename name of the MIDAS file
+         * @param[in] save flag to write the sidecar after building it. Default is true.
+         *
+         * @return the index
+         */
+        static MidasIndex LoadOrBuild(std::string filename, bool save = true);
+
+        /**
+         * @brief This method writes the index; the file is replaced atomically
+         */
+        void Save(std::string indexfilename) const;
+
+        bool IsCompressed() const { return fCompressed; }
+        uint64_t GetFileSize() const { return fFileSize; }
+        uint64_t GetSpan() const { return fSpan; }
+
+        /**
+         * @brief This method returns the size of the uncompressed data up to the end of the last event
+         */
+        uint64_t GetDataSize() const { return fDataSize; }
+        std::size_t GetNEvents() const { return fEvents.size(); }
+        std::size_t GetNCheckpoints() const { return fCheckpoints.size(); }
+
+        /**
+         * @brief This method returns the offset of an event in the uncompressed stream
+         */
+        uint64_t GetEventOffset(std::size_t event) const { return fEvents.at(event); }
+        const std::vector<uint64_t> &GetEventOffsets() const { return fEvents; }
+
+        /**
+         * @brief This method returns the last checkpoint at or before an uncompressed offset
+         */
+        const Checkpoint &FindCheckpoint(uint64_t offset) const;
+
+    private:
+        bool fCompressed = false;
+        uint64_t fFileSize = 0;
+        uint64_t fSpan = kMidasIndexSpan;
+        uint64_t fDataSize = 0;
+        std::vector<uint64_t> fEvents;
+        std::vector<Checkpoint> fCheckpoints;
+    };
+
+    /**
+     * @brief A range [first, last) of events of a MIDAS file
+     */
+    struct EventRange {
+        std::size_t first;
+        std::size_t last;
+    };
+
+    /**
+     * @brief This function splits the events of a file into contiguous, disjoint ranges
+     *
+     * @details The boundaries are placed so that the ranges hold about the same amount of
+     * uncompressed data, rather than the same number of events, since camera and PMT-only events
+     * differ in size by orders of magnitude.
+     *
+     * @param[in] index index of the file
+     * @param[in] nranges requested number of ranges (fewer are returned if the file has fewer events)
+     * @param[in] first index of the first event to cover, e.g. RunSession::GetNEventsRead() to skip
+     * the events already read. Default value is 0.
+     *
+     * @return the ranges, in file order, covering the events from first on
+     *
+     */
+    std::vector<EventRange> SplitEventRanges(const MidasIndex &index, unsigned int nranges, std::size_t first = 0);
+
+    /**
+     * @brief This function returns the name of the sidecar index of a MIDAS file (filename + ".idx")
+     */
+    std::string GetMidasIndexFilename(std::string filename);
+
+    /**
+     * @brief This function opens the MIDAS file positioned at an event
+     *
+     * @details For compressed files the decompression starts at the checkpoint preceding the event,
+     * so the cost does not depend on the position of the event in the file. Reading then proceeds
+     * sequentially until the end of the file, as with OpenMidasFile(std::string).
+     *
+     * @param[in] filename name of the MIDAS file
+     * @param[in] index index of the file
+     * @param[in] event number of the first event to read (0 is the first event of the file)
+     *
+     * @return the reader; to be closed and deleted by the caller
+     *
+     */
+    TMReaderInterface* OpenMidasFile(std::string filename, const MidasIndex &index, std::size_t event);
+
+}
+
+#endif
@@ -26,6 +26,8 @@
 #include <opencv2/opencv.hpp>
 #include <list>
 #include <numeric>
+#include "cygnobuffer.h"
+#include "drs4.h"
 
 
 /**
@@ -58,6 +60,22 @@ namespace cygnolib {
          */
         Picture(unsigned int height = 2304, unsigned int width = 2304);
         
+        /**
+         * @brief Constructor.
+         * @details This constructor adopts an existing buffer without copying it.
+         *
+         * @param[in] buffer row-major pixels, its size must be height*width
+         * @param[in] heigth Height of the image in pixel.
+         * @param[in] width Width of the image in pixel.
+         *
+         */
+        Picture(AlignedVector<uint16_t> &&buffer, unsigned int height, unsigned int width);
+        
+        Picture(const Picture &) = default;
+        Picture(Picture &&) noexcept = default;
+        Picture &operator=(const Picture &) = default;
+        Picture &operator=(Picture &&) noexcept = default;
+        
         /**
          * @brief The default destructor.
          *
@@ -69,29 +87,135 @@ namespace cygnolib {
          *
          * @return the number of rows of the image
          */
-        unsigned int GetNRows();
+        unsigned int GetNRows() const;
         
         /**
          * @brief This method returns the number of columns of the image
          *
          * @return the number of columns of the image
          */
-        unsigned int GetNColumns();
+        unsigned int GetNColumns() const;
         
         /**
-         * @brief This method returns the image in the form of a 2D std::vector
+         * @brief This method returns a copy of the image in the form of a 2D std::vector
+         *
+         * @details The image is copied row by row out of the contiguous buffer. Prefer GetBuffer(),
+         * GetPixels(), Row() or View() in performance-critical code.
          *
          * @return the image
          */
-        std::vector<std::vector<uint16_t>> GetFrame();
+        std::vector<std::vector<uint16_t>> GetFrame() const;
+        
+        /**
+         * @brief This method returns the image as a flat row-major buffer
+         *
+         * @return a const reference to the image, no pixel is copied
+         */
+        const AlignedVector<uint16_t> &GetBuffer() const;
+        
+        /**
+         * @brief This method sets the image, copying it
+         *
+         * @param[in] inputframe the image in the form of a 2D std::vector
+         *
+         */
+        void SetFrame(const std::vector<std::vector<uint16_t>> &inputframe);
+        
+        /**
+         * @brief This method sets the image, copying it into the existing buffer
+         *
+         * @param[in] inputframe the image as a flat row-major array of GetNRows()*GetNColumns() pixels
+         *
+         */
+        void SetFrame(Span<const uint16_t> inputframe);
+        
+        /**
+         * @brief This method sets the image, taking ownership of the input buffer
+         *
+         * @param[in] inputframe the image as a flat row-major buffer of GetNRows()*GetNColumns() pixels
+         *
+         */
+        void SetFrame(AlignedVector<uint16_t> &&inputframe);
         
         /**
-         * @brief This method sets the image
+         * @brief This method replaces the image and its dimensions, taking ownership of the buffer
          *
-         * @param[in] inputframe the image in the form og a 2D std::vector
+         * @param[in] buffer row-major pixels, its size must be height*width
+         * @param[in] heigth Height of the image in pixel.
+         * @param[in] width Width of the image in pixel.
          *
          */
-        void SetFrame(std::vector<std::vector<uint16_t>> inputframe);
+        void AdoptBuffer(AlignedVector<uint16_t> &&buffer, unsigned int height, unsigned int width);
+        
+        /**
+         * @brief This method gives away the buffer of the image, e.g. to recycle it
+         *
+         * @details After the call the Picture is empty (0x0).
+         *
+         * @return the buffer of the image
+         */
+        AlignedVector<uint16_t> ReleaseBuffer();
+        
+        /**
+         * @brief This method returns a pointer to the first pixel of the image
+         *
+         * @details Pixels are stored row-major in a single buffer aligned to kBufferAlignment bytes,
+         * with no padding between rows.
+         *
+         * @return a pointer to the first pixel
+         */
+        uint16_t *Data();
+        const uint16_t *Data() const;
+        
+        /**
+         * @brief This method returns the number of pixels of the image
+         *
+         * @return the number of pixels
+         */
+        std::size_t Size() const;
+        
+        /**
+         * @brief This method returns the whole image as a single contiguous array
+         *
+         * @details The non-const overloads, together with Row() and View(), give mutable access to
+         * the pixels in place.
+         *
+         * @return a span over all the pixels
+         */
+        Span<uint16_t> GetPixels();
+        Span<const uint16_t> GetPixels() const;
+        
+        /**
+         * @brief This method returns a row of the image
+         *
+         * @param[in] r index of the row
+         *
+         * @return a span over the pixels of the row
+         */
+        Span<uint16_t> Row(unsigned int r);
+        Span<const uint16_t> Row(unsigned int r) const;
+        
+        /**
+         * @brief This method returns a 2D view of the image
+         *
+         * @return a view over the image
+         */
+        ImageView<uint16_t> View();
+        ImageView<const uint16_t> View() const;
+        
+        /**
+         * @brief Unchecked access to the pixel (r, c)
+         */
+        uint16_t &operator()(unsigned int r, unsigned int c) { return frame[std::size_t(r)*ncolumns + c]; }
+        uint16_t operator()(unsigned int r, unsigned int c) const { return frame[std::size_t(r)*ncolumns + c]; }
+        
+        /**
+         * @brief Bounds-checked access to the pixel (r, c)
+         *
+         * @details Throws std::out_of_range if the pixel is outside the image.
+         */
+        uint16_t &At(unsigned int r, unsigned int c);
+        uint16_t At(unsigned int r, unsigned int c) const;
         
         /**
          * @brief This method prints a crop [0, a]x[0, b] of the image on stdout
@@ -115,7 +239,82 @@ namespace cygnolib {
     private:
         unsigned int nrows;
         unsigned int ncolumns;
-        std::vector<std::vector<uint16_t>> frame;
+        AlignedVector<uint16_t> frame;
+    };
+    
+    /**
+     * @class PictureView
+     * @brief A non-owning, read-only view of an image collected by the CYGNO cameras
+     * @author CYGNO Collaboration
+     *
+     * @details This class aliases memory owned by someone else, typically the CAM0 bank of a
+     * TMidasEvent as returned by daq_cam2picview(). No pixel is copied when the view is created.
+     * The view is valid only as long as the underlying memory is: for a MIDAS bank this means the
+     * TMidasEvent must outlive the view and must not be cleared, copied into, or reused by
+     * TMReadEvent while the view is in use. Call Materialize() to get an owning Picture that can
+     * outlive the event.
+     *
+     */
+    class PictureView {
+    public:
+        
+        /**
+         * @brief Constructor. It creates an empty (0x0) view.
+         */
+        PictureView() {}
+        
+        /**
+         * @brief Constructor.
+         * @details This constructor wraps a row-major image without copying it.
+         *
+         * @param[in] data pointer to the first pixel of the image
+         * @param[in] heigth Height of the image in pixel.
+         * @param[in] width Width of the image in pixel.
+         *
+         */
+        PictureView(const uint16_t *data, unsigned int height, unsigned int width);
+        
+        unsigned int GetNRows() const { return fView.GetNRows(); }
+        unsigned int GetNColumns() const { return fView.GetNColumns(); }
+        const uint16_t *Data() const { return fView.Data(); }
+        std::size_t Size() const { return std::size_t(fView.GetNRows())*fView.GetNColumns(); }
+        Span<const uint16_t> GetPixels() const { return Span<const uint16_t>(Data(), Size()); }
+        Span<const uint16_t> Row(unsigned int r) const { return fView.Row(r); }
+        ImageView<const uint16_t> View() const { return fView; }
+        uint16_t operator()(unsigned int r, unsigned int c) const { return fView(r, c); }
+        uint16_t At(unsigned int r, unsigned int c) const { return fView.At(r, c); }
+        
+        /**
+         * @brief This method makes an owning copy of the image
+         *
+         * @details This is the only place where the pixels of the view are copied. Use it when the
+         * image must outlive the memory the view points to.
+         *
+         * @return the image as a Picture object
+         */
+        Picture Materialize() const;
+        
+        /**
+         * @brief This method prints a crop [0, a]x[0, b] of the image on stdout
+         *
+         * @param[in] a number of rows to print
+         * @param[in] b number of columns to print
+         *
+         */
+        void Print(int a, int b) const;
+        
+        /**
+         * @brief This method saves the image on a file in grayscale
+         *
+         * @param[in] filename name of the output file
+         * @param[in] vmin minimum intensity for the grayscale. Default value is 99.
+         * @param[in] vmax maximum intensity for the grayscale. Default value is 130.
+         *
+         */
+        void SavePng(std::string filename, int vmin = 99, int vmax = 130) const;
+        
+    private:
+        ImageView<const uint16_t> fView;
     };
     
     /**
@@ -180,12 +379,32 @@ namespace cygnolib {
         
         /**
          * @brief Constructor.
-         * @details This constructor passes the raw PMT data as contained in the MIDAS file.
+         * @details This constructor copies the raw PMT data as contained in the MIDAS file.
          *
          * @param[in] rawwaveforms the raw PMT data contained in the bank DIG0 of the MIDAS file.
          *
          */
-        PMTData(DGHeader *DGH, std::vector<uint16_t> rawwaveforms);
+        PMTData(DGHeader *DGH, const std::vector<uint16_t> &rawwaveforms);
+        
+        /**
+         * @brief Constructor.
+         * @details This constructor wraps the raw PMT data without copying them. The waveforms
+         * are read straight from rawwaveforms until a board needs to be modified (e.g. by
+         * ApplyDRS4Corrections()), at which point only that board is copied into an owned buffer.
+         * The memory pointed by rawwaveforms, typically the DIG0 bank of a TMidasEvent, must
+         * therefore outlive this object and must not be modified or reused in the meantime.
+         *
+         * @param[in] rawwaveforms pointer to the raw PMT data contained in the bank DIG0
+         * @param[in] length number of samples pointed by rawwaveforms
+         *
+         */
+        PMTData(DGHeader *DGH, const uint16_t *rawwaveforms, std::size_t length);
+        
+        PMTData(const PMTData &) = default;
+        PMTData(PMTData &&) noexcept = default;
+        PMTData &operator=(const PMTData &) = default;
+        PMTData &operator=(PMTData &&) noexcept = default;
+        
         /**
          * @brief The default destructor.
          *
@@ -193,13 +412,29 @@ namespace cygnolib {
         ~PMTData();
         
         /**
-         * @brief This method returns a pointer to the triggered PMT waveforms of the specified board
+         * @brief This method returns a read-only view of the triggered PMT waveforms of the specified board
+         *
+         * @details The waveforms of each board are laid out as [event][channel][sample], so every
+         * channel row is contiguous in memory. Boards that have not been modified are read
+         * directly from the raw data the object was built from.
+         *
+         * @param[in] board_model an integer specifiying the board model
+         *
+         * @return a view of the triggered PMT waveforms, indexed as [evt][ch][samp]
+         */
+        WaveformView<const uint16_t> GetWaveforms(int board_model);
+        
+        /**
+         * @brief This method returns a mutable view of the triggered PMT waveforms of the specified board
+         *
+         * @details The first call for a board that still aliases the raw data copies it into an
+         * aligned buffer owned by this object. The view is valid as long as this object is alive.
          *
          * @param[in] board_model an integer specifiying the board model
          *
-         * @return a pointer to the triggered PMT waveforms
+         * @return a view of the triggered PMT waveforms, indexed as [evt][ch][samp]
          */
-        std::vector<std::vector<std::vector<uint16_t>>> *GetWaveforms(int board_model);
+        WaveformView<uint16_t> GetMutableWaveforms(int board_model);
         
         /**
          * @brief This method applies the PeakCorrection to the raw waveforms collected.
@@ -208,10 +443,10 @@ namespace cygnolib {
          * is not yet general enough to be used also for other models. This correction
          * must be applied only after the 'cell' and 'nsample' correction.
          *
-         * @param[in] wfs reference to the triggered waveforms data
+         * @param[in] wfs view of the channels of one triggered event
          *
          */
-        void PeakCorrection(std::vector<std::vector<uint16_t>> &wfs);
+        void PeakCorrection(EventView<uint16_t> wfs);
         
         /**
          * @brief This method applies the DRS4Corrections to the raw waveforms collected.
@@ -219,6 +454,12 @@ namespace cygnolib {
          * @details This method is developed and tested only for the board V1742. The implementation
          * is not yet general enough to be used also for other models.
          *
+         * The tables are converted to a DRS4Calibration, which is kept (one per thread) and reused
+         * as long as the tables passed in are the same vectors, with the same storage and sizes, so
+         * that calling this method for every event only costs a few pointer comparisons. Values
+         * changed in place in the same storage are therefore not seen: pass new vectors, or prefer
+         * the DRS4Calibration overload, e.g. with the tables given by GetDRS4Calibration().
+         *
          * @param[in] channels_offsets pointer to a std::vector containing the channel offsets
          * @param[in] table_cell pointer to the 'cell' correction tables
          * @param[in] table_nsample pointer to the 'nsample' correction tables
@@ -228,9 +469,28 @@ namespace cygnolib {
                                   std::vector<std::vector<int>> *table_cell,
                                   std::vector<std::vector<int>> *table_nsample);
         
+        /**
+         * @brief This method applies the DRS4Corrections to the raw waveforms collected.
+         *
+         * @details Same as above, but with the tables already converted to the int16 layout used by
+         * the vectorized kernels. The correction is subtracted with unsigned 16-bit saturation, in
+         * the mode selected with DRS4Calibration::SetMode().
+         *
+         * @param[in] channels_offsets pointer to a std::vector containing the channel offsets
+         * @param[in] calib the 'cell' and 'nsample' correction tables
+         *
+         */
+        void ApplyDRS4Corrections(std::vector<float> *channels_offsets,
+                                  const DRS4Calibration &calib);
+        
         
     private:
-        std::list<std::vector<std::vector<std::vector<uint16_t>>>> data;
+        int GetBoardIndex(int board_model);
+        void MaterializeBoard(int board_index);
+        
+        std::vector<const uint16_t *> fRaw;        ///< raw [evt][ch][samp] data of each board
+        std::vector<AlignedVector<uint16_t>> data; ///< owned copy of each board, filled on demand
+        std::vector<bool> fOwned;                  ///< true if the board has been copied into data
         DGHeader *fDGH;
         bool fCorrected;
         
@@ -239,6 +499,64 @@ namespace cygnolib {
     };
     
     
+    /**
+     * @brief Location of one bank inside a MIDAS event
+     */
+    struct BankInfo {
+        char name[4];              ///< bank name (not NUL-terminated)
+        uint32_t type;             ///< MIDAS type id (TID_WORD, TID_DWORD, ...)
+        uint32_t size;             ///< size of the bank data in bytes
+        const void *data;          ///< bank data, inside the event buffer
+        
+        /**
+         * @brief This method returns the bank data as an array of T
+         */
+        template <typename T>
+        Span<const T> As() const { return Span<const T>((const T *)data, size/sizeof(T)); }
+    };
+    
+    /**
+     * @class EventBanks
+     * @brief A directory of the banks of a MIDAS event
+     * @author CYGNO Collaboration
+     *
+     * @details The bank headers of the event are walked once by Index(), which records name,
+     * type, size and data pointer of every bank; Find() then is a lookup in a short array and the
+     * daq_* decoders taking an EventBanks do not scan the event again. 16-bit, 32-bit and 32-bit
+     * 64-bit-aligned bank formats are supported. The pointers alias the event buffer, so the
+     * directory is valid until the event is modified or destroyed. Reusing one EventBanks across
+     * events does not allocate once the number of banks is stable.
+     *
+     */
+    class EventBanks {
+    public:
+        EventBanks() {}
+        explicit EventBanks(TMidasEvent &event) { Index(event); }
+        
+        /**
+         * @brief This method builds the directory of an event, replacing the previous one
+         *
+         * @details Begin and end of run ODB dumps contain no banks and give an empty directory.
+         *
+         * @param[in] event reference to the MIDAS event
+         *
+         */
+        void Index(TMidasEvent &event);
+        
+        /**
+         * @brief This method returns the bank with the given name, or nullptr if the event has none
+         */
+        const BankInfo *Find(const std::string &bname) const;
+        bool Has(const std::string &bname) const { return Find(bname)!=nullptr; }
+        
+        std::size_t GetNBanks() const { return fBanks.size(); }
+        const std::vector<BankInfo> &GetBanks() const { return fBanks; }
+        
+    private:
+        std::vector<BankInfo> fBanks;
+    };
+    
+    
     /**
      * @brief This function opens the MIDAS file
      *
@@ -286,6 +604,23 @@ namespace cygnolib {
     MVOdb* GetODBDumpBOR(TMidasEvent &event,  MVOdbError *odberror = NULL);
     
     
+    /**
+     * @brief This function reads the PMT readout configuration from the BOR ODB dump
+     *
+     * @details Events are read until the begin of run ODB dump, so that the reader is left
+     * positioned on the first event after it (see RunSession).
+     *
+     * @param[in] reader the MIDAS reader
+     * @param[out] DRS4correction pointer to the DRS4Correction flag
+     * @param[out] channels_offsets pointer to the digitizer offsets
+     *
+     * @return the number of events read, the BOR ODB dump included
+     *
+     */
+    uint64_t ReadPMTReadoutODB(TMReaderInterface *reader,
+                               bool *DRS4correction,
+                               std::vector<float> *channels_offsets);
+    
     /**
      * @brief This function initializes the PMT readout
      *
@@ -304,6 +639,29 @@ namespace cygnolib {
                               std::vector<std::vector<int>> &table_nsample
                              );
     
+    /**
+     * @brief This function initializes the PMT readout
+     *
+     * @details Same as above, but the correction tables are returned in the int16 layout used by
+     * PMTData::ApplyDRS4Corrections(std::vector<float>*, const DRS4Calibration&), as given by
+     * GetDRS4Calibration(), which loads them once per tag. The file is opened only to read the BOR
+     * ODB dump: use RunSession to read the ODB and the events in one pass.
+     *
+     * @param[in] filename name of the MIDAS file
+     * @param[in] DRS4correction pointer to the DRS4Correction flag
+     * @param[in] tag tag of the DAQ where the data have been collected (LNGS, LNF, ...)
+     * @param[out] calib reference to the correction tables
+     * @param[in] calibdir folder overriding the embedded tables. Default is empty (no override).
+     *
+     */
+    void InitializePMTReadout(std::string filename,
+                              bool *DRS4correction, 
+                              std::vector<float> *channels_offsets,
+                              std::string tag,
+                              DRS4Calibration &calib,
+                              std::string calibdir = ""
+                             );
+    
     /**
      * @brief This function extracts the picture from the MIDAS event and converts it
      * to a Picture object
@@ -316,6 +674,33 @@ namespace cygnolib {
      */
     Picture  daq_cam2pic(TMidasEvent &event, std::string cam_model = "fusion");
     
+    /**
+     * @brief This function copies the picture from the MIDAS event into an existing Picture object
+     *
+     * @details The buffer of pic is reused: when its dimensions already match the camera model no
+     * memory is allocated, which makes it suitable for per-event loops.
+     *
+     * @param[in] event reference to the MIDAS event
+     * @param[out] pic the Picture object to fill
+     * @param[in] cam_model model of the Hamamatsu camera
+     *
+     */
+    void daq_cam2pic(TMidasEvent &event, Picture &pic, std::string cam_model = "fusion");
+    
+    /**
+     * @brief This function wraps the picture contained in the MIDAS event without copying it
+     *
+     * @details The returned view aliases the CAM0 bank of the event: see PictureView for the
+     * lifetime rules. daq_cam2pic(event) is equivalent to daq_cam2picview(event).Materialize().
+     *
+     * @param[in] event reference to the MIDAS event
+     * @param[in] cam_model model of the Hamamatsu camera
+     *
+     * @return the image as a PictureView object
+     *
+     */
+    PictureView daq_cam2picview(TMidasEvent &event, std::string cam_model = "fusion");
+    
     /**
      * @brief This function extracts the digitizer header from the MIDAS event and
      * converts it to a DGHeader object
@@ -331,6 +716,9 @@ namespace cygnolib {
      * @brief This function extracts the PMT data from the MIDAS event and
      * converts it to a PMTData object
      *
+     * @details The returned object reads the waveforms straight from the DIG0 bank (see
+     * PMTData::PMTData(DGHeader*, const uint16_t*, std::size_t)): the event must outlive it.
+     *
      * @param[in] event reference to the MIDAS event
      *
      * @return the PMT data as a PMTData object
@@ -338,6 +726,31 @@ namespace cygnolib {
      */
     PMTData daq_dig2PMTData(TMidasEvent &event, DGHeader *DGH);
     
+    /**
+     * @brief Same as daq_cam2pic(TMidasEvent&, std::string), from the bank directory of the event
+     */
+    Picture  daq_cam2pic(const EventBanks &banks, std::string cam_model = "fusion");
+    
+    /**
+     * @brief Same as daq_cam2pic(TMidasEvent&, Picture&, std::string), from the bank directory of the event
+     */
+    void daq_cam2pic(const EventBanks &banks, Picture &pic, std::string cam_model = "fusion");
+    
+    /**
+     * @brief Same as daq_cam2picview(TMidasEvent&, std::string), from the bank directory of the event
+     */
+    PictureView daq_cam2picview(const EventBanks &banks, std::string cam_model = "fusion");
+    
+    /**
+     * @brief Same as daq_dgh2head(TMidasEvent&), from the bank directory of the event
+     */
+    DGHeader daq_dgh2head(const EventBanks &banks);
+    
+    /**
+     * @brief Same as daq_dig2PMTData(TMidasEvent&, DGHeader*), from the bank directory of the event
+     */
+    PMTData daq_dig2PMTData(const EventBanks &banks, DGHeader *DGH);
+    
     
 }
 
@@ -0,0 +1,418 @@
+/*
+ * Copyright (C) 2024 CYGNO Collaboration
+ *
+ *
+ * Author: Stefano Piacentini
+ * Created in 2024
+ *
+ */
+
+#ifndef __CYGNO_PIPELINE_H__
+#define __CYGNO_PIPELINE_H__
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "cygnolib.h"
+#include "cygnoindex.h"
+#include "cygnoreader.h"
+#include "cygnothreads.h"
+
+
+namespace cygnolib {
+
+    /**
+     * @brief Time accounting of an EventPipeline run
+     *
+     * @details The stage times are summed over the worker threads, so with N threads busy they can
+     * add up to N times the wall time.
+     */
+    struct PipelineStats {
+        uint64_t events          = 0;  ///< number of events processed
+        unsigned int nthreads    = 0;  ///< number of worker threads
+        double   wall_seconds    = 0;  ///< duration of Run()
+        double   index_seconds   = 0;  ///< bank indexing (EventBanks::Index)
+        double   decode_seconds  = 0;  ///< decode stage
+        double   process_seconds = 0;  ///< corrections/reconstruction stage
+        double   output_seconds  = 0;  ///< output stage (serial)
+        PrefetchStats reader;          ///< read stage
+    };
+
+    /**
+     * @class EventPipeline
+     * @brief A staged, multithreaded event loop over a MIDAS file
+     * @author CYGNO Collaboration
+     *
+     * @details Every event goes through the stages
+     *
+     *     read -> bank index -> decode -> process -> output
+     *
+     * The read stage runs on the thread of a PrefetchReader. Bank index, decode and process run,
+     * for different events at the same time, on a WorkerPool. The output stage runs on the thread
+     * calling Run(), strictly in file order: events completed early wait in a reorder window of
+     * GetWindow() events, which also bounds the memory in use.
+     *
+     * Data is the per-event state passed between the stages. One Data object is kept per
+     * window slot and reused for the events going through that slot, so buffers held by Data are
+     * allocated only once. The event and its banks stay valid until the output stage of the event
+     * has returned, so Data may alias them (e.g. PictureView, PMTData).
+     *
+     * The decode and process functions run concurrently on different events and must only modify
+     * their Data; the output function is never called concurrently. An exception thrown by a
+     * stage stops the run and is rethrown by Run(), after the events in flight have completed.
+     *
+     */
+    template <typename Data>
+    class EventPipeline {
+    public:
+        typedef std::function<void(const EventBanks &, Data &)> DecodeFunction;
+        typedef std::function<void(Data &)> ProcessFunction;
+        typedef std::function<void(uint64_t, TMidasEvent &, Data &)> OutputFunction;
+
+        /**
+         * @brief Constructor. The worker threads start immediately.
+         *
+         * @param[in] nthreads number of worker threads. Default value is 0 (GetDefaultNThreads()).
+         * @param[in] window maximum number of events in flight. Default value is 0 (2*nthreads).
+         * @param[in] readahead number of events read ahead beyond the window. Default value is 4.
+         *
+         */
+        EventPipeline(unsigned int nthreads = 0, unsigned int window = 0, unsigned int readahead = 4):
+            fReadAhead(readahead), fPool(nthreads) {
+            fWindow = window > 0 ? window : 2*fPool.GetNThreads();
+            fSlots.reset(new Slot[fWindow]);
+        }
+
+        EventPipeline(const EventPipeline &) = delete;
+        EventPipeline &operator=(const EventPipeline &) = delete;
+
+        unsigned int GetNThreads() const { return fPool.GetNThreads(); }
+        unsigned int GetWindow() const { return fWindow; }
+
+        /**
+         * @brief This method sets the decode stage, called with the bank directory of the event
+         */
+        void SetDecode(DecodeFunction decode) { fDecode = std::move(decode); }
+
+        /**
+         * @brief This method sets the corrections/reconstruction stage
+         */
+        void SetProcess(ProcessFunction process) { fProcess = std::move(process); }
+
+        /**
+         * @brief This method sets the output stage, called in file order with the index of the event
+         */
+        void SetOutput(OutputFunction output) { fOutput = std::move(output); }
+
+        /**
+         * @brief This method runs the pipeline over all the events of a MIDAS reader
+         *
+         * @param[in] reader the MIDAS reader, not owned
+         * @param[in] first index given to the first event of the reader, e.g.
+         * RunSession::GetNEventsRead() for a reader that already went past the BOR ODB dump.
+         * Default value is 0.
+         *
+         * @return the time accounting of the run
+         *
+         */
+        PipelineStats Run(TMReaderInterface *reader, uint64_t first = 0) {
+            typedef std::chrono::steady_clock clock;
+            clock::time_point start = clock::now();
+
+            PipelineStats stats;
+            stats.nthreads = GetNThreads();
+
+            // the reader must be able to fill the whole window, since the events of the window are
+            // given back only after their output
+            PrefetchReader prefetch(reader, fWindow + fReadAhead);
+            uint64_t next_seq = 0;
+            uint64_t next_out = 0;
+            bool eof = false;
+            std::exception_ptr error;
+
+            try {
+                while(true) {
+                    while(next_out<next_seq && IsDone(fSlots[next_out%fWindow])) {
+                        Slot &slot = fSlots[next_out%fWindow];
+                        if(slot.error) std::rethrow_exception(slot.error);
+
+                        clock::time_point output_start = clock::now();
+                        if(fOutput) fOutput(slot.seq, *slot.event, slot.data);
+                        stats.output_seconds  += std::chrono::duration<double>(clock::now()-output_start).count();
+                        stats.index_seconds   += slot.index_seconds;
+                        stats.decode_seconds  += slot.decode_seconds;
+                        stats.process_seconds += slot.process_seconds;
+                        stats.events++;
+
+                        prefetch.Release(slot.event);
+                        slot.event = nullptr;
+                        next_out++;
+                    }
+
+                    if(eof && next_out==next_seq) break;
+
+                    if(!eof && next_seq-next_out<fWindow) {
+                        TMidasEvent *event = prefetch.Acquire();
+                        if(!event) {
+                            eof = true;
+                            continue;
+                        }
+                        Slot &slot = fSlots[next_seq%fWindow];
+                        slot.event = event;
+                        slot.seq   = first + next_seq;
+                        slot.error = nullptr;
+                        {
+                            std::lock_guard<std::mutex> lock(fMutex);
+                            slot.done = false;
+                        }
+                        fPool.Submit([this, &slot] { RunStages(slot); });
+                        next_seq++;
+                        continue;
+                    }
+
+                    std::unique_lock<std::mutex> lock(fMutex);
+                    Slot &head = fSlots[next_out%fWindow];
+                    fCV.wait(lock, [&head] { return head.done; });
+                }
+            } catch(...) {
+                error = std::current_exception();
+            }
+
+            // the tasks in flight use the events of prefetch: wait for them before leaving
+            {
+                std::unique_lock<std::mutex> lock(fMutex);
+                for(uint64_t seq=next_out; seq<next_seq; seq++) {
+                    Slot &slot = fSlots[seq%fWindow];
+                    fCV.wait(lock, [&slot] { return slot.done; });
+                }
+            }
+            for(uint64_t seq=next_out; seq<next_seq; seq++) fSlots[seq%fWindow].event = nullptr;
+            if(error) std::rethrow_exception(error);
+
+            stats.reader = prefetch.GetStats();
+            stats.wall_seconds = std::chrono::duration<double>(clock::now()-start).count();
+            return stats;
+        }
+
+    private:
+        struct Slot {
+            TMidasEvent *event = nullptr;
+            EventBanks banks;
+            Data data;
+            uint64_t seq = 0;
+            bool done = true;
+            std::exception_ptr error;
+            double index_seconds   = 0;
+            double decode_seconds  = 0;
+            double process_seconds = 0;
+        };
+
+        bool IsDone(const Slot &slot) {
+            std::lock_guard<std::mutex> lock(fMutex);
+            return slot.done;
+        }
+
+        void RunStages(Slot &slot) {
+            typedef std::chrono::steady_clock clock;
+            try {
+                clock::time_point t0 = clock::now();
+                slot.banks.Index(*slot.event);
+                clock::time_point t1 = clock::now();
+                if(fDecode) fDecode(slot.banks, slot.data);
+                clock::time_point t2 = clock::now();
+                if(fProcess) fProcess(slot.data);
+                clock::time_point t3 = clock::now();
+                slot.index_seconds   = std::chrono::duration<double>(t1-t0).count();
+                slot.decode_seconds  = std::chrono::duration<double>(t2-t1).count();
+                slot.process_seconds = std::chrono::duration<double>(t3-t2).count();
+            } catch(...) {
+                slot.error = std::current_exception();
+            }
+            {
+                std::lock_guard<std::mutex> lock(fMutex);
+                slot.done = true;
+            }
+            fCV.notify_all();
+        }
+
+        unsigned int fWindow;
+        unsigned int fReadAhead;
+        std::unique_ptr<Slot[]> fSlots;
+        DecodeFunction fDecode;
+        ProcessFunction fProcess;
+        OutputFunction fOutput;
+
+        std::mutex fMutex;
+        std::condition_variable fCV;
+        WorkerPool fPool;   ///< last, so that its threads are joined first
+    };
+
+
+    /**
+     * @brief Time accounting of one range of an EventRangeRunner run
+     */
+    struct RangeStats {
+        EventRange range;              ///< the events of the range
+        double   wall_seconds    = 0;  ///< time to go through the whole range, seek included
+        double   seek_seconds    = 0;  ///< time to open the file at the first event of the range
+        double   read_seconds    = 0;  ///< reading and decompression
+        double   index_seconds   = 0;  ///< bank indexing (EventBanks::Index)
+        double   decode_seconds  = 0;  ///< decode stage
+        double   process_seconds = 0;  ///< corrections/reconstruction stage
+        double   output_seconds  = 0;  ///< output stage
+    };
+
+    /**
+     * @brief Time accounting of an EventRangeRunner run
+     */
+    struct RangeRunStats {
+        uint64_t events       = 0;     ///< number of events processed
+        double   wall_seconds = 0;     ///< duration of Run()
+        double   merge_seconds = 0;    ///< time spent merging the outputs of the ranges
+        std::vector<RangeStats> ranges;
+    };
+
+    /**
+     * @class EventRangeRunner
+     * @brief Processes one MIDAS file as several event ranges in parallel
+     * @author CYGNO Collaboration
+     *
+     * @details The events of the file are split into contiguous ranges (see SplitEventRanges()),
+     * and each range is read, decompressed and processed on its own thread from its own reader,
+     * positioned with the random-access index of the file. Unlike EventPipeline, decompression is
+     * therefore parallel too, which is what limits a single large run.
+     *
+     * The stages are the same as in EventPipeline, but the output stage of every range writes into
+     * an Output object of its own (e.g. a buffer or a temporary file). When all the ranges are
+     * done, the merge function is called with the Output of each range, in file order. As long as
+     * the per-event stages only depend on the event, the merged output is identical to the one of
+     * a sequential pass, and the event numbers given to the output stage are the same.
+     *
+     */
+    template <typename Data, typename Output>
+    class EventRangeRunner {
+    public:
+        typedef std::function<void(const EventBanks &, Data &)> DecodeFunction;
+        typedef std::function<void(Data &)> ProcessFunction;
+        typedef std::function<void(uint64_t, TMidasEvent &, Data &, Output &)> OutputFunction;
+        typedef std::function<void(std::size_t, Output &)> MergeFunction;
+
+        /**
+         * @brief Constructor. The worker threads start immediately.
+         *
+         * @param[in] nthreads number of worker threads. Default value is 0 (GetDefaultNThreads()).
+         *
+         */
+        explicit EventRangeRunner(unsigned int nthreads = 0): fPool(nthreads) {}
+
+        EventRangeRunner(const EventRangeRunner &) = delete;
+        EventRangeRunner &operator=(const EventRangeRunner &) = delete;
+
+        unsigned int GetNThreads() const { return fPool.GetNThreads(); }
+
+        void SetDecode(DecodeFunction decode) { fDecode = std::move(decode); }
+        void SetProcess(ProcessFunction process) { fProcess = std::move(process); }
+
+        /**
+         * @brief This method sets the output stage, called in file order within each range
+         */
+        void SetOutput(OutputFunction output) { fOutput = std::move(output); }
+
+        /**
+         * @brief This method sets the merge function, called once per range in file order
+         */
+        void SetMerge(MergeFunction merge) { fMerge = std::move(merge); }
+
+        /**
+         * @brief This method processes all the events of a file
+         *
+         * @param[in] filename name of the MIDAS file
+         * @param[in] index index of the file (see MidasIndex::LoadOrBuild())
+         * @param[in] nranges number of ranges. Default value is 0 (GetNThreads()).
+         * @param[in] first index of the first event to process, e.g. RunSession::GetNEventsRead() to
+         * skip the BOR ODB dump as a sequential pass does. Default value is 0.
+         *
+         * @return the time accounting of the run, per range
+         *
+         */
+        RangeRunStats Run(std::string filename, const MidasIndex &index, unsigned int nranges = 0, uint64_t first = 0) {
+            typedef std::chrono::steady_clock clock;
+            clock::time_point start = clock::now();
+
+            std::vector<EventRange> ranges = SplitEventRanges(index, nranges>0 ? nranges : GetNThreads(), first);
+            std::vector<Output> outputs(ranges.size());
+            RangeRunStats stats;
+            stats.ranges.resize(ranges.size());
+
+            fPool.ParallelFor(ranges.size(), [&](std::size_t r) {
+                stats.ranges[r] = RunRange(filename, index, ranges[r], outputs[r]);
+            });
+
+            clock::time_point merge_start = clock::now();
+            for(std::size_t r=0; r<ranges.size(); r++) {
+                if(fMerge) fMerge(r, outputs[r]);
+                stats.events += ranges[r].last-ranges[r].first;
+            }
+            stats.merge_seconds = std::chrono::duration<double>(clock::now()-merge_start).count();
+            stats.wall_seconds  = std::chrono::duration<double>(clock::now()-start).count();
+            return stats;
+        }
+
+    private:
+        RangeStats RunRange(const std::string &filename, const MidasIndex &index, EventRange range, Output &out) {
+            typedef std::chrono::steady_clock clock;
+            RangeStats stats;
+            stats.range = range;
+            clock::time_point start = clock::now();
+
+            std::unique_ptr<TMReaderInterface> reader(OpenMidasFile(filename, index, range.first));
+            clock::time_point t0 = clock::now();
+            stats.seek_seconds = std::chrono::duration<double>(t0-start).count();
+
+            TMidasEvent event;
+            AlignedVector<char> buffer;
+            EventBanks banks;
+            Data data;
+            for(std::size_t e=range.first; e<range.last; e++) {
+                if(!ReadMidasEvent(reader.get(), event, buffer)) {
+                    throw std::runtime_error("cygnolib::EventRangeRunner::Run: "+filename+" ends before event "+std::to_string(e)+".");
+                }
+                clock::time_point t1 = clock::now();
+                banks.Index(event);
+                clock::time_point t2 = clock::now();
+                if(fDecode) fDecode(banks, data);
+                clock::time_point t3 = clock::now();
+                if(fProcess) fProcess(data);
+                clock::time_point t4 = clock::now();
+                if(fOutput) fOutput(e, event, data, out);
+                clock::time_point t5 = clock::now();
+
+                stats.read_seconds    += std::chrono::duration<double>(t1-t0).count();
+                stats.index_seconds   += std::chrono::duration<double>(t2-t1).count();
+                stats.decode_seconds  += std::chrono::duration<double>(t3-t2).count();
+                stats.process_seconds += std::chrono::duration<double>(t4-t3).count();
+                stats.output_seconds  += std::chrono::duration<double>(t5-t4).count();
+                t0 = t5;
+            }
+            reader->Close();
+            stats.wall_seconds = std::chrono::duration<double>(clock::now()-start).count();
+            return stats;
+        }
+
+        DecodeFunction fDecode;
+        ProcessFunction fProcess;
+        OutputFunction fOutput;
+        MergeFunction fMerge;
+        WorkerPool fPool;   ///< last, so that its threads are joined first
+    };
+
+}
+
+#endif
@@ -0,0 +1,143 @@
+/*
+ * Copyright (C) 2024 CYGNO Collaboration
+ *
+ *
+ * Author: Stefano Piacentini
+ * Created in 2024
+ *
+ */
+
+#ifndef __CYGNO_READER_H__
+#define __CYGNO_READER_H__
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include "midasio.h"
+#include "TMidasEvent.h"
+#include "cygnobuffer.h"
+
+
+namespace cygnolib {
+
+    /**
+     * @brief This function reads the next event of a MIDAS file into an existing event
+     *
+     * @details Same as TMReadEvent(), but the event data are read into buffer, which is grown only
+     * when an event larger than its capacity is found, and the event aliases it (see
+     * TMidasEvent::SetData). Reading a whole file through the same event and buffer therefore
+     * does not allocate once the largest event has been seen.
+     * As TMReadEvent(), an event truncated at the end of the file (a run cut off by the DAQ) ends
+     * the reading, with a warning; an error of the reader or an event larger than
+     * TMidasEvent::IsGoodSize() allows throws. An event without data, which IsGoodSize() rejects
+     * too, is read as an empty event.
+     *
+     * @param[in] reader the MIDAS reader
+     * @param[out] event the event to fill; valid as long as buffer is neither modified nor destroyed
+     * @param[in,out] buffer the storage of the event data
+     *
+     * @return true if an event has been read, false at the end of the file
+     *
+     */
+    bool ReadMidasEvent(TMReaderInterface *reader, TMidasEvent &event, AlignedVector<char> &buffer);
+
+
+    /**
+     * @brief Time accounting of a PrefetchReader
+     */
+    struct PrefetchStats {
+        uint64_t events         = 0;   ///< number of events read
+        double   read_seconds   = 0;   ///< time spent by the reading thread reading and decompressing
+        double   io_stall_seconds       = 0; ///< time consumers waited for an event (the reader is the bottleneck)
+        double   consumer_stall_seconds = 0; ///< time the reading thread waited for a free buffer (consumers are the bottleneck)
+    };
+
+    /**
+     * @class PrefetchReader
+     * @brief A MIDAS reader that reads ahead on a dedicated thread
+     * @author CYGNO Collaboration
+     *
+     * @details A background thread reads (and, for compressed files, inflates) the events of a
+     * TMReaderInterface into a ring of depth reusable TMidasEvent buffers, while the caller
+     * processes the events already read. When all the buffers are filled the thread waits for the
+     * caller to release one (back-pressure), so the memory in use is bounded by depth events.
+     *
+     * Events are handed out in file order by Acquire() and must be given back with Release(); they
+     * can be released in any order. Next() is a shortcut for loops handling one event at a time.
+     * The reader is not owned and must outlive the PrefetchReader. Errors of the reading thread
+     * are rethrown by Acquire().
+     *
+     */
+    class PrefetchReader {
+    public:
+        /**
+         * @brief Constructor. The reading thread starts immediately.
+         *
+         * @param[in] reader the MIDAS reader
+         * @param[in] depth number of event buffers. Default value is 4.
+         *
+         */
+        PrefetchReader(TMReaderInterface *reader, unsigned int depth = 4);
+        ~PrefetchReader();
+
+        PrefetchReader(const PrefetchReader &) = delete;
+        PrefetchReader &operator=(const PrefetchReader &) = delete;
+
+        /**
+         * @brief This method returns the next event of the file, waiting for it if needed
+         *
+         * @return the event, or nullptr at the end of the file. The event stays valid until it is
+         * passed to Release().
+         */
+        TMidasEvent *Acquire();
+
+        /**
+         * @brief This method gives an event returned by Acquire() back to the reading thread
+         */
+        void Release(TMidasEvent *event);
+
+        /**
+         * @brief This method releases the event returned by the previous call, then acquires the next one
+         */
+        TMidasEvent *Next();
+
+        unsigned int GetDepth() const { return fDepth; }
+
+        /**
+         * @brief This method returns a snapshot of the time accounting
+         */
+        PrefetchStats GetStats() const;
+
+    private:
+        struct Slot {
+            TMidasEvent event;
+            AlignedVector<char> buffer;
+        };
+
+        void Run();
+        void Stop();
+
+        TMReaderInterface *fReader;
+        unsigned int fDepth;
+        std::unique_ptr<Slot[]> fSlots;
+        std::deque<unsigned int> fFree;     ///< slots the reading thread can fill
+        std::deque<unsigned int> fFilled;   ///< slots holding events not yet acquired, in file order
+        bool fEOF  = false;
+        bool fStop = false;
+        std::exception_ptr fError;
+        TMidasEvent *fCurrent = nullptr;    ///< event returned by Next()
+        PrefetchStats fStats;
+
+        mutable std::mutex fMutex;
+        std::condition_variable fFreeCV;
+        std::condition_variable fFilledCV;
+        std::thread fThread;
+    };
+
+}
+
+#endif
@@ -0,0 +1,114 @@
+/*
+ * Copyright (C) 2024 CYGNO Collaboration
+ *
+ *
+ * Author: Stefano Piacentini
+ * Created in 2024
+ *
+ */
+
+#ifndef __CYGNO_SESSION_H__
+#define __CYGNO_SESSION_H__
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include "midasio.h"
+#include "drs4.h"
+
+
+namespace cygnolib {
+
+    /**
+     * @class RunSession
+     * @brief A MIDAS run opened once for both its BOR ODB dump and its events
+     * @author CYGNO Collaboration
+     *
+     * @details The constructor opens the file, reads the PMT readout configuration from the begin
+     * of run ODB dump (see ReadPMTReadoutODB()) and gets the DRS4 correction tables of the tag (see
+     * GetDRS4Calibration(), so the tables are loaded only for the first run of a tag). The reader
+     * is then handed out by GetReader() positioned right after the ODB dump, so the events read to
+     * get there are neither read nor decompressed twice.
+     *
+     */
+    class RunSession {
+    public:
+        /**
+         * @brief Constructor.
+         *
+         * @param[in] filename name of the MIDAS file
+         * @param[in] tag tag of the DAQ where the data have been collected (LNGS, LNF, ...)
+         * @param[in] calibdir folder overriding the embedded DRS4 tables. Default is empty (no override).
+         *
+         */
+        RunSession(std::string filename, std::string tag, std::string calibdir = "");
+
+        /**
+         * @brief Constructor.
+         * @details Same as above, but for a reader opened by the caller (e.g. s3::open_stream()),
+         * of which the session takes the ownership.
+         *
+         * @param[in] reader the MIDAS reader, positioned at the start of the run
+         * @param[in] tag tag of the DAQ where the data have been collected (LNGS, LNF, ...)
+         * @param[in] calibdir folder overriding the embedded DRS4 tables. Default is empty (no override).
+         *
+         */
+        RunSession(TMReaderInterface *reader, std::string tag, std::string calibdir = "");
+
+        /**
+         * @brief Destructor. The reader is closed and deleted.
+         */
+        ~RunSession();
+
+        RunSession(const RunSession &) = delete;
+        RunSession &operator=(const RunSession &) = delete;
+
+        const std::string &GetFilename() const { return fFilename; }
+        const std::string &GetTag() const { return fTag; }
+
+        /**
+         * @brief This method returns the DRS4Correction flag of the BOR ODB dump
+         */
+        bool GetDRS4Correction() const { return fDRS4Correction; }
+
+        /**
+         * @brief This method returns the digitizer offsets of the BOR ODB dump
+         */
+        std::vector<float> *GetChannelsOffsets() { return &fChannelsOffsets; }
+        const std::vector<float> &GetChannelsOffsets() const { return fChannelsOffsets; }
+
+        /**
+         * @brief This method returns the DRS4 correction tables of the tag
+         */
+        DRS4Calibration &GetCalibration() { return fCalibration; }
+        const DRS4Calibration &GetCalibration() const { return fCalibration; }
+
+        /**
+         * @brief This method returns the reader, positioned on the first event after the BOR ODB dump
+         *
+         * @details The reader is owned by the session and is valid until its destruction.
+         */
+        TMReaderInterface *GetReader() { return fReader.get(); }
+
+        /**
+         * @brief This method returns the number of events read by the constructor, the BOR ODB
+         * dump included, i.e. the index in the file of the next event given by the reader
+         */
+        uint64_t GetNEventsRead() const { return fNEventsRead; }
+
+    private:
+        void Initialize(std::string calibdir);
+
+        std::string fFilename;
+        std::string fTag;
+        std::unique_ptr<TMReaderInterface> fReader;
+        uint64_t fNEventsRead = 0;
+        bool fDRS4Correction = false;
+        std::vector<float> fChannelsOffsets;
+        DRS4Calibration fCalibration;
+    };
+
+}
+
+#endif
@@ -0,0 +1,65 @@
+/*
+ * Copyright (C) 2024 CYGNO Collaboration
+ *
+ *
+ * Author: Stefano Piacentini
+ * Created in 2024
+ *
+ */
+
+#ifndef __CYGNO_SIMD_H__
+#define __CYGNO_SIMD_H__
+
+#include <string>
+
+
+namespace cygnolib {
+
+    /**
+     * @brief Instruction set levels used by the runtime dispatch of the cygnolib kernels
+     */
+    enum class SimdLevel {
+        Scalar = 0, ///< portable C++ implementation
+        SSE42  = 1, ///< SSE4.2
+        AVX2   = 2, ///< AVX2
+        AVX512 = 3  ///< AVX-512 (F and BW)
+    };
+
+    /**
+     * @brief This function returns the instruction set level used by the kernels
+     *
+     * @details The level is detected once from the CPU (cpuid) and can be lowered with
+     * SetSimdLevel(), e.g. to compare the implementations.
+     *
+     * @return the instruction set level in use
+     */
+    SimdLevel GetSimdLevel();
+
+    /**
+     * @brief This function returns the best instruction set level supported by the CPU
+     *
+     * @return the detected instruction set level
+     */
+    SimdLevel GetSupportedSimdLevel();
+
+    /**
+     * @brief This function sets the instruction set level used by the kernels
+     *
+     * @details Levels above GetSupportedSimdLevel() are clamped to it.
+     *
+     * @param[in] level the requested instruction set level
+     */
+    void SetSimdLevel(SimdLevel level);
+
+    /**
+     * @brief This function returns a printable name of the instruction set level
+     *
+     * @param[in] level the instruction set level
+     *
+     * @return the name of the level
+     */
+    std::string SimdLevelName(SimdLevel level);
+
+}
+
+#endif
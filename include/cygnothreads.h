@@ -0,0 +1,102 @@
+/*
+ * Copyright (C) 2024 CYGNO Collaboration
+ *
+ *
+ * Author: Stefano Piacentini
+ * Created in 2024
+ *
+ */
+
+#ifndef __CYGNO_THREADS_H__
+#define __CYGNO_THREADS_H__
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+namespace cygnolib {
+
+    /**
+     * @brief This function returns the number of threads used when 0 is requested
+     *
+     * @return std::thread::hardware_concurrency(), or 1 if it is unknown
+     */
+    unsigned int GetDefaultNThreads();
+
+    /**
+     * @class WorkerPool
+     * @brief A fixed set of threads running tasks from a FIFO queue
+     * @author CYGNO Collaboration
+     *
+     */
+    class WorkerPool {
+    public:
+        /**
+         * @brief Constructor. The threads start immediately.
+         *
+         * @param[in] nthreads number of threads. Default value is 0 (GetDefaultNThreads()).
+         *
+         */
+        explicit WorkerPool(unsigned int nthreads = 0);
+
+        /**
+         * @brief Destructor. Tasks already queued are run before the threads are joined.
+         */
+        ~WorkerPool();
+
+        WorkerPool(const WorkerPool &) = delete;
+        WorkerPool &operator=(const WorkerPool &) = delete;
+
+        unsigned int GetNThreads() const { return fThreads.size(); }
+
+        /**
+         * @brief This method queues a task. Exceptions escaping the task terminate the program, so
+         * the task must catch them itself.
+         */
+        void Submit(std::function<void()> task);
+
+        /**
+         * @brief This method runs fn(i) for i in [0, n) on the threads of the pool and waits for all of them
+         *
+         * @details The indices are handed out dynamically, one at a time, and the calling thread
+         * takes part in the loop. The first exception thrown by fn is rethrown once the loop is
+         * over. It must not be called from a task running on the same pool.
+         *
+         * @param[in] n number of iterations
+         * @param[in] fn the loop body
+         *
+         */
+        void ParallelFor(std::size_t n, const std::function<void(std::size_t)> &fn);
+
+    private:
+        void Run();
+
+        std::vector<std::thread> fThreads;
+        std::deque<std::function<void()>> fTasks;
+        bool fStop = false;
+        std::mutex fMutex;
+        std::condition_variable fCV;
+    };
+
+    /**
+     * @brief This function returns the pool of the loops run by nthreads threads, the calling one included
+     *
+     * @details The pool has nthreads-1 threads, as the calling thread takes part in
+     * WorkerPool::ParallelFor(); for a single thread there is no pool (nullptr) and the loops run
+     * on the calling thread. The pool can be shared by the objects running their loops in turn.
+     *
+     * @param[in] nthreads number of threads, the calling one included. 0 means GetDefaultNThreads().
+     *
+     * @return the pool, or nullptr for a single thread
+     */
+    std::shared_ptr<WorkerPool> MakeWorkerPool(unsigned int nthreads);
+
+}
+
+#endif
@@ -0,0 +1,213 @@
+/*
+ * Copyright (C) 2024 CYGNO Collaboration
+ *
+ *
+ * Author: Stefano Piacentini
+ * Created in 2024
+ *
+ */
+
+#ifndef __CYGNO_DBSCAN_H__
+#define __CYGNO_DBSCAN_H__
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <utility>
+#include <vector>
+#include "cygnobuffer.h"
+#include "cygnothreads.h"
+#include "clustering.h"
+#include "zerosuppression.h"
+
+
+namespace cygnolib {
+
+    /**
+     * @class HitGrid
+     * @brief A uniform grid over the hits of a HitList, for neighbour queries
+     * @author CYGNO Collaboration
+     *
+     * @details The frame is divided in square cells of cellsize pixels and the hits are sorted by
+     * cell (and in row-major order within a cell), so that the hits of a region are found by
+     * visiting only the cells overlapping it. With cellsize not smaller than a search radius, a
+     * query visits at most 3x3 cells.
+     *
+     */
+    class HitGrid {
+    public:
+        HitGrid() {}
+
+        /**
+         * @brief This method sorts the hits in the cells of the grid
+         *
+         * @param[in] hits the hits; the grid refers to them by index
+         * @param[in] cellsize side of the cells in pixel
+         *
+         */
+        void Build(const HitList &hits, unsigned int cellsize);
+
+        unsigned int GetCellSize() const { return fCellSize; }
+        unsigned int GetNCellRows() const { return fNCellRows; }
+        unsigned int GetNCellColumns() const { return fNCellColumns; }
+
+        /**
+         * @brief This method returns the index of the cell containing pixel (row, column)
+         */
+        std::size_t GetCell(unsigned int row, unsigned int column) const {
+            return std::size_t(row/fCellSize)*fNCellColumns + column/fCellSize;
+        }
+
+        /**
+         * @brief This method returns the cell offsets: the hits of cell c are in [GetOffsets()[c], GetOffsets()[c+1])
+         */
+        Span<const uint32_t> GetOffsets() const { return Span<const uint32_t>(fOffsets.data(), fOffsets.size()); }
+
+        /**
+         * @brief These methods return the index in the HitList, the row and the column of the hits, in cell order
+         */
+        Span<const uint32_t> GetHits() const { return Span<const uint32_t>(fHits.data(), fHits.size()); }
+        Span<const uint32_t> GetRows() const { return Span<const uint32_t>(fRows.data(), fRows.size()); }
+        Span<const uint32_t> GetColumns() const { return Span<const uint32_t>(fColumns.data(), fColumns.size()); }
+
+        /**
+         * @brief This method calls fn(hit, row, column) for every hit in the box [rmin, rmax]x[cmin, cmax]
+         *
+         * @details The hits are visited cell by cell; the order only depends on the hits and on
+         * the box.
+         */
+        template <typename F>
+        void ForEachInBox(int rmin, int rmax, int cmin, int cmax, F &&fn) const {
+            rmin = std::max(rmin, 0);
+            cmin = std::max(cmin, 0);
+            rmax = std::min<int>(rmax, int(fNRows)-1);
+            cmax = std::min<int>(cmax, int(fNColumns)-1);
+            if(rmin>rmax || cmin>cmax) return;
+            for(unsigned int cr=rmin/fCellSize; cr<=unsigned(rmax)/fCellSize; cr++) {
+                for(unsigned int cc=cmin/fCellSize; cc<=unsigned(cmax)/fCellSize; cc++) {
+                    std::size_t cell = std::size_t(cr)*fNCellColumns + cc;
+                    for(uint32_t k=fOffsets[cell]; k<fOffsets[cell+1]; k++) {
+                        int r = fRows[k], c = fColumns[k];
+                        if(r>=rmin && r<=rmax && c>=cmin && c<=cmax) fn(fHits[k], r, c);
+                    }
+                }
+            }
+        }
+
+    private:
+        unsigned int fNRows = 0;
+        unsigned int fNColumns = 0;
+        unsigned int fCellSize = 1;
+        unsigned int fNCellRows = 0;
+        unsigned int fNCellColumns = 0;
+        AlignedVector<uint32_t> fOffsets;
+        // in cell order
+        AlignedVector<uint32_t> fHits;
+        AlignedVector<uint32_t> fRows;
+        AlignedVector<uint32_t> fColumns;
+    };
+
+    /**
+     * @class DBSCAN
+     * @brief Density-based clustering (DBSCAN) of the hits of camera frames
+     * @author CYGNO Collaboration
+     *
+     * @details A hit is a core point if at least minpts hits, itself included, are within eps
+     * pixels of it. Core points within eps of each other belong to the same cluster; a hit that is
+     * not a core point joins the cluster of its nearest core point within eps (the first one in
+     * row-major order in case of a tie), otherwise it is noise (label -1).
+     *
+     * The hits are sorted on a HitGrid whose cells are small enough (diagonal not larger than
+     * eps) that all the hits of a cell are neighbours of each other: a cell with at least minpts
+     * hits only holds core points, the core points of a cell always belong to the same cluster,
+     * and two cells are joined as soon as one pair of their core points is within eps. Only the
+     * few cells around a hit or a cell are visited.
+     *
+     * As for ComponentLabeler, the core points are found and joined by a union-find in bands of
+     * rows, in parallel, and the trees of neighbouring bands are merged afterwards; clusters are
+     * numbered in row-major order of their first core point, so the result is the same for any
+     * number of threads.
+     *
+     */
+    class DBSCAN {
+    public:
+        /**
+         * @brief Constructor.
+         *
+         * @param[in] eps neighbourhood radius in pixel
+         * @param[in] minpts minimum number of hits within eps of a core point, itself included
+         * @param[in] nthreads number of threads, the calling one included. Default value is 0 (GetDefaultNThreads()).
+         * @param[in] band_rows number of rows of the bands processed in parallel. Default value is 64.
+         *
+         */
+        DBSCAN(float eps, unsigned int minpts, unsigned int nthreads = 0, unsigned int band_rows = 64);
+
+        /**
+         * @brief Constructor.
+         * @details This constructor runs the loops on a pool shared with other objects (see MakeWorkerPool()).
+         *
+         * @param[in] eps neighbourhood radius in pixel
+         * @param[in] minpts minimum number of hits within eps of a core point, itself included
+         * @param[in] pool the pool; nullptr to run on the calling thread only
+         * @param[in] band_rows number of rows of the bands processed in parallel. Default value is 64.
+         *
+         */
+        DBSCAN(float eps, unsigned int minpts, std::shared_ptr<WorkerPool> pool, unsigned int band_rows = 64);
+
+        float GetEps() const { return fEps; }
+        unsigned int GetMinPts() const { return fMinPts; }
+        unsigned int GetNThreads() const { return fPool ? fPool->GetNThreads()+1 : 1; }
+
+        /**
+         * @brief This method clusters a list of hits
+         *
+         * @param[in] hits the hits, e.g. from ZeroSuppress()
+         * @param[out] clusters the clusters; noise hits have label -1
+         *
+         */
+        void Cluster(const HitList &hits, HitClusters &clusters);
+
+        /**
+         * @brief This method returns the grid built by the last call to Cluster()
+         */
+        const HitGrid &GetGrid() const { return fGrid; }
+
+        /**
+         * @brief This method returns, for every hit of the last call to Cluster(), 1 if it is a core point
+         */
+        Span<const uint8_t> GetCorePoints() const { return Span<const uint8_t>(fCore.data(), fNHits); }
+
+    private:
+        void ForEachBand(std::size_t nbands, const std::function<void(std::size_t)> &fn);
+        uint32_t Find(uint32_t x);
+        void Union(uint32_t a, uint32_t b);
+        bool IsNeighbour(unsigned int r1, unsigned int c1, unsigned int r2, unsigned int c2) const;
+        uint32_t FirstCore(std::size_t cell) const;
+        uint32_t CellsTouch(std::size_t a, std::size_t b) const;
+
+        float fEps;
+        float fEps2;
+        unsigned int fMinPts;
+        unsigned int fCellSize;
+        unsigned int fBandRows;
+        // number of cell rows above a cell that may hold its neighbours
+        int fReach;
+        // offsets (rows, columns) of the cells that may hold neighbours of a cell, all of them and
+        // only those preceding it in row-major order
+        std::vector<std::pair<int, int>> fNeighbourCells;
+        std::vector<std::pair<int, int>> fPrecedingCells;
+        std::shared_ptr<WorkerPool> fPool;
+
+        HitGrid fGrid;
+        std::size_t fNHits = 0;
+        AlignedVector<uint8_t> fCore;
+        AlignedVector<uint32_t> fParent;
+        AlignedVector<uint32_t> fRoot;
+        std::vector<std::size_t> fBandClusters;
+    };
+
+}
+
+#endif
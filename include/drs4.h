@@ -0,0 +1,332 @@
+/*
+ * Copyright (C) 2024 CYGNO Collaboration
+ *
+ *
+ * Author: Stefano Piacentini
+ * Created in 2024
+ *
+ */
+
+#ifndef __CYGNO_DRS4_H__
+#define __CYGNO_DRS4_H__
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include "cygnobuffer.h"
+
+
+namespace cygnolib {
+
+    /**
+     * @brief How the DRS4 'cell' and 'nsample' corrections are applied
+     */
+    enum class DRS4Mode {
+        Rotate = 0, ///< rotate the 'cell' table by the start index cell of every waveform (default)
+        LUT    = 1  ///< use the combined correction precomputed for every start index cell
+    };
+
+    /**
+     * @class DRS4Calibration
+     * @brief A class holding the 'cell' and 'nsample' correction tables of a DRS4 digitizer
+     * @author CYGNO Collaboration
+     *
+     * @details The tables are stored as int16 in aligned buffers, one row of GetNCells() values per
+     * channel, which is the layout expected by the vectorized correction kernels. The tables can
+     * also alias read-only memory owned by someone else (e.g. a binary calibration file mapped by
+     * LoadDRS4CalibrationBinary()): they are then copied into an owned buffer only the first time a
+     * non-const accessor is called.
+     *
+     */
+    class DRS4Calibration {
+    public:
+
+        /**
+         * @brief Constructor.
+         * @details This constructor creates zero-filled tables.
+         *
+         * @param[in] nchannels number of channels. Default value is 8.
+         * @param[in] ncells number of DRS4 cells. Default value is 1024.
+         *
+         */
+        DRS4Calibration(unsigned int nchannels = 8, unsigned int ncells = 1024);
+
+        /**
+         * @brief Constructor.
+         * @details This constructor converts tables in the format filled by InitializePMTReadout.
+         * Values outside the int16 range are saturated.
+         *
+         * @param[in] table_cell the 'cell' correction tables
+         * @param[in] table_nsample the 'nsample' correction tables
+         *
+         */
+        DRS4Calibration(const std::vector<std::vector<int>> &table_cell,
+                        const std::vector<std::vector<int>> &table_nsample);
+
+        /**
+         * @brief Constructor.
+         * @details This constructor wraps tables owned by someone else without copying them.
+         *
+         * @param[in] nchannels number of channels
+         * @param[in] ncells number of DRS4 cells
+         * @param[in] cell the 'cell' correction tables, nchannels rows of ncells values
+         * @param[in] nsample the 'nsample' correction tables, nchannels rows of ncells values
+         * @param[in] owner object keeping the memory of the tables alive (may be empty for static data)
+         *
+         */
+        DRS4Calibration(unsigned int nchannels, unsigned int ncells,
+                        const int16_t *cell, const int16_t *nsample,
+                        std::shared_ptr<const void> owner);
+
+        DRS4Calibration(const DRS4Calibration &other);
+        DRS4Calibration(DRS4Calibration &&) noexcept = default;
+        DRS4Calibration &operator=(const DRS4Calibration &other);
+        DRS4Calibration &operator=(DRS4Calibration &&) noexcept = default;
+
+        unsigned int GetNChannels() const { return fNChannels; }
+        unsigned int GetNCells() const { return fNCells; }
+
+        /**
+         * @brief This method returns the tag of the DAQ the tables belong to (LNGS, LNF, ...)
+         */
+        const std::string &GetTag() const { return fTag; }
+        void SetTag(const std::string &tag) { fTag = tag; }
+
+        /**
+         * @brief This method returns true if the tables alias memory not owned by this object
+         */
+        bool IsExternal() const { return fStorage.empty() && fNChannels*fNCells > 0; }
+
+        /**
+         * @brief This method returns the 'cell' correction table of a channel
+         */
+        Span<const int16_t> GetCell(unsigned int ch) const { return Span<const int16_t>(fCell + ch*fNCells, fNCells); }
+        Span<int16_t> GetCell(unsigned int ch) { Detach(); return Span<int16_t>(fStorage.data() + ch*fNCells, fNCells); }
+
+        /**
+         * @brief This method returns the 'nsample' correction table of a channel
+         */
+        Span<const int16_t> GetNSample(unsigned int ch) const { return Span<const int16_t>(fNSample + ch*fNCells, fNCells); }
+        Span<int16_t> GetNSample(unsigned int ch) { Detach(); return Span<int16_t>(fStorage.data() + (fNChannels + ch)*fNCells, fNCells); }
+
+        /**
+         * @brief This method selects how the corrections are applied by Correct()
+         *
+         * @details DRS4Mode::LUT precomputes, for every channel and every possible start index cell,
+         * the combined correction cell[(s+SIC)%ncells] + nsample[s] (nchannels*ncells*ncells int16,
+         * i.e. 16 MB for 8 channels of 1024 cells), so that correcting a waveform is a single
+         * vector subtraction. Whether it is faster than DRS4Mode::Rotate depends on how much of the
+         * table stays in cache: see drs4bench. The table is built here and dropped when switching
+         * back to DRS4Mode::Rotate. Call it again after modifying the tables.
+         *
+         * @param[in] mode the correction mode
+         *
+         */
+        void SetMode(DRS4Mode mode);
+        DRS4Mode GetMode() const { return fMode; }
+
+        /**
+         * @brief This method returns the combined correction of a channel for a start index cell
+         *
+         * @details Only available in DRS4Mode::LUT.
+         */
+        Span<const int16_t> GetCombined(unsigned int ch, unsigned int SIC) const {
+            return Span<const int16_t>(fLUT.data() + (std::size_t(ch)*fNCells + SIC%fNCells)*fNCells, fNCells);
+        }
+
+        /**
+         * @brief This method applies the corrections of a channel to one waveform in place
+         *
+         * @details The correction is subtracted with unsigned 16-bit saturation, using the mode
+         * selected with SetMode(). Both modes give identical results.
+         *
+         * @param[in,out] wf the waveform, GetNCells() samples
+         * @param[in] ch the channel
+         * @param[in] SIC start index cell of the waveform
+         *
+         */
+        void Correct(uint16_t *wf, unsigned int ch, unsigned int SIC) const;
+
+    private:
+        void Detach();
+
+        unsigned int fNChannels;
+        unsigned int fNCells;
+        std::string fTag;
+        AlignedVector<int16_t> fStorage;      ///< owned tables ('cell' rows, then 'nsample' rows)
+        std::shared_ptr<const void> fOwner;   ///< keeps external tables alive
+        const int16_t *fCell;                 ///< 'cell' tables, owned or external
+        const int16_t *fNSample;              ///< 'nsample' tables, owned or external
+        DRS4Mode fMode = DRS4Mode::Rotate;
+        AlignedVector<int16_t> fLUT;
+    };
+
+
+    /**
+     * @brief This function reads the correction tables from the text files in the input folder
+     *
+     * @details Each file holds one line of whitespace-separated integers per channel.
+     *
+     * @param[in] table_cell_filename name of the 'cell' table file
+     * @param[in] table_nsample_filename name of the 'nsample' table file
+     * @param[in] tag tag of the DAQ the tables belong to (LNGS, LNF, ...)
+     *
+     * @return the correction tables
+     *
+     */
+    DRS4Calibration LoadDRS4CalibrationText(std::string table_cell_filename,
+                                            std::string table_nsample_filename,
+                                            std::string tag);
+
+    /**
+     * @brief This function writes the correction tables in the binary calibration format
+     *
+     * @details The format (version 1, native little-endian) is a 64-byte header:
+     *
+     *     char     magic[8]   "CYDRS4\0\0"
+     *     uint32_t version    1
+     *     uint32_t nchannels
+     *     uint32_t ncells
+     *     uint32_t checksum   CRC-32 of everything after the header
+     *     char     tag[16]    NUL-padded
+     *     uint8_t  reserved[24]
+     *
+     * followed by the 'cell' and then the 'nsample' tables as int16 rows, each table padded to a
+     * multiple of 64 bytes, so that a mapped file can be used in place by the correction kernels.
+     *
+     * @param[in] calib the correction tables
+     * @param[in] filename name of the output file
+     *
+     */
+    void WriteDRS4CalibrationBinary(const DRS4Calibration &calib, std::string filename);
+
+    /**
+     * @brief This function loads correction tables written by WriteDRS4CalibrationBinary()
+     *
+     * @details The file is mapped read-only in memory and the returned object aliases the
+     * mapping, which stays alive as long as the object (or any copy of it) does. The header and
+     * the checksum are validated.
+     *
+     * @param[in] filename name of the binary calibration file
+     *
+     * @return the correction tables
+     *
+     */
+    DRS4Calibration LoadDRS4CalibrationBinary(std::string filename);
+
+    /**
+     * @brief This function loads the correction tables of a tag from a folder
+     *
+     * @details The binary file table_<tag>.bin (see drs4convert) is used if it exists, otherwise the
+     * text tables table_cell_<tag>.txt and table_nsample_<tag>.txt are parsed.
+     *
+     * @param[in] dirname name of the folder holding the tables (e.g. $RECOPPSYS/input)
+     * @param[in] tag tag of the DAQ the tables belong to (LNGS, LNF, ...)
+     *
+     * @return the correction tables
+     *
+     */
+    DRS4Calibration LoadDRS4Calibration(std::string dirname, std::string tag);
+
+    /**
+     * @brief This function returns true if the tables of a tag are compiled in the library
+     *
+     * @details The tables found in input/ at configure time are embedded when the project is built
+     * with -DRECOPP_EMBED_CALIBRATION=ON; otherwise this function always returns false.
+     *
+     * @param[in] tag tag of the DAQ (LNGS, LNF, ...)
+     *
+     */
+    bool HasEmbeddedDRS4Calibration(std::string tag);
+
+    /**
+     * @brief This function returns the correction tables of a tag compiled in the library
+     *
+     * @details The returned object aliases the static tables, so no file is read and nothing is
+     * copied until a non-const accessor is called.
+     *
+     * @param[in] tag tag of the DAQ (LNGS, LNF, ...)
+     *
+     * @return the correction tables
+     *
+     */
+    DRS4Calibration GetEmbeddedDRS4Calibration(std::string tag);
+
+    /**
+     * @brief This function returns the correction tables of a tag, loading them once per process
+     *
+     * @details The tables are taken, in order of preference, from calibdir if given (see
+     * LoadDRS4Calibration()), from the tables compiled in the library (see
+     * HasEmbeddedDRS4Calibration()), or from $RECOPPSYS/input. The first call for a (tag, calibdir)
+     * pair loads them; later calls, e.g. for the following runs, return an object aliasing the
+     * cached tables, so nothing is read or copied. It is thread safe.
+     *
+     * @param[in] tag tag of the DAQ (LNGS, LNF, ...)
+     * @param[in] calibdir folder overriding the embedded tables. Default is empty (no override).
+     *
+     * @return the correction tables
+     *
+     */
+    DRS4Calibration GetDRS4Calibration(std::string tag, std::string calibdir = "");
+
+
+    /**
+     * @brief This function applies the 'cell' and 'nsample' corrections to one DRS4 channel in place
+     *
+     * @details For every sample s the correction cell[(s+SIC)%ncells] + nsample[s] is subtracted
+     * from the waveform with unsigned 16-bit saturation. The rotation by the start index cell is
+     * split in two contiguous segments, so no modulo is computed in the inner loop. The
+     * implementation (scalar, SSE4.2, AVX2 or AVX-512) is chosen at runtime, see GetSimdLevel().
+     *
+     * @param[in,out] wf the waveform, ncells samples
+     * @param[in] cell the 'cell' correction table of the channel, ncells values
+     * @param[in] nsample the 'nsample' correction table of the channel, ncells values
+     * @param[in] ncells number of DRS4 cells
+     * @param[in] SIC start index cell of the waveform
+     *
+     */
+    void DRS4CorrectChannel(uint16_t *wf, const int16_t *cell, const int16_t *nsample,
+                            unsigned int ncells, unsigned int SIC);
+
+    /**
+     * @brief This function subtracts a precomputed correction from one waveform in place
+     *
+     * @details wf[s] is replaced by wf[s] - correction[s] with unsigned 16-bit saturation. The
+     * implementation is chosen at runtime, see GetSimdLevel().
+     *
+     * @param[in,out] wf the waveform, n samples
+     * @param[in] correction the correction, n values
+     * @param[in] n number of samples
+     *
+     */
+    void DRS4SubtractCorrection(uint16_t *wf, const int16_t *correction, unsigned int n);
+
+    /**
+     * @brief Portable reference implementation of DRS4CorrectChannel()
+     */
+    void DRS4CorrectChannelScalar(uint16_t *wf, const int16_t *cell, const int16_t *nsample,
+                                  unsigned int ncells, unsigned int SIC);
+
+    /**
+     * @brief This function applies the PeakCorrection to one V1742 event in place
+     *
+     * @details The first 8 channels of the event are corrected for the spikes and the sample
+     * drops common to (almost) all channels, which the DRS4 'cell' and 'nsample' corrections leave
+     * behind. When AVX2 is available the 8 channels are processed in parallel in the lanes of a
+     * vector register; the result is bit-exact with DRS4PeakCorrectionScalar().
+     *
+     * @param[in,out] wfs view of the channels of one triggered event (at least 8 channels of 1024
+     * samples)
+     *
+     */
+    void DRS4PeakCorrection(EventView<uint16_t> wfs);
+
+    /**
+     * @brief Reference (scalar) implementation of DRS4PeakCorrection()
+     */
+    void DRS4PeakCorrectionScalar(EventView<uint16_t> wfs);
+
+}
+
+#endif
@@ -0,0 +1,150 @@
+/*
+ * Copyright (C) 2024 CYGNO Collaboration
+ *
+ *
+ * Author: Stefano Piacentini
+ * Created in 2024
+ *
+ */
+
+#ifndef __CYGNO_IDDBSCAN_H__
+#define __CYGNO_IDDBSCAN_H__
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <vector>
+#include "cygnobuffer.h"
+#include "cygnothreads.h"
+#include "clustering.h"
+#include "dbscan.h"
+#include "zerosuppression.h"
+
+
+namespace cygnolib {
+
+    /**
+     * @brief Parameters of the iterative directional DBSCAN
+     */
+    struct IDDBSCANParameters {
+        float        eps            = 2.5f;   ///< radius in pixel of the seeding DBSCAN
+        unsigned int minpts         = 4;      ///< minimum number of hits within eps of a core point of the seeding DBSCAN
+        unsigned int min_track_hits = 30;     ///< minimum number of hits of a cluster grown along its direction
+        float        min_elongation = 3.f;    ///< minimum ratio of the RMS along and across the main axis of such a cluster
+        float        fit_length     = 20.f;   ///< length in pixel of the ends of a track used to fit their direction
+        float        search_length  = 30.f;   ///< length in pixel of the search region beyond each end of a track
+        float        search_width   = 4.f;    ///< half width in pixel of the search region
+        float        max_angle      = 0.3f;   ///< maximum angle in radians between the directions of two merged tracks
+        unsigned int max_iterations = 10;     ///< maximum number of growing iterations
+    };
+
+    /**
+     * @class IDDBSCAN
+     * @brief Iterative directional DBSCAN (iDDBSCAN) of the hits of camera frames, for long tracks
+     * @author CYGNO Collaboration
+     *
+     * @details Long and faint tracks come out of a plain DBSCAN in several fragments, separated by
+     * gaps larger than eps. The hits are first clustered by DBSCAN with a small eps; the clusters
+     * with at least min_track_hits hits and an elongation of at least min_elongation are tracks,
+     * and are then grown along their direction:
+     *
+     *     - the direction of each end of a track is fitted (principal axis) on its last
+     *       fit_length pixels;
+     *     - a half ellipse of semi-axes search_length, along the direction, and search_width,
+     *       across it, is searched beyond the end on a HitGrid;
+     *     - the noise hits found there join the track, as well as the clusters that are not
+     *       tracks themselves (fragments) and the tracks whose direction is within max_angle.
+     *
+     * The growing is repeated, with the directions fitted again on the grown tracks, until no track
+     * changes or max_iterations is reached; from the second iteration on, only the tracks that
+     * changed are searched again.
+     *
+     * In every iteration the search regions of the tracks are scanned in parallel, reading only
+     * the clusters of the previous iteration; what they find is then assigned in the order of the
+     * tracks (a noise hit or a fragment found by several tracks joins the first one). Clusters are
+     * numbered in row-major order of their first hit, so the result is the same for any number of
+     * threads.
+     *
+     */
+    class IDDBSCAN {
+    public:
+        /**
+         * @brief Constructor.
+         *
+         * @param[in] parameters the clustering parameters
+         * @param[in] nthreads number of threads, the calling one included. Default value is 0 (GetDefaultNThreads()).
+         *
+         */
+        explicit IDDBSCAN(const IDDBSCANParameters &parameters = IDDBSCANParameters(), unsigned int nthreads = 0);
+
+        const IDDBSCANParameters &GetParameters() const { return fParameters; }
+        unsigned int GetNThreads() const { return fPool ? fPool->GetNThreads()+1 : 1; }
+
+        /**
+         * @brief This method clusters a list of hits
+         *
+         * @param[in] hits the hits, e.g. from ZeroSuppress()
+         * @param[out] clusters the clusters; noise hits have label -1
+         *
+         */
+        void Cluster(const HitList &hits, HitClusters &clusters);
+
+        /**
+         * @brief This method returns the number of growing iterations of the last call to Cluster()
+         */
+        unsigned int GetNIterations() const { return fNIterations; }
+
+    private:
+        // sums over a set of hits
+        struct Moments {
+            double n = 0, row = 0, column = 0, row2 = 0, column2 = 0, rowcolumn = 0;
+            void Add(double r, double c) {
+                n += 1; row += r; column += c;
+                row2 += r*r; column2 += c*c; rowcolumn += r*c;
+            }
+            void Add(const Moments &m) {
+                n += m.n; row += m.row; column += m.column;
+                row2 += m.row2; column2 += m.column2; rowcolumn += m.rowcolumn;
+            }
+        };
+        // principal axis of a set of hits
+        struct Axis {
+            double row = 0, column = 0;   // centroid
+            double urow = 0, ucolumn = 1; // unit vector along the main axis
+            double l1 = 0, l2 = 0;        // variances along and across the main axis
+        };
+
+        static Axis FitAxis(const Moments &m);
+        void ForEachCluster(std::size_t nclusters, const std::function<void(std::size_t)> &fn);
+        void Search(std::size_t k, Span<const int32_t> labels);
+        uint32_t Find(uint32_t x);
+        void Merge(uint32_t a, uint32_t b);
+
+        IDDBSCANParameters fParameters;
+        double fCosMaxAngle;
+        // shared with the seeding DBSCAN, so constructed before it
+        std::shared_ptr<WorkerPool> fPool;
+        DBSCAN fSeeding;
+        unsigned int fNIterations = 0;
+
+        HitGrid fGrid;
+        Span<const uint32_t> fRows;
+        Span<const uint32_t> fColumns;
+        // per cluster of the seeding DBSCAN; merged clusters are a union-find whose root holds
+        // the hits and the sums of the whole cluster
+        AlignedVector<uint32_t> fParent;
+        std::vector<Moments> fMoments;
+        std::vector<std::vector<uint32_t>> fMembers;
+        std::vector<Axis> fAxes;
+        AlignedVector<uint8_t> fTrack;
+        AlignedVector<uint8_t> fActive;
+        AlignedVector<uint8_t> fChanged;
+        std::vector<std::vector<uint32_t>> fFoundHits;
+        std::vector<std::vector<uint32_t>> fFoundClusters;
+        AlignedVector<int32_t> fNumber;
+    };
+
+}
+
+#endif
@@ -0,0 +1,226 @@
+/*
+ * Copyright (C) 2024 CYGNO Collaboration
+ *
+ *
+ * Author: Stefano Piacentini
+ * Created in 2024
+ *
+ */
+
+#ifndef __CYGNO_PEDESTAL_H__
+#define __CYGNO_PEDESTAL_H__
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include "cygnobuffer.h"
+#include "cygnolib.h"
+
+
+namespace cygnolib {
+
+    /**
+     * @class PedestalMap
+     * @brief A class holding the per-pixel pedestal (mean) and noise (RMS) of a camera
+     * @author CYGNO Collaboration
+     *
+     * @details The mean and the RMS are stored as float in two aligned row-major arrays. As for
+     * DRS4Calibration, they can also alias read-only memory owned by someone else, e.g. a pedestal
+     * file mapped by LoadPedestalMap(), in which case nothing is copied.
+     *
+     * Maps are built from the frames of a pedestal run with PedestalBuilder (or
+     * BuildPedestalMap()), and subtracted from every frame with Subtract().
+     *
+     */
+    class PedestalMap {
+    public:
+        /**
+         * @brief Constructor.
+         * @details This constructor creates a map with zero mean and RMS.
+         *
+         * @param[in] height Height of the image in pixel. Default value is 2304.
+         * @param[in] width Width of the image in pixel. Default value is 2304.
+         *
+         */
+        PedestalMap(unsigned int height = 2304, unsigned int width = 2304);
+
+        /**
+         * @brief Constructor.
+         * @details This constructor wraps arrays owned by someone else without copying them.
+         *
+         * @param[in] height Height of the image in pixel.
+         * @param[in] width Width of the image in pixel.
+         * @param[in] nframes number of frames the map was computed from
+         * @param[in] mean the per-pixel mean, height*width values
+         * @param[in] rms the per-pixel RMS, height*width values
+         * @param[in] owner object keeping the memory of the arrays alive (may be empty for static data)
+         *
+         */
+        PedestalMap(unsigned int height, unsigned int width, uint64_t nframes,
+                    const float *mean, const float *rms, std::shared_ptr<const void> owner);
+
+        PedestalMap(const PedestalMap &other);
+        PedestalMap(PedestalMap &&) noexcept = default;
+        PedestalMap &operator=(const PedestalMap &other);
+        PedestalMap &operator=(PedestalMap &&) noexcept = default;
+
+        unsigned int GetNRows() const { return fNRows; }
+        unsigned int GetNColumns() const { return fNColumns; }
+        std::size_t Size() const { return std::size_t(fNRows)*fNColumns; }
+
+        /**
+         * @brief This method returns the number of frames the map was computed from
+         */
+        uint64_t GetNFrames() const { return fNFrames; }
+        void SetNFrames(uint64_t nframes) { fNFrames = nframes; }
+
+        /**
+         * @brief This method returns true if the arrays alias memory not owned by this object
+         */
+        bool IsExternal() const { return fStorage.empty() && Size() > 0; }
+
+        /**
+         * @brief This method returns the per-pixel mean, row-major
+         */
+        Span<const float> GetMean() const { return Span<const float>(fMean, Size()); }
+        Span<float> GetMean() { Detach(); return Span<float>(fStorage.data(), Size()); }
+
+        /**
+         * @brief This method returns the per-pixel RMS, row-major
+         */
+        Span<const float> GetRMS() const { return Span<const float>(fRMS, Size()); }
+        Span<float> GetRMS() { Detach(); return Span<float>(fStorage.data() + Size(), Size()); }
+
+        /**
+         * @brief This method subtracts the pedestal from a frame
+         *
+         * @details Every pixel becomes the nearest integer to pixel - mean, as a signed value, in a
+         * single vectorized pass over the frame, the mean and the output (see PedestalSubtract()).
+         *
+         * @param[in] frame the frame, with the dimensions of the map
+         * @param[out] out the pedestal-subtracted frame, row-major; resized if needed, so that
+         * the same buffer can be reused across frames
+         *
+         */
+        void Subtract(ImageView<const uint16_t> frame, AlignedVector<int32_t> &out) const;
+        void Subtract(const Picture &pic, AlignedVector<int32_t> &out) const { Subtract(pic.View(), out); }
+        void Subtract(const PictureView &pic, AlignedVector<int32_t> &out) const { Subtract(pic.View(), out); }
+
+    private:
+        void Detach();
+
+        unsigned int fNRows;
+        unsigned int fNColumns;
+        uint64_t fNFrames = 0;
+        AlignedVector<float> fStorage;
+        std::shared_ptr<const void> fOwner;
+        const float *fMean;
+        const float *fRMS;
+    };
+
+    /**
+     * @class PedestalBuilder
+     * @brief A streaming accumulator of the per-pixel mean and RMS of camera frames
+     * @author CYGNO Collaboration
+     *
+     * @details Frames are added one at a time and folded into the running mean and sum of squared
+     * deviations of every pixel with Welford's algorithm, in two float arrays updated by a
+     * vectorized kernel, so the frames themselves never need to be kept in memory.
+     *
+     */
+    class PedestalBuilder {
+    public:
+        /**
+         * @brief Constructor.
+         *
+         * @param[in] height Height of the image in pixel. Default value is 2304.
+         * @param[in] width Width of the image in pixel. Default value is 2304.
+         *
+         */
+        PedestalBuilder(unsigned int height = 2304, unsigned int width = 2304);
+
+        /**
+         * @brief This method adds a frame to the statistics
+         *
+         * @param[in] frame the frame, with the dimensions given to the constructor
+         *
+         */
+        void Add(ImageView<const uint16_t> frame);
+        void Add(const Picture &pic) { Add(pic.View()); }
+        void Add(const PictureView &pic) { Add(pic.View()); }
+
+        uint64_t GetNFrames() const { return fNFrames; }
+
+        /**
+         * @brief This method returns the map of the frames added so far
+         *
+         * @details The RMS is the population standard deviation, sqrt(sum((x-mean)^2)/n).
+         */
+        PedestalMap GetMap() const;
+
+    private:
+        unsigned int fNRows;
+        unsigned int fNColumns;
+        uint64_t fNFrames = 0;
+        AlignedVector<float> fMean;
+        AlignedVector<float> fM2;
+    };
+
+    /**
+     * @brief This function builds the pedestal map of a pedestal run
+     *
+     * @details The camera frames of the run are read one at a time (see daq_cam2picview()) and
+     * added to a PedestalBuilder.
+     *
+     * @param[in] filename name of the MIDAS file of the pedestal run
+     * @param[in] cam_model model of the Hamamatsu camera. Default is "fusion".
+     * @param[in] maxframes maximum number of frames to use. Default is 0 (all).
+     *
+     * @return the pedestal map
+     *
+     */
+    PedestalMap BuildPedestalMap(std::string filename, std::string cam_model = "fusion", uint64_t maxframes = 0);
+
+    /**
+     * @brief This function writes a pedestal map in the binary format read by LoadPedestalMap()
+     *
+     * @details The file holds a 64-byte header (magic, version, dimensions, number of frames,
+     * CRC-32 of the payload) followed by the mean and the RMS arrays, each padded to 64 bytes, so
+     * that they can be used in place once the file is mapped.
+     *
+     * @param[in] map the pedestal map
+     * @param[in] filename name of the output file
+     *
+     */
+    void WritePedestalMap(const PedestalMap &map, std::string filename);
+
+    /**
+     * @brief This function maps a file written by WritePedestalMap() in memory
+     *
+     * @details The returned map aliases the mapped file, which stays mapped as long as the map
+     * or any copy of it exists.
+     *
+     * @param[in] filename name of the pedestal file
+     *
+     * @return the pedestal map
+     *
+     */
+    PedestalMap LoadPedestalMap(std::string filename);
+
+    /**
+     * @brief This function subtracts a pedestal from n pixels: out[i] = nearest integer to (in[i] - mean[i])
+     *
+     * @details The kernel is chosen according to GetSimdLevel(); all the kernels give the same
+     * result as PedestalSubtractScalar().
+     */
+    void PedestalSubtract(const uint16_t *in, const float *mean, int32_t *out, std::size_t n);
+
+    /**
+     * @brief Portable version of PedestalSubtract()
+     */
+    void PedestalSubtractScalar(const uint16_t *in, const float *mean, int32_t *out, std::size_t n);
+
+}
+
+#endif
@@ -10,6 +10,8 @@
 #ifndef __S3_H__
 #define __S3_H__
 
+#include <cstdint>
+#include <memory>
 #include <string>
 #include <iostream>
 #include <sstream>
@@ -29,6 +31,30 @@
  */
 namespace s3 {
     
+    extern std::string BUCKET_POSIX_PATH; ///< Bucket Posix path on the cloud
+    extern std::string BUCKET_REST_PATH;  ///< Bucket rest path on the cloud (e.g. a local http server for tests)
+    
+    /**
+     * @brief Default number of parallel connections used to download a file
+     */
+    constexpr unsigned int kDownloadConnections = 4;
+    
+    /**
+     * @brief Maximum size in bytes of the segments a download is split into
+     */
+    constexpr uint64_t kDownloadSegmentSize = 64*1024*1024;
+    
+    /**
+     * @brief Time in seconds allowed to connect to the server for a HEAD request
+     */
+    constexpr long kHeadConnectSeconds = 10;
+    
+    /**
+     * @brief Time in seconds allowed for a whole HEAD request, after which the size and the ETag of
+     * the remote file are taken as unknown
+     */
+    constexpr long kHeadTimeoutSeconds = 30;
+    
     /**
      * @brief This function identifies the string of the MIDAS datafile based on the
      * run number and the location of the file
@@ -44,26 +70,200 @@ namespace s3 {
     std::string mid_file(int run, std::string tag="LNGS", bool cloud = true, bool verbose=false);
     
     
+    /**
+     * @class CacheLock
+     * @brief An advisory lock on an entry of the local cache
+     * @author CYGNO Collaboration
+     *
+     * @details The lock is a flock() on filename+".lock", released by the destructor (or by the
+     * system if the process dies). The exclusive lock is taken to download, replace or evict the
+     * entry; the shared one (see s3::CachedFile) by everyone using the file, so that it is neither
+     * replaced nor evicted meanwhile. Lock files are never removed, since a process could otherwise
+     * lock a file that another one has just replaced.
+     *
+     */
+    class CacheLock {
+    public:
+        /**
+         * @brief Constructor.
+         *
+         * @param[in] filename name of the cached file
+         * @param[in] wait flag to wait until the lock is free; if false, see IsLocked(). Default is true.
+         * @param[in] shared flag to take a shared lock instead of an exclusive one. Default is false.
+         *
+         */
+        explicit CacheLock(std::string filename, bool wait = true, bool shared = false);
+        ~CacheLock();
+        
+        CacheLock(const CacheLock &) = delete;
+        CacheLock &operator=(const CacheLock &) = delete;
+        
+        bool IsLocked() const { return fFd>=0; }
+        
+    private:
+        int fFd = -1;
+    };
+    
+    
+    /**
+     * @class CachedFile
+     * @brief A file of the local cache, kept on disk as long as the object lives
+     * @author CYGNO Collaboration
+     *
+     * @details The object holds a shared s3::CacheLock on the entry, so that s3::evict_cache
+     * skips it and s3::cache_file does not replace it, also in other processes, while it is
+     * read (e.g. reopened for every range by cygnolib::EventRangeRunner). It can be moved, e.g.
+     * out of s3::cache_file; Release() gives the entry back before the destruction.
+     *
+     */
+    class CachedFile {
+    public:
+        CachedFile() = default;
+        
+        /**
+         * @brief Constructor. It waits while someone else downloads, replaces or evicts the entry.
+         *
+         * @param[in] filename name of the cached file
+         * @param[in] lock flag to lock the entry; false for files that are not in a cache. Default is true.
+         *
+         */
+        explicit CachedFile(std::string filename, bool lock = true);
+        
+        const std::string &GetName() const { return fName; }
+        bool IsLocked() const { return fLock!=nullptr; }
+        void Release() { fLock.reset(); }
+        
+    private:
+        std::string fName;
+        std::unique_ptr<CacheLock> fLock;
+    };
+    
+    
     /**
      * @brief This function identifies the location of the MIDAS datafile based on its name
      * as given by the s3::mid_file function. If the file is not found, it is then
      * downloaded from the cloud.
      *
+     * @details The file is downloaded holding the exclusive lock of the entry (see
+     * s3::CacheLock), so concurrent processes asking for the same run download it only once. A
+     * file already in path is used only if it passes s3::cache_entry_valid, otherwise it is
+     * downloaded again (with its index and metadata removed). Every cache hit therefore costs a
+     * HEAD request to the cloud before the file is used, bounded by kHeadTimeoutSeconds; when the
+     * server cannot be reached the cached file is used as is. Since downloads go to a temporary
+     * file renamed when complete, an interrupted download never leaves a truncated file under the
+     * final name. The file is returned with a shared lock, which keeps it from being evicted or
+     * replaced as long as the caller holds the s3::CachedFile.
+     *
      * @param[in] fname the string of the MIDAS datafile
      * @param[in] path path where the MIDAS file will be stored on the local disk. Default
      * is "./tmp/".
      * @param[in] cloud flag to look for the data on the cloud. Default is true.
      * @param[in] tag tag of the bucket the datafile belongs to (LNGS, LNF, ...). Default is "LNGS".
      * @param[in] verbose flag for verbose mode. Default is false.
+     * @param[in] nconnections number of parallel connections of the download (see
+     * s3::download_file). Default value is kDownloadConnections.
+     * @param[in] budget maximum size in bytes of path, enforced with s3::evict_cache before a
+     * download, keeping room for the size of the remote file, and after the file is found or
+     * downloaded. Default is 0 (unlimited).
+     *
+     * @return the MIDAS datafile, whose name is given by CachedFile::GetName()
+     *
+     */
+    CachedFile cache_file(std::string fname,
+                          std::string path  = "./tmp/", 
+                          bool        cloud = true,
+                          std::string tag   = "LNGS",
+                          bool      verbose = false,
+                          unsigned int nconnections = kDownloadConnections,
+                          uint64_t    budget = 0);
+    
+    
+    /**
+     * @brief This function downloads a file over several parallel connections
+     *
+     * @details When the server accepts HTTP range requests, the file is split into segments of at
+     * most kDownloadSegmentSize bytes, downloaded by up to nconnections concurrent transfers of a
+     * curl multi handle and written in place with pwrite into filename+".part", preallocated to
+     * the size of the file. The progress of every segment is saved in filename+".part.state", so
+     * after an interruption (or a failure, which throws) the next call for the same file resumes
+     * each segment where it stopped, provided the size and the ETag of the remote file did not
+     * change. Otherwise, or if the server announces range requests but answers them with the
+     * whole file, the file is downloaded over a single connection. The .part file is renamed
+     * to filename once complete, and its size and ETag are recorded in filename+".meta".
+     *
+     * @param[in] url URL of the file
+     * @param[in] filename local name of the file
+     * @param[in] nconnections maximum number of parallel connections. Default value is kDownloadConnections.
+     * @param[in] verbose flag for verbose mode. Default is false.
+     *
+     */
+    void download_file(std::string url,
+                       std::string filename,
+                       unsigned int nconnections = kDownloadConnections,
+                       bool         verbose      = false);
+    
+    
+    /**
+     * @brief This function returns the size of a remote file, from a HEAD request
+     *
+     * @param[in] url URL of the file
+     * @param[in] verbose flag for verbose mode. Default is false.
+     *
+     * @return the size in bytes, or -1 if it is unknown or the server cannot be reached
+     *
+     */
+    int64_t remote_file_size(std::string url, bool verbose = false);
+    
+    
+    /**
+     * @brief This function checks that a cached file is the complete, current copy of a remote file
+     *
+     * @details The file must have the size recorded when it was downloaded, and the size and the
+     * ETag of the remote file, which are asked with a blocking HEAD request. If the server cannot
+     * be reached, within kHeadConnectSeconds to connect and kHeadTimeoutSeconds in all, the file
+     * is accepted as is.
+     *
+     * @param[in] url URL of the file
+     * @param[in] filename local name of the file
+     * @param[in] verbose flag for verbose mode. Default is false.
+     *
+     * @return true if the file can be used
+     *
+     */
+    bool cache_entry_valid(std::string url, std::string filename, bool verbose = false);
+    
+    
+    /**
+     * @brief This function removes the least recently used entries of a cache folder
+     *
+     * @details Every file of path belongs to an entry, made of the data file and its .idx, .meta,
+     * .part and .part.state files. The entries are removed, oldest modification time of the data
+     * first (s3::cache_file updates it on every use), until the folder is within budget; entries
+     * in use (see s3::CachedFile) or being downloaded are skipped.
+     *
+     * @param[in] path the cache folder
+     * @param[in] budget maximum size in bytes of the folder
+     * @param[in] keep name of a file never to remove. Default is empty.
+     * @param[in] verbose flag for verbose mode. Default is false.
+     *
+     * @return the size in bytes of the folder afterwards
+     *
+     */
+    uint64_t evict_cache(std::string path, uint64_t budget, std::string keep = "", bool verbose = false);
+    
+    
+    /**
+     * @brief This function returns the size of the entries of a cache folder that cannot be evicted
+     *
+     * @details These are the entries in use (see s3::CachedFile) or being downloaded, by this
+     * process or by others, counted with all their files (see s3::evict_cache).
+     *
+     * @param[in] path the cache folder
      *
-     * @return the filepath to the MIDAS datafile
+     * @return the size in bytes
      *
      */
-    std::string cache_file(std::string fname,
-                           std::string path  = "./tmp/", 
-                           bool        cloud = true,
-                           std::string tag   = "LNGS",
-                           bool      verbose = false);
+    uint64_t cache_bytes_in_use(std::string path);
 }
 
 
@@ -0,0 +1,124 @@
+/*
+ * Copyright (C) 2024 CYGNO Collaboration
+ *
+ *
+ * Author: Stefano Piacentini
+ * Created in 2024
+ *
+ */
+
+#ifndef __S3_QUEUE_H__
+#define __S3_QUEUE_H__
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "s3.h"
+
+
+namespace s3 {
+
+    /**
+     * @class RunQueue
+     * @brief A list of runs downloaded in the background ahead of their processing
+     * @author CYGNO Collaboration
+     *
+     * @details A background thread downloads the runs in order with s3::cache_file, keeping up
+     * to ahead runs beyond the one being processed ready on disk, so that the download of the next
+     * runs overlaps with the processing of the current one. With a budget, a run is not fetched
+     * ahead while the entries of the cache that cannot be evicted (see s3::cache_bytes_in_use),
+     * plus the new run, would exceed it (the run asked by Next() is always fetched), and the same
+     * budget is given to s3::cache_file, which evicts the least recently used of the others, i.e.
+     * already processed runs. The entries used by other processes are checked again whenever
+     * Next() is called, and at least every second while a run is held back.
+     *
+     * A run is considered processed when Next() is called for the following one. Until then the
+     * queue holds the s3::CachedFile of the run, as well as those of the runs fetched ahead, so
+     * that neither its own evictions nor those of other processes remove them.
+     *
+     */
+    class RunQueue {
+    public:
+        /**
+         * @brief Constructor. The downloads start immediately.
+         *
+         * @param[in] runs run numbers, in processing order
+         * @param[in] tag tag of the bucket the runs belong to (LNGS, LNF, ...). Default is "LNGS".
+         * @param[in] path path where the runs are cached on the local disk. Default is "./tmp/".
+         * @param[in] ahead number of runs downloaded ahead of the current one. Default value is 2.
+         * @param[in] budget maximum size in bytes of path (see s3::evict_cache). Default is 0 (unlimited).
+         * @param[in] verbose flag for verbose mode. Default is false.
+         *
+         */
+        RunQueue(std::vector<int> runs,
+                 std::string  tag     = "LNGS",
+                 std::string  path    = "./tmp/",
+                 unsigned int ahead   = 2,
+                 uint64_t     budget  = 0,
+                 bool         verbose = false);
+
+        /**
+         * @brief Destructor. The download in progress, if any, is completed first.
+         */
+        ~RunQueue();
+
+        RunQueue(const RunQueue &) = delete;
+        RunQueue &operator=(const RunQueue &) = delete;
+
+        /**
+         * @brief This method waits until the next run is on disk
+         *
+         * @details If the download of the run failed, its exception is rethrown; calling Next()
+         * again moves on to the following run.
+         *
+         * @param[out] run the run number
+         * @param[out] filename the filepath to the MIDAS datafile
+         *
+         * @return false when all the runs have been given
+         *
+         */
+        bool Next(int &run, std::string &filename);
+
+        std::size_t GetNRuns() const { return fEntries.size(); }
+
+        /**
+         * @brief This method returns the total time spent by Next() waiting for a download
+         */
+        double GetWaitSeconds() const;
+
+    private:
+        struct Entry {
+            int run;
+            uint64_t size = 0;
+            bool ready = false;
+            CachedFile file;
+            std::exception_ptr error;
+        };
+
+        void Run();
+
+        std::string fTag;
+        std::string fPath;
+        unsigned int fAhead;
+        uint64_t fBudget;
+        bool fVerbose;
+
+        std::vector<Entry> fEntries;
+        std::size_t fRequested = 0;
+        double fWaitSeconds = 0;
+        bool fStop = false;
+        mutable std::mutex fMutex;
+        std::condition_variable fCV;
+
+        std::thread fThread;
+    };
+
+}
+
+
+#endif
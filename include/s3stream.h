@@ -0,0 +1,164 @@
+/*
+ * Copyright (C) 2024 CYGNO Collaboration
+ *
+ *
+ * Author: Stefano Piacentini
+ * Created in 2024
+ *
+ */
+
+#ifndef __S3_STREAM_H__
+#define __S3_STREAM_H__
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <zlib.h>
+#include <curl/curl.h>
+#include "midasio.h"
+#include "s3.h"
+
+
+namespace s3 {
+
+    /**
+     * @brief Default size in bytes of the buffer between the download and the decompression
+     */
+    constexpr std::size_t kStreamBufferSize = 16*1024*1024;
+
+    /**
+     * @brief Time in seconds without data from the server after which a stream download fails
+     */
+    constexpr long kStreamStallSeconds = 60;
+
+    /**
+     * @brief Counters of a s3::StreamReader
+     */
+    struct StreamStats {
+        uint64_t downloaded = 0;             ///< bytes received from the server
+        uint64_t read = 0;                   ///< bytes given to the MIDAS parser (after decompression)
+        double download_stall_seconds = 0;   ///< time the download waited for room in the buffer
+        double read_stall_seconds = 0;       ///< time Read() waited for data from the network
+    };
+
+    /**
+     * @class StreamReader
+     * @brief A MIDAS reader over a file being downloaded
+     * @author CYGNO Collaboration
+     *
+     * @details A background thread downloads the file with curl and its write callback copies the
+     * data into a ring buffer of fixed size; Read() takes the data from the buffer and inflates it
+     * on the fly when the name ends with .gz (concatenated gzip members are supported). The events
+     * can then be processed while the rest of the file is still being downloaded. When the buffer
+     * is full the callback waits, so the download never runs more than the buffer size ahead of
+     * the processing.
+     *
+     * Optionally the downloaded data are also written to a cache file, so the next run over the
+     * same file does not download it again: the data go to cachename+".part", which is renamed to
+     * cachename only once the download is complete. The entry is locked meanwhile (see
+     * s3::CacheLock); if someone else holds the lock, the file is streamed without caching.
+     *
+     * A failed download makes Read() fail with fError set and the curl error in fErrorString; a
+     * server sending no data for kStreamStallSeconds fails the download as well. Close() stops
+     * the transfer within about a second, even on a stalled connection.
+     *
+     */
+    class StreamReader: public TMReaderInterface {
+    public:
+        /**
+         * @brief Constructor. The download starts immediately.
+         *
+         * @param[in] url URL of the MIDAS file (any protocol supported by curl, e.g. a local http server)
+         * @param[in] cachename file where the downloaded data are cached. Default is empty (no cache).
+         * @param[in] buffersize size in bytes of the buffer. Default value is kStreamBufferSize.
+         * @param[in] verbose flag for verbose mode. Default is false.
+         *
+         */
+        StreamReader(std::string url,
+                     std::string cachename  = "",
+                     std::size_t buffersize = kStreamBufferSize,
+                     bool        verbose    = false);
+
+        /**
+         * @brief Destructor. See Close().
+         */
+        ~StreamReader() override;
+
+        StreamReader(const StreamReader &) = delete;
+        StreamReader &operator=(const StreamReader &) = delete;
+
+        int Read(void *buf, int count) override;
+
+        /**
+         * @brief This method stops the download if still running; an incomplete cache file is removed
+         */
+        int Close() override;
+
+        StreamStats GetStats() const;
+
+    private:
+        static size_t WriteData(char *ptr, size_t size, size_t nmemb, void *userdata);
+        static int Progress(void *clientp, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow);
+        void Download(bool verbose);
+        std::size_t Push(const char *data, std::size_t n);
+        std::size_t Pull(unsigned char *data, std::size_t n);
+        int ReadInflated(void *buf, int count);
+
+        std::string fURL;
+        std::string fCacheName;
+        std::unique_ptr<CacheLock> fCacheLock;
+        FILE *fCacheFile = nullptr;
+        CURL *fCurl = nullptr;
+
+        std::vector<char> fBuffer;
+        std::size_t fHead = 0;
+        std::size_t fSize = 0;
+        bool fDone = false;
+        bool fAbort = false;
+        std::string fDownloadError;
+        StreamStats fStats;
+        mutable std::mutex fMutex;
+        std::condition_variable fNotFull;
+        std::condition_variable fNotEmpty;
+
+        bool fCompressed = false;
+        bool fInflating = false;
+        bool fMemberStart = true;
+        bool fEnd = false;
+        bool fTruncated = false;
+        z_stream fStrm;
+        std::vector<unsigned char> fInput;
+
+        std::thread fThread;
+    };
+
+    /**
+     * @brief This function opens a MIDAS datafile of the cloud for reading while it is downloaded
+     *
+     * @details If the file is already in path (e.g. downloaded by s3::cache_file) and passes
+     * s3::cache_entry_valid, it is read from there, and kept in the cache until the reader is
+     * closed (see s3::CachedFile). Otherwise it is streamed with a StreamReader, which also stores
+     * it in path unless path is empty.
+     *
+     * @param[in] fname URL of the MIDAS datafile, as given by the s3::mid_file function
+     * @param[in] path path where the MIDAS file is cached on the local disk. Default is "" (no cache).
+     * @param[in] buffersize size in bytes of the download buffer. Default value is kStreamBufferSize.
+     * @param[in] verbose flag for verbose mode. Default is false.
+     *
+     * @return the reader; to be closed and deleted by the caller
+     *
+     */
+    TMReaderInterface *open_stream(std::string fname,
+                                   std::string path       = "",
+                                   std::size_t buffersize = kStreamBufferSize,
+                                   bool        verbose    = false);
+}
+
+
+#endif
@@ -0,0 +1,144 @@
+/*
+ * Copyright (C) 2024 CYGNO Collaboration
+ *
+ *
+ * Author: Stefano Piacentini
+ * Created in 2024
+ *
+ */
+
+#ifndef __CYGNO_ZEROSUPPRESSION_H__
+#define __CYGNO_ZEROSUPPRESSION_H__
+
+#include <cstddef>
+#include <cstdint>
+#include "cygnobuffer.h"
+#include "cygnolib.h"
+#include "pedestal.h"
+
+
+namespace cygnolib {
+
+    namespace detail {
+        // appends the above-threshold pixels of n pixels starting at column first to columns and
+        // values, returns their number
+        typedef std::size_t (*ZeroSuppressRowFunc)(const uint16_t *in, const float *mean, const float *threshold,
+                                                   uint32_t first, uint32_t *columns, int32_t *values, std::size_t n);
+    }
+
+    /**
+     * @class HitList
+     * @brief The above-threshold pixels of a camera frame, as a sparse list
+     * @author CYGNO Collaboration
+     *
+     * @details The hits are stored in row-major order as three parallel arrays (row, column and
+     * pedestal-subtracted value), and indexed by row as in the CSR format: the hits of row r are
+     * [GetRowOffsets()[r], GetRowOffsets()[r+1]). The storage only grows, so reusing one HitList
+     * across frames does not allocate once the busiest frame has been seen.
+     *
+     */
+    class HitList {
+    public:
+        HitList() {}
+
+        /**
+         * @brief This method empties the list and sets the dimensions of the frame
+         */
+        void Reset(unsigned int nrows, unsigned int ncolumns);
+
+        unsigned int GetNRows() const { return fNRows; }
+        unsigned int GetNColumns() const { return fNColumns; }
+
+        /**
+         * @brief This method returns the number of hits
+         */
+        std::size_t Size() const { return fSize; }
+        bool Empty() const { return fSize == 0; }
+
+        Span<const uint32_t> GetRows() const { return Span<const uint32_t>(fRows.data(), fSize); }
+        Span<const uint32_t> GetColumns() const { return Span<const uint32_t>(fColumns.data(), fSize); }
+        Span<const int32_t> GetValues() const { return Span<const int32_t>(fValues.data(), fSize); }
+
+        /**
+         * @brief This method returns the CSR row offsets, GetNRows()+1 values
+         */
+        Span<const uint32_t> GetRowOffsets() const { return Span<const uint32_t>(fRowOffsets.data(), fRowOffsets.size()); }
+
+        /**
+         * @brief This method returns the columns of the hits of row r
+         */
+        Span<const uint32_t> GetRowColumns(unsigned int r) const {
+            return Span<const uint32_t>(fColumns.data() + fRowOffsets[r], fRowOffsets[r+1] - fRowOffsets[r]);
+        }
+
+        /**
+         * @brief This method returns the values of the hits of row r
+         */
+        Span<const int32_t> GetRowValues(unsigned int r) const {
+            return Span<const int32_t>(fValues.data() + fRowOffsets[r], fRowOffsets[r+1] - fRowOffsets[r]);
+        }
+
+        /**
+         * @brief This method returns the frame with the hits at their value and zero elsewhere
+         */
+        AlignedVector<int32_t> ToDense() const;
+
+    private:
+        friend void ZeroSuppress(ImageView<const uint16_t>, const PedestalMap &, Span<const float>, HitList &);
+        friend void ZeroSuppressScalar(ImageView<const uint16_t>, const PedestalMap &, Span<const float>, HitList &);
+
+        void Fill(detail::ZeroSuppressRowFunc kernel, ImageView<const uint16_t> frame,
+                  const PedestalMap &pedestal, Span<const float> thresholds);
+
+        unsigned int fNRows = 0;
+        unsigned int fNColumns = 0;
+        std::size_t fSize = 0;
+        AlignedVector<uint32_t> fRows;
+        AlignedVector<uint32_t> fColumns;
+        AlignedVector<int32_t> fValues;
+        AlignedVector<uint32_t> fRowOffsets;
+    };
+
+    /**
+     * @brief This function returns per-pixel zero-suppression thresholds from the noise of a pedestal
+     *
+     * @param[in] pedestal the pedestal map
+     * @param[in] nsigma threshold in units of the pixel RMS
+     * @param[in] minimum lowest threshold, applied to pixels with a small RMS. Default is 0.
+     *
+     * @return the thresholds, max(nsigma*rms, minimum), row-major
+     *
+     */
+    AlignedVector<float> ZeroSuppressionThresholds(const PedestalMap &pedestal, float nsigma, float minimum = 0);
+
+    /**
+     * @brief This function zero-suppresses a camera frame
+     *
+     * @details The pedestal is subtracted from every pixel and the pixels whose difference is
+     * above their threshold are appended to hits, with the difference rounded as in
+     * PedestalMap::Subtract(). The frame is read once, by a vectorized kernel chosen according to
+     * GetSimdLevel() that compresses the selected lanes to the output; all the kernels give the
+     * same result as ZeroSuppressScalar().
+     *
+     * @param[in] frame the frame, with the dimensions of the pedestal
+     * @param[in] pedestal the pedestal map
+     * @param[in] thresholds per-pixel thresholds above the pedestal, row-major (see ZeroSuppressionThresholds())
+     * @param[out] hits the above-threshold pixels; previous content is discarded
+     *
+     */
+    void ZeroSuppress(ImageView<const uint16_t> frame, const PedestalMap &pedestal, Span<const float> thresholds, HitList &hits);
+    inline void ZeroSuppress(const Picture &pic, const PedestalMap &pedestal, Span<const float> thresholds, HitList &hits) {
+        ZeroSuppress(pic.View(), pedestal, thresholds, hits);
+    }
+    inline void ZeroSuppress(const PictureView &pic, const PedestalMap &pedestal, Span<const float> thresholds, HitList &hits) {
+        ZeroSuppress(pic.View(), pedestal, thresholds, hits);
+    }
+
+    /**
+     * @brief Portable version of ZeroSuppress()
+     */
+    void ZeroSuppressScalar(ImageView<const uint16_t> frame, const PedestalMap &pedestal, Span<const float> thresholds, HitList &hits);
+
+}
+
+#endif
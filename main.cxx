@@ -8,128 +8,190 @@
  */
 
 #include "cygnolib.h"
+#include "cygnosimd.h"
+#include "cygnopipeline.h"
+#include "cygnosession.h"
 #include <iostream>
 #include "s3.h"
+#include "s3stream.h"
 #include <zlib.h>
 #include <stdexcept>
 #include <chrono>
+#include <optional>
+#include <sstream>
 
 int main() {
     
     bool debug   = true;
     bool verbose = true;
     bool cloud   = true;
+    bool drs4lut = false; // precomputed DRS4 correction per start index cell (see drs4bench)
+    std::string drs4tables = ""; // folder with DRS4 tables overriding the embedded ones (empty: no override)
+    unsigned int prefetch_depth = 4; // number of events read ahead by the background reader
+    unsigned int nthreads = 0; // worker threads of the event pipeline (0: one per core)
+    unsigned int nranges  = 0; // >0: split the run in event ranges processed in parallel (uses the .idx index)
+    bool stream  = false; // process the run while it is downloaded (requires cloud, ignores nranges)
+    uint64_t cache_budget = 0; // bytes of ./tmp/ kept by the run cache, least recently used runs are removed (0: unlimited)
     
     int run = 35138;
     
     //Download or find midas file
-    std::string filename = s3::cache_file(s3::mid_file(run, "LNGS", cloud, verbose), "./tmp/", cloud, "LNGS", verbose);
-    
-    
-    //reading PMT readout infos from midas file
-    std::vector<float> channels_offsets;
-    std::vector<std::vector<int>>    table_cell;
-    std::vector<std::vector<int>> table_nsample;
-    bool correction;
-    cygnolib::InitializePMTReadout(filename, &correction, &channels_offsets, "LNGS", table_cell, table_nsample);
+    std::string filename;
+    s3::CachedFile cached; // keeps the run in ./tmp/ until the end of its processing
+    TMReaderInterface *stream_reader = nullptr;
+    if(stream && cloud) {
+        // the file is stored in ./tmp/ while it is read, for the next runs
+        stream_reader = s3::open_stream(s3::mid_file(run, "LNGS", cloud, verbose), "./tmp/", s3::kStreamBufferSize, verbose);
+    } else {
+        cached = s3::cache_file(s3::mid_file(run, "LNGS", cloud, verbose), "./tmp/", cloud, "LNGS", verbose,
+                                s3::kDownloadConnections, cache_budget);
+        filename = cached.GetName();
+    }
     
     
-    //reading data from midas file
-    std::cout<<"Opening midas file "<<filename<<" ..."<<std::endl;
-    TMReaderInterface* reader = cygnolib::OpenMidasFile(filename);
-    bool reading = true;
+    //opening the midas file and reading PMT readout infos from its BOR ODB dump
+    if(!stream_reader) std::cout<<"Opening midas file "<<filename<<" ..."<<std::endl;
+    cygnolib::RunSession session = stream_reader ? cygnolib::RunSession(stream_reader, "LNGS", drs4tables)
+                                                 : cygnolib::RunSession(filename, "LNGS", drs4tables);
+    std::vector<float> &channels_offsets = *session.GetChannelsOffsets();
+    cygnolib::DRS4Calibration &drs4calib = session.GetCalibration();
+    if(drs4lut) drs4calib.SetMode(cygnolib::DRS4Mode::LUT);
+    if(debug) std::cout<<"DRS4 correction kernel: "<<cygnolib::SimdLevelName(cygnolib::GetSimdLevel())<<std::endl;
     
-    int counter =0;
     
-    auto start00 = std::chrono::high_resolution_clock::now();
+    // per-event state, reused across events: it aliases the banks of the event
+    struct EventData {
+        bool cam_found = false;
+        bool dgh_found = false;
+        bool dig_found = false;
+        std::optional<cygnolib::DGHeader> dgh;
+        std::optional<cygnolib::PMTData> pmts;
+        cygnolib::PictureView pic;
+        double pmt_ms = 0;
+        double cam_ms = 0;
+        cygnolib::BufferStats cam_buffers; // buffer allocations made to decode CAM0
+    };
     
-    while (reading) {
+    auto decode = [](const cygnolib::EventBanks &banks, EventData &data) {
+        data.cam_found = banks.Has("CAM0");
+        data.dgh_found = banks.Has("DGH0");
+        data.dig_found = banks.Has("DIG0");
+        data.pmts.reset();
+        data.dgh.reset();
         
-        auto start0 = std::chrono::high_resolution_clock::now();
-        if(debug) std::cout<<"Reading evt "<<counter<<std::endl;
-        TMidasEvent event = TMidasEvent();
-        reading = TMReadEvent(reader, &event);
-        if (!reading) {
-            if(debug) std::cout<<"EOF reached."<<std::endl;
-            break;
+        auto start = std::chrono::high_resolution_clock::now();
+        if(data.dgh_found) {
+            data.dgh.emplace(cygnolib::daq_dgh2head(banks));
+            if(data.dig_found) data.pmts.emplace(cygnolib::daq_dig2PMTData(banks, &*data.dgh));
         }
+        auto stop = std::chrono::high_resolution_clock::now();
+        data.pmt_ms = std::chrono::duration<double, std::milli>(stop - start).count();
         
-        bool cam_found = cygnolib::FindBankByName(event, "CAM0");
-        bool dgh_found = cygnolib::FindBankByName(event, "DGH0");
-        bool dig_found = cygnolib::FindBankByName(event, "DIG0");
-        
-        if(debug) {
-            auto stop0 = std::chrono::high_resolution_clock::now();
-            auto duration0 = std::chrono::duration_cast<std::chrono::milliseconds>(stop0 - start0);
-            std::cout<<">> TIME TO READ MIDASEVENT "<< duration0.count()<<" ms"<<std::endl;
-        }
+        cygnolib::BufferStats buffers0 = cygnolib::GetThreadBufferStats();
+        start = std::chrono::high_resolution_clock::now();
+        // the view aliases the CAM0 bank: it is valid until the output of the event
+        if(data.cam_found) data.pic = cygnolib::daq_cam2picview(banks, "fusion");
+        stop = std::chrono::high_resolution_clock::now();
+        data.cam_ms = std::chrono::duration<double, std::milli>(stop - start).count();
+        cygnolib::BufferStats buffers = cygnolib::GetThreadBufferStats();
+        data.cam_buffers.allocations = buffers.allocations - buffers0.allocations;
+        data.cam_buffers.bytes       = buffers.bytes - buffers0.bytes;
+    };
+    
+    auto process = [&](EventData &data) {
+        if(!data.pmts) return;
+        auto start = std::chrono::high_resolution_clock::now();
+        data.pmts->ApplyDRS4Corrections(&channels_offsets, drs4calib);
+        auto stop = std::chrono::high_resolution_clock::now();
+        data.pmt_ms += std::chrono::duration<double, std::milli>(stop - start).count();
+    };
+    
+    auto output = [&](std::ostream &out, uint64_t counter, EventData &data) {
+        if(debug) out<<"Evt "<<counter<<std::endl;
         
-        if(dgh_found) {
-            auto start = std::chrono::high_resolution_clock::now();
-            //std::cout<<"Reading evt "<<counter<<std::endl;
-            //std::cout<<"DGH0 bank found"<<std::endl;
-            cygnolib::DGHeader dgh = cygnolib::daq_dgh2head(event);
-            //dgh.Print();
+        if(data.pmts) {
+            cygnolib::WaveformView<const uint16_t> fastwfs = data.pmts->GetWaveforms(1742);
+            cygnolib::WaveformView<const uint16_t> slowwfs = data.pmts->GetWaveforms(1720);
             
-        
-            if(dig_found) {
-                //std::cout<<"DIG0 bank found"<<std::endl;
-                cygnolib::PMTData pmts = daq_dig2PMTData(event, &dgh);
-                pmts.ApplyDRS4Corrections(&channels_offsets, &table_cell, &table_nsample);
-                
-                std::vector<std::vector<std::vector<uint16_t>>> *fastwfs = pmts.GetWaveforms(1742);
-                std::vector<std::vector<std::vector<uint16_t>>> *slowwfs = pmts.GetWaveforms(1720);
-                
-                
-                bool print = false;
-                if(print) {
-                    std::cout<<"====== fast ====="<<std::endl;
-                    int ev = 0;
-                    int ch = 1;
-                    for(int i =0; i<10; i++) {
-                        std::cout<<(*fastwfs)[ev][ch][i]<<", ";
-                    }
-                    std::cout<<std::endl;
-                    std::cout<<"====== slow ====="<<std::endl;
-                    for(int i =0; i<10; i++) {
-                        std::cout<<(*slowwfs)[ev][ch][i]<<", ";
-                    }
-                    std::cout<<std::endl;
+            bool print = false;
+            if(print) {
+                out<<"====== fast ====="<<std::endl;
+                int ev = 0;
+                int ch = 1;
+                for(int i =0; i<10; i++) {
+                    out<<fastwfs[ev][ch][i]<<", ";
                 }
-                
-            }
-            
-            if(debug) {
-                auto stop = std::chrono::high_resolution_clock::now();
-                auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(stop - start);
-                std::cout<<">> TIME TO INIT DGH0 AND DIG0 "<< duration.count()<<" ms"<<std::endl;
+                out<<std::endl;
+                out<<"====== slow ====="<<std::endl;
+                for(int i =0; i<10; i++) {
+                    out<<slowwfs[ev][ch][i]<<", ";
+                }
+                out<<std::endl;
             }
         }
+        if(data.dgh_found && debug) out<<">> TIME TO INIT DGH0 AND DIG0 "<< data.pmt_ms<<" ms"<<std::endl;
         
-        if(cam_found) {
-            auto start = std::chrono::high_resolution_clock::now();
-            cygnolib::Picture pic=cygnolib::daq_cam2pic(event, "fusion");
-            //pic.Print(4,4); // print upper left 4x4 angle
-            //pic.SavePng("/data11/cygno/piacenst/stefano/cygnocpp/debug/test.png");
-            
+        if(data.cam_found) {
+            //data.pic.Print(4,4); // print upper left 4x4 angle
+            //data.pic.SavePng("/data11/cygno/piacenst/stefano/cygnocpp/debug/test.png");
             if(debug) {
-                auto stop = std::chrono::high_resolution_clock::now();
-                auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(stop - start);
-                std::cout<<">> TIME TO INIT CAM0 "<< duration.count()<<" ms"<<std::endl;
+                out<<">> TIME TO INIT CAM0 "<< data.cam_ms<<" ms"<<std::endl;
+                out<<">> CAM0 BUFFER ALLOCATIONS "<< data.cam_buffers.allocations
+                   <<" ("<< data.cam_buffers.bytes<<" bytes)"<<std::endl;
             }
         }
+    };
+    
+    
+    //reading data from midas file
+    if(nranges>0 && !stream_reader) {
+        // the run is split into event ranges processed in parallel, each from its own reader
+        cygnolib::MidasIndex index = cygnolib::MidasIndex::LoadOrBuild(filename);
         
-        counter ++;
+        cygnolib::EventRangeRunner<EventData, std::ostringstream> runner(nthreads);
+        if(debug) std::cout<<"Processing "<<nranges<<" ranges with "<<runner.GetNThreads()<<" threads"<<std::endl;
+        runner.SetDecode(decode);
+        runner.SetProcess(process);
+        runner.SetOutput([&](uint64_t counter, TMidasEvent &, EventData &data, std::ostringstream &out) {
+            output(out, counter, data);
+        });
+        runner.SetMerge([](std::size_t, std::ostringstream &out) {
+            std::cout<<out.str();
+        });
         
+        // the events already read by the session (up to the BOR ODB dump) are skipped, as in the sequential pass
+        cygnolib::RangeRunStats stats = runner.Run(filename, index, nranges, session.GetNEventsRead());
+        
+        if(debug) {
+            std::cout<<">> TIME TO READ ALL MIDAS FILE "<< stats.wall_seconds*1000<<" ms ("<<stats.events<<" events)"<<std::endl;
+            for(const cygnolib::RangeStats &range : stats.ranges) {
+                std::cout<<">> RANGE ["<<range.range.first<<", "<<range.range.last<<"): "<<range.wall_seconds<<" s (seek "
+                         <<range.seek_seconds<<" s, read "<<range.read_seconds<<" s, decode "<<range.decode_seconds
+                         <<" s, process "<<range.process_seconds<<" s)"<<std::endl;
+            }
+        }
+        return 0;
     }
     
-    reader->Close();
-    delete reader;
+    cygnolib::EventPipeline<EventData> pipeline(nthreads, 0, prefetch_depth);
+    if(debug) std::cout<<"Processing with "<<pipeline.GetNThreads()<<" threads"<<std::endl;
+    
+    pipeline.SetDecode(decode);
+    pipeline.SetProcess(process);
+    pipeline.SetOutput([&](uint64_t counter, TMidasEvent &, EventData &data) {
+        output(std::cout, counter, data);
+    });
+    
+    // the reader of the session is already past the BOR ODB dump
+    cygnolib::PipelineStats stats = pipeline.Run(session.GetReader(), session.GetNEventsRead());
     
     if(debug) {
-        auto stop00 = std::chrono::high_resolution_clock::now();
-        auto duration00 = std::chrono::duration_cast<std::chrono::milliseconds>(stop00 - start00);
-        std::cout<<">> TIME TO READ ALL MIDAS FILE "<< duration00.count()<<" ms"<<std::endl;
+        std::cout<<">> TIME TO READ ALL MIDAS FILE "<< stats.wall_seconds*1000<<" ms ("<<stats.events<<" events)"<<std::endl;
+        std::cout<<">> STAGES (summed over threads): index "<<stats.index_seconds<<" s, decode "<<stats.decode_seconds
+                 <<" s, process "<<stats.process_seconds<<" s, output "<<stats.output_seconds<<" s"<<std::endl;
+        std::cout<<">> READER: "<<stats.reader.read_seconds<<" s reading, "
+                 <<stats.reader.io_stall_seconds<<" s stalled on I/O, "
+                 <<stats.reader.consumer_stall_seconds<<" s stalled on processing"<<std::endl;
     }
     
     return 0;
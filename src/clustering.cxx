@@ -0,0 +1,161 @@
+/*
+ * Copyright (C) 2024 CYGNO Collaboration
+ *
+ *
+ * Author: Stefano Piacentini
+ * Created in 2024
+ *
+ */
+
+#include "clustering.h"
+#include <algorithm>
+
+
+namespace cygnolib {
+
+    void HitClusters::Reset(std::size_t nhits) {
+        fLabels.assign(nhits, -1);
+        fOffsets.clear();
+        fHits.clear();
+    }
+
+    void HitClusters::Index(std::size_t nclusters) {
+        fOffsets.assign(nclusters+1, 0);
+        for(int32_t label : fLabels) {
+            if(label>=0) fOffsets[label+1]++;
+        }
+        for(std::size_t k=0; k<nclusters; k++) fOffsets[k+1] += fOffsets[k];
+
+        fHits.resize(fOffsets[nclusters]);
+        AlignedVector<uint32_t> next(fOffsets.begin(), fOffsets.end()-1);
+        for(std::size_t i=0; i<fLabels.size(); i++) {
+            if(fLabels[i]>=0) fHits[next[fLabels[i]]++] = i;
+        }
+    }
+
+
+    ComponentLabeler::ComponentLabeler(Connectivity connectivity, unsigned int nthreads, unsigned int band_rows):
+        fConnectivity(connectivity), fBandRows(std::max(band_rows, 1u)) {
+        if(nthreads==0) nthreads = GetDefaultNThreads();
+        // the calling thread takes part in the loops of the pool
+        if(nthreads>1) fPool.reset(new WorkerPool(nthreads-1));
+    }
+
+    void ComponentLabeler::ForEachBand(std::size_t nbands, const std::function<void(std::size_t)> &fn) {
+        if(fPool) {
+            fPool->ParallelFor(nbands, fn);
+            return;
+        }
+        for(std::size_t b=0; b<nbands; b++) fn(b);
+    }
+
+    uint32_t ComponentLabeler::Find(uint32_t x) {
+        while(fParent[x]!=x) {
+            fParent[x] = fParent[fParent[x]];
+            x = fParent[x];
+        }
+        return x;
+    }
+
+    void ComponentLabeler::Union(uint32_t a, uint32_t b) {
+        a = Find(a);
+        b = Find(b);
+        // the root is the run coming first in row-major order
+        if(a<b)      fParent[b] = a;
+        else if(b<a) fParent[a] = b;
+    }
+
+    void ComponentLabeler::MergeRows(const HitList &hits, unsigned int upper, unsigned int lower) {
+        Span<const uint32_t> offsets = hits.GetRowOffsets();
+        Span<const uint32_t> columns = hits.GetColumns();
+        // runs [a0, a1] and [b0, b1] touch if they overlap, or also share a corner with 8-connectivity
+        uint32_t gap = fConnectivity==Connectivity::Eight ? 1 : 0;
+
+        uint32_t i = offsets[upper], iend = offsets[upper+1];
+        uint32_t j = offsets[lower], jend = offsets[lower+1];
+        while(i<iend && j<jend) {
+            uint32_t a0 = columns[i], a1 = columns[fRunEnd[i]-1];
+            uint32_t b0 = columns[j], b1 = columns[fRunEnd[j]-1];
+            if(a0<=b1+gap && b0<=a1+gap) Union(i, j);
+            // the run ending first cannot touch the following runs of the other row
+            if(a1<b1) i = fRunEnd[i];
+            else      j = fRunEnd[j];
+        }
+    }
+
+    void ComponentLabeler::Label(const HitList &hits, HitClusters &clusters) {
+        std::size_t nhits = hits.Size();
+        clusters.Reset(nhits);
+        if(nhits==0) {
+            clusters.Index(0);
+            return;
+        }
+        if(fParent.size()<nhits) {
+            fParent.resize(nhits);
+            fRunEnd.resize(nhits);
+            fRoot.resize(nhits);
+        }
+
+        unsigned int nrows = hits.GetNRows();
+        std::size_t nbands = (nrows + fBandRows - 1) / fBandRows;
+        Span<const uint32_t> offsets = hits.GetRowOffsets();
+        Span<const uint32_t> columns = hits.GetColumns();
+        Span<int32_t> labels = clusters.GetLabels();
+        auto band_first = [&](std::size_t b) { return offsets[std::min<std::size_t>(b*fBandRows, nrows)]; };
+
+        // runs of every row and their union-find within each band
+        ForEachBand(nbands, [&](std::size_t b) {
+            unsigned int first = b*fBandRows;
+            unsigned int last  = std::min<std::size_t>(first+fBandRows, nrows);
+            for(unsigned int r=first; r<last; r++) {
+                uint32_t end = offsets[r+1];
+                for(uint32_t i=offsets[r]; i<end; ) {
+                    uint32_t j = i+1;
+                    while(j<end && columns[j]==columns[j-1]+1) j++;
+                    fParent[i] = i;
+                    fRunEnd[i] = j;
+                    i = j;
+                }
+                if(r>first) MergeRows(hits, r-1, r);
+            }
+        });
+
+        // boundaries between the bands
+        for(std::size_t b=1; b<nbands; b++) {
+            unsigned int r = b*fBandRows;
+            MergeRows(hits, r-1, r);
+        }
+
+        // roots of the runs, without compressing the paths so that the bands can be read in parallel
+        fBandClusters.assign(nbands+1, 0);
+        ForEachBand(nbands, [&](std::size_t b) {
+            std::size_t n = 0;
+            for(uint32_t i=band_first(b); i<band_first(b+1); i=fRunEnd[i]) {
+                uint32_t x = i;
+                while(fParent[x]!=x) x = fParent[x];
+                fRoot[i] = x;
+                if(x==i) n++;
+            }
+            fBandClusters[b+1] = n;
+        });
+        for(std::size_t b=0; b<nbands; b++) fBandClusters[b+1] += fBandClusters[b];
+
+        // clusters are numbered in the order of their root run...
+        ForEachBand(nbands, [&](std::size_t b) {
+            int32_t next = fBandClusters[b];
+            for(uint32_t i=band_first(b); i<band_first(b+1); i=fRunEnd[i]) {
+                if(fRoot[i]==i) labels[i] = next++;
+            }
+        });
+        // ... and the label of the root is given to all the hits of the component
+        ForEachBand(nbands, [&](std::size_t b) {
+            for(uint32_t i=band_first(b); i<band_first(b+1); i=fRunEnd[i]) {
+                int32_t label = labels[fRoot[i]];
+                std::fill(labels.begin() + (fRoot[i]==i ? i+1 : i), labels.begin() + fRunEnd[i], label);
+            }
+        });
+
+        clusters.Index(fBandClusters[nbands]);
+    }
+
+}
@@ -0,0 +1,507 @@
+/*
+ * Copyright (C) 2024 CYGNO Collaboration
+ *
+ *
+ * Author: Stefano Piacentini
+ * Created in 2024
+ *
+ */
+
+#include "cygnoindex.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <stdexcept>
+#include <zlib.h>
+
+
+namespace cygnolib {
+
+    namespace {
+        const std::size_t kWindowSize = 32768;     // size of the inflate window
+        const std::size_t kChunkSize  = 1 << 18;   // size of the compressed input reads
+        const std::size_t kEventHeaderSize = 16;   // size of a MIDAS event header
+
+        struct FileCloser {
+            void operator()(FILE *file) const { if(file) fclose(file); }
+        };
+        typedef std::unique_ptr<FILE, FileCloser> FilePtr;
+
+        FilePtr OpenFile(const std::string &filename, const char *caller) {
+            FilePtr file(fopen(filename.c_str(), "rb"));
+            if(!file) {
+                throw std::runtime_error(std::string("cygnolib::")+caller+": cannot open "+filename+".");
+            }
+            return file;
+        }
+
+        bool IsGzip(FILE *file) {
+            unsigned char magic[2] = {0, 0};
+            std::size_t n = fread(magic, 1, 2, file);
+            rewind(file);
+            return n==2 && magic[0]==0x1f && magic[1]==0x8b;
+        }
+
+        // Finds the events in the uncompressed stream, fed in arbitrary chunks
+        class EventScanner {
+        public:
+            explicit EventScanner(std::vector<uint64_t> &events): fEvents(events) {}
+
+            void Feed(const unsigned char *data, std::size_t n) {
+                while(n>0) {
+                    if(fPos<fNext) {
+                        std::size_t skip = std::min<uint64_t>(n, fNext-fPos);
+                        data += skip; n -= skip; fPos += skip;
+                        continue;
+                    }
+                    std::size_t take = std::min(n, kEventHeaderSize-fHeaderLength);
+                    std::memcpy(fHeader+fHeaderLength, data, take);
+                    fHeaderLength += take; data += take; n -= take; fPos += take;
+                    if(fHeaderLength==kEventHeaderSize) {
+                        uint32_t size;
+                        std::memcpy(&size, fHeader+12, sizeof(size)); // fDataSize
+                        fEvents.push_back(fNext);
+                        fNext += kEventHeaderSize + size;
+                        fHeaderLength = 0;
+                    }
+                }
+            }
+
+            // drops the last event if the file ends before its end
+            void Finish() {
+                if(!fEvents.empty() && fNext>fPos) {
+                    fNext = fEvents.back();
+                    fEvents.pop_back();
+                }
+            }
+
+            // end of the last complete event
+            uint64_t GetEnd() const { return fNext; }
+
+        private:
+            std::vector<uint64_t> &fEvents;
+            uint64_t fPos  = 0;
+            uint64_t fNext = 0;
+            unsigned char fHeader[kEventHeaderSize];
+            std::size_t fHeaderLength = 0;
+        };
+
+        std::vector<unsigned char> CompressWindow(const unsigned char *window) {
+            uLongf length = compressBound(kWindowSize);
+            std::vector<unsigned char> out(length);
+            if(compress2(out.data(), &length, window, kWindowSize, Z_BEST_SPEED)!=Z_OK) {
+                throw std::runtime_error("cygnolib::MidasIndex: cannot compress an inflate window.");
+            }
+            out.resize(length);
+            return out;
+        }
+    }
+
+
+    MidasIndex MidasIndex::Build(std::string filename, uint64_t span) {
+        FilePtr file = OpenFile(filename, "MidasIndex::Build");
+        MidasIndex index;
+        index.fSpan = span;
+        index.fFileSize = std::filesystem::file_size(filename);
+        index.fCompressed = IsGzip(file.get());
+        EventScanner scanner(index.fEvents);
+
+        if(!index.fCompressed) {
+            std::vector<unsigned char> buffer(kChunkSize);
+            for(std::size_t n = fread(buffer.data(), 1, kChunkSize, file.get()); n>0;
+                n = fread(buffer.data(), 1, kChunkSize, file.get())) {
+                scanner.Feed(buffer.data(), n);
+            }
+            scanner.Finish();
+            index.fDataSize = scanner.GetEnd();
+            return index;
+        }
+
+        z_stream strm;
+        std::memset(&strm, 0, sizeof(strm));
+        if(inflateInit2(&strm, 47)!=Z_OK) { // gzip header, 32 KB window
+            throw std::runtime_error("cygnolib::MidasIndex::Build: cannot initialize inflate.");
+        }
+        std::unique_ptr<z_stream, int(*)(z_stream *)> guard(&strm, inflateEnd);
+
+        std::vector<unsigned char> input(kChunkSize);
+        std::vector<unsigned char> window(kWindowSize, 0);
+        uint64_t totin  = 0;
+        uint64_t totout = 0;
+        uint64_t last   = 0;
+        index.fCheckpoints.push_back(Checkpoint{0, 0, 0, true, {}});
+
+        bool member_start = false;
+        while(true) {
+            if(strm.avail_in==0) {
+                strm.avail_in = fread(input.data(), 1, input.size(), file.get());
+                if(ferror(file.get())) {
+                    throw std::runtime_error("cygnolib::MidasIndex::Build: cannot read "+filename+".");
+                }
+                if(strm.avail_in==0) break; // truncated file: index what has been read
+                strm.next_in = input.data();
+            }
+            if(strm.avail_out==0) {
+                strm.avail_out = kWindowSize;
+                strm.next_out  = window.data();
+            }
+
+            unsigned char *produced = strm.next_out;
+            totin  += strm.avail_in;
+            totout += strm.avail_out;
+            int ret = inflate(&strm, Z_BLOCK);
+            totin  -= strm.avail_in;
+            totout -= strm.avail_out;
+            scanner.Feed(produced, strm.next_out-produced);
+
+            if(ret==Z_NEED_DICT || ret==Z_DATA_ERROR || ret==Z_MEM_ERROR) {
+                // trailing garbage after a complete gzip member is ignored, as gzip does
+                if(member_start) break;
+                throw std::runtime_error("cygnolib::MidasIndex::Build: corrupted compressed data in "+filename+".");
+            }
+            if(strm.next_out!=produced) member_start = false;
+
+            if(ret==Z_STREAM_END) {
+                if(strm.avail_in==0) {
+                    int c = getc(file.get());
+                    if(c==EOF) break;
+                    ungetc(c, file.get());
+                }
+                // another gzip member follows
+                inflateReset2(&strm, 47);
+                index.fCheckpoints.push_back(Checkpoint{totout, totin, 0, true, {}});
+                last = totout;
+                member_start = true;
+                continue;
+            }
+
+            // end of a deflate block which is not the last one: candidate checkpoint
+            if((strm.data_type & 128) && !(strm.data_type & 64) && totout-last>span) {
+                std::vector<unsigned char> unrolled(kWindowSize);
+                std::size_t left = strm.avail_out;
+                std::memcpy(unrolled.data(), window.data()+kWindowSize-left, left);
+                std::memcpy(unrolled.data()+left, window.data(), kWindowSize-left);
+                index.fCheckpoints.push_back(Checkpoint{totout, totin, strm.data_type & 7, false, CompressWindow(unrolled.data())});
+                last = totout;
+            }
+        }
+        scanner.Finish();
+        index.fDataSize = scanner.GetEnd();
+        return index;
+    }
+
+
+    namespace {
+        struct MidasIndexHeader {
+            char     magic[8];
+            uint32_t version;
+            uint32_t compressed;
+            uint64_t filesize;
+            uint64_t span;
+            uint64_t nevents;
+            uint64_t ncheckpoints;
+            uint64_t datasize;
+            uint32_t checksum;
+            uint8_t  reserved[4];
+        };
+        static_assert(sizeof(MidasIndexHeader) == 64, "MidasIndexHeader must be 64 bytes");
+
+        struct MidasIndexCheckpoint {
+            uint64_t out;
+            uint64_t in;
+            uint32_t bits;
+            uint32_t member;
+            uint32_t window_size;
+            uint32_t reserved;
+        };
+        static_assert(sizeof(MidasIndexCheckpoint) == 32, "MidasIndexCheckpoint must be 32 bytes");
+
+        const char     kMidasIndexMagic[8] = {'C', 'Y', 'M', 'I', 'D', 'I', 'D', 'X'};
+        const uint32_t kMidasIndexVersion  = 2;
+
+        template <typename T>
+        void Append(std::vector<char> &out, const T *data, std::size_t n) {
+            out.insert(out.end(), (const char *)data, (const char *)(data+n));
+        }
+    }
+
+    void MidasIndex::Save(std::string indexfilename) const {
+        std::vector<char> payload;
+        Append(payload, fEvents.data(), fEvents.size());
+        for(const Checkpoint &cp : fCheckpoints) {
+            MidasIndexCheckpoint record = {cp.out, cp.in, (uint32_t)cp.bits, cp.member ? 1u : 0u, (uint32_t)cp.window.size(), 0};
+            Append(payload, &record, 1);
+        }
+        for(const Checkpoint &cp : fCheckpoints) Append(payload, cp.window.data(), cp.window.size());
+
+        MidasIndexHeader header;
+        std::memset(&header, 0, sizeof(header));
+        std::memcpy(header.magic, kMidasIndexMagic, sizeof(header.magic));
+        header.version      = kMidasIndexVersion;
+        header.compressed   = fCompressed ? 1 : 0;
+        header.filesize     = fFileSize;
+        header.span         = fSpan;
+        header.nevents      = fEvents.size();
+        header.ncheckpoints = fCheckpoints.size();
+        header.datasize     = fDataSize;
+        header.checksum     = crc32(0L, (const Bytef *)payload.data(), payload.size());
+
+        std::string tmpfilename = indexfilename+".tmp";
+        {
+            std::ofstream outFile(tmpfilename, std::ios::binary | std::ios::trunc);
+            outFile.write((const char *)&header, sizeof(header));
+            outFile.write(payload.data(), payload.size());
+            if(!outFile) {
+                throw std::runtime_error("cygnolib::MidasIndex::Save: cannot write "+tmpfilename+".");
+            }
+        }
+        std::filesystem::rename(tmpfilename, indexfilename);
+    }
+
+    MidasIndex MidasIndex::Load(std::string indexfilename) {
+        std::ifstream inFile(indexfilename, std::ios::binary);
+        if(!inFile) {
+            throw std::runtime_error("cygnolib::MidasIndex::Load: cannot open "+indexfilename+".");
+        }
+        MidasIndexHeader header;
+        if(!inFile.read((char *)&header, sizeof(header)) || std::memcmp(header.magic, kMidasIndexMagic, sizeof(kMidasIndexMagic))!=0) {
+            throw std::runtime_error("cygnolib::MidasIndex::Load: "+indexfilename+" is not a MIDAS index.");
+        }
+        if(header.version!=kMidasIndexVersion) {
+            throw std::runtime_error("cygnolib::MidasIndex::Load: unsupported version "+
+                                     std::to_string(header.version)+" in "+indexfilename+".");
+        }
+        std::vector<char> payload((std::istreambuf_iterator<char>(inFile)), std::istreambuf_iterator<char>());
+        if(crc32(0L, (const Bytef *)payload.data(), payload.size())!=header.checksum) {
+            throw std::runtime_error("cygnolib::MidasIndex::Load: checksum mismatch in "+indexfilename+".");
+        }
+
+        MidasIndex index;
+        index.fCompressed = header.compressed!=0;
+        index.fFileSize   = header.filesize;
+        index.fSpan       = header.span;
+        index.fDataSize   = header.datasize;
+
+        std::size_t events_bytes = header.nevents*sizeof(uint64_t);
+        std::size_t records_bytes = header.ncheckpoints*sizeof(MidasIndexCheckpoint);
+        if(payload.size() < events_bytes+records_bytes) {
+            throw std::runtime_error("cygnolib::MidasIndex::Load: "+indexfilename+" is truncated.");
+        }
+        index.fEvents.resize(header.nevents);
+        std::memcpy(index.fEvents.data(), payload.data(), events_bytes);
+
+        const char *records = payload.data()+events_bytes;
+        std::size_t window_offset = events_bytes+records_bytes;
+        index.fCheckpoints.resize(header.ncheckpoints);
+        for(std::size_t i=0; i<header.ncheckpoints; i++) {
+            MidasIndexCheckpoint record;
+            std::memcpy(&record, records+i*sizeof(record), sizeof(record));
+            if(window_offset+record.window_size > payload.size()) {
+                throw std::runtime_error("cygnolib::MidasIndex::Load: "+indexfilename+" is truncated.");
+            }
+            Checkpoint &cp = index.fCheckpoints[i];
+            cp.out    = record.out;
+            cp.in     = record.in;
+            cp.bits   = record.bits;
+            cp.member = record.member!=0;
+            cp.window.assign(payload.begin()+window_offset, payload.begin()+window_offset+record.window_size);
+            window_offset += record.window_size;
+        }
+        return index;
+    }
+
+    MidasIndex MidasIndex::LoadOrBuild(std::string filename, bool save) {
+        std::string indexfilename = GetMidasIndexFilename(filename);
+        if(std::filesystem::exists(indexfilename)) {
+            try {
+                MidasIndex index = Load(indexfilename);
+                if(index.GetFileSize()==std::filesystem::file_size(filename)) return index;
+            } catch(std::runtime_error &) {
+                // stale or corrupted sidecar: rebuild it
+            }
+        }
+        MidasIndex index = Build(filename);
+        if(save) {
+            try {
+                index.Save(indexfilename);
+            } catch(std::exception &e) {
+                // e.g. read-only folder: the index is still usable
+            }
+        }
+        return index;
+    }
+
+    const MidasIndex::Checkpoint &MidasIndex::FindCheckpoint(uint64_t offset) const {
+        if(fCheckpoints.empty()) {
+            throw std::logic_error("cygnolib::MidasIndex::FindCheckpoint: the file is not compressed.");
+        }
+        std::vector<Checkpoint>::const_iterator it = std::upper_bound(fCheckpoints.begin(), fCheckpoints.end(), offset,
+            [](uint64_t value, const Checkpoint &cp) { return value < cp.out; });
+        return *(it-1);
+    }
+
+    std::vector<EventRange> SplitEventRanges(const MidasIndex &index, unsigned int nranges, std::size_t first) {
+        const std::vector<uint64_t> &offsets = index.GetEventOffsets();
+        std::vector<EventRange> ranges;
+        if(first>=offsets.size()) return ranges;
+        if(nranges==0) nranges = 1;
+        if(nranges>offsets.size()-first) nranges = offsets.size()-first;
+        
+        // the end of the data, not the start of the last event, which may be a large one
+        uint64_t base = offsets[first];
+        uint64_t end  = index.GetDataSize();
+        for(unsigned int k=1; k<nranges; k++) {
+            uint64_t target = base + (end-base)*k/nranges;
+            std::size_t last = std::lower_bound(offsets.begin(), offsets.end(), target)-offsets.begin();
+            // at least one event per range, and leave one for each of the next ranges
+            last = std::max(last, first+1);
+            last = std::min(last, offsets.size()-(nranges-k));
+            ranges.push_back(EventRange{first, last});
+            first = last;
+        }
+        ranges.push_back(EventRange{first, offsets.size()});
+        return ranges;
+    }
+
+    std::string GetMidasIndexFilename(std::string filename) {
+        return filename+".idx";
+    }
+
+
+    namespace {
+        // Reads a MIDAS file starting from an offset of its uncompressed stream
+        class IndexedMidasReader: public TMReaderInterface {
+        public:
+            IndexedMidasReader(const std::string &filename, const MidasIndex &index, uint64_t offset):
+                fFile(OpenFile(filename, "OpenMidasFile")), fInput(index.IsCompressed() ? kChunkSize : 0) {
+                std::memset(&fStrm, 0, sizeof(fStrm));
+                try {
+                    Seek(filename, index, offset);
+                } catch(...) {
+                    Close();
+                    throw;
+                }
+            }
+
+            ~IndexedMidasReader() override { Close(); }
+
+            void Seek(const std::string &filename, const MidasIndex &index, uint64_t offset) {
+                if(!index.IsCompressed()) {
+                    if(fseeko(fFile.get(), offset, SEEK_SET)!=0) {
+                        throw std::runtime_error("cygnolib::OpenMidasFile: cannot seek in "+filename+".");
+                    }
+                    return;
+                }
+
+                const MidasIndex::Checkpoint &cp = index.FindCheckpoint(offset);
+                fRaw = !cp.member;
+                if(inflateInit2(&fStrm, fRaw ? -15 : 47)!=Z_OK) {
+                    throw std::runtime_error("cygnolib::OpenMidasFile: cannot initialize inflate.");
+                }
+                fInflating = true;
+                if(fseeko(fFile.get(), cp.in - (cp.bits ? 1 : 0), SEEK_SET)!=0) {
+                    throw std::runtime_error("cygnolib::OpenMidasFile: cannot seek in "+filename+".");
+                }
+                if(fRaw) {
+                    if(cp.bits) {
+                        int c = getc(fFile.get());
+                        if(c==EOF) throw std::runtime_error("cygnolib::OpenMidasFile: "+filename+" is truncated.");
+                        inflatePrime(&fStrm, cp.bits, c >> (8-cp.bits));
+                    }
+                    std::vector<unsigned char> window(kWindowSize);
+                    uLongf length = kWindowSize;
+                    if(uncompress(window.data(), &length, cp.window.data(), cp.window.size())!=Z_OK || length!=kWindowSize) {
+                        throw std::runtime_error("cygnolib::OpenMidasFile: corrupted index window.");
+                    }
+                    inflateSetDictionary(&fStrm, window.data(), kWindowSize);
+                }
+
+                // at most one span of data is inflated and discarded here
+                std::vector<unsigned char> scratch(kWindowSize);
+                for(uint64_t skip = offset-cp.out; skip>0; ) {
+                    int n = Read(scratch.data(), std::min<uint64_t>(skip, scratch.size()));
+                    if(n<=0) throw std::runtime_error("cygnolib::OpenMidasFile: "+filename+" is truncated.");
+                    skip -= n;
+                }
+            }
+
+            int Read(void *buf, int count) override {
+                if(!fFile) return -1;
+                if(!fInflating) return fread(buf, 1, count, fFile.get());
+
+                fStrm.next_out  = (Bytef *)buf;
+                fStrm.avail_out = count;
+                while(fStrm.avail_out>0 && !fEnd) {
+                    if(fStrm.avail_in==0) {
+                        fStrm.avail_in = fread(fInput.data(), 1, fInput.size(), fFile.get());
+                        fStrm.next_in  = fInput.data();
+                        if(fStrm.avail_in==0) {
+                            fEnd = true;
+                            break;
+                        }
+                    }
+                    Bytef *before = fStrm.next_out;
+                    int ret = inflate(&fStrm, Z_NO_FLUSH);
+                    if(ret==Z_NEED_DICT || ret==Z_DATA_ERROR || ret==Z_MEM_ERROR) {
+                        if(fMemberStart) { // trailing garbage after the last member
+                            fEnd = true;
+                            break;
+                        }
+                        fError = true;
+                        fErrorString = "corrupted compressed data";
+                        return -1;
+                    }
+                    if(fStrm.next_out!=before) fMemberStart = false;
+                    if(ret==Z_STREAM_END) {
+                        if(fRaw) SkipInput(8); // gzip trailer, left over by raw inflate
+                        fRaw = false;
+                        inflateReset2(&fStrm, 47);
+                        fMemberStart = true;
+                    }
+                }
+                return count-fStrm.avail_out;
+            }
+
+            int Close() override {
+                if(fInflating) inflateEnd(&fStrm);
+                fInflating = false;
+                fFile.reset();
+                return 0;
+            }
+
+        private:
+            void SkipInput(std::size_t n) {
+                while(n>0) {
+                    if(fStrm.avail_in==0) {
+                        fStrm.avail_in = fread(fInput.data(), 1, fInput.size(), fFile.get());
+                        fStrm.next_in  = fInput.data();
+                        if(fStrm.avail_in==0) return;
+                    }
+                    std::size_t skip = std::min<std::size_t>(n, fStrm.avail_in);
+                    fStrm.next_in  += skip;
+                    fStrm.avail_in -= skip;
+                    n -= skip;
+                }
+            }
+
+            FilePtr fFile;
+            std::vector<unsigned char> fInput;
+            z_stream fStrm;
+            bool fInflating   = false;
+            bool fRaw         = false;
+            bool fEnd         = false;
+            bool fMemberStart = false;
+        };
+    }
+
+    TMReaderInterface* OpenMidasFile(std::string filename, const MidasIndex &index, std::size_t event) {
+        if(event>=index.GetNEvents()) {
+            throw std::out_of_range("cygnolib::OpenMidasFile: event "+std::to_string(event)+" out of range.");
+        }
+        return new IndexedMidasReader(filename, index, index.GetEventOffset(event));
+    }
+
+}
@@ -26,53 +26,155 @@
 #include <list>
 #include <cstdlib>
 #include <numeric>
+#include <algorithm>
+#include <utility>
+#include <cstring>
+#include <memory>
 
 
 namespace cygnolib {
     
-    Picture::Picture(unsigned int height, unsigned int width): nrows(height), ncolumns(width), frame(height, std::vector<uint16_t>(width,0)) {
+    Picture::Picture(unsigned int height, unsigned int width): nrows(height), ncolumns(width), frame(std::size_t(height)*width, 0) {
+    }
+    Picture::Picture(AlignedVector<uint16_t> &&buffer, unsigned int height, unsigned int width): nrows(0), ncolumns(0) {
+        AdoptBuffer(std::move(buffer), height, width);
     }
     Picture::~Picture(){
     }
-    unsigned int Picture::GetNRows(){
+    unsigned int Picture::GetNRows() const {
         return nrows;
     }
-    unsigned int Picture::GetNColumns(){
+    unsigned int Picture::GetNColumns() const {
         return ncolumns;
     }
-    std::vector<std::vector<uint16_t>> Picture::GetFrame(){
+    std::vector<std::vector<uint16_t>> Picture::GetFrame() const {
+        std::vector<std::vector<uint16_t>> outframe(nrows);
+        for(unsigned int r=0; r<nrows; r++) {
+            Span<const uint16_t> row = Row(r);
+            outframe[r].assign(row.begin(), row.end());
+        }
+        return outframe;
+    }
+    const AlignedVector<uint16_t> &Picture::GetBuffer() const {
         return frame;
     }
-    void Picture::SetFrame(std::vector<std::vector<uint16_t>> inputframe){
+    void Picture::SetFrame(const std::vector<std::vector<uint16_t>> &inputframe){
         unsigned int height = inputframe.size();
         unsigned int width  = inputframe[0].size();
         if(height!=nrows || width!=ncolumns) {
             throw std::invalid_argument("cygnolib::Picture::SetFrame: input frame has wrong dimensions.\n");
         }
-        frame = inputframe;
+        for(unsigned int r=0; r<nrows; r++) {
+            if(inputframe[r].size()!=ncolumns) {
+                throw std::invalid_argument("cygnolib::Picture::SetFrame: input frame has wrong dimensions.\n");
+            }
+            std::copy(inputframe[r].begin(), inputframe[r].end(), Row(r).begin());
+        }
+    }
+    void Picture::SetFrame(Span<const uint16_t> inputframe){
+        if(inputframe.size()!=frame.size()) {
+            throw std::invalid_argument("cygnolib::Picture::SetFrame: input frame has wrong dimensions.\n");
+        }
+        std::copy(inputframe.begin(), inputframe.end(), frame.begin());
     }
-    void Picture::Print(int a, int b) {
+    void Picture::SetFrame(AlignedVector<uint16_t> &&inputframe){
+        if(inputframe.size()!=frame.size()) {
+            throw std::invalid_argument("cygnolib::Picture::SetFrame: input frame has wrong dimensions.\n");
+        }
+        frame = std::move(inputframe);
+    }
+    void Picture::AdoptBuffer(AlignedVector<uint16_t> &&buffer, unsigned int height, unsigned int width){
+        if(buffer.size()!=std::size_t(height)*width) {
+            throw std::invalid_argument("cygnolib::Picture::AdoptBuffer: buffer size does not match the dimensions.\n");
+        }
+        frame    = std::move(buffer);
+        nrows    = height;
+        ncolumns = width;
+    }
+    AlignedVector<uint16_t> Picture::ReleaseBuffer(){
+        AlignedVector<uint16_t> buffer(std::move(frame));
+        frame.clear();
+        nrows    = 0;
+        ncolumns = 0;
+        return buffer;
+    }
+    uint16_t *Picture::Data() {
+        return frame.data();
+    }
+    const uint16_t *Picture::Data() const {
+        return frame.data();
+    }
+    std::size_t Picture::Size() const {
+        return frame.size();
+    }
+    Span<uint16_t> Picture::GetPixels() {
+        return Span<uint16_t>(frame.data(), frame.size());
+    }
+    Span<const uint16_t> Picture::GetPixels() const {
+        return Span<const uint16_t>(frame.data(), frame.size());
+    }
+    Span<uint16_t> Picture::Row(unsigned int r) {
+        return Span<uint16_t>(frame.data() + std::size_t(r)*ncolumns, ncolumns);
+    }
+    Span<const uint16_t> Picture::Row(unsigned int r) const {
+        return Span<const uint16_t>(frame.data() + std::size_t(r)*ncolumns, ncolumns);
+    }
+    ImageView<uint16_t> Picture::View() {
+        return ImageView<uint16_t>(frame.data(), nrows, ncolumns);
+    }
+    ImageView<const uint16_t> Picture::View() const {
+        return ImageView<const uint16_t>(frame.data(), nrows, ncolumns);
+    }
+    uint16_t &Picture::At(unsigned int r, unsigned int c) {
+        return View().At(r, c);
+    }
+    uint16_t Picture::At(unsigned int r, unsigned int c) const {
+        return View().At(r, c);
+    }
+    static void PrintImage(ImageView<const uint16_t> view, int a, int b) {
         for(int i=0;i<a;i++) {
             for(int j=0;j<b;j++) {
-                std::cout<<frame[i][j]<<",\t";
+                std::cout<<view(i, j)<<",\t";
             }
             std::cout<<std::endl;
         }
     }
-    void Picture::SavePng(std::string filename, int vmin, int vmax) {
+    static void SaveImagePng(ImageView<const uint16_t> view, std::string filename, int vmin, int vmax) {
         cv::Mat mat;
-        mat.create(nrows, ncolumns, CV_16U); 
-        for (unsigned int r = 0; r < nrows; ++r) {
-            for (unsigned int c = 0; c < ncolumns; ++c) {
-                uint16_t tmp = frame[r][c];
+        mat.create(view.GetNRows(), view.GetNColumns(), CV_16U); 
+        for (unsigned int r = 0; r < view.GetNRows(); ++r) {
+            Span<const uint16_t> in = view.Row(r);
+            uint16_t *out = mat.ptr<uint16_t>(r);
+            for (unsigned int c = 0; c < view.GetNColumns(); ++c) {
+                uint16_t tmp = in[c];
                 if (tmp<vmin) tmp = vmin;
                 else if (tmp>vmax) tmp = vmax;
                 tmp = (tmp-vmin)*65535/(vmax-vmin);
-                mat.at<uint16_t>(r, c) = tmp;
+                out[c] = tmp;
             }
         }
         cv::imwrite(filename, mat);
     }
+    void Picture::Print(int a, int b) {
+        PrintImage(View(), a, b);
+    }
+    void Picture::SavePng(std::string filename, int vmin, int vmax) {
+        SaveImagePng(View(), filename, vmin, vmax);
+    }
+    
+    
+    PictureView::PictureView(const uint16_t *data, unsigned int height, unsigned int width): fView(data, height, width) {
+    }
+    Picture PictureView::Materialize() const {
+        Span<const uint16_t> pixels = GetPixels();
+        return Picture(AlignedVector<uint16_t>(pixels.begin(), pixels.end()), GetNRows(), GetNColumns());
+    }
+    void PictureView::Print(int a, int b) const {
+        PrintImage(fView, a, b);
+    }
+    void PictureView::SavePng(std::string filename, int vmin, int vmax) const {
+        SaveImagePng(fView, filename, vmin, vmax);
+    }
      
     
     DGHeader::DGHeader(std::vector<uint32_t> rawheader) {
@@ -165,180 +267,114 @@ namespace cygnolib {
     }
     
     
-    PMTData::PMTData(DGHeader *DGH, std::vector<uint16_t> rawwaveforms): fDGH(DGH), fCorrected(false) {
+    PMTData::PMTData(DGHeader *DGH, const std::vector<uint16_t> &rawwaveforms): PMTData(DGH, rawwaveforms.data(), rawwaveforms.size()) {
+        // the input vector is not owned by this object: detach from it right away
+        for(int i=0;i<fDGH->nboards;i++) {
+            MaterializeBoard(i);
+        }
+    }
+    PMTData::PMTData(DGHeader *DGH, const uint16_t *rawwaveforms, std::size_t length): fDGH(DGH), fCorrected(false) {
         int nboards = fDGH->nboards;
         
-        int baseidx = 0;
-        
-        unsigned int totlength = 0;
+        std::size_t totlength = 0;
         for(int i=0;i<nboards;i++) {
-            int length_i = fDGH->nchannels[i]*fDGH->nsamples[i]*fDGH->nwaveforms[i];
+            std::size_t length_i = std::size_t(fDGH->nchannels[i])*fDGH->nsamples[i]*fDGH->nwaveforms[i];
             totlength += length_i;
         }
-        if(totlength!=rawwaveforms.size()) {
+        if(totlength!=length) {
             throw std::runtime_error("cygnolib::PMTData::PMTdata: corrupted.");
         }
         
-        
+        // the bank is already laid out as [board][evt][ch][samp]
+        fRaw.reserve(nboards);
+        const uint16_t *raw = rawwaveforms;
         for(int i=0;i<nboards;i++) {
-            int length_i = fDGH->nchannels[i]*fDGH->nsamples[i]*fDGH->nwaveforms[i];
-            std::vector<uint16_t> rawwaveforms_i(length_i, 0);
-            for(int j=0; j<length_i; j++) {
-                rawwaveforms_i[j]=rawwaveforms[baseidx+j];
-            }
-            baseidx += length_i;
-            
-            std::vector<std::vector<std::vector<uint16_t>>> tmp(fDGH->nwaveforms[i],
-                                                            std::vector<std::vector<uint16_t>>(fDGH->nchannels[i], 
-                                                            std::vector<uint16_t>(fDGH->nsamples[i], 0)
-                                                            )
-                                                           );
-            
-            for(int evt=0; evt<fDGH->nwaveforms[i]; evt++) {
-                for (int ch=0; ch<fDGH->nchannels[i]; ch++) {
-                    for (int samp=0; samp<fDGH->nsamples[i]; samp++) {
-                        int index = evt*fDGH->nchannels[i]*fDGH->nsamples[i] + ch*fDGH->nsamples[i] + samp;
-                        tmp[evt][ch][samp] = rawwaveforms_i[index];
-                    }
-                }
-            }
-            
-            data.push_back(tmp);
+            fRaw.push_back(raw);
+            raw += std::size_t(fDGH->nchannels[i])*fDGH->nsamples[i]*fDGH->nwaveforms[i];
         }
+        data.resize(nboards);
+        fOwned.assign(nboards, false);
     }
     PMTData::~PMTData(){
     }
-    std::vector<std::vector<std::vector<uint16_t>>> *PMTData::GetWaveforms(int board_model) {
-        if(board_model == 1742 && !fCorrected && !fCorrecting) {
-            std::cout<<"WARNING: PMTData::GetWaveforms: Getting uncorrected raw data!"<<std::endl;
-        }
-        
+    int PMTData::GetBoardIndex(int board_model) {
         int nboards = fDGH->nboards;
-        bool board_found = false;
         int board_index = -1;
         for(int i=0;i<nboards;i++) {
             if(board_model==fDGH->board_model[i]) {
-                board_found = true;
                 board_index = i;
             }
         }
-        if(!board_found) {
+        return board_index;
+    }
+    void PMTData::MaterializeBoard(int board_index) {
+        if(fOwned[board_index]) return;
+        std::size_t length = std::size_t(fDGH->nchannels[board_index])*fDGH->nsamples[board_index]*fDGH->nwaveforms[board_index];
+        data[board_index].assign(fRaw[board_index], fRaw[board_index]+length);
+        fRaw[board_index]   = nullptr;
+        fOwned[board_index] = true;
+    }
+    WaveformView<const uint16_t> PMTData::GetWaveforms(int board_model) {
+        if(board_model == 1742 && !fCorrected && !fCorrecting) {
+            std::cout<<"WARNING: PMTData::GetWaveforms: Getting uncorrected raw data!"<<std::endl;
+        }
+        
+        int board_index = GetBoardIndex(board_model);
+        if(board_index<0) {
             throw std::runtime_error("cygnolib::PMTData::GetWaveforms: board model"+
                                      std::to_string(board_model)+
                                      " not found."
                                     );
         }
+        const uint16_t *wfs = fOwned[board_index] ? data[board_index].data() : fRaw[board_index];
         
-        auto data_front = data.begin();
-        std::advance(data_front, board_index);
-        
-        return &(*data_front);
+        return WaveformView<const uint16_t>(wfs,
+                                            fDGH->nwaveforms[board_index],
+                                            fDGH->nchannels[board_index],
+                                            fDGH->nsamples[board_index]);
     }
-    void PMTData::PeakCorrection(std::vector<std::vector<uint16_t>> &wfs) {
-        unsigned int NS = 1024; //hardcoded!!! Valid only for V1742
-        unsigned int Nch = 8;
-        std::vector<double> avgs(Nch, 0.0);
-        for(unsigned int ch=0; ch<Nch; ch++){
-            avgs[ch] = std::accumulate(wfs[ch].begin(), wfs[ch].end(), 0.0) / NS; // averages of each channel 
-        }
-        for(unsigned int i =1; i<NS; i++) {
-            int offset      = 0;
-            int offset_plus = 0;
-            
-            for(unsigned int ch=0; ch<Nch; ch++){
-                if(i ==1) {                          
-                    if ((wfs[ch][2] - wfs[ch][1])>30) {
-                        offset += 1;
-                    } else {
-                        if ((wfs[ch][3]-wfs[ch][1])>30 && (wfs[ch][3]-wfs[ch][2])>30) {
-                            offset += 1;
-                        }
-                    }
-                } else {
-                    if (i == (NS-1) && (wfs[ch][NS-2] - wfs[ch][NS-1])>30) {
-                        offset+=1;
-                    } else {
-                        if ((wfs[ch][i-1]-wfs[ch][i])>30) {
-                            if ((wfs[ch][i+1] - wfs[ch][i])>30) {
-                                offset += 1;
-                            } else if ((i+2)<NS-2) {
-                                if ((wfs[ch][i+2] - wfs[ch][i])>30 && (wfs[ch][i+1] - wfs[ch][i])<5) {
-                                    offset += 1;
-                                }
-                            } else {
-                                if (i == (NS-2) || (wfs[ch][i+2]-wfs[ch][i])>30) {
-                                    offset += 1;
-                                }
-                            }
-                        }
-                    }
-                }
-                
-                if ((i < (NS-6))                  &&
-                    (avgs[ch] - wfs[ch][i])  <-30 &&
-                    (avgs[ch] - wfs[ch][i+1])<-30 &&
-                    (avgs[ch] - wfs[ch][i+2])<-30 &&
-                    (avgs[ch] - wfs[ch][i+3])<-30 &&
-                    (avgs[ch] - wfs[ch][i+4])<-30 &&
-                    (avgs[ch] - wfs[ch][i+5])<-30 ) {
-                    
-                    offset_plus += 1;
-                }
-            }
-            
-            
-            if (offset >= 7) { // 7 instead of 8 !!!!
-                
-                for(unsigned int ch=0; ch<Nch; ch++){
-                    if (i ==1) {
-                        if ((wfs[ch][2] - wfs[ch][1])>30){
-                            wfs[ch][0] = wfs[ch][2];
-                            wfs[ch][1] = wfs[ch][2];
-                        } else {
-                            wfs[ch][0] = wfs[ch][3];
-                            wfs[ch][1] = wfs[ch][3];
-                            wfs[ch][2] = wfs[ch][3];
-                        }
-                    } else {
-                        if (i == (NS-1)) {
-                            wfs[ch][NS-1] = wfs[ch][NS-2];
-                        } else {
-                            if ((wfs[ch][i+1]-wfs[ch][i])>30) {
-                                if ((wfs[ch][i+1] - wfs[ch][i])>30) {
-                                    wfs[ch][i]   =  int((wfs[ch][i+1]+ wfs[ch][i-1])/2);
-                                } else if ((i+2)<NS-2) {
-                                    if ((wfs[ch][i+2] - wfs[ch][i])>30 && (wfs[ch][i+1] - wfs[ch][i])<5){
-                                        wfs[ch][i]   =  int((wfs[ch][i+2]+ wfs[ch][i-1])/2);
-                                        wfs[ch][i+1] =  int((wfs[ch][i+2]+ wfs[ch][i-1])/2);
-                                    }
-                                }
-                            } else {
-                                if (i == (NS-2)){
-                                    wfs[ch][NS-2] = wfs[ch][NS-3];
-                                    wfs[ch][NS-2] = wfs[ch][NS-1-3];                 
-                                } else {
-                                    wfs[ch][i]   = int((wfs[ch][i+2]+wfs[ch][i-1])/2);
-                                    wfs[ch][i+1] = int((wfs[ch][i+2]+wfs[ch][i-1])/2);
-                                }
-                            }
-                        }
-                    }
-                }
-            }
-            
-            
-            if (offset_plus>=7) {  // 7 instead of 8 !!!!
-                for(unsigned int ch=0; ch<Nch; ch++){
-                    for(unsigned int m=0; m<6; m++){
-                        wfs[ch][i+m] = avgs[ch];
-                    }
-                }
-            }
+    WaveformView<uint16_t> PMTData::GetMutableWaveforms(int board_model) {
+        int board_index = GetBoardIndex(board_model);
+        if(board_index<0) {
+            throw std::runtime_error("cygnolib::PMTData::GetMutableWaveforms: board model"+
+                                     std::to_string(board_model)+
+                                     " not found."
+                                    );
         }
-    }  
+        MaterializeBoard(board_index);
+        
+        return WaveformView<uint16_t>(data[board_index].data(),
+                                      fDGH->nwaveforms[board_index],
+                                      fDGH->nchannels[board_index],
+                                      fDGH->nsamples[board_index]);
+    }
+    void PMTData::PeakCorrection(EventView<uint16_t> wfs) {
+        DRS4PeakCorrection(wfs);
+    }
     void PMTData::ApplyDRS4Corrections(std::vector<float> *channel_offsets,
                                        std::vector<std::vector<int>> *table_cell,
                                        std::vector<std::vector<int>> *table_nsample) {
+        // the conversion is redone only when the tables change, which is told from the storage of
+        // their channels (a few pointer compares per event, not the values)
+        typedef std::vector<std::pair<const int *, std::size_t>> TablesKey;
+        struct CachedCalibration {
+            TablesKey key;
+            std::unique_ptr<DRS4Calibration> calib;
+        };
+        TablesKey key;
+        for(const std::vector<std::vector<int>> *table : {table_cell, table_nsample}) {
+            key.emplace_back(nullptr, table->size());
+            for(const std::vector<int> &channel : *table) key.emplace_back(channel.data(), channel.size());
+        }
+        thread_local CachedCalibration cache;
+        if(!cache.calib || cache.key!=key) {
+            cache.calib.reset(new DRS4Calibration(*table_cell, *table_nsample));
+            cache.key = std::move(key);
+        }
+        ApplyDRS4Corrections(channel_offsets, *cache.calib);
+    }
+    void PMTData::ApplyDRS4Corrections(std::vector<float> *channel_offsets,
+                                       const DRS4Calibration &calib) {
         
         if(fCorrected) {
             std::cout<<"WARNING: PMTData::ApplyDRS4Corrections:: correction not applied, wfs already corrected"<<std::endl;
@@ -347,40 +383,32 @@ namespace cygnolib {
         
         fCorrecting = true;
         
-        int nboards = fDGH->nboards;
-        bool board_found = false;
-        int board_index = -1;
-        for(int i=0;i<nboards;i++) {
-            if(1742==fDGH->board_model[i]) {
-                board_found = true;
-                board_index = i;
-            }
-        }
-        if(!board_found) {
+        int board_index = GetBoardIndex(1742);
+        if(board_index<0) {
+            fCorrecting = false;
             throw std::runtime_error("cygnolib::PMTData::ApplyDRS4Corrections: board model"+
                                      std::to_string(1742)+
                                      " not found."
                                     );
         }
+        if(fDGH->nsamples[board_index]!=(int)calib.GetNCells()) {
+            fCorrecting = false;
+            throw std::runtime_error("cygnolib::PMTData::ApplyDRS4Corrections: number of samples does not match the calibration tables.");
+        }
         
-        std::vector<std::vector<std::vector<uint16_t>>> *fastwfs = GetWaveforms(1742);
+        WaveformView<uint16_t> fastwfs = GetMutableWaveforms(1742);
+        unsigned int nch = std::min({8u, fastwfs.GetNChannels(), calib.GetNChannels()}); //only first 8 channels - hard coded
         
-        for (unsigned int evt=0; evt < fastwfs->size(); evt++) {
+        for (unsigned int evt=0; evt < fastwfs.GetNEvents(); evt++) {
             int SIC = fDGH->SIC[board_index][evt];
             
-            for(unsigned int ch=0; ch<8; ch++) { //only first 8 channels - hard coded
+            for(unsigned int ch=0; ch<nch; ch++) {
                 if((*channel_offsets)[ch]>-0.35 && (*channel_offsets)[ch]<-0.25){
-                    std::vector<uint16_t> tmp((*fastwfs)[evt][ch]);
-                    for(unsigned int samp=0; samp<1024; samp++) {
-                        int sic_index = (samp+SIC)%1024;
-                        tmp[samp]    -= (*table_cell)[ch][sic_index];
-                        tmp[samp]    -= (*table_nsample)[ch][samp];
-                    }
-                    (*fastwfs)[evt][ch]=tmp;
+                    calib.Correct(fastwfs.Channel(evt, ch).data(), ch, SIC);
                 }
             }
             
-            PeakCorrection((*fastwfs)[evt]);
+            PeakCorrection(fastwfs[evt]);
         }
         
         fCorrected = true;
@@ -429,6 +457,32 @@ namespace cygnolib {
     
     
     
+    uint64_t ReadPMTReadoutODB(TMReaderInterface *reader,
+                               bool *DRS4correction,
+                               std::vector<float> *channels_offsets) {
+        uint64_t nevents = 0;
+        TMidasEvent event;
+        while(TMReadEvent(reader, &event)) {
+            nevents++;
+            if(cygnolib::FindODBDumpBOR(event, true)) {
+                std::unique_ptr<MVOdb> odb(cygnolib::GetODBDumpBOR(event));
+                
+                odb->RB("/Configurations/DRS4Correction", DRS4correction);
+                odb->RFA("/Configurations/DigitizerOffset", channels_offsets);
+                return nevents;
+            }
+        }
+        throw std::runtime_error("cygnolib::ReadPMTReadoutODB: no begin of run ODB dump found.");
+    }
+    
+    static void ReadPMTReadoutODB(std::string filename,
+                                  bool *DRS4correction,
+                                  std::vector<float> *channels_offsets) {
+        std::unique_ptr<TMReaderInterface> reader(cygnolib::OpenMidasFile(filename));
+        ReadPMTReadoutODB(reader.get(), DRS4correction, channels_offsets);
+        reader->Close();
+    }
+    
     void InitializePMTReadout(std::string filename,
                               bool *DRS4correction,
                               std::vector<float> *channels_offsets,
@@ -481,30 +535,104 @@ namespace cygnolib {
         inFile.close();
         table_nsample = ftable2;
         
-        TMReaderInterface* reader = cygnolib::OpenMidasFile(filename);
-
-        bool reading = true;
-        while(reading) {
-            TMidasEvent event = TMidasEvent();
-            reading = TMReadEvent(reader, &event);
-            bool odb_bor_found = cygnolib::FindODBDumpBOR(event, true);
-            if(odb_bor_found) {
-                MVOdb* odb = NULL;
-                odb = cygnolib::GetODBDumpBOR(event);
-
-
-                odb->RB("/Configurations/DRS4Correction", DRS4correction);
-                odb->RFA("/Configurations/DigitizerOffset", channels_offsets);
-
-                reader->Close();
-                break;
+        ReadPMTReadoutODB(filename, DRS4correction, channels_offsets);
+    }
+    
+    void InitializePMTReadout(std::string filename,
+                              bool *DRS4correction,
+                              std::vector<float> *channels_offsets,
+                              std::string tag,
+                              DRS4Calibration &calib,
+                              std::string calibdir) {
+        
+        if(tag!="LNGS" && tag!="LNF") {
+            throw std::runtime_error("cygnolib::InitializePMTReadout: unknown tag "+tag+".\n");
+        }
+        
+        calib = GetDRS4Calibration(tag, calibdir);
+        
+        ReadPMTReadoutODB(filename, DRS4correction, channels_offsets);
+    }
+    
+    void EventBanks::Index(TMidasEvent &event) {
+        fBanks.clear();
+        if ((event.GetEventId() & 0xFFFF) == 0x8000 || (event.GetEventId() & 0xFFFF) == 0x8001) {
+            return;
+        }
+        
+        const char *pdata = event.GetData();
+        std::size_t size = event.GetDataSize();
+        if(!pdata || size < sizeof(TMidasEvent_BANK_HEADER)) return;
+        
+        const TMidasEvent_BANK_HEADER *header = (const TMidasEvent_BANK_HEADER *)pdata;
+        const char *end = pdata + std::min(size, sizeof(TMidasEvent_BANK_HEADER) + header->fDataSize);
+        const char *pbank = pdata + sizeof(TMidasEvent_BANK_HEADER);
+        
+        bool bank32  = header->fFlags & (1<<4); // BANK_FORMAT_32BIT
+        bool bank32a = header->fFlags & (1<<5); // BANK_FORMAT_64BIT_ALIGNED
+        std::size_t hsize = bank32a ? sizeof(TMidasEvent_BANK32)+4 : (bank32 ? sizeof(TMidasEvent_BANK32) : sizeof(TMidasEvent_BANK));
+        
+        while(pbank + hsize <= end) {
+            BankInfo info;
+            if(bank32 || bank32a) {
+                const TMidasEvent_BANK32 *bank = (const TMidasEvent_BANK32 *)pbank;
+                std::memcpy(info.name, bank->fName, 4);
+                info.type = bank->fType;
+                info.size = bank->fDataSize;
+            } else {
+                const TMidasEvent_BANK *bank = (const TMidasEvent_BANK *)pbank;
+                std::memcpy(info.name, bank->fName, 4);
+                info.type = bank->fType;
+                info.size = bank->fDataSize;
+            }
+            info.data = pbank + hsize;
+            if((const char *)info.data + info.size > end) {
+                throw std::runtime_error("cygnolib::EventBanks::Index: bank "+std::string(info.name, 4)+" exceeds the event.");
             }
+            fBanks.push_back(info);
+            pbank = (const char *)info.data + ((info.size + 7) & ~std::size_t(7));
         }
     }
     
+    const BankInfo *EventBanks::Find(const std::string &bname) const {
+        if(bname.size()!=4) return nullptr;
+        for(const BankInfo &info : fBanks) {
+            if(std::memcmp(info.name, bname.data(), 4)==0) return &info;
+        }
+        return nullptr;
+    }
+    
     Picture daq_cam2pic(TMidasEvent &event, std::string cam_model) {
-        int rows;
-        int columns;
+        return daq_cam2pic(EventBanks(event), cam_model);
+    }
+    void daq_cam2pic(TMidasEvent &event, Picture &pic, std::string cam_model) {
+        daq_cam2pic(EventBanks(event), pic, cam_model);
+    }
+    PictureView daq_cam2picview(TMidasEvent &event, std::string cam_model) {
+        return daq_cam2picview(EventBanks(event), cam_model);
+    }
+    DGHeader daq_dgh2head(TMidasEvent &event) {
+        return daq_dgh2head(EventBanks(event));
+    }
+    PMTData daq_dig2PMTData(TMidasEvent &event, DGHeader *DGH) {
+        return daq_dig2PMTData(EventBanks(event), DGH);
+    }
+    
+    Picture daq_cam2pic(const EventBanks &banks, std::string cam_model) {
+        return daq_cam2picview(banks, cam_model).Materialize();
+    }
+    void daq_cam2pic(const EventBanks &banks, Picture &pic, std::string cam_model) {
+        PictureView view = daq_cam2picview(banks, cam_model);
+        if(pic.GetNRows()!=view.GetNRows() || pic.GetNColumns()!=view.GetNColumns()) {
+            AlignedVector<uint16_t> buffer = pic.ReleaseBuffer();
+            buffer.resize(view.Size());
+            pic.AdoptBuffer(std::move(buffer), view.GetNRows(), view.GetNColumns());
+        }
+        pic.SetFrame(view.GetPixels());
+    }
+    PictureView daq_cam2picview(const EventBanks &banks, std::string cam_model) {
+        unsigned int rows;
+        unsigned int columns;
         
         if(cam_model=="fusion") {
             rows = 2304;
@@ -513,61 +641,35 @@ namespace cygnolib {
             throw std::invalid_argument("cygnolib::daq_cam2pic: invalid model '"+cam_model+"' for the camera.\n");
         }
         
-        Picture pic(rows, columns);
-        
         std::string bname="CAM0";
-        int bankLength = 0;
-        int bankType = 0;
-        void *pdata = 0;
-        event.FindBank(bname.c_str(), &bankLength, &bankType, &pdata);
-        uint16_t *pdatacast = (uint16_t *)pdata; //recast to bank type to increment
-        std::vector<std::vector<uint16_t>> frame(rows, std::vector<uint16_t>(columns,0)); 
-        for(int i=0; i<rows; i++) {
-            for (int j=0; j<columns;j++) {
-                frame[i][j] = *pdatacast;
-                pdatacast++;
-            }
+        const BankInfo *bank = banks.Find(bname);
+        if(!bank || bank->As<uint16_t>().size() < std::size_t(rows)*columns) {
+            throw std::runtime_error("cygnolib::daq_cam2pic: bank "+bname+" missing or too short for model '"+cam_model+"'.");
         }
-        pic.SetFrame(frame);
-        return pic;
         
+        return PictureView(bank->As<uint16_t>().data(), rows, columns);
     }
-    DGHeader daq_dgh2head(TMidasEvent &event) {
+    DGHeader daq_dgh2head(const EventBanks &banks) {
         std::string bname="DGH0";
-        int bankLength = 0;
-        int bankType = 0;
-        void *pdata = 0;
-        event.FindBank(bname.c_str(), &bankLength, &bankType, &pdata);
-        uint32_t *pdatacast = (uint32_t *)pdata; //recast to bank type to increment
-        
-        std::vector<uint32_t> v(bankLength, 0);
-        for (int i=0; i<bankLength; i++) {
-            v[i] = *pdatacast;
-            pdatacast++;
+        const BankInfo *bank = banks.Find(bname);
+        if(!bank) {
+            throw std::runtime_error("cygnolib::daq_dgh2head: bank "+bname+" not found.");
         }
+        Span<const uint32_t> raw = bank->As<uint32_t>();
         
-        DGHeader DGH(v);
+        DGHeader DGH(std::vector<uint32_t>(raw.begin(), raw.end()));
         return DGH;
     }
     
-    PMTData daq_dig2PMTData(TMidasEvent &event, DGHeader *DGH) {
+    PMTData daq_dig2PMTData(const EventBanks &banks, DGHeader *DGH) {
         std::string bname="DIG0";
-        int bankLength = 0;
-        int bankType = 0;
-        void *pdata = 0;
-        event.FindBank(bname.c_str(), &bankLength, &bankType, &pdata);
-        uint16_t *pdatacast = (uint16_t *)pdata; //recast to bank type to increment
-        
-        std::vector<uint16_t> v(bankLength, 0);
-        for (int i=0; i<bankLength; i++) {
-            v[i] = *pdatacast;
-            pdatacast++;
+        const BankInfo *bank = banks.Find(bname);
+        if(!bank) {
+            throw std::runtime_error("cygnolib::daq_dig2PMTData: bank "+bname+" not found.");
         }
-        //return v;
+        Span<const uint16_t> raw = bank->As<uint16_t>();
         
-        PMTData PMTD(DGH, v);
-        return PMTD;
+        return PMTData(DGH, raw.data(), raw.size());
     }
     
 }
-
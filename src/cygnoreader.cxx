@@ -0,0 +1,157 @@
+/*
+ * Copyright (C) 2024 CYGNO Collaboration
+ *
+ *
+ * Author: Stefano Piacentini
+ * Created in 2024
+ *
+ */
+
+#include "cygnoreader.h"
+#include <chrono>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+
+
+namespace cygnolib {
+
+    bool ReadMidasEvent(TMReaderInterface *reader, TMidasEvent &event, AlignedVector<char> &buffer) {
+        event.Clear();
+
+        TMidasEvent_EVENT_HEADER *header = event.GetEventHeader();
+        int rd = reader->Read(header, sizeof(TMidasEvent_EVENT_HEADER));
+        if(reader->fError) {
+            throw std::runtime_error("cygnolib::ReadMidasEvent: "+reader->fErrorString+".");
+        }
+        if(rd==0) return false;
+        if(rd!=(int)sizeof(TMidasEvent_EVENT_HEADER)) {
+            // a run cut off by the DAQ: stop at the last complete event, as TMReadEvent() does
+            std::cerr<<"cygnolib::ReadMidasEvent: truncated event header at the end of the file, ignored."<<std::endl;
+            return false;
+        }
+        // IsGoodSize() also rejects events without data, which are valid: only sizes above its limit
+        // mean a corrupted header
+        if(header->fDataSize>0 && !event.IsGoodSize()) {
+            throw std::runtime_error("cygnolib::ReadMidasEvent: invalid event size "+std::to_string(header->fDataSize)+".");
+        }
+
+        uint32_t size = header->fDataSize;
+        if(buffer.size()<size) buffer.resize(size);
+        rd = size>0 ? reader->Read(buffer.data(), size) : 0;
+        if(reader->fError) {
+            throw std::runtime_error("cygnolib::ReadMidasEvent: "+reader->fErrorString+".");
+        }
+        if(rd!=(int)size) {
+            std::cerr<<"cygnolib::ReadMidasEvent: truncated event data at the end of the file, ignored."<<std::endl;
+            return false;
+        }
+        event.SetData(size, buffer.data());
+        return true;
+    }
+
+
+    PrefetchReader::PrefetchReader(TMReaderInterface *reader, unsigned int depth):
+        fReader(reader), fDepth(depth > 0 ? depth : 1), fSlots(new Slot[fDepth]) {
+        for(unsigned int i=0; i<fDepth; i++) fFree.push_back(i);
+        fThread = std::thread(&PrefetchReader::Run, this);
+    }
+
+    PrefetchReader::~PrefetchReader() {
+        Stop();
+    }
+
+    void PrefetchReader::Stop() {
+        {
+            std::lock_guard<std::mutex> lock(fMutex);
+            fStop = true;
+        }
+        fFreeCV.notify_all();
+        if(fThread.joinable()) fThread.join();
+    }
+
+    void PrefetchReader::Run() {
+        typedef std::chrono::steady_clock clock;
+        while(true) {
+            unsigned int slot;
+            {
+                std::unique_lock<std::mutex> lock(fMutex);
+                clock::time_point start = clock::now();
+                fFreeCV.wait(lock, [this] { return fStop || !fFree.empty(); });
+                fStats.consumer_stall_seconds += std::chrono::duration<double>(clock::now()-start).count();
+                if(fStop) return;
+                slot = fFree.front();
+                fFree.pop_front();
+            }
+
+            clock::time_point start = clock::now();
+            bool read = false;
+            std::exception_ptr error;
+            try {
+                read = ReadMidasEvent(fReader, fSlots[slot].event, fSlots[slot].buffer);
+            } catch(...) {
+                error = std::current_exception();
+            }
+            double seconds = std::chrono::duration<double>(clock::now()-start).count();
+
+            {
+                std::lock_guard<std::mutex> lock(fMutex);
+                fStats.read_seconds += seconds;
+                if(read) {
+                    fStats.events++;
+                    fFilled.push_back(slot);
+                } else {
+                    fFree.push_back(slot);
+                    fError = error;
+                    fEOF   = true;
+                }
+            }
+            fFilledCV.notify_one();
+            if(!read) return;
+        }
+    }
+
+    TMidasEvent *PrefetchReader::Acquire() {
+        typedef std::chrono::steady_clock clock;
+        std::unique_lock<std::mutex> lock(fMutex);
+        clock::time_point start = clock::now();
+        fFilledCV.wait(lock, [this] { return fEOF || !fFilled.empty(); });
+        fStats.io_stall_seconds += std::chrono::duration<double>(clock::now()-start).count();
+        if(fFilled.empty()) {
+            if(fError) {
+                std::exception_ptr error = fError;
+                fError = nullptr;
+                std::rethrow_exception(error);
+            }
+            return nullptr;
+        }
+        unsigned int slot = fFilled.front();
+        fFilled.pop_front();
+        return &fSlots[slot].event;
+    }
+
+    void PrefetchReader::Release(TMidasEvent *event) {
+        unsigned int slot = 0;
+        while(slot<fDepth && &fSlots[slot].event!=event) slot++;
+        if(slot==fDepth) {
+            throw std::invalid_argument("cygnolib::PrefetchReader::Release: event not owned by this reader.");
+        }
+        {
+            std::lock_guard<std::mutex> lock(fMutex);
+            fFree.push_back(slot);
+        }
+        fFreeCV.notify_one();
+    }
+
+    TMidasEvent *PrefetchReader::Next() {
+        if(fCurrent) Release(fCurrent);
+        fCurrent = Acquire();
+        return fCurrent;
+    }
+
+    PrefetchStats PrefetchReader::GetStats() const {
+        std::lock_guard<std::mutex> lock(fMutex);
+        return fStats;
+    }
+
+}
@@ -0,0 +1,42 @@
+/*
+ * Copyright (C) 2024 CYGNO Collaboration
+ *
+ *
+ * Author: Stefano Piacentini
+ * Created in 2024
+ *
+ */
+
+#include "cygnosession.h"
+#include "cygnolib.h"
+#include <stdexcept>
+
+
+namespace cygnolib {
+
+    RunSession::RunSession(std::string filename, std::string tag, std::string calibdir):
+        fFilename(filename), fTag(tag) {
+        Initialize(calibdir);
+    }
+
+    RunSession::RunSession(TMReaderInterface *reader, std::string tag, std::string calibdir):
+        fTag(tag), fReader(reader) {
+        Initialize(calibdir);
+    }
+
+    void RunSession::Initialize(std::string calibdir) {
+        if(fTag!="LNGS" && fTag!="LNF") {
+            throw std::runtime_error("cygnolib::RunSession: unknown tag "+fTag+".");
+        }
+
+        fCalibration = GetDRS4Calibration(fTag, calibdir);
+
+        if(!fReader) fReader.reset(OpenMidasFile(fFilename));
+        fNEventsRead = ReadPMTReadoutODB(fReader.get(), &fDRS4Correction, &fChannelsOffsets);
+    }
+
+    RunSession::~RunSession() {
+        if(fReader) fReader->Close();
+    }
+
+}
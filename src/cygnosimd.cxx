@@ -0,0 +1,52 @@
+/*
+ * Copyright (C) 2024 CYGNO Collaboration
+ *
+ *
+ * Author: Stefano Piacentini
+ * Created in 2024
+ *
+ */
+
+#include "cygnosimd.h"
+#include <atomic>
+#include <string>
+
+
+namespace cygnolib {
+
+    static SimdLevel DetectSimdLevel() {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")) return SimdLevel::AVX512;
+        if (__builtin_cpu_supports("avx2"))   return SimdLevel::AVX2;
+        if (__builtin_cpu_supports("sse4.2")) return SimdLevel::SSE42;
+#endif
+        return SimdLevel::Scalar;
+    }
+
+    static std::atomic<int> gSimdLevel{-1};
+
+    SimdLevel GetSupportedSimdLevel() {
+        static const SimdLevel supported = DetectSimdLevel();
+        return supported;
+    }
+    SimdLevel GetSimdLevel() {
+        int level = gSimdLevel.load(std::memory_order_relaxed);
+        if (level < 0) return GetSupportedSimdLevel();
+        return static_cast<SimdLevel>(level);
+    }
+    void SetSimdLevel(SimdLevel level) {
+        if (level > GetSupportedSimdLevel()) level = GetSupportedSimdLevel();
+        gSimdLevel.store(static_cast<int>(level), std::memory_order_relaxed);
+    }
+    std::string SimdLevelName(SimdLevel level) {
+        switch (level) {
+            case SimdLevel::Scalar: return "scalar";
+            case SimdLevel::SSE42:  return "SSE4.2";
+            case SimdLevel::AVX2:   return "AVX2";
+            case SimdLevel::AVX512: return "AVX-512";
+        }
+        return "unknown";
+    }
+
+}
@@ -0,0 +1,113 @@
+/*
+ * Copyright (C) 2024 CYGNO Collaboration
+ *
+ *
+ * Author: Stefano Piacentini
+ * Created in 2024
+ *
+ */
+
+#include "cygnothreads.h"
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <memory>
+
+
+namespace cygnolib {
+
+    unsigned int GetDefaultNThreads() {
+        unsigned int n = std::thread::hardware_concurrency();
+        return n > 0 ? n : 1;
+    }
+
+    WorkerPool::WorkerPool(unsigned int nthreads) {
+        if(nthreads==0) nthreads = GetDefaultNThreads();
+        fThreads.reserve(nthreads);
+        for(unsigned int i=0; i<nthreads; i++) fThreads.emplace_back(&WorkerPool::Run, this);
+    }
+
+    WorkerPool::~WorkerPool() {
+        {
+            std::lock_guard<std::mutex> lock(fMutex);
+            fStop = true;
+        }
+        fCV.notify_all();
+        for(std::thread &thread : fThreads) thread.join();
+    }
+
+    void WorkerPool::Run() {
+        while(true) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(fMutex);
+                fCV.wait(lock, [this] { return fStop || !fTasks.empty(); });
+                if(fTasks.empty()) return;
+                task = std::move(fTasks.front());
+                fTasks.pop_front();
+            }
+            task();
+        }
+    }
+
+    void WorkerPool::Submit(std::function<void()> task) {
+        {
+            std::lock_guard<std::mutex> lock(fMutex);
+            fTasks.push_back(std::move(task));
+        }
+        fCV.notify_one();
+    }
+
+    namespace {
+        struct ParallelForState {
+            std::atomic<std::size_t> next{0};
+            std::size_t n;
+            const std::function<void(std::size_t)> *fn;
+            std::exception_ptr error;
+            unsigned int running;
+            std::mutex mutex;
+            std::condition_variable cv;
+
+            void Loop() {
+                for(std::size_t i = next.fetch_add(1); i<n; i = next.fetch_add(1)) {
+                    try {
+                        (*fn)(i);
+                    } catch(...) {
+                        std::lock_guard<std::mutex> lock(mutex);
+                        if(!error) error = std::current_exception();
+                        next.store(n);
+                    }
+                }
+            }
+        };
+    }
+
+    void WorkerPool::ParallelFor(std::size_t n, const std::function<void(std::size_t)> &fn) {
+        if(n==0) return;
+        std::shared_ptr<ParallelForState> state = std::make_shared<ParallelForState>();
+        state->n  = n;
+        state->fn = &fn;
+
+        std::size_t nhelpers = std::min<std::size_t>(fThreads.size(), n-1);
+        state->running = nhelpers;
+        for(std::size_t h=0; h<nhelpers; h++) {
+            Submit([state] {
+                state->Loop();
+                std::lock_guard<std::mutex> lock(state->mutex);
+                if(--state->running==0) state->cv.notify_all();
+            });
+        }
+        state->Loop();
+
+        std::unique_lock<std::mutex> lock(state->mutex);
+        state->cv.wait(lock, [&state] { return state->running==0; });
+        if(state->error) std::rethrow_exception(state->error);
+    }
+
+    std::shared_ptr<WorkerPool> MakeWorkerPool(unsigned int nthreads) {
+        if(nthreads==0) nthreads = GetDefaultNThreads();
+        if(nthreads<=1) return nullptr;
+        return std::make_shared<WorkerPool>(nthreads-1);
+    }
+
+}
@@ -0,0 +1,284 @@
+/*
+ * Copyright (C) 2024 CYGNO Collaboration
+ *
+ *
+ * Author: Stefano Piacentini
+ * Created in 2024
+ *
+ */
+
+#include "dbscan.h"
+#include <cmath>
+#include <stdexcept>
+#include <string>
+
+
+namespace cygnolib {
+
+    void HitGrid::Build(const HitList &hits, unsigned int cellsize) {
+        if(cellsize==0) {
+            throw std::invalid_argument("cygnolib::HitGrid::Build: the cell size must be positive.");
+        }
+        fNRows        = hits.GetNRows();
+        fNColumns     = hits.GetNColumns();
+        fCellSize     = cellsize;
+        fNCellRows    = (fNRows + cellsize - 1) / cellsize;
+        fNCellColumns = (fNColumns + cellsize - 1) / cellsize;
+
+        std::size_t ncells = std::size_t(fNCellRows)*fNCellColumns;
+        std::size_t nhits  = hits.Size();
+        Span<const uint32_t> rows    = hits.GetRows();
+        Span<const uint32_t> columns = hits.GetColumns();
+
+        // counting sort by cell, stable so that the hits of a cell stay in row-major order
+        fOffsets.assign(ncells+1, 0);
+        for(std::size_t i=0; i<nhits; i++) {
+            fOffsets[std::size_t(rows[i]/cellsize)*fNCellColumns + columns[i]/cellsize + 1]++;
+        }
+        for(std::size_t c=0; c<ncells; c++) fOffsets[c+1] += fOffsets[c];
+
+        fHits.resize(nhits);
+        fRows.resize(nhits);
+        fColumns.resize(nhits);
+        AlignedVector<uint32_t> next(fOffsets.begin(), fOffsets.end()-1);
+        for(std::size_t i=0; i<nhits; i++) {
+            uint32_t k = next[std::size_t(rows[i]/cellsize)*fNCellColumns + columns[i]/cellsize]++;
+            fHits[k]    = i;
+            fRows[k]    = rows[i];
+            fColumns[k] = columns[i];
+        }
+    }
+
+
+    DBSCAN::DBSCAN(float eps, unsigned int minpts, unsigned int nthreads, unsigned int band_rows):
+        DBSCAN(eps, minpts, MakeWorkerPool(nthreads), band_rows) {
+    }
+
+    DBSCAN::DBSCAN(float eps, unsigned int minpts, std::shared_ptr<WorkerPool> pool, unsigned int band_rows):
+        fEps(eps), fEps2(eps*eps), fMinPts(minpts), fPool(std::move(pool)) {
+        if(!(eps>0)) {
+            throw std::invalid_argument("cygnolib::DBSCAN::DBSCAN: eps must be positive.");
+        }
+        // two hits of a cell are at most (cellsize-1)*sqrt(2) apart
+        fCellSize = unsigned(std::floor(eps/std::sqrt(2.f))) + 1;
+
+        // cells whose closest pixels are within eps
+        fReach = 0;
+        int range = int(std::ceil(eps))/int(fCellSize) + 1;
+        for(int dr=-range; dr<=range; dr++) {
+            for(int dc=-range; dc<=range; dc++) {
+                int gr = std::max(0, std::abs(dr)*int(fCellSize) - int(fCellSize) + 1);
+                int gc = std::max(0, std::abs(dc)*int(fCellSize) - int(fCellSize) + 1);
+                if(float(gr*gr + gc*gc)>fEps2) continue;
+                fNeighbourCells.emplace_back(dr, dc);
+                if(dr<0 || (dr==0 && dc<0)) fPrecedingCells.emplace_back(dr, dc);
+                fReach = std::max(fReach, -dr);
+            }
+        }
+        // the cell itself first: its hits are all neighbours of each other
+        std::stable_partition(fNeighbourCells.begin(), fNeighbourCells.end(),
+                              [](const std::pair<int, int> &d) { return d.first==0 && d.second==0; });
+        // bands are made of whole cell rows, and at least as high as the reach of a cell, so that
+        // the neighbours of a cell are in its band or in the previous one
+        unsigned int band_cells = std::max<unsigned int>((band_rows + fCellSize - 1)/fCellSize, std::max(fReach, 1));
+        fBandRows = band_cells*fCellSize;
+    }
+
+    void DBSCAN::ForEachBand(std::size_t nbands, const std::function<void(std::size_t)> &fn) {
+        if(fPool) {
+            fPool->ParallelFor(nbands, fn);
+            return;
+        }
+        for(std::size_t b=0; b<nbands; b++) fn(b);
+    }
+
+    uint32_t DBSCAN::Find(uint32_t x) {
+        while(fParent[x]!=x) {
+            fParent[x] = fParent[fParent[x]];
+            x = fParent[x];
+        }
+        return x;
+    }
+
+    void DBSCAN::Union(uint32_t a, uint32_t b) {
+        a = Find(a);
+        b = Find(b);
+        // the root is the core point coming first in row-major order
+        if(a<b)      fParent[b] = a;
+        else if(b<a) fParent[a] = b;
+    }
+
+    bool DBSCAN::IsNeighbour(unsigned int r1, unsigned int c1, unsigned int r2, unsigned int c2) const {
+        int dr = int(r1)-int(r2), dc = int(c1)-int(c2);
+        return float(dr*dr + dc*dc)<=fEps2;
+    }
+
+    uint32_t DBSCAN::FirstCore(std::size_t cell) const {
+        Span<const uint32_t> offsets = fGrid.GetOffsets();
+        Span<const uint32_t> hits    = fGrid.GetHits();
+        for(uint32_t k=offsets[cell]; k<offsets[cell+1]; k++) {
+            if(fCore[hits[k]]) return hits[k];
+        }
+        return UINT32_MAX;
+    }
+
+    uint32_t DBSCAN::CellsTouch(std::size_t a, std::size_t b) const {
+        Span<const uint32_t> offsets = fGrid.GetOffsets();
+        Span<const uint32_t> hits    = fGrid.GetHits();
+        Span<const uint32_t> rows    = fGrid.GetRows();
+        Span<const uint32_t> columns = fGrid.GetColumns();
+        for(uint32_t k=offsets[a]; k<offsets[a+1]; k++) {
+            if(!fCore[hits[k]]) continue;
+            for(uint32_t l=offsets[b]; l<offsets[b+1]; l++) {
+                if(fCore[hits[l]] && IsNeighbour(rows[k], columns[k], rows[l], columns[l])) return hits[l];
+            }
+        }
+        return UINT32_MAX;
+    }
+
+    void DBSCAN::Cluster(const HitList &hits, HitClusters &clusters) {
+        fNHits = hits.Size();
+        clusters.Reset(fNHits);
+        fGrid.Build(hits, fCellSize);
+        if(fNHits==0) {
+            clusters.Index(0);
+            return;
+        }
+        if(fParent.size()<fNHits) {
+            fCore.resize(fNHits);
+            fParent.resize(fNHits);
+            fRoot.resize(fNHits);
+        }
+
+        unsigned int nrows = hits.GetNRows();
+        std::size_t nbands = (nrows + fBandRows - 1) / fBandRows;
+        unsigned int band_cells = fBandRows/fCellSize;
+        int ncellrows = fGrid.GetNCellRows(), ncellcolumns = fGrid.GetNCellColumns();
+        Span<const uint32_t> offsets = hits.GetRowOffsets();
+        Span<const uint32_t> rows    = hits.GetRows();
+        Span<const uint32_t> columns = hits.GetColumns();
+        Span<const uint32_t> coffsets = fGrid.GetOffsets();
+        Span<const uint32_t> chits    = fGrid.GetHits();
+        Span<const uint32_t> crows    = fGrid.GetRows();
+        Span<const uint32_t> ccolumns = fGrid.GetColumns();
+        Span<int32_t> labels = clusters.GetLabels();
+        auto band_first = [&](std::size_t b) { return offsets[std::min<std::size_t>(b*fBandRows, nrows)]; };
+        auto band_last_cellrow = [&](std::size_t b) { return std::min<int>((b+1)*band_cells, ncellrows); };
+
+        // core points
+        ForEachBand(nbands, [&](std::size_t b) {
+            for(int cr=b*band_cells; cr<band_last_cellrow(b); cr++) {
+                for(int cc=0; cc<ncellcolumns; cc++) {
+                    std::size_t cell = std::size_t(cr)*ncellcolumns + cc;
+                    // the hits of a cell are all neighbours of each other
+                    unsigned int ncell = coffsets[cell+1]-coffsets[cell];
+                    for(uint32_t k=coffsets[cell]; k<coffsets[cell+1]; k++) {
+                        uint32_t i = chits[k];
+                        fParent[i] = i;
+                        unsigned int n = ncell;
+                        for(std::size_t d=1; d<fNeighbourCells.size() && n<fMinPts; d++) {
+                            int nr = cr + fNeighbourCells[d].first, nc = cc + fNeighbourCells[d].second;
+                            if(nr<0 || nr>=ncellrows || nc<0 || nc>=ncellcolumns) continue;
+                            std::size_t other = std::size_t(nr)*ncellcolumns + nc;
+                            for(uint32_t l=coffsets[other]; l<coffsets[other+1]; l++) {
+                                n += IsNeighbour(crows[k], ccolumns[k], crows[l], ccolumns[l]);
+                            }
+                        }
+                        fCore[i] = n>=fMinPts;
+                    }
+                }
+            }
+        });
+
+        // core points of the same cell, and of neighbouring cells of the same band...
+        auto join = [&](int cr, int cc, int first_cellrow) {
+            std::size_t cell = std::size_t(cr)*ncellcolumns + cc;
+            uint32_t core = FirstCore(cell);
+            if(core==UINT32_MAX) return;
+            for(std::size_t d=0; d<fPrecedingCells.size(); d++) {
+                int nr = cr + fPrecedingCells[d].first, nc = cc + fPrecedingCells[d].second;
+                if(nr<first_cellrow || nr<0 || nc<0 || nc>=ncellcolumns) continue;
+                std::size_t other = std::size_t(nr)*ncellcolumns + nc;
+                uint32_t other_core = FirstCore(other);
+                if(other_core==UINT32_MAX || Find(core)==Find(other_core)) continue;
+                uint32_t touching = CellsTouch(cell, other);
+                if(touching!=UINT32_MAX) Union(core, touching);
+            }
+        };
+        ForEachBand(nbands, [&](std::size_t b) {
+            for(int cr=b*band_cells; cr<band_last_cellrow(b); cr++) {
+                for(int cc=0; cc<ncellcolumns; cc++) {
+                    std::size_t cell = std::size_t(cr)*ncellcolumns + cc;
+                    uint32_t core = FirstCore(cell);
+                    if(core==UINT32_MAX) continue;
+                    for(uint32_t k=coffsets[cell]; k<coffsets[cell+1]; k++) {
+                        if(fCore[chits[k]]) Union(core, chits[k]);
+                    }
+                    join(cr, cc, b*band_cells);
+                }
+            }
+        });
+        // ... and of neighbouring cells across the boundaries between the bands, which only the
+        // first fReach cell rows of a band have
+        for(std::size_t b=1; b<nbands; b++) {
+            int first_cellrow = b*band_cells;
+            for(int cr=first_cellrow; cr<std::min(first_cellrow + fReach, band_last_cellrow(b)); cr++) {
+                for(int cc=0; cc<ncellcolumns; cc++) join(cr, cc, 0);
+            }
+        }
+
+        // roots of the core points, without compressing the paths so that the bands can be read in parallel
+        fBandClusters.assign(nbands+1, 0);
+        ForEachBand(nbands, [&](std::size_t b) {
+            std::size_t n = 0;
+            for(uint32_t i=band_first(b); i<band_first(b+1); i++) {
+                if(!fCore[i]) continue;
+                uint32_t x = i;
+                while(fParent[x]!=x) x = fParent[x];
+                fRoot[i] = x;
+                if(x==i) n++;
+            }
+            fBandClusters[b+1] = n;
+        });
+        for(std::size_t b=0; b<nbands; b++) fBandClusters[b+1] += fBandClusters[b];
+
+        // clusters are numbered in the order of their root...
+        ForEachBand(nbands, [&](std::size_t b) {
+            int32_t next = fBandClusters[b];
+            for(uint32_t i=band_first(b); i<band_first(b+1); i++) {
+                if(fCore[i] && fRoot[i]==i) labels[i] = next++;
+            }
+        });
+        // ... core points take the label of their root, border points that of their nearest core point
+        ForEachBand(nbands, [&](std::size_t b) {
+            for(uint32_t i=band_first(b); i<band_first(b+1); i++) {
+                if(fCore[i]) {
+                    if(fRoot[i]!=i) labels[i] = labels[fRoot[i]];
+                    continue;
+                }
+                int cr = rows[i]/fCellSize, cc = columns[i]/fCellSize;
+                uint32_t best = UINT32_MAX;
+                int best_d2 = 0;
+                for(std::size_t d=0; d<fNeighbourCells.size(); d++) {
+                    int nr = cr + fNeighbourCells[d].first, nc = cc + fNeighbourCells[d].second;
+                    if(nr<0 || nr>=ncellrows || nc<0 || nc>=ncellcolumns) continue;
+                    std::size_t other = std::size_t(nr)*ncellcolumns + nc;
+                    for(uint32_t l=coffsets[other]; l<coffsets[other+1]; l++) {
+                        uint32_t j = chits[l];
+                        if(!fCore[j]) continue;
+                        int dr = int(rows[i])-int(crows[l]), dc = int(columns[i])-int(ccolumns[l]);
+                        int d2 = dr*dr + dc*dc;
+                        if(float(d2)<=fEps2 && (best==UINT32_MAX || d2<best_d2 || (d2==best_d2 && j<best))) {
+                            best    = j;
+                            best_d2 = d2;
+                        }
+                    }
+                }
+                if(best!=UINT32_MAX) labels[i] = labels[fRoot[best]];
+            }
+        });
+
+        clusters.Index(fBandClusters[nbands]);
+    }
+
+}
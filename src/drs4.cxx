@@ -0,0 +1,750 @@
+/*
+ * Copyright (C) 2024 CYGNO Collaboration
+ *
+ *
+ * Author: Stefano Piacentini
+ * Created in 2024
+ *
+ */
+
+#include "drs4.h"
+#include "cygnosimd.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <stdexcept>
+#include <vector>
+#include <zlib.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#ifdef RECOPP_EMBED_CALIBRATION
+#include "drs4_embedded_tables.h"
+#endif
+
+
+namespace cygnolib {
+
+    static int16_t SaturateInt16(int x) {
+        return (int16_t)std::min<int>(std::max<int>(x, std::numeric_limits<int16_t>::min()),
+                                      std::numeric_limits<int16_t>::max());
+    }
+
+    DRS4Calibration::DRS4Calibration(unsigned int nchannels, unsigned int ncells):
+        fNChannels(nchannels), fNCells(ncells), fStorage(2*std::size_t(nchannels)*ncells, 0),
+        fCell(fStorage.data()), fNSample(fStorage.data() + std::size_t(nchannels)*ncells) {
+    }
+    DRS4Calibration::DRS4Calibration(const std::vector<std::vector<int>> &table_cell,
+                                     const std::vector<std::vector<int>> &table_nsample):
+        DRS4Calibration(table_cell.size(), table_cell.empty() ? 0 : table_cell[0].size()) {
+        if(table_nsample.size()!=fNChannels) {
+            throw std::invalid_argument("cygnolib::DRS4Calibration::DRS4Calibration: tables have different number of channels.");
+        }
+        for(unsigned int ch=0; ch<fNChannels; ch++) {
+            if(table_cell[ch].size()!=fNCells || table_nsample[ch].size()!=fNCells) {
+                throw std::invalid_argument("cygnolib::DRS4Calibration::DRS4Calibration: tables have different number of cells.");
+            }
+            std::transform(table_cell[ch].begin(),    table_cell[ch].end(),    GetCell(ch).begin(),    SaturateInt16);
+            std::transform(table_nsample[ch].begin(), table_nsample[ch].end(), GetNSample(ch).begin(), SaturateInt16);
+        }
+    }
+    DRS4Calibration::DRS4Calibration(unsigned int nchannels, unsigned int ncells,
+                                     const int16_t *cell, const int16_t *nsample,
+                                     std::shared_ptr<const void> owner):
+        fNChannels(nchannels), fNCells(ncells), fOwner(std::move(owner)), fCell(cell), fNSample(nsample) {
+    }
+    DRS4Calibration::DRS4Calibration(const DRS4Calibration &other):
+        fNChannels(other.fNChannels), fNCells(other.fNCells), fTag(other.fTag),
+        fStorage(other.fStorage), fOwner(other.fOwner), fCell(other.fCell), fNSample(other.fNSample),
+        fMode(other.fMode), fLUT(other.fLUT) {
+        if(!fStorage.empty()) {
+            fCell    = fStorage.data();
+            fNSample = fStorage.data() + std::size_t(fNChannels)*fNCells;
+        }
+    }
+    DRS4Calibration &DRS4Calibration::operator=(const DRS4Calibration &other) {
+        if(this!=&other) {
+            DRS4Calibration tmp(other);
+            *this = std::move(tmp);
+        }
+        return *this;
+    }
+    void DRS4Calibration::Detach() {
+        if(!IsExternal()) return;
+        std::size_t n = std::size_t(fNChannels)*fNCells;
+        AlignedVector<int16_t> storage(2*n);
+        std::copy(fCell,    fCell+n,    storage.begin());
+        std::copy(fNSample, fNSample+n, storage.begin()+n);
+        fStorage = std::move(storage);
+        fOwner.reset();
+        fCell    = fStorage.data();
+        fNSample = fStorage.data() + n;
+    }
+
+
+    // ------------------------------------------------------------------------------------------
+    // Segment kernels: wf[i] = sat_u16(wf[i] - sat_s16(cell[i] + nsample[i])) for i < n.
+    // The SIMD versions subtract the positive part of the correction and add the negative one
+    // with unsigned saturation, which gives the same result as the scalar code for every input.
+    // ------------------------------------------------------------------------------------------
+
+    static void CorrectSegmentScalar(uint16_t *wf, const int16_t *cell, const int16_t *nsample, unsigned int n) {
+        for(unsigned int i=0; i<n; i++) {
+            int c = SaturateInt16(int(cell[i]) + int(nsample[i]));
+            int v = int(wf[i]) - c;
+            wf[i] = (uint16_t)std::min(std::max(v, 0), 65535);
+        }
+    }
+    static void SubtractScalar(uint16_t *wf, const int16_t *correction, unsigned int n) {
+        for(unsigned int i=0; i<n; i++) {
+            int v = int(wf[i]) - int(correction[i]);
+            wf[i] = (uint16_t)std::min(std::max(v, 0), 65535);
+        }
+    }
+
+#if defined(__x86_64__) || defined(__i386__)
+    __attribute__((target("sse4.2")))
+    static void CorrectSegmentSSE42(uint16_t *wf, const int16_t *cell, const int16_t *nsample, unsigned int n) {
+        const __m128i zero = _mm_setzero_si128();
+        unsigned int i = 0;
+        for(; i+8<=n; i+=8) {
+            __m128i c   = _mm_adds_epi16(_mm_loadu_si128((const __m128i *)(cell+i)),
+                                         _mm_loadu_si128((const __m128i *)(nsample+i)));
+            __m128i pos = _mm_max_epi16(c, zero);
+            __m128i neg = _mm_sub_epi16(zero, _mm_min_epi16(c, zero));
+            __m128i w   = _mm_loadu_si128((const __m128i *)(wf+i));
+            w = _mm_adds_epu16(_mm_subs_epu16(w, pos), neg);
+            _mm_storeu_si128((__m128i *)(wf+i), w);
+        }
+        CorrectSegmentScalar(wf+i, cell+i, nsample+i, n-i);
+    }
+    __attribute__((target("sse4.2")))
+    static void SubtractSSE42(uint16_t *wf, const int16_t *correction, unsigned int n) {
+        const __m128i zero = _mm_setzero_si128();
+        unsigned int i = 0;
+        for(; i+8<=n; i+=8) {
+            __m128i c   = _mm_loadu_si128((const __m128i *)(correction+i));
+            __m128i pos = _mm_max_epi16(c, zero);
+            __m128i neg = _mm_sub_epi16(zero, _mm_min_epi16(c, zero));
+            __m128i w   = _mm_loadu_si128((const __m128i *)(wf+i));
+            w = _mm_adds_epu16(_mm_subs_epu16(w, pos), neg);
+            _mm_storeu_si128((__m128i *)(wf+i), w);
+        }
+        SubtractScalar(wf+i, correction+i, n-i);
+    }
+
+    __attribute__((target("avx2")))
+    static void CorrectSegmentAVX2(uint16_t *wf, const int16_t *cell, const int16_t *nsample, unsigned int n) {
+        const __m256i zero = _mm256_setzero_si256();
+        unsigned int i = 0;
+        for(; i+16<=n; i+=16) {
+            __m256i c   = _mm256_adds_epi16(_mm256_loadu_si256((const __m256i *)(cell+i)),
+                                            _mm256_loadu_si256((const __m256i *)(nsample+i)));
+            __m256i pos = _mm256_max_epi16(c, zero);
+            __m256i neg = _mm256_sub_epi16(zero, _mm256_min_epi16(c, zero));
+            __m256i w   = _mm256_loadu_si256((const __m256i *)(wf+i));
+            w = _mm256_adds_epu16(_mm256_subs_epu16(w, pos), neg);
+            _mm256_storeu_si256((__m256i *)(wf+i), w);
+        }
+        CorrectSegmentSSE42(wf+i, cell+i, nsample+i, n-i);
+    }
+    __attribute__((target("avx2")))
+    static void SubtractAVX2(uint16_t *wf, const int16_t *correction, unsigned int n) {
+        const __m256i zero = _mm256_setzero_si256();
+        unsigned int i = 0;
+        for(; i+16<=n; i+=16) {
+            __m256i c   = _mm256_loadu_si256((const __m256i *)(correction+i));
+            __m256i pos = _mm256_max_epi16(c, zero);
+            __m256i neg = _mm256_sub_epi16(zero, _mm256_min_epi16(c, zero));
+            __m256i w   = _mm256_loadu_si256((const __m256i *)(wf+i));
+            w = _mm256_adds_epu16(_mm256_subs_epu16(w, pos), neg);
+            _mm256_storeu_si256((__m256i *)(wf+i), w);
+        }
+        SubtractSSE42(wf+i, correction+i, n-i);
+    }
+
+    __attribute__((target("avx512f,avx512bw")))
+    static void CorrectSegmentAVX512(uint16_t *wf, const int16_t *cell, const int16_t *nsample, unsigned int n) {
+        const __m512i zero = _mm512_setzero_si512();
+        unsigned int i = 0;
+        for(; i+32<=n; i+=32) {
+            __m512i c   = _mm512_adds_epi16(_mm512_loadu_si512((const void *)(cell+i)),
+                                            _mm512_loadu_si512((const void *)(nsample+i)));
+            __m512i pos = _mm512_max_epi16(c, zero);
+            __m512i neg = _mm512_sub_epi16(zero, _mm512_min_epi16(c, zero));
+            __m512i w   = _mm512_loadu_si512((const void *)(wf+i));
+            w = _mm512_adds_epu16(_mm512_subs_epu16(w, pos), neg);
+            _mm512_storeu_si512((void *)(wf+i), w);
+        }
+        CorrectSegmentAVX2(wf+i, cell+i, nsample+i, n-i);
+    }
+    __attribute__((target("avx512f,avx512bw")))
+    static void SubtractAVX512(uint16_t *wf, const int16_t *correction, unsigned int n) {
+        const __m512i zero = _mm512_setzero_si512();
+        unsigned int i = 0;
+        for(; i+32<=n; i+=32) {
+            __m512i c   = _mm512_loadu_si512((const void *)(correction+i));
+            __m512i pos = _mm512_max_epi16(c, zero);
+            __m512i neg = _mm512_sub_epi16(zero, _mm512_min_epi16(c, zero));
+            __m512i w   = _mm512_loadu_si512((const void *)(wf+i));
+            w = _mm512_adds_epu16(_mm512_subs_epu16(w, pos), neg);
+            _mm512_storeu_si512((void *)(wf+i), w);
+        }
+        SubtractAVX2(wf+i, correction+i, n-i);
+    }
+#endif
+
+    typedef void (*CorrectSegmentFunc)(uint16_t *, const int16_t *, const int16_t *, unsigned int);
+
+    static CorrectSegmentFunc GetCorrectSegment(SimdLevel level) {
+#if defined(__x86_64__) || defined(__i386__)
+        switch(level) {
+            case SimdLevel::AVX512: return CorrectSegmentAVX512;
+            case SimdLevel::AVX2:   return CorrectSegmentAVX2;
+            case SimdLevel::SSE42:  return CorrectSegmentSSE42;
+            default: break;
+        }
+#endif
+        (void)level;
+        return CorrectSegmentScalar;
+    }
+
+    static void DRS4CorrectChannelWith(CorrectSegmentFunc segment, uint16_t *wf, const int16_t *cell,
+                                       const int16_t *nsample, unsigned int ncells, unsigned int SIC) {
+        if(ncells==0) return;
+        unsigned int first = ncells - SIC%ncells;
+        // samples [0, first) use the cells [SIC, ncells), samples [first, ncells) the cells [0, SIC)
+        segment(wf,       cell+ncells-first, nsample,       first);
+        segment(wf+first, cell,              nsample+first, ncells-first);
+    }
+
+    void DRS4CorrectChannel(uint16_t *wf, const int16_t *cell, const int16_t *nsample,
+                            unsigned int ncells, unsigned int SIC) {
+        DRS4CorrectChannelWith(GetCorrectSegment(GetSimdLevel()), wf, cell, nsample, ncells, SIC);
+    }
+    void DRS4CorrectChannelScalar(uint16_t *wf, const int16_t *cell, const int16_t *nsample,
+                                  unsigned int ncells, unsigned int SIC) {
+        DRS4CorrectChannelWith(CorrectSegmentScalar, wf, cell, nsample, ncells, SIC);
+    }
+    void DRS4SubtractCorrection(uint16_t *wf, const int16_t *correction, unsigned int n) {
+#if defined(__x86_64__) || defined(__i386__)
+        switch(GetSimdLevel()) {
+            case SimdLevel::AVX512: SubtractAVX512(wf, correction, n); return;
+            case SimdLevel::AVX2:   SubtractAVX2(wf, correction, n);   return;
+            case SimdLevel::SSE42:  SubtractSSE42(wf, correction, n);  return;
+            default: break;
+        }
+#endif
+        SubtractScalar(wf, correction, n);
+    }
+
+
+    void DRS4Calibration::SetMode(DRS4Mode mode) {
+        fMode = mode;
+        if(mode==DRS4Mode::Rotate) {
+            AlignedVector<int16_t>().swap(fLUT);
+            return;
+        }
+        std::size_t n = fNCells;
+        fLUT.assign(std::size_t(fNChannels)*n*n, 0);
+        for(unsigned int ch=0; ch<fNChannels; ch++) {
+            // read only: the tables stay aliased (mapped, embedded or cached), see Detach()
+            const int16_t *cell    = fCell + ch*n;
+            const int16_t *nsample = fNSample + ch*n;
+            for(std::size_t sic=0; sic<n; sic++) {
+                int16_t *row = fLUT.data() + (ch*n + sic)*n;
+                for(std::size_t samp=0; samp<n; samp++) {
+                    std::size_t sic_index = samp+sic < n ? samp+sic : samp+sic-n;
+                    row[samp] = SaturateInt16(int(cell[sic_index]) + int(nsample[samp]));
+                }
+            }
+        }
+    }
+    void DRS4Calibration::Correct(uint16_t *wf, unsigned int ch, unsigned int SIC) const {
+        if(fMode==DRS4Mode::LUT) {
+            DRS4SubtractCorrection(wf, GetCombined(ch, SIC).data(), fNCells);
+        } else {
+            DRS4CorrectChannel(wf, GetCell(ch).data(), GetNSample(ch).data(), fNCells, SIC);
+        }
+    }
+
+
+    void DRS4PeakCorrectionScalar(EventView<uint16_t> wfs) {
+        unsigned int NS = 1024; //hardcoded!!! Valid only for V1742
+        unsigned int Nch = 8;
+        std::vector<double> avgs(Nch, 0.0);
+        for(unsigned int ch=0; ch<Nch; ch++){
+            avgs[ch] = std::accumulate(wfs[ch].begin(), wfs[ch].end(), 0.0) / NS; // averages of each channel 
+        }
+        for(unsigned int i =1; i<NS; i++) {
+            int offset      = 0;
+            int offset_plus = 0;
+            
+            for(unsigned int ch=0; ch<Nch; ch++){
+                if(i ==1) {                          
+                    if ((wfs[ch][2] - wfs[ch][1])>30) {
+                        offset += 1;
+                    } else {
+                        if ((wfs[ch][3]-wfs[ch][1])>30 && (wfs[ch][3]-wfs[ch][2])>30) {
+                            offset += 1;
+                        }
+                    }
+                } else {
+                    if (i == (NS-1) && (wfs[ch][NS-2] - wfs[ch][NS-1])>30) {
+                        offset+=1;
+                    } else {
+                        if ((wfs[ch][i-1]-wfs[ch][i])>30) {
+                            if ((wfs[ch][i+1] - wfs[ch][i])>30) {
+                                offset += 1;
+                            } else if ((i+2)<NS-2) {
+                                if ((wfs[ch][i+2] - wfs[ch][i])>30 && (wfs[ch][i+1] - wfs[ch][i])<5) {
+                                    offset += 1;
+                                }
+                            } else {
+                                if (i == (NS-2) || (wfs[ch][i+2]-wfs[ch][i])>30) {
+                                    offset += 1;
+                                }
+                            }
+                        }
+                    }
+                }
+                
+                if ((i < (NS-6))                  &&
+                    (avgs[ch] - wfs[ch][i])  <-30 &&
+                    (avgs[ch] - wfs[ch][i+1])<-30 &&
+                    (avgs[ch] - wfs[ch][i+2])<-30 &&
+                    (avgs[ch] - wfs[ch][i+3])<-30 &&
+                    (avgs[ch] - wfs[ch][i+4])<-30 &&
+                    (avgs[ch] - wfs[ch][i+5])<-30 ) {
+                    
+                    offset_plus += 1;
+                }
+            }
+            
+            
+            if (offset >= 7) { // 7 instead of 8 !!!!
+                
+                for(unsigned int ch=0; ch<Nch; ch++){
+                    if (i ==1) {
+                        if ((wfs[ch][2] - wfs[ch][1])>30){
+                            wfs[ch][0] = wfs[ch][2];
+                            wfs[ch][1] = wfs[ch][2];
+                        } else {
+                            wfs[ch][0] = wfs[ch][3];
+                            wfs[ch][1] = wfs[ch][3];
+                            wfs[ch][2] = wfs[ch][3];
+                        }
+                    } else {
+                        if (i == (NS-1)) {
+                            wfs[ch][NS-1] = wfs[ch][NS-2];
+                        } else {
+                            if ((wfs[ch][i+1]-wfs[ch][i])>30) {
+                                if ((wfs[ch][i+1] - wfs[ch][i])>30) {
+                                    wfs[ch][i]   =  int((wfs[ch][i+1]+ wfs[ch][i-1])/2);
+                                } else if ((i+2)<NS-2) {
+                                    if ((wfs[ch][i+2] - wfs[ch][i])>30 && (wfs[ch][i+1] - wfs[ch][i])<5){
+                                        wfs[ch][i]   =  int((wfs[ch][i+2]+ wfs[ch][i-1])/2);
+                                        wfs[ch][i+1] =  int((wfs[ch][i+2]+ wfs[ch][i-1])/2);
+                                    }
+                                }
+                            } else {
+                                if (i == (NS-2)){
+                                    wfs[ch][NS-2] = wfs[ch][NS-3];
+                                    wfs[ch][NS-2] = wfs[ch][NS-1-3];                 
+                                } else {
+                                    wfs[ch][i]   = int((wfs[ch][i+2]+wfs[ch][i-1])/2);
+                                    wfs[ch][i+1] = int((wfs[ch][i+2]+wfs[ch][i-1])/2);
+                                }
+                            }
+                        }
+                    }
+                }
+            }
+            
+            
+            if (offset_plus>=7) {  // 7 instead of 8 !!!!
+                for(unsigned int ch=0; ch<Nch; ch++){
+                    for(unsigned int m=0; m<6; m++){
+                        wfs[ch][i+m] = avgs[ch];
+                    }
+                }
+            }
+        }
+    }  
+    // ------------------------------------------------------------------------------------------
+    // PeakCorrection. The vectorized version puts the 8 channels in the 32-bit lanes of an AVX2
+    // register, sample by sample, so the per-channel votes become lane masks and the vote counts
+    // popcounts. The samples are processed in order, as in the scalar code, because a correction
+    // at sample i changes the inputs of the following samples.
+    //
+    // The comparisons with the channel averages are done in integer arithmetic: the average is
+    // sum/1024, which is exact in double, so (avg - w) < -30 <=> 1024*w - sum > 30*1024, and the
+    // value written back, uint16_t(avg), is sum>>10.
+    // ------------------------------------------------------------------------------------------
+
+#if defined(__x86_64__) || defined(__i386__)
+    __attribute__((target("avx2")))
+    static void Transpose8x8Epi16(const __m128i in[8], __m128i out[8]) {
+        __m128i t0 = _mm_unpacklo_epi16(in[0], in[1]);
+        __m128i t1 = _mm_unpackhi_epi16(in[0], in[1]);
+        __m128i t2 = _mm_unpacklo_epi16(in[2], in[3]);
+        __m128i t3 = _mm_unpackhi_epi16(in[2], in[3]);
+        __m128i t4 = _mm_unpacklo_epi16(in[4], in[5]);
+        __m128i t5 = _mm_unpackhi_epi16(in[4], in[5]);
+        __m128i t6 = _mm_unpacklo_epi16(in[6], in[7]);
+        __m128i t7 = _mm_unpackhi_epi16(in[6], in[7]);
+        __m128i u0 = _mm_unpacklo_epi32(t0, t2);
+        __m128i u1 = _mm_unpackhi_epi32(t0, t2);
+        __m128i u2 = _mm_unpacklo_epi32(t1, t3);
+        __m128i u3 = _mm_unpackhi_epi32(t1, t3);
+        __m128i u4 = _mm_unpacklo_epi32(t4, t6);
+        __m128i u5 = _mm_unpackhi_epi32(t4, t6);
+        __m128i u6 = _mm_unpacklo_epi32(t5, t7);
+        __m128i u7 = _mm_unpackhi_epi32(t5, t7);
+        out[0] = _mm_unpacklo_epi64(u0, u4);
+        out[1] = _mm_unpackhi_epi64(u0, u4);
+        out[2] = _mm_unpacklo_epi64(u1, u5);
+        out[3] = _mm_unpackhi_epi64(u1, u5);
+        out[4] = _mm_unpacklo_epi64(u2, u6);
+        out[5] = _mm_unpackhi_epi64(u2, u6);
+        out[6] = _mm_unpacklo_epi64(u3, u7);
+        out[7] = _mm_unpackhi_epi64(u3, u7);
+    }
+
+    __attribute__((target("avx2")))
+    static inline __m256i PeakLoad(const __m128i *T, int i) {
+        return _mm256_cvtepu16_epi32(T[i]);
+    }
+    __attribute__((target("avx2")))
+    static inline void PeakStore(__m128i *T, int i, __m256i v) {
+        T[i] = _mm_packus_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+    }
+    __attribute__((target("avx2")))
+    static inline __m256i PeakGt30(__m256i x) {
+        return _mm256_cmpgt_epi32(x, _mm256_set1_epi32(30));
+    }
+    __attribute__((target("avx2")))
+    static inline int PeakVotes(__m256i mask) {
+        return __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(mask)));
+    }
+    __attribute__((target("avx2")))
+    static inline uint8_t PeakAbove(const __m128i *T, int i, __m256i sum) {
+        __m256i x = _mm256_sub_epi32(_mm256_slli_epi32(PeakLoad(T, i), 10), sum);
+        return (uint8_t)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(x, _mm256_set1_epi32(30*1024))));
+    }
+
+    __attribute__((target("avx2")))
+    static void DRS4PeakCorrectionAVX2(EventView<uint16_t> wfs) {
+        const int NS = 1024; //hardcoded!!! Valid only for V1742
+        const int Nch = 8;
+
+        // transposed copy of the event: T[i] holds sample i of the 8 channels
+        alignas(64) __m128i T[NS];
+        for(int i=0; i<NS; i+=8) {
+            __m128i in[8];
+            for(int ch=0; ch<Nch; ch++) in[ch] = _mm_loadu_si128((const __m128i *)(wfs[ch].data()+i));
+            Transpose8x8Epi16(in, T+i);
+        }
+
+        alignas(32) int32_t sums[Nch];
+        for(int ch=0; ch<Nch; ch++) {
+            sums[ch] = std::accumulate(wfs[ch].begin(), wfs[ch].begin()+NS, 0);
+        }
+        const __m256i sum     = _mm256_load_si256((const __m256i *)sums);
+        const __m256i avg     = _mm256_srli_epi32(sum, 10);
+        const __m256i c4      = _mm256_set1_epi32(4);  // x < 5 <=> !(x > 4)
+
+        // above[i]: lanes where the sample i is more than 30 counts above the channel average
+        uint8_t above[NS];
+        for(int i=0; i<NS; i++) above[i] = PeakAbove(T, i, sum);
+
+        for(int i=1; i<NS; i++) {
+            __m256i vote;
+            if(i==1) {
+                __m256i w1 = PeakLoad(T, 1), w2 = PeakLoad(T, 2), w3 = PeakLoad(T, 3);
+                vote = _mm256_or_si256(PeakGt30(_mm256_sub_epi32(w2, w1)),
+                                       _mm256_and_si256(PeakGt30(_mm256_sub_epi32(w3, w1)), PeakGt30(_mm256_sub_epi32(w3, w2))));
+            } else if(i==NS-1) {
+                vote = PeakGt30(_mm256_sub_epi32(PeakLoad(T, NS-2), PeakLoad(T, NS-1)));
+            } else {
+                __m256i a = PeakLoad(T, i-1), b = PeakLoad(T, i), c = PeakLoad(T, i+1);
+                __m256i drop = PeakGt30(_mm256_sub_epi32(a, b));
+                __m256i rise = PeakGt30(_mm256_sub_epi32(c, b));
+                if(i < NS-4) {
+                    __m256i d = PeakLoad(T, i+2);
+                    __m256i flat = _mm256_andnot_si256(_mm256_cmpgt_epi32(_mm256_sub_epi32(c, b), c4),
+                                                       PeakGt30(_mm256_sub_epi32(d, b)));
+                    vote = _mm256_and_si256(drop, _mm256_or_si256(rise, flat));
+                } else if(i < NS-2) {
+                    __m256i d = PeakLoad(T, i+2);
+                    vote = _mm256_and_si256(drop, _mm256_or_si256(rise, PeakGt30(_mm256_sub_epi32(d, b))));
+                } else {
+                    vote = drop;
+                }
+            }
+            int offset = PeakVotes(vote);
+
+            int offset_plus = 0;
+            if(i < NS-6) {
+                offset_plus = __builtin_popcount(above[i] & above[i+1] & above[i+2] &
+                                                 above[i+3] & above[i+4] & above[i+5]);
+            }
+
+            if(offset >= 7) { // 7 instead of 8 !!!!
+                if(i==1) {
+                    __m256i w1 = PeakLoad(T, 1), w2 = PeakLoad(T, 2), w3 = PeakLoad(T, 3);
+                    __m256i v = _mm256_blendv_epi8(w3, w2, PeakGt30(_mm256_sub_epi32(w2, w1)));
+                    for(int k=0; k<3; k++) { PeakStore(T, k, v); above[k] = PeakAbove(T, k, sum); }
+                } else if(i==NS-1) {
+                    PeakStore(T, NS-1, PeakLoad(T, NS-2));
+                    above[NS-1] = PeakAbove(T, NS-1, sum);
+                } else {
+                    __m256i a = PeakLoad(T, i-1), b = PeakLoad(T, i), c = PeakLoad(T, i+1);
+                    __m256i rise = PeakGt30(_mm256_sub_epi32(c, b));
+                    __m256i mid_c = _mm256_srli_epi32(_mm256_add_epi32(c, a), 1);
+                    if(i==NS-2) {
+                        // the scalar code assigns NS-3 and then NS-1-3: the latter wins
+                        PeakStore(T, i, _mm256_blendv_epi8(PeakLoad(T, NS-4), mid_c, rise));
+                        above[i] = PeakAbove(T, i, sum);
+                    } else {
+                        __m256i mid_d = _mm256_srli_epi32(_mm256_add_epi32(PeakLoad(T, i+2), a), 1);
+                        PeakStore(T, i,   _mm256_blendv_epi8(mid_d, mid_c, rise));
+                        PeakStore(T, i+1, _mm256_blendv_epi8(mid_d, c,     rise));
+                        above[i] = PeakAbove(T, i, sum);
+                        above[i+1] = PeakAbove(T, i+1, sum);
+                    }
+                }
+            }
+
+            if(offset_plus >= 7) { // 7 instead of 8 !!!!
+                for(int m=0; m<6; m++) { PeakStore(T, i+m, avg); above[i+m] = PeakAbove(T, i+m, sum); }
+            }
+        }
+
+        for(int i=0; i<NS; i+=8) {
+            __m128i out[8];
+            Transpose8x8Epi16(T+i, out);
+            for(int ch=0; ch<Nch; ch++) _mm_storeu_si128((__m128i *)(wfs[ch].data()+i), out[ch]);
+        }
+    }
+#endif
+
+    void DRS4PeakCorrection(EventView<uint16_t> wfs) {
+#if defined(__x86_64__) || defined(__i386__)
+        if(GetSimdLevel() >= SimdLevel::AVX2 && wfs.GetNChannels() >= 8 && wfs.GetNSamples() == 1024) {
+            DRS4PeakCorrectionAVX2(wfs);
+            return;
+        }
+#endif
+        DRS4PeakCorrectionScalar(wfs);
+    }
+
+
+    // ------------------------------------------------------------------------------------------
+    // Calibration files
+    // ------------------------------------------------------------------------------------------
+
+    static std::vector<std::vector<int>> ReadDRS4TextTable(const std::string &filename) {
+        std::ifstream inFile(filename);
+        if(!inFile) {
+            throw std::runtime_error("cygnolib::LoadDRS4CalibrationText: cannot open "+filename+".");
+        }
+        std::vector<std::vector<int>> table;
+        std::string line;
+        while(std::getline(inFile, line)) {
+            std::vector<int> row;
+            const char *p = line.c_str();
+            char *end = nullptr;
+            for(long x = std::strtol(p, &end, 10); end!=p; x = std::strtol(p, &end, 10)) {
+                row.push_back((int)x);
+                p = end;
+            }
+            if(!row.empty()) table.push_back(std::move(row));
+        }
+        return table;
+    }
+
+    DRS4Calibration LoadDRS4CalibrationText(std::string table_cell_filename,
+                                            std::string table_nsample_filename,
+                                            std::string tag) {
+        DRS4Calibration calib(ReadDRS4TextTable(table_cell_filename), ReadDRS4TextTable(table_nsample_filename));
+        calib.SetTag(tag);
+        return calib;
+    }
+
+    namespace {
+        struct DRS4FileHeader {
+            char     magic[8];
+            uint32_t version;
+            uint32_t nchannels;
+            uint32_t ncells;
+            uint32_t checksum;
+            char     tag[16];
+            uint8_t  reserved[24];
+        };
+        static_assert(sizeof(DRS4FileHeader) == 64, "DRS4FileHeader must be 64 bytes");
+
+        const char     kDRS4Magic[8]  = {'C', 'Y', 'D', 'R', 'S', '4', 0, 0};
+        const uint32_t kDRS4Version   = 1;
+
+        std::size_t DRS4TableBytes(std::size_t nchannels, std::size_t ncells) {
+            return (nchannels*ncells*sizeof(int16_t) + 63) / 64 * 64;
+        }
+    }
+
+    void WriteDRS4CalibrationBinary(const DRS4Calibration &calib, std::string filename) {
+        std::size_t n = std::size_t(calib.GetNChannels())*calib.GetNCells();
+        std::size_t table_bytes = DRS4TableBytes(calib.GetNChannels(), calib.GetNCells());
+        
+        std::vector<char> payload(2*table_bytes, 0);
+        if(n>0) {
+            std::copy((const char *)calib.GetCell(0).data(),    (const char *)(calib.GetCell(0).data()+n),    payload.begin());
+            std::copy((const char *)calib.GetNSample(0).data(), (const char *)(calib.GetNSample(0).data()+n), payload.begin()+table_bytes);
+        }
+        
+        DRS4FileHeader header;
+        std::memset(&header, 0, sizeof(header));
+        std::memcpy(header.magic, kDRS4Magic, sizeof(header.magic));
+        header.version   = kDRS4Version;
+        header.nchannels = calib.GetNChannels();
+        header.ncells    = calib.GetNCells();
+        header.checksum  = crc32(0L, (const Bytef *)payload.data(), payload.size());
+        std::strncpy(header.tag, calib.GetTag().c_str(), sizeof(header.tag)-1);
+        
+        // written aside and renamed: a file mapped by LoadDRS4CalibrationBinary() is never rewritten in place
+        std::string tmpfilename = filename+".tmp";
+        {
+            std::ofstream outFile(tmpfilename, std::ios::binary | std::ios::trunc);
+            outFile.write((const char *)&header, sizeof(header));
+            outFile.write(payload.data(), payload.size());
+            if(!outFile) {
+                throw std::runtime_error("cygnolib::WriteDRS4CalibrationBinary: cannot write "+tmpfilename+".");
+            }
+        }
+        std::filesystem::rename(tmpfilename, filename);
+    }
+
+    DRS4Calibration LoadDRS4CalibrationBinary(std::string filename) {
+        int fd = open(filename.c_str(), O_RDONLY);
+        if(fd<0) {
+            throw std::runtime_error("cygnolib::LoadDRS4CalibrationBinary: cannot open "+filename+".");
+        }
+        struct stat st;
+        if(fstat(fd, &st)!=0 || st.st_size < (off_t)sizeof(DRS4FileHeader)) {
+            close(fd);
+            throw std::runtime_error("cygnolib::LoadDRS4CalibrationBinary: "+filename+" is too short.");
+        }
+        std::size_t size = st.st_size;
+        void *map = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if(map==MAP_FAILED) {
+            throw std::runtime_error("cygnolib::LoadDRS4CalibrationBinary: cannot map "+filename+".");
+        }
+        std::shared_ptr<const void> mapping(map, [size](const void *p) { munmap(const_cast<void *>(p), size); });
+        
+        const DRS4FileHeader *header = (const DRS4FileHeader *)map;
+        if(std::memcmp(header->magic, kDRS4Magic, sizeof(kDRS4Magic))!=0) {
+            throw std::runtime_error("cygnolib::LoadDRS4CalibrationBinary: "+filename+" is not a DRS4 calibration file.");
+        }
+        if(header->version!=kDRS4Version) {
+            throw std::runtime_error("cygnolib::LoadDRS4CalibrationBinary: unsupported version "+
+                                     std::to_string(header->version)+" in "+filename+".");
+        }
+        std::size_t table_bytes = DRS4TableBytes(header->nchannels, header->ncells);
+        if(size < sizeof(DRS4FileHeader) + 2*table_bytes) {
+            throw std::runtime_error("cygnolib::LoadDRS4CalibrationBinary: "+filename+" is truncated.");
+        }
+        const char *payload = (const char *)map + sizeof(DRS4FileHeader);
+        if(crc32(0L, (const Bytef *)payload, 2*table_bytes)!=header->checksum) {
+            throw std::runtime_error("cygnolib::LoadDRS4CalibrationBinary: checksum mismatch in "+filename+".");
+        }
+        
+        DRS4Calibration calib(header->nchannels, header->ncells,
+                              (const int16_t *)payload, (const int16_t *)(payload + table_bytes),
+                              std::move(mapping));
+        calib.SetTag(std::string(header->tag, strnlen(header->tag, sizeof(header->tag))));
+        return calib;
+    }
+
+    DRS4Calibration LoadDRS4Calibration(std::string dirname, std::string tag) {
+        std::string binary_filename(dirname+"/table_"+tag+".bin");
+        if(std::filesystem::exists(binary_filename)) {
+            DRS4Calibration calib = LoadDRS4CalibrationBinary(binary_filename);
+            if(calib.GetTag()!=tag) {
+                throw std::runtime_error("cygnolib::LoadDRS4Calibration: "+binary_filename+" has tag "+calib.GetTag()+".");
+            }
+            return calib;
+        }
+        return LoadDRS4CalibrationText(dirname+"/table_cell_"   +tag+".txt",
+                                       dirname+"/table_nsample_"+tag+".txt",
+                                       tag);
+    }
+
+    bool HasEmbeddedDRS4Calibration([[maybe_unused]] std::string tag) {
+#ifdef RECOPP_EMBED_CALIBRATION
+        for(const embedded::DRS4Table &table : embedded::kDRS4Tables) {
+            if(tag==table.tag) return true;
+        }
+#endif
+        return false;
+    }
+
+    DRS4Calibration GetEmbeddedDRS4Calibration([[maybe_unused]] std::string tag) {
+#ifdef RECOPP_EMBED_CALIBRATION
+        for(const embedded::DRS4Table &table : embedded::kDRS4Tables) {
+            if(tag==table.tag) {
+                DRS4Calibration calib(table.nchannels, table.ncells, table.cell, table.nsample, nullptr);
+                calib.SetTag(tag);
+                return calib;
+            }
+        }
+        throw std::runtime_error("cygnolib::GetEmbeddedDRS4Calibration: no tables embedded for tag "+tag+".");
+#else
+        throw std::runtime_error("cygnolib::GetEmbeddedDRS4Calibration: built without RECOPP_EMBED_CALIBRATION.");
+#endif
+    }
+
+    DRS4Calibration GetDRS4Calibration(std::string tag, std::string calibdir) {
+        static std::mutex mutex;
+        static std::map<std::pair<std::string, std::string>, std::shared_ptr<const DRS4Calibration>> cache;
+
+        std::shared_ptr<const DRS4Calibration> cached;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            std::shared_ptr<const DRS4Calibration> &entry = cache[std::make_pair(tag, calibdir)];
+            if(!entry) {
+                if(!calibdir.empty()) {
+                    entry = std::make_shared<const DRS4Calibration>(LoadDRS4Calibration(calibdir, tag));
+                } else if(HasEmbeddedDRS4Calibration(tag)) {
+                    entry = std::make_shared<const DRS4Calibration>(GetEmbeddedDRS4Calibration(tag));
+                } else {
+                    const char *recoppsys = getenv("RECOPPSYS");
+                    if(!recoppsys) {
+                        throw std::runtime_error("cygnolib::GetDRS4Calibration: RECOPPSYS is not set and no tables are embedded.");
+                    }
+                    entry = std::make_shared<const DRS4Calibration>(LoadDRS4Calibration(std::string(recoppsys)+"/input", tag));
+                }
+            }
+            cached = entry;
+        }
+
+        DRS4Calibration calib(cached->GetNChannels(), cached->GetNCells(),
+                              cached->GetCell(0).data(), cached->GetNSample(0).data(), cached);
+        calib.SetTag(cached->GetTag());
+        return calib;
+    }
+
+}
@@ -0,0 +1,245 @@
+/*
+ * Copyright (C) 2024 CYGNO Collaboration
+ *
+ *
+ * Author: Stefano Piacentini
+ * Created in 2024
+ *
+ */
+
+#include "iddbscan.h"
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <limits>
+#include <numeric>
+#include <stdexcept>
+
+
+namespace cygnolib {
+
+    IDDBSCAN::IDDBSCAN(const IDDBSCANParameters &parameters, unsigned int nthreads):
+        fParameters(parameters), fCosMaxAngle(std::cos(parameters.max_angle)),
+        fPool(MakeWorkerPool(nthreads)), fSeeding(parameters.eps, parameters.minpts, fPool) {
+        if(!(parameters.search_length>0) || !(parameters.search_width>0)) {
+            throw std::invalid_argument("cygnolib::IDDBSCAN::IDDBSCAN: the search region must have a positive length and width.");
+        }
+    }
+
+    void IDDBSCAN::ForEachCluster(std::size_t nclusters, const std::function<void(std::size_t)> &fn) {
+        if(fPool) {
+            fPool->ParallelFor(nclusters, fn);
+            return;
+        }
+        for(std::size_t k=0; k<nclusters; k++) fn(k);
+    }
+
+    IDDBSCAN::Axis IDDBSCAN::FitAxis(const Moments &m) {
+        Axis axis;
+        if(m.n==0) return axis;
+        axis.row    = m.row/m.n;
+        axis.column = m.column/m.n;
+        double vrr = std::max(m.row2/m.n - axis.row*axis.row, 0.);
+        double vcc = std::max(m.column2/m.n - axis.column*axis.column, 0.);
+        double vrc = m.rowcolumn/m.n - axis.row*axis.column;
+
+        // eigenvalues and main eigenvector of the covariance matrix
+        double half  = 0.5*(vrr + vcc);
+        double delta = std::sqrt(0.25*(vrr - vcc)*(vrr - vcc) + vrc*vrc);
+        axis.l1 = half + delta;
+        axis.l2 = std::max(half - delta, 0.);
+        double theta = 0.5*std::atan2(2*vrc, vrr - vcc);
+        axis.urow    = std::cos(theta);
+        axis.ucolumn = std::sin(theta);
+        return axis;
+    }
+
+    uint32_t IDDBSCAN::Find(uint32_t x) {
+        while(fParent[x]!=x) {
+            fParent[x] = fParent[fParent[x]];
+            x = fParent[x];
+        }
+        return x;
+    }
+
+    void IDDBSCAN::Merge(uint32_t a, uint32_t b) {
+        a = Find(a);
+        b = Find(b);
+        if(a==b) return;
+        // the root is the cluster coming first in row-major order
+        if(b<a) std::swap(a, b);
+        fParent[b] = a;
+        fMoments[a].Add(fMoments[b]);
+        // the order of the hits does not matter, the shorter list is appended to the longer one
+        if(fMembers[a].size()<fMembers[b].size()) fMembers[a].swap(fMembers[b]);
+        fMembers[a].insert(fMembers[a].end(), fMembers[b].begin(), fMembers[b].end());
+        fMembers[b].clear();
+    }
+
+    void IDDBSCAN::Search(std::size_t k, Span<const int32_t> labels) {
+        const std::vector<uint32_t> &members = fMembers[k];
+        const Axis &axis = fAxes[k];
+        double length = fParameters.search_length;
+        double width  = fParameters.search_width;
+        std::vector<uint32_t> &found_hits     = fFoundHits[k];
+        std::vector<uint32_t> &found_clusters = fFoundClusters[k];
+
+        for(int side : {1, -1}) {
+            double ur = side*axis.urow, uc = side*axis.ucolumn;
+            auto along = [&](uint32_t h) { return (fRows[h] - axis.row)*ur + (fColumns[h] - axis.column)*uc; };
+
+            // the end of the track, the hits within fit_length of its farthest one along the axis
+            double tmax = -std::numeric_limits<double>::infinity();
+            for(uint32_t h : members) tmax = std::max(tmax, along(h));
+            double tmin = tmax - fParameters.fit_length;
+            Moments moments;
+            for(uint32_t h : members) {
+                if(along(h)>=tmin) moments.Add(fRows[h], fColumns[h]);
+            }
+
+            // local direction, pointing out of the track; a round end keeps the direction of the track
+            Axis end = FitAxis(moments);
+            double dr = ur, dc = uc;
+            if(end.l1>end.l2) {
+                double sign = end.urow*ur + end.ucolumn*uc < 0 ? -1 : 1;
+                dr = sign*end.urow;
+                dc = sign*end.ucolumn;
+            }
+            // the search region starts at the last hit along the local direction
+            double amax = -std::numeric_limits<double>::infinity();
+            for(uint32_t h : members) {
+                if(along(h)>=tmin) amax = std::max(amax, (fRows[h] - end.row)*dr + (fColumns[h] - end.column)*dc);
+            }
+            double pr = end.row + amax*dr, pc = end.column + amax*dc;
+
+            // half ellipse beyond the end
+            double qr = pr + length*dr, qc = pc + length*dc;
+            int rmin = int(std::floor(std::min(pr, qr) - width)), rmax = int(std::ceil(std::max(pr, qr) + width));
+            int cmin = int(std::floor(std::min(pc, qc) - width)), cmax = int(std::ceil(std::max(pc, qc) + width));
+            fGrid.ForEachInBox(rmin, rmax, cmin, cmax, [&](uint32_t j, int r, int c) {
+                // the parents are only one step from the roots during the search
+                uint32_t m = labels[j]<0 ? UINT32_MAX : fParent[labels[j]];
+                if(m==k) return;
+                double a = (r - pr)*dr + (c - pc)*dc;
+                double b = (c - pc)*dr - (r - pr)*dc;
+                if(a<0 || (a*a)/(length*length) + (b*b)/(width*width) > 1) return;
+                if(m==UINT32_MAX) {
+                    found_hits.push_back(j);
+                    return;
+                }
+                if(!found_clusters.empty() && found_clusters.back()==m) return;
+                if(fTrack[m]) {
+                    // another track, merged if it goes in the same direction
+                    if(std::abs(dr*fAxes[m].urow + dc*fAxes[m].ucolumn)<fCosMaxAngle) return;
+                }
+                else if(fMoments[m].n>=fParameters.min_track_hits) {
+                    // a large blob, not a fragment of the track
+                    return;
+                }
+                found_clusters.push_back(m);
+            });
+        }
+        std::sort(found_hits.begin(), found_hits.end());
+        found_hits.erase(std::unique(found_hits.begin(), found_hits.end()), found_hits.end());
+        std::sort(found_clusters.begin(), found_clusters.end());
+        found_clusters.erase(std::unique(found_clusters.begin(), found_clusters.end()), found_clusters.end());
+    }
+
+    void IDDBSCAN::Cluster(const HitList &hits, HitClusters &clusters) {
+        fSeeding.Cluster(hits, clusters);
+        fNIterations = 0;
+        std::size_t nclusters = clusters.GetNClusters();
+        if(nclusters==0 || fParameters.max_iterations==0) return;
+
+        fRows    = hits.GetRows();
+        fColumns = hits.GetColumns();
+        // cells of about a quarter of the search region
+        unsigned int cellsize = unsigned(std::ceil(std::max(fParameters.search_width, fParameters.search_length/4)));
+        fGrid.Build(hits, std::max(cellsize, 1u));
+
+        Span<int32_t> labels = clusters.GetLabels();
+        fParent.resize(nclusters);
+        std::iota(fParent.begin(), fParent.end(), 0);
+        fMoments.assign(nclusters, Moments());
+        fMembers.resize(nclusters);
+        ForEachCluster(nclusters, [&](std::size_t k) {
+            Span<const uint32_t> cluster = clusters.GetCluster(k);
+            fMembers[k].assign(cluster.begin(), cluster.end());
+            for(uint32_t h : cluster) fMoments[k].Add(fRows[h], fColumns[h]);
+        });
+        fAxes.resize(nclusters);
+        fTrack.assign(nclusters, 0);
+        fActive.assign(nclusters, 1);
+        if(fFoundHits.size()<nclusters) {
+            fFoundHits.resize(nclusters);
+            fFoundClusters.resize(nclusters);
+        }
+
+        double elongation2 = double(fParameters.min_elongation)*fParameters.min_elongation;
+        bool changed = false;
+        while(fNIterations<fParameters.max_iterations) {
+            fNIterations++;
+
+            // directions of the clusters, and which ones are tracks
+            ForEachCluster(nclusters, [&](std::size_t k) {
+                fTrack[k] = 0;
+                if(fParent[k]!=k || fMoments[k].n<fParameters.min_track_hits) return;
+                fAxes[k]  = FitAxis(fMoments[k]);
+                fTrack[k] = fAxes[k].l1>=elongation2*fAxes[k].l2;
+            });
+
+            // search beyond the ends of the tracks that changed, reading only the clusters of the
+            // previous iteration
+            ForEachCluster(nclusters, [&](std::size_t k) {
+                fFoundHits[k].clear();
+                fFoundClusters[k].clear();
+                if(fTrack[k] && fActive[k]) Search(k, labels);
+            });
+
+            // what was found is assigned in the order of the tracks
+            fChanged.assign(nclusters, 0);
+            bool grown = false;
+            for(std::size_t k=0; k<nclusters; k++) {
+                for(uint32_t j : fFoundHits[k]) {
+                    if(labels[j]>=0) continue;
+                    uint32_t root = Find(k);
+                    labels[j] = root;
+                    fMoments[root].Add(fRows[j], fColumns[j]);
+                    fMembers[root].push_back(j);
+                    fChanged[root] = 1;
+                    grown = true;
+                }
+                for(uint32_t m : fFoundClusters[k]) {
+                    if(Find(m)==Find(k)) continue;
+                    // a fragment joins the first track finding it
+                    if(!fTrack[m] && fChanged[m]) continue;
+                    fChanged[m] = 1;
+                    Merge(k, m);
+                    fChanged[Find(k)] = 1;
+                    grown = true;
+                }
+            }
+            if(!grown) break;
+            changed = true;
+
+            // the parents are set to the roots, which come first, and only the grown tracks stay active
+            for(std::size_t k=0; k<nclusters; k++) {
+                fParent[k] = fParent[fParent[k]];
+                fActive[k] = fChanged[k];
+            }
+        }
+        if(!changed) return;
+
+        // clusters are numbered again in row-major order of their first hit
+        fNumber.assign(nclusters, -1);
+        int32_t next = 0;
+        for(std::size_t i=0; i<labels.size(); i++) {
+            if(labels[i]<0) continue;
+            uint32_t root = fParent[labels[i]];
+            if(fNumber[root]<0) fNumber[root] = next++;
+            labels[i] = fNumber[root];
+        }
+        clusters.Index(next);
+    }
+
+}
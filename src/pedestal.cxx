@@ -0,0 +1,371 @@
+/*
+ * Copyright (C) 2024 CYGNO Collaboration
+ *
+ *
+ * Author: Stefano Piacentini
+ * Created in 2024
+ *
+ */
+
+#include "pedestal.h"
+#include "cygnoreader.h"
+#include "cygnosimd.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <optional>
+#include <stdexcept>
+#include <vector>
+#include <zlib.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+
+namespace cygnolib {
+
+    PedestalMap::PedestalMap(unsigned int height, unsigned int width):
+        fNRows(height), fNColumns(width), fStorage(2*std::size_t(height)*width, 0.f),
+        fMean(fStorage.data()), fRMS(fStorage.data() + std::size_t(height)*width) {
+    }
+    PedestalMap::PedestalMap(unsigned int height, unsigned int width, uint64_t nframes,
+                             const float *mean, const float *rms, std::shared_ptr<const void> owner):
+        fNRows(height), fNColumns(width), fNFrames(nframes), fOwner(std::move(owner)), fMean(mean), fRMS(rms) {
+    }
+    PedestalMap::PedestalMap(const PedestalMap &other):
+        fNRows(other.fNRows), fNColumns(other.fNColumns), fNFrames(other.fNFrames),
+        fStorage(other.fStorage), fOwner(other.fOwner), fMean(other.fMean), fRMS(other.fRMS) {
+        if(!fStorage.empty()) {
+            fMean = fStorage.data();
+            fRMS  = fStorage.data() + Size();
+        }
+    }
+    PedestalMap &PedestalMap::operator=(const PedestalMap &other) {
+        if(this!=&other) {
+            PedestalMap tmp(other);
+            *this = std::move(tmp);
+        }
+        return *this;
+    }
+    void PedestalMap::Detach() {
+        if(!IsExternal()) return;
+        std::size_t n = Size();
+        AlignedVector<float> storage(2*n);
+        std::copy(fMean, fMean+n, storage.begin());
+        std::copy(fRMS,  fRMS+n,  storage.begin()+n);
+        fStorage = std::move(storage);
+        fOwner.reset();
+        fMean = fStorage.data();
+        fRMS  = fStorage.data() + n;
+    }
+
+
+    // ------------------------------------------------------------------------------------------
+    // Subtraction kernels: out[i] = round_to_nearest_even(float(in[i]) - mean[i]) for i < n.
+    // The SIMD versions widen the pixels to int32, convert them to float and round with the
+    // default rounding mode of cvtps2dq, which gives the same result as lrintf().
+    // ------------------------------------------------------------------------------------------
+
+    void PedestalSubtractScalar(const uint16_t *in, const float *mean, int32_t *out, std::size_t n) {
+        for(std::size_t i=0; i<n; i++) {
+            out[i] = (int32_t)std::lrintf(float(in[i]) - mean[i]);
+        }
+    }
+
+#if defined(__x86_64__) || defined(__i386__)
+    __attribute__((target("sse4.2")))
+    static void PedestalSubtractSSE42(const uint16_t *in, const float *mean, int32_t *out, std::size_t n) {
+        std::size_t i = 0;
+        for(; i+4<=n; i+=4) {
+            __m128i x = _mm_cvtepu16_epi32(_mm_loadl_epi64((const __m128i *)(in+i)));
+            __m128  d = _mm_sub_ps(_mm_cvtepi32_ps(x), _mm_loadu_ps(mean+i));
+            _mm_storeu_si128((__m128i *)(out+i), _mm_cvtps_epi32(d));
+        }
+        PedestalSubtractScalar(in+i, mean+i, out+i, n-i);
+    }
+
+    __attribute__((target("avx2")))
+    static void PedestalSubtractAVX2(const uint16_t *in, const float *mean, int32_t *out, std::size_t n) {
+        std::size_t i = 0;
+        for(; i+8<=n; i+=8) {
+            __m256i x = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(in+i)));
+            __m256  d = _mm256_sub_ps(_mm256_cvtepi32_ps(x), _mm256_loadu_ps(mean+i));
+            _mm256_storeu_si256((__m256i *)(out+i), _mm256_cvtps_epi32(d));
+        }
+        PedestalSubtractSSE42(in+i, mean+i, out+i, n-i);
+    }
+
+    // GCC 12 warns about the undefined vector passed by the widening and conversion intrinsics
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+    __attribute__((target("avx512f,avx512bw")))
+    static void PedestalSubtractAVX512(const uint16_t *in, const float *mean, int32_t *out, std::size_t n) {
+        std::size_t i = 0;
+        for(; i+16<=n; i+=16) {
+            __m512i x = _mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i *)(in+i)));
+            __m512  d = _mm512_sub_ps(_mm512_cvtepi32_ps(x), _mm512_loadu_ps(mean+i));
+            _mm512_storeu_si512((void *)(out+i), _mm512_cvtps_epi32(d));
+        }
+        PedestalSubtractAVX2(in+i, mean+i, out+i, n-i);
+    }
+#pragma GCC diagnostic pop
+#endif
+
+    void PedestalSubtract(const uint16_t *in, const float *mean, int32_t *out, std::size_t n) {
+#if defined(__x86_64__) || defined(__i386__)
+        switch(GetSimdLevel()) {
+            case SimdLevel::AVX512: PedestalSubtractAVX512(in, mean, out, n); return;
+            case SimdLevel::AVX2:   PedestalSubtractAVX2(in, mean, out, n);   return;
+            case SimdLevel::SSE42:  PedestalSubtractSSE42(in, mean, out, n);  return;
+            default: break;
+        }
+#endif
+        PedestalSubtractScalar(in, mean, out, n);
+    }
+
+    void PedestalMap::Subtract(ImageView<const uint16_t> frame, AlignedVector<int32_t> &out) const {
+        if(frame.GetNRows()!=fNRows || frame.GetNColumns()!=fNColumns) {
+            throw std::invalid_argument("cygnolib::PedestalMap::Subtract: frame is "+std::to_string(frame.GetNRows())+"x"+
+                                        std::to_string(frame.GetNColumns())+", pedestal is "+
+                                        std::to_string(fNRows)+"x"+std::to_string(fNColumns)+".");
+        }
+        out.resize(Size());
+        if(frame.IsContiguous()) {
+            PedestalSubtract(frame.Data(), fMean, out.data(), Size());
+            return;
+        }
+        for(unsigned int r=0; r<fNRows; r++) {
+            std::size_t offset = std::size_t(r)*fNColumns;
+            PedestalSubtract(frame.Row(r).data(), fMean+offset, out.data()+offset, fNColumns);
+        }
+    }
+
+
+    // ------------------------------------------------------------------------------------------
+    // Welford kernels: with x = in[i], delta = x - mean[i],
+    //   mean[i] += delta*invn;  m2[i] += delta*(x - mean[i])
+    // where invn is 1/n and n the number of frames including the new one.
+    // ------------------------------------------------------------------------------------------
+
+    static void WelfordScalar(const uint16_t *in, float *mean, float *m2, float invn, std::size_t n) {
+        for(std::size_t i=0; i<n; i++) {
+            float x     = float(in[i]);
+            float delta = x - mean[i];
+            mean[i] += delta*invn;
+            m2[i]   += delta*(x - mean[i]);
+        }
+    }
+
+#if defined(__x86_64__) || defined(__i386__)
+    __attribute__((target("avx2")))
+    static void WelfordAVX2(const uint16_t *in, float *mean, float *m2, float invn, std::size_t n) {
+        const __m256 vinvn = _mm256_set1_ps(invn);
+        std::size_t i = 0;
+        for(; i+8<=n; i+=8) {
+            __m256 x     = _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(in+i))));
+            __m256 mu    = _mm256_loadu_ps(mean+i);
+            __m256 delta = _mm256_sub_ps(x, mu);
+            mu = _mm256_add_ps(mu, _mm256_mul_ps(delta, vinvn));
+            __m256 s     = _mm256_add_ps(_mm256_loadu_ps(m2+i), _mm256_mul_ps(delta, _mm256_sub_ps(x, mu)));
+            _mm256_storeu_ps(mean+i, mu);
+            _mm256_storeu_ps(m2+i, s);
+        }
+        WelfordScalar(in+i, mean+i, m2+i, invn, n-i);
+    }
+
+    // GCC 12 warns about the undefined vector passed by the widening and conversion intrinsics
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+    __attribute__((target("avx512f,avx512bw")))
+    static void WelfordAVX512(const uint16_t *in, float *mean, float *m2, float invn, std::size_t n) {
+        const __m512 vinvn = _mm512_set1_ps(invn);
+        std::size_t i = 0;
+        for(; i+16<=n; i+=16) {
+            __m512 x     = _mm512_cvtepi32_ps(_mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i *)(in+i))));
+            __m512 mu    = _mm512_loadu_ps(mean+i);
+            __m512 delta = _mm512_sub_ps(x, mu);
+            mu = _mm512_add_ps(mu, _mm512_mul_ps(delta, vinvn));
+            __m512 s     = _mm512_add_ps(_mm512_loadu_ps(m2+i), _mm512_mul_ps(delta, _mm512_sub_ps(x, mu)));
+            _mm512_storeu_ps(mean+i, mu);
+            _mm512_storeu_ps(m2+i, s);
+        }
+        WelfordAVX2(in+i, mean+i, m2+i, invn, n-i);
+    }
+#pragma GCC diagnostic pop
+#endif
+
+    typedef void (*WelfordFunc)(const uint16_t *, float *, float *, float, std::size_t);
+
+    static WelfordFunc GetWelford(SimdLevel level) {
+#if defined(__x86_64__) || defined(__i386__)
+        switch(level) {
+            case SimdLevel::AVX512: return WelfordAVX512;
+            case SimdLevel::AVX2:   return WelfordAVX2;
+            default: break;
+        }
+#endif
+        (void)level;
+        return WelfordScalar;
+    }
+
+    PedestalBuilder::PedestalBuilder(unsigned int height, unsigned int width):
+        fNRows(height), fNColumns(width),
+        fMean(std::size_t(height)*width, 0.f), fM2(std::size_t(height)*width, 0.f) {
+    }
+
+    void PedestalBuilder::Add(ImageView<const uint16_t> frame) {
+        if(frame.GetNRows()!=fNRows || frame.GetNColumns()!=fNColumns) {
+            throw std::invalid_argument("cygnolib::PedestalBuilder::Add: frame is "+std::to_string(frame.GetNRows())+"x"+
+                                        std::to_string(frame.GetNColumns())+", pedestal is "+
+                                        std::to_string(fNRows)+"x"+std::to_string(fNColumns)+".");
+        }
+        fNFrames++;
+        float invn = float(1.0/double(fNFrames));
+        WelfordFunc welford = GetWelford(GetSimdLevel());
+        if(frame.IsContiguous()) {
+            welford(frame.Data(), fMean.data(), fM2.data(), invn, fMean.size());
+            return;
+        }
+        for(unsigned int r=0; r<fNRows; r++) {
+            std::size_t offset = std::size_t(r)*fNColumns;
+            welford(frame.Row(r).data(), fMean.data()+offset, fM2.data()+offset, invn, fNColumns);
+        }
+    }
+
+    PedestalMap PedestalBuilder::GetMap() const {
+        PedestalMap map(fNRows, fNColumns);
+        map.SetNFrames(fNFrames);
+        if(fNFrames==0) return map;
+
+        Span<float> mean = map.GetMean();
+        Span<float> rms  = map.GetRMS();
+        std::copy(fMean.begin(), fMean.end(), mean.begin());
+        float invn = float(1.0/double(fNFrames));
+        for(std::size_t i=0; i<fM2.size(); i++) rms[i] = std::sqrt(std::max(fM2[i]*invn, 0.f));
+        return map;
+    }
+
+
+    PedestalMap BuildPedestalMap(std::string filename, std::string cam_model, uint64_t maxframes) {
+        std::unique_ptr<TMReaderInterface> reader(OpenMidasFile(filename));
+        TMidasEvent event;
+        AlignedVector<char> buffer;
+        EventBanks banks;
+        std::optional<PedestalBuilder> builder;
+
+        while((maxframes==0 || !builder || builder->GetNFrames()<maxframes) &&
+              ReadMidasEvent(reader.get(), event, buffer)) {
+            banks.Index(event);
+            if(!banks.Has("CAM0")) continue;
+            PictureView pic = daq_cam2picview(banks, cam_model);
+            if(!builder) builder.emplace(pic.GetNRows(), pic.GetNColumns());
+            builder->Add(pic);
+        }
+        reader->Close();
+
+        if(!builder) {
+            throw std::runtime_error("cygnolib::BuildPedestalMap: no camera frame in "+filename+".");
+        }
+        return builder->GetMap();
+    }
+
+
+    namespace {
+        struct PedestalFileHeader {
+            char     magic[8];
+            uint32_t version;
+            uint32_t nrows;
+            uint32_t ncolumns;
+            uint32_t checksum;
+            uint64_t nframes;
+            uint8_t  reserved[32];
+        };
+        static_assert(sizeof(PedestalFileHeader) == 64, "PedestalFileHeader must be 64 bytes");
+
+        const char     kPedestalMagic[8] = {'C', 'Y', 'P', 'E', 'D', 'M', 'A', 'P'};
+        const uint32_t kPedestalVersion  = 1;
+
+        std::size_t PedestalTableBytes(std::size_t nrows, std::size_t ncolumns) {
+            return (nrows*ncolumns*sizeof(float) + 63) / 64 * 64;
+        }
+    }
+
+    void WritePedestalMap(const PedestalMap &map, std::string filename) {
+        std::size_t n = map.Size();
+        std::size_t table_bytes = PedestalTableBytes(map.GetNRows(), map.GetNColumns());
+
+        std::vector<char> payload(2*table_bytes, 0);
+        if(n>0) {
+            std::memcpy(payload.data(),             map.GetMean().data(), n*sizeof(float));
+            std::memcpy(payload.data()+table_bytes, map.GetRMS().data(),  n*sizeof(float));
+        }
+
+        PedestalFileHeader header;
+        std::memset(&header, 0, sizeof(header));
+        std::memcpy(header.magic, kPedestalMagic, sizeof(header.magic));
+        header.version  = kPedestalVersion;
+        header.nrows    = map.GetNRows();
+        header.ncolumns = map.GetNColumns();
+        header.nframes  = map.GetNFrames();
+        header.checksum = crc32(0L, (const Bytef *)payload.data(), payload.size());
+
+        // written aside and renamed: a file mapped by LoadPedestalMap() is never rewritten in place
+        std::string tmpfilename = filename+".tmp";
+        {
+            std::ofstream outFile(tmpfilename, std::ios::binary | std::ios::trunc);
+            outFile.write((const char *)&header, sizeof(header));
+            outFile.write(payload.data(), payload.size());
+            if(!outFile) {
+                throw std::runtime_error("cygnolib::WritePedestalMap: cannot write "+tmpfilename+".");
+            }
+        }
+        std::filesystem::rename(tmpfilename, filename);
+    }
+
+    PedestalMap LoadPedestalMap(std::string filename) {
+        int fd = open(filename.c_str(), O_RDONLY);
+        if(fd<0) {
+            throw std::runtime_error("cygnolib::LoadPedestalMap: cannot open "+filename+".");
+        }
+        struct stat st;
+        if(fstat(fd, &st)!=0 || st.st_size < (off_t)sizeof(PedestalFileHeader)) {
+            close(fd);
+            throw std::runtime_error("cygnolib::LoadPedestalMap: "+filename+" is too short.");
+        }
+        std::size_t size = st.st_size;
+        void *addr = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if(addr==MAP_FAILED) {
+            throw std::runtime_error("cygnolib::LoadPedestalMap: cannot map "+filename+".");
+        }
+        std::shared_ptr<const void> mapping(addr, [size](const void *p) { munmap(const_cast<void *>(p), size); });
+
+        const PedestalFileHeader *header = (const PedestalFileHeader *)addr;
+        if(std::memcmp(header->magic, kPedestalMagic, sizeof(kPedestalMagic))!=0) {
+            throw std::runtime_error("cygnolib::LoadPedestalMap: "+filename+" is not a pedestal file.");
+        }
+        if(header->version!=kPedestalVersion) {
+            throw std::runtime_error("cygnolib::LoadPedestalMap: unsupported version "+
+                                     std::to_string(header->version)+" in "+filename+".");
+        }
+        std::size_t table_bytes = PedestalTableBytes(header->nrows, header->ncolumns);
+        if(size < sizeof(PedestalFileHeader) + 2*table_bytes) {
+            throw std::runtime_error("cygnolib::LoadPedestalMap: "+filename+" is truncated.");
+        }
+        const char *payload = (const char *)addr + sizeof(PedestalFileHeader);
+        if(crc32(0L, (const Bytef *)payload, 2*table_bytes)!=header->checksum) {
+            throw std::runtime_error("cygnolib::LoadPedestalMap: checksum mismatch in "+filename+".");
+        }
+
+        return PedestalMap(header->nrows, header->ncolumns, header->nframes,
+                           (const float *)payload, (const float *)(payload + table_bytes),
+                           std::move(mapping));
+    }
+
+}
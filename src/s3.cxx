@@ -12,10 +12,24 @@
 #include <iomanip>
 #include <filesystem>
 #include <string>
+#include <vector>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <curl/curl.h>
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <limits>
+#include <stdexcept>
+#include <map>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
 
 namespace s3 {
     std::string BUCKET_POSIX_PATH = "/jupyter-workspace/cloud-storage/"; ///< Bucket Posix path on the cloud
@@ -40,27 +54,496 @@ namespace s3 {
     }
     
     
-    static size_t write_data(void *ptr, size_t size, size_t nmemb, void *stream) {
-      size_t written = std::fwrite(ptr, size, nmemb, (FILE *)stream);
-      return written;
+    namespace {
+        constexpr char     kStateMagic[8]    = {'C','Y','S','3','S','E','G','1'};
+        constexpr uint64_t kStateSaveBytes   = 64*1024*1024; ///< data downloaded between two saves of the resume state
+        constexpr unsigned int kSegmentRetries = 3;          ///< attempts to resume a segment within a call
+        constexpr uint64_t kUnknownSize      = std::numeric_limits<uint64_t>::max();
+
+        struct RemoteFile {
+            curl_off_t size = -1;
+            bool ranges = false;
+            std::string etag;
+        };
+
+        // a byte range [begin, end) of the file, of which the first done bytes are on disk
+        struct Segment {
+            uint64_t begin;
+            uint64_t end;
+            uint64_t done;
+        };
+
+        struct Transfer {
+            Segment *segment = nullptr;
+            int fd = -1;
+            uint64_t *unsaved = nullptr;
+            CURL *curl = nullptr;
+            bool range = false;
+            bool checked = false;
+            bool norange = false;
+            unsigned int retries = 0;
+        };
+
+        size_t parse_header(char *buffer, size_t size, size_t nitems, void *userdata) {
+            RemoteFile *remote = (RemoteFile *)userdata;
+            std::string line(buffer, size*nitems);
+            // a new response (e.g. after a redirect) replaces the headers of the previous one
+            if(line.compare(0, 5, "HTTP/")==0) *remote = RemoteFile();
+
+            std::size_t colon = line.find(':');
+            if(colon!=std::string::npos) {
+                std::string name = line.substr(0, colon);
+                std::transform(name.begin(), name.end(), name.begin(), [](unsigned char c) { return std::tolower(c); });
+                std::string value = line.substr(colon+1);
+                value.erase(0, value.find_first_not_of(" \t"));
+                value.erase(value.find_last_not_of(" \t\r\n")+1);
+                if(name=="accept-ranges") remote->ranges = value.find("bytes")!=std::string::npos;
+                else if(name=="etag") remote->etag = value;
+            }
+            return size*nitems;
+        }
+
+        RemoteFile head_file(const std::string &url, bool verbose) {
+            RemoteFile remote;
+            CURL *curl = curl_easy_init();
+            if(!curl) return remote;
+            curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+            if (verbose) curl_easy_setopt(curl, CURLOPT_VERBOSE, 1L);
+            curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
+            curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+            curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
+            // a hanging server must not block every cache hit
+            curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, kHeadConnectSeconds);
+            curl_easy_setopt(curl, CURLOPT_TIMEOUT, kHeadTimeoutSeconds);
+            curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, parse_header);
+            curl_easy_setopt(curl, CURLOPT_HEADERDATA, &remote);
+            CURLcode res = curl_easy_perform(curl);
+            if(res==CURLE_OK) {
+                curl_easy_getinfo(curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &remote.size);
+            } else {
+                // e.g. HEAD not allowed: fall back to a single plain download, which reports the errors
+                if(verbose) std::cout<<"HEAD "<<url<<" failed: "<<curl_easy_strerror(res)<<std::endl;
+                remote = RemoteFile();
+            }
+            curl_easy_cleanup(curl);
+            return remote;
+        }
+
+        // the resume state: size and ETag of the remote file, then the segments
+        bool load_state(const std::string &statename, uint64_t size, const std::string &etag, std::vector<Segment> &segments) {
+            std::ifstream in(statename, std::ios::binary);
+            char magic[sizeof(kStateMagic)];
+            uint64_t fsize = 0, nsegments = 0;
+            uint32_t etaglength = 0;
+            if(!in.read(magic, sizeof(magic)) || std::memcmp(magic, kStateMagic, sizeof(magic))!=0) return false;
+            if(!in.read((char *)&fsize, sizeof(fsize)) || fsize!=size) return false;
+            if(!in.read((char *)&etaglength, sizeof(etaglength)) || etaglength>4096) return false;
+            std::string fetag(etaglength, '\0');
+            if(!in.read(&fetag[0], etaglength) || fetag!=etag) return false;
+            if(!in.read((char *)&nsegments, sizeof(nsegments)) || nsegments==0 || nsegments>size) return false;
+            segments.resize(nsegments);
+            if(!in.read((char *)segments.data(), nsegments*sizeof(Segment))) return false;
+
+            uint64_t next = 0;
+            for(const Segment &segment : segments) {
+                if(segment.begin!=next || segment.end<=segment.begin || segment.done>segment.end-segment.begin) return false;
+                next = segment.end;
+            }
+            return next==size;
+        }
+
+        void save_state(const std::string &statename, uint64_t size, const std::string &etag, const std::vector<Segment> &segments) {
+            std::string tmpname = statename+".tmp";
+            {
+                std::ofstream out(tmpname, std::ios::binary | std::ios::trunc);
+                uint32_t etaglength = etag.size();
+                uint64_t nsegments = segments.size();
+                out.write(kStateMagic, sizeof(kStateMagic));
+                out.write((const char *)&size, sizeof(size));
+                out.write((const char *)&etaglength, sizeof(etaglength));
+                out.write(etag.data(), etaglength);
+                out.write((const char *)&nsegments, sizeof(nsegments));
+                out.write((const char *)segments.data(), nsegments*sizeof(Segment));
+                if(!out) return; // the download goes on, it just cannot be resumed from here
+            }
+            std::rename(tmpname.c_str(), statename.c_str());
+        }
+
+        size_t write_segment(char *ptr, size_t size, size_t nmemb, void *userdata) {
+            Transfer *transfer = (Transfer *)userdata;
+            Segment &segment = *transfer->segment;
+            std::size_t n = size*nmemb;
+
+            if(transfer->range && !transfer->checked) {
+                // a server ignoring the range would send the whole file from the start
+                long code = 0;
+                curl_easy_getinfo(transfer->curl, CURLINFO_RESPONSE_CODE, &code);
+                if(code!=206) {
+                    transfer->norange = true;
+                    return 0;
+                }
+                transfer->checked = true;
+            }
+            if(segment.end!=kUnknownSize && n>segment.end-segment.begin-segment.done) return 0;
+
+            for(std::size_t written = 0; written<n; ) {
+                ssize_t ret = pwrite(transfer->fd, ptr+written, n-written, segment.begin+segment.done+written);
+                if(ret<0 && errno==EINTR) continue;
+                if(ret<=0) return 0;
+                written += ret;
+            }
+            segment.done += n;
+            *transfer->unsaved += n;
+            return n;
+        }
+
+        // the metadata of a cache entry, recorded when it is downloaded
+        struct EntryMeta {
+            uint64_t size = 0;
+            std::string etag;
+        };
+
+        bool read_meta(const std::string &filename, EntryMeta &meta) {
+            std::ifstream in(filename+".meta");
+            if(!(in>>meta.size)) return false;
+            in.ignore(1);
+            std::getline(in, meta.etag);
+            return true;
+        }
+
+        void write_meta(const std::string &filename, const EntryMeta &meta) {
+            std::string tmpname = filename+".meta.tmp";
+            {
+                std::ofstream out(tmpname, std::ios::trunc);
+                out<<meta.size<<"\n"<<meta.etag<<"\n";
+                if(!out) return; // the entry is then validated against the size of the remote file only
+            }
+            std::rename(tmpname.c_str(), (filename+".meta").c_str());
+        }
+
+        // the files of a cache entry: the data (or its .part), the index and the bookkeeping files
+        struct CacheEntry {
+            uint64_t bytes = 0;
+            std::filesystem::file_time_type last_use = std::filesystem::file_time_type::min();
+            std::vector<std::filesystem::path> files;
+        };
+
+        std::map<std::string, CacheEntry> scan_cache(const std::string &path, uint64_t &total) {
+            static const std::vector<std::string> suffixes = {".part.state.tmp", ".part.state", ".part",
+                                                              ".meta.tmp", ".meta", ".idx.tmp", ".idx", ".lock"};
+            std::error_code ec;
+            std::map<std::string, CacheEntry> entries;
+            total = 0;
+            for(const std::filesystem::directory_entry &file : std::filesystem::directory_iterator(path, ec)) {
+                if(!file.is_regular_file(ec)) continue;
+                std::string name = file.path().string();
+                std::string base = name;
+                for(const std::string &suffix : suffixes) {
+                    if(base.size()>suffix.size() && base.compare(base.size()-suffix.size(), suffix.size(), suffix)==0) {
+                        base.erase(base.size()-suffix.size());
+                        break;
+                    }
+                }
+                CacheEntry &entry = entries[base];
+                if(name==base+".lock") continue; // lock files are never removed, see CacheLock
+                uint64_t bytes = file.file_size(ec);
+                if(ec) continue;
+                entry.bytes += bytes;
+                total += bytes;
+                entry.files.push_back(file.path());
+                if(name==base || name==base+".part") entry.last_use = std::max(entry.last_use, file.last_write_time(ec));
+            }
+            return entries;
+        }
+
+        struct CurlGlobal {
+            CurlGlobal() { curl_global_init(CURL_GLOBAL_ALL); }
+            ~CurlGlobal() { curl_global_cleanup(); }
+        };
+
+        // returns false, with nothing left on disk, if the server ignored the range requests
+        bool download(const std::string &url, const std::string &filename, unsigned int nconnections,
+                      const RemoteFile &remote, bool verbose) {
+            bool segmented = remote.ranges && remote.size>0;
+            uint64_t size = remote.size>=0 ? uint64_t(remote.size) : kUnknownSize;
+
+            std::string partname  = filename+".part";
+            std::string statename = filename+".part.state";
+
+            std::vector<Segment> segments;
+            std::error_code ec;
+            bool resume = segmented && load_state(statename, size, remote.etag, segments) &&
+                          std::filesystem::file_size(partname, ec)==size && !ec;
+            if(!resume) {
+                segments.clear();
+                if(segmented) {
+                    uint64_t nsegments = std::max<uint64_t>(nconnections, (size+kDownloadSegmentSize-1)/kDownloadSegmentSize);
+                    nsegments = std::min(nsegments, size);
+                    for(uint64_t k=0; k<nsegments; k++) {
+                        segments.push_back(Segment{size*k/nsegments, size*(k+1)/nsegments, 0});
+                    }
+                } else {
+                    segments.push_back(Segment{0, size, 0});
+                }
+            } else if(verbose) {
+                uint64_t done = 0;
+                for(const Segment &segment : segments) done += segment.done;
+                std::cout<<"Resuming download of "<<url<<" ("<<done<<"/"<<size<<" bytes already on disk)"<<std::endl;
+            }
+
+            int fd = open(partname.c_str(), O_WRONLY | O_CREAT | (resume ? 0 : O_TRUNC), 0644);
+            if(fd<0) throw std::runtime_error("s3::download_file: cannot create "+partname+".");
+            if(!resume && size!=kUnknownSize && size>0) {
+                // the segments are written out of order: reserve the whole file upfront
+                if(posix_fallocate(fd, 0, size)!=0 && ftruncate(fd, size)!=0) {
+                    close(fd);
+                    throw std::runtime_error("s3::download_file: cannot allocate "+std::to_string(size)+" bytes for "+partname+".");
+                }
+            }
+            if(segmented) save_state(statename, size, remote.etag, segments);
+
+            CURLM *multi = curl_multi_init();
+            uint64_t unsaved = 0;
+            std::vector<Transfer> transfers(segments.size());
+            std::deque<std::size_t> pending;
+            for(std::size_t i=0; i<segments.size(); i++) {
+                transfers[i].segment = &segments[i];
+                transfers[i].fd      = fd;
+                transfers[i].unsaved = &unsaved;
+                transfers[i].range   = segmented;
+                if(segments[i].end==kUnknownSize || segments[i].done<segments[i].end-segments[i].begin) pending.push_back(i);
+            }
+
+            unsigned int active = 0;
+            bool norange = false;
+            std::string error;
+            while(error.empty() && (!pending.empty() || active>0)) {
+                while(active<nconnections && !pending.empty()) {
+                    Transfer &transfer = transfers[pending.front()];
+                    pending.pop_front();
+                    Segment &segment = *transfer.segment;
+                    if(!segmented) segment.done = 0; // without ranges a transfer always starts from the beginning
+
+                    transfer.curl    = curl_easy_init();
+                    transfer.checked = false;
+                    curl_easy_setopt(transfer.curl, CURLOPT_URL, url.c_str());
+                    if (verbose) curl_easy_setopt(transfer.curl, CURLOPT_VERBOSE, 1L);
+                    curl_easy_setopt(transfer.curl, CURLOPT_FOLLOWLOCATION, 1L);
+                    curl_easy_setopt(transfer.curl, CURLOPT_FAILONERROR, 1L);
+                    curl_easy_setopt(transfer.curl, CURLOPT_WRITEFUNCTION, write_segment);
+                    curl_easy_setopt(transfer.curl, CURLOPT_WRITEDATA, &transfer);
+                    curl_easy_setopt(transfer.curl, CURLOPT_PRIVATE, &transfer);
+                    if(segmented) {
+                        std::string range = std::to_string(segment.begin+segment.done)+"-"+std::to_string(segment.end-1);
+                        curl_easy_setopt(transfer.curl, CURLOPT_RANGE, range.c_str());
+                    }
+                    curl_multi_add_handle(multi, transfer.curl);
+                    active++;
+                }
+
+                int running = 0;
+                curl_multi_perform(multi, &running);
+
+                CURLMsg *msg;
+                int left = 0;
+                while((msg = curl_multi_info_read(multi, &left))) {
+                    if(msg->msg!=CURLMSG_DONE) continue;
+                    Transfer *transfer = nullptr;
+                    curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&transfer);
+                    CURLcode res = msg->data.result;
+                    curl_multi_remove_handle(multi, transfer->curl);
+                    curl_easy_cleanup(transfer->curl);
+                    transfer->curl = nullptr;
+                    active--;
+
+                    const Segment &segment = *transfer->segment;
+                    bool complete = res==CURLE_OK && (segment.end==kUnknownSize || segment.done==segment.end-segment.begin);
+                    if(complete) continue;
+                    if(transfer->norange) {
+                        norange = true;
+                        error = "the server does not honour range requests";
+                    } else if(++transfer->retries>kSegmentRetries) {
+                        error = res!=CURLE_OK ? curl_easy_strerror(res) : "incomplete transfer";
+                    } else {
+                        pending.push_back(transfer-transfers.data());
+                    }
+                }
+
+                if(segmented && unsaved>=kStateSaveBytes) {
+                    // the state must not claim data that are not on disk yet
+                    fdatasync(fd);
+                    save_state(statename, size, remote.etag, segments);
+                    unsaved = 0;
+                }
+                if(error.empty() && active>0) curl_multi_wait(multi, nullptr, 0, 1000, nullptr);
+            }
+
+            for(Transfer &transfer : transfers) {
+                if(!transfer.curl) continue;
+                curl_multi_remove_handle(multi, transfer.curl);
+                curl_easy_cleanup(transfer.curl);
+            }
+            curl_multi_cleanup(multi);
+
+            if(norange) {
+                close(fd);
+                std::remove(partname.c_str());
+                std::remove(statename.c_str());
+                return false;
+            }
+
+            bool synced = fdatasync(fd)==0;
+            if(segmented) save_state(statename, size, remote.etag, segments);
+            if(close(fd)!=0) synced = false;
+            if(error.empty() && !synced) error = "cannot write "+partname;
+            if(!error.empty()) {
+                if(!segmented) std::remove(partname.c_str());
+                throw std::runtime_error("s3::download_file: download of "+url+" failed: "+error+
+                                         (segmented ? " (it will be resumed by the next call)." : "."));
+            }
+
+            std::filesystem::rename(partname, filename);
+            std::remove(statename.c_str());
+            std::error_code sizeerror;
+            write_meta(filename, EntryMeta{std::filesystem::file_size(filename, sizeerror), remote.etag});
+            return true;
+        }
+
+        // download_file() once the HEAD request is done
+        void download_remote(const std::string &url, const std::string &filename, unsigned int nconnections,
+                             RemoteFile remote, bool verbose) {
+            if(nconnections==0) nconnections = 1;
+            if(download(url, filename, nconnections, remote, verbose)) return;
+            // Accept-Ranges announced, but the whole file sent: downloaded again over one connection
+            if(verbose) std::cout<<"The server of "<<url<<" ignores range requests, downloading it over one connection."<<std::endl;
+            remote.ranges = false;
+            download(url, filename, 1, remote, verbose);
+        }
+    }
+
+    void download_file(std::string url, std::string filename, unsigned int nconnections, bool verbose) {
+        CurlGlobal global;
+        download_remote(url, filename, nconnections, head_file(url, verbose), verbose);
+    }
+    
+    
+    CacheLock::CacheLock(std::string filename, bool wait, bool shared) {
+        int fd = open((filename+".lock").c_str(), O_RDWR | O_CREAT, 0644);
+        if(fd<0) {
+            if(wait) throw std::runtime_error("s3::CacheLock: cannot create "+filename+".lock.");
+            return;
+        }
+        int ret;
+        do {
+            ret = flock(fd, (shared ? LOCK_SH : LOCK_EX) | (wait ? 0 : LOCK_NB));
+        } while(ret!=0 && errno==EINTR);
+        if(ret!=0) {
+            close(fd);
+            if(wait) throw std::runtime_error("s3::CacheLock: cannot lock "+filename+".lock.");
+            return;
+        }
+        fFd = fd;
+    }
+    
+    CacheLock::~CacheLock() {
+        if(fFd<0) return;
+        flock(fFd, LOCK_UN);
+        close(fFd);
     }
-    std::string cache_file(std::string fname,
-                           std::string path, 
-                           bool        cloud,
-                           std::string tag,
-                           bool      verbose) {
+    
+    CachedFile::CachedFile(std::string filename, bool lock): fName(filename) {
+        if(lock) fLock.reset(new CacheLock(fName, true, true));
+    }
+    
+    int64_t remote_file_size(std::string url, bool verbose) {
+        CurlGlobal global;
+        return head_file(url, verbose).size;
+    }
+    
+    bool cache_entry_valid(std::string url, std::string filename, bool verbose) {
+        std::error_code ec;
+        uint64_t size = std::filesystem::file_size(filename, ec);
+        if(ec) return false;
+        
+        EntryMeta meta;
+        bool hasmeta = read_meta(filename, meta);
+        if(hasmeta && meta.size!=size) {
+            if(verbose) std::cout<<"File "<<filename<<" has "<<size<<" bytes instead of "<<meta.size<<"."<<std::endl;
+            return false;
+        }
+        
+        CurlGlobal global;
+        RemoteFile remote = head_file(url, verbose);
+        if(remote.size<0) {
+            // the server cannot be reached: a download would fail anyway
+            if(verbose) std::cout<<"Cannot validate "<<filename<<" against "<<url<<", using it as is."<<std::endl;
+            return true;
+        }
+        if(uint64_t(remote.size)!=size) {
+            if(verbose) std::cout<<"File "<<filename<<" has "<<size<<" bytes instead of "<<remote.size<<"."<<std::endl;
+            return false;
+        }
+        if(hasmeta && !meta.etag.empty() && !remote.etag.empty() && meta.etag!=remote.etag) {
+            if(verbose) std::cout<<"File "<<filename<<" changed on the server (ETag "<<remote.etag<<")."<<std::endl;
+            return false;
+        }
+        if(!hasmeta || meta.etag.empty()) write_meta(filename, EntryMeta{size, remote.etag});
+        return true;
+    }
+    
+    uint64_t evict_cache(std::string path, uint64_t budget, std::string keep, bool verbose) {
+        uint64_t total = 0;
+        std::map<std::string, CacheEntry> entries = scan_cache(path, total);
+        if(total<=budget) return total;
+        
+        std::vector<std::pair<std::filesystem::file_time_type, std::string>> order;
+        for(const auto &entry : entries) order.emplace_back(entry.second.last_use, entry.first);
+        std::sort(order.begin(), order.end());
         
-        std::string return_name;
+        std::string keepname = keep.empty() ? "" : std::filesystem::path(keep).lexically_normal().string();
+        for(const auto &item : order) {
+            if(total<=budget) break;
+            const std::string &base = item.second;
+            if(!keepname.empty() && std::filesystem::path(base).lexically_normal().string()==keepname) continue;
+            CacheEntry &entry = entries[base];
+            if(entry.files.empty()) continue;
+            
+            // entries in use (see CachedFile) or being downloaded are skipped
+            CacheLock lock(base, false);
+            if(!lock.IsLocked()) continue;
+            if(verbose) std::cout<<"Evicting "<<base<<" ("<<entry.bytes<<" bytes) from the cache"<<std::endl;
+            std::error_code ec;
+            for(const std::filesystem::path &file : entry.files) std::filesystem::remove(file, ec);
+            total -= entry.bytes;
+        }
+        return total;
+    }
+    uint64_t cache_bytes_in_use(std::string path) {
+        uint64_t total = 0, used = 0;
+        for(const auto &entry : scan_cache(path, total)) {
+            if(entry.second.files.empty()) continue;
+            CacheLock lock(entry.first, false);
+            if(!lock.IsLocked()) used += entry.second.bytes;
+        }
+        return used;
+    }
+    
+    CachedFile cache_file(std::string fname,
+                          std::string path, 
+                          bool        cloud,
+                          std::string tag,
+                          bool      verbose,
+                          unsigned int nconnections,
+                          uint64_t    budget) {
         
         if(!cloud) {
-            return_name = path+tag+fname;
-            return return_name;
+            return CachedFile(path+tag+fname, false);
         } else {
-            if(path != "" && !std::filesystem::exists(path.c_str())) {
-                int com = std::system(("mkdir "+path).c_str());
-                if(com != 0) {
-                    std::cout<<com<<std::endl;
-                }
+            if(path != "") {
+                // concurrent processes may create it at the same time
+                std::error_code ec;
+                std::filesystem::create_directories(path, ec);
+                if(ec) throw std::runtime_error("s3::cache_file: cannot create "+path+": "+ec.message()+".");
             }
             
             std::stringstream sstmp(fname);
@@ -71,44 +554,42 @@ namespace s3 {
             }
             std::string tmpname = path + subslist[subslist.size()-1];
             
-            
-            if(!std::filesystem::exists(tmpname.c_str())) {
-                if(verbose) std::cout<<"File "<<tmpname<<" not found. Downloading it from cloud..."<<std::endl;
-                
-                CURL *curl_handle;
-                FILE *pagefile;
-                curl_global_init(CURL_GLOBAL_ALL);
-
-                // init the curl session 
-                curl_handle = curl_easy_init();
-                // set URL to get here 
-                curl_easy_setopt(curl_handle, CURLOPT_URL, fname.c_str());
-                // Switch on full protocol/debug output while testing
-                if (verbose) curl_easy_setopt(curl_handle, CURLOPT_VERBOSE, 1L);
-                // disable progress meter, set to 0L to enable and disable debug output
-                curl_easy_setopt(curl_handle, CURLOPT_NOPROGRESS, 0L);
-                // send all data to this function
-                curl_easy_setopt(curl_handle, CURLOPT_WRITEFUNCTION, write_data);
-                // open the file 
-                pagefile = fopen(tmpname.c_str(), "wb");
-                if(pagefile) {
-                    // write the page body to this file handle
-                    curl_easy_setopt(curl_handle, CURLOPT_WRITEDATA, pagefile);
-                    // get it!
-                    curl_easy_perform(curl_handle);
-                    // close the header file
-                    fclose(pagefile);
+            // a file in use by other processes is validated under the shared lock they hold too
+            CachedFile file(tmpname);
+            bool found = std::filesystem::exists(tmpname) && cache_entry_valid(fname, tmpname, verbose);
+            while(!found) {
+                file.Release();
+                {
+                    // a second process asking for the same run waits here for the end of the download
+                    CacheLock lock(tmpname);
+                    bool exists = std::filesystem::exists(tmpname);
+                    if(!exists || !cache_entry_valid(fname, tmpname, verbose)) {
+                        if(verbose) std::cout<<"File "<<tmpname<<(exists ? " is not valid. Downloading it again" : " not found. Downloading it")
+                                             <<" from cloud..."<<std::endl;
+                        // the index of a previous file of the same name must not be reused
+                        for(std::string suffix : {"", ".meta", ".idx"}) std::filesystem::remove(tmpname+suffix);
+                        CurlGlobal global;
+                        RemoteFile remote = head_file(fname, verbose);
+                        // room is made before the download, so that the folder stays within the
+                        // budget while the file is written
+                        if(budget>0) {
+                            uint64_t size = remote.size>0 ? uint64_t(remote.size) : 0;
+                            evict_cache(path.empty() ? "." : path, budget-std::min(budget, size), tmpname, verbose);
+                        }
+                        download_remote(fname, tmpname, nconnections, remote, verbose);
+                    }
                 }
-                // cleanup curl stuff
-                curl_easy_cleanup(curl_handle);
-                curl_global_cleanup();
-
+                file = CachedFile(tmpname);
+                // evicted by someone else between the two locks
+                found = std::filesystem::exists(tmpname);
             }
             
-            
-            return_name = tmpname; //to change
+            // the modification time of the data orders the entries for the eviction
+            std::error_code ec;
+            std::filesystem::last_write_time(tmpname, std::filesystem::file_time_type::clock::now(), ec);
+            if(budget>0) evict_cache(path.empty() ? "." : path, budget, tmpname, verbose);
+            return file;
         }
-        return return_name;
     }
     
 }
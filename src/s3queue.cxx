@@ -0,0 +1,105 @@
+/*
+ * Copyright (C) 2024 CYGNO Collaboration
+ *
+ *
+ * Author: Stefano Piacentini
+ * Created in 2024
+ *
+ */
+
+#include "s3queue.h"
+#include <chrono>
+#include <iostream>
+
+
+namespace s3 {
+
+    RunQueue::RunQueue(std::vector<int> runs, std::string tag, std::string path,
+                       unsigned int ahead, uint64_t budget, bool verbose):
+        fTag(tag), fPath(path), fAhead(ahead), fBudget(budget), fVerbose(verbose) {
+        fEntries.resize(runs.size());
+        for(std::size_t i=0; i<runs.size(); i++) fEntries[i].run = runs[i];
+        fThread = std::thread(&RunQueue::Run, this);
+    }
+
+    RunQueue::~RunQueue() {
+        {
+            std::lock_guard<std::mutex> lock(fMutex);
+            fStop = true;
+        }
+        fCV.notify_all();
+        fThread.join();
+    }
+
+    void RunQueue::Run() {
+        for(std::size_t i=0; i<fEntries.size(); i++) {
+            Entry &entry = fEntries[i];
+            std::string url = mid_file(entry.run, fTag, true, false);
+            int64_t size = fBudget>0 ? remote_file_size(url) : -1;
+
+            {
+                std::unique_lock<std::mutex> lock(fMutex);
+                entry.size = size>0 ? size : 0;
+                while(true) {
+                    fCV.wait(lock, [this, i] { return fStop || i<fRequested+fAhead; });
+                    if(fStop) return;
+                    // the run asked by Next() is always fetched
+                    if(i+1==fRequested || fBudget==0) break;
+                    // what cache_file cannot evict: the current run and those fetched ahead, with
+                    // their .idx and .meta, and the runs used by other processes; the directory
+                    // scan and its locks are done without holding fMutex, which Next() waits for
+                    lock.unlock();
+                    uint64_t held = cache_bytes_in_use(fPath.empty() ? "." : fPath);
+                    lock.lock();
+                    if(held==0 || held+entry.size<=fBudget) break;
+                    // Next() notifies when it releases a run, other processes do not: check again
+                    // at least every second
+                    fCV.wait_for(lock, std::chrono::seconds(1));
+                }
+            }
+
+            CachedFile file;
+            std::exception_ptr error;
+            try {
+                if(fVerbose) std::cout<<"Fetching run "<<entry.run<<" ("<<i+1<<"/"<<fEntries.size()<<")"<<std::endl;
+                file = cache_file(url, fPath, true, fTag, fVerbose, kDownloadConnections, fBudget);
+            } catch(...) {
+                error = std::current_exception();
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(fMutex);
+                entry.file = std::move(file);
+                entry.error = error;
+                entry.ready = true;
+            }
+            fCV.notify_all();
+        }
+    }
+
+    bool RunQueue::Next(int &run, std::string &filename) {
+        typedef std::chrono::steady_clock clock;
+        std::unique_lock<std::mutex> lock(fMutex);
+        // the previous run is processed: it can be evicted
+        if(fRequested>0) fEntries[fRequested-1].file.Release();
+        if(fRequested>=fEntries.size()) return false;
+        Entry &entry = fEntries[fRequested++];
+        fCV.notify_all();
+
+        if(!entry.ready) {
+            clock::time_point start = clock::now();
+            fCV.wait(lock, [&entry] { return entry.ready; });
+            fWaitSeconds += std::chrono::duration<double>(clock::now()-start).count();
+        }
+        if(entry.error) std::rethrow_exception(entry.error);
+        run = entry.run;
+        filename = entry.file.GetName();
+        return true;
+    }
+
+    double RunQueue::GetWaitSeconds() const {
+        std::lock_guard<std::mutex> lock(fMutex);
+        return fWaitSeconds;
+    }
+
+}
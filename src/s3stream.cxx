@@ -0,0 +1,306 @@
+/*
+ * Copyright (C) 2024 CYGNO Collaboration
+ *
+ *
+ * Author: Stefano Piacentini
+ * Created in 2024
+ *
+ */
+
+#include "s3stream.h"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <stdexcept>
+
+
+namespace s3 {
+
+    namespace {
+        constexpr std::size_t kInputSize = 64*1024;
+
+        bool EndsWith(const std::string &s, const std::string &suffix) {
+            return s.size()>=suffix.size() && s.compare(s.size()-suffix.size(), suffix.size(), suffix)==0;
+        }
+
+        // a reader of a cached file, which keeps the entry until it is closed
+        class CachedReader: public TMReaderInterface {
+        public:
+            CachedReader(TMReaderInterface *reader, CachedFile file): fReader(reader), fFile(std::move(file)) {}
+
+            int Read(void *buf, int count) override {
+                int n = fReader->Read(buf, count);
+                fError       = fReader->fError;
+                fErrorString = fReader->fErrorString;
+                return n;
+            }
+
+            int Close() override {
+                int ret = fReader->Close();
+                fFile.Release();
+                return ret;
+            }
+
+        private:
+            std::unique_ptr<TMReaderInterface> fReader;
+            CachedFile fFile;
+        };
+    }
+
+    StreamReader::StreamReader(std::string url, std::string cachename, std::size_t buffersize, bool verbose):
+        fURL(url), fCacheName(cachename), fBuffer(std::max<std::size_t>(buffersize, kInputSize)),
+        fCompressed(EndsWith(url, ".gz")), fInput(kInputSize) {
+
+        std::memset(&fStrm, 0, sizeof(fStrm));
+        if(fCompressed) {
+            // 47: gzip or zlib header, 32 KB window
+            if(inflateInit2(&fStrm, 47)!=Z_OK) {
+                throw std::runtime_error("s3::StreamReader: cannot initialize inflate.");
+            }
+            fInflating = true;
+        }
+
+        if(!fCacheName.empty()) {
+            fCacheLock.reset(new CacheLock(fCacheName, false));
+            if(!fCacheLock->IsLocked()) {
+                fCacheLock.reset();
+                fCacheName = "";
+            }
+        }
+        if(!fCacheName.empty()) {
+            // a segmented download of the same file left by s3::download_file cannot be resumed any more
+            std::remove((fCacheName+".part.state").c_str());
+            fCacheFile = fopen((fCacheName+".part").c_str(), "wb");
+            if(!fCacheFile) {
+                if(fInflating) inflateEnd(&fStrm);
+                throw std::runtime_error("s3::StreamReader: cannot create "+fCacheName+".part.");
+            }
+        }
+
+        curl_global_init(CURL_GLOBAL_ALL);
+        fCurl = curl_easy_init();
+        if(!fCurl) {
+            if(fCacheFile) {
+                fclose(fCacheFile);
+                std::remove((fCacheName+".part").c_str());
+            }
+            if(fInflating) inflateEnd(&fStrm);
+            curl_global_cleanup();
+            throw std::runtime_error("s3::StreamReader: cannot initialize curl.");
+        }
+        fThread = std::thread(&StreamReader::Download, this, verbose);
+    }
+
+    StreamReader::~StreamReader() {
+        Close();
+        curl_global_cleanup();
+    }
+
+    size_t StreamReader::WriteData(char *ptr, size_t size, size_t nmemb, void *userdata) {
+        StreamReader *reader = (StreamReader *)userdata;
+        std::size_t n = size*nmemb;
+        if(reader->fCacheFile && std::fwrite(ptr, 1, n, reader->fCacheFile)!=n) {
+            std::lock_guard<std::mutex> lock(reader->fMutex);
+            reader->fDownloadError = "cannot write "+reader->fCacheName+".part";
+            return 0;
+        }
+        // returning less than n makes curl abort the transfer
+        return reader->Push(ptr, n);
+    }
+
+    int StreamReader::Progress(void *clientp, curl_off_t, curl_off_t, curl_off_t, curl_off_t) {
+        StreamReader *reader = (StreamReader *)clientp;
+        std::lock_guard<std::mutex> lock(reader->fMutex);
+        // a non-zero value aborts the transfer
+        return reader->fAbort ? 1 : 0;
+    }
+
+    void StreamReader::Download(bool verbose) {
+        curl_easy_setopt(fCurl, CURLOPT_URL, fURL.c_str());
+        if (verbose) curl_easy_setopt(fCurl, CURLOPT_VERBOSE, 1L);
+        // the progress callback is also called about once per second while no data arrive, so
+        // Close() does not wait for a stalled server
+        curl_easy_setopt(fCurl, CURLOPT_NOPROGRESS, 0L);
+        curl_easy_setopt(fCurl, CURLOPT_XFERINFOFUNCTION, &StreamReader::Progress);
+        curl_easy_setopt(fCurl, CURLOPT_XFERINFODATA, this);
+        curl_easy_setopt(fCurl, CURLOPT_LOW_SPEED_LIMIT, 1L);
+        curl_easy_setopt(fCurl, CURLOPT_LOW_SPEED_TIME, kStreamStallSeconds);
+        curl_easy_setopt(fCurl, CURLOPT_FOLLOWLOCATION, 1L);
+        // HTTP errors (e.g. 404) must not be taken as the content of the file
+        curl_easy_setopt(fCurl, CURLOPT_FAILONERROR, 1L);
+        curl_easy_setopt(fCurl, CURLOPT_WRITEFUNCTION, &StreamReader::WriteData);
+        curl_easy_setopt(fCurl, CURLOPT_WRITEDATA, this);
+        CURLcode res = curl_easy_perform(fCurl);
+
+        if(fCacheFile) {
+            // the cache is only an optimization: a failure here does not affect the reading
+            bool closed = fclose(fCacheFile)==0;
+            fCacheFile = nullptr;
+            std::error_code ec;
+            if(res==CURLE_OK && closed) {
+                // the index and the metadata of a previous file of the same name must not be reused
+                std::remove((fCacheName+".idx").c_str());
+                std::remove((fCacheName+".meta").c_str());
+                std::filesystem::rename(fCacheName+".part", fCacheName, ec);
+            }
+            if(res!=CURLE_OK || !closed || ec) std::remove((fCacheName+".part").c_str());
+            fCacheLock.reset();
+        }
+
+        std::lock_guard<std::mutex> lock(fMutex);
+        if(res!=CURLE_OK && !fAbort && fDownloadError.empty()) fDownloadError = curl_easy_strerror(res);
+        fDone = true;
+        fNotEmpty.notify_all();
+    }
+
+    std::size_t StreamReader::Push(const char *data, std::size_t n) {
+        typedef std::chrono::steady_clock clock;
+        std::unique_lock<std::mutex> lock(fMutex);
+        std::size_t pushed = 0;
+        while(pushed<n) {
+            if(fSize==fBuffer.size() && !fAbort) {
+                clock::time_point start = clock::now();
+                fNotFull.wait(lock, [this] { return fSize<fBuffer.size() || fAbort; });
+                fStats.download_stall_seconds += std::chrono::duration<double>(clock::now()-start).count();
+            }
+            if(fAbort) break;
+
+            std::size_t tail  = (fHead+fSize)%fBuffer.size();
+            std::size_t chunk = std::min({n-pushed, fBuffer.size()-fSize, fBuffer.size()-tail});
+            std::memcpy(fBuffer.data()+tail, data+pushed, chunk);
+            fSize  += chunk;
+            pushed += chunk;
+            fStats.downloaded += chunk;
+            fNotEmpty.notify_one();
+        }
+        return pushed;
+    }
+
+    std::size_t StreamReader::Pull(unsigned char *data, std::size_t n) {
+        typedef std::chrono::steady_clock clock;
+        std::unique_lock<std::mutex> lock(fMutex);
+        if(fSize==0 && !fDone) {
+            clock::time_point start = clock::now();
+            fNotEmpty.wait(lock, [this] { return fSize>0 || fDone; });
+            fStats.read_stall_seconds += std::chrono::duration<double>(clock::now()-start).count();
+        }
+
+        std::size_t pulled = 0;
+        while(pulled<n && fSize>0) {
+            std::size_t chunk = std::min({n-pulled, fSize, fBuffer.size()-fHead});
+            std::memcpy(data+pulled, fBuffer.data()+fHead, chunk);
+            fHead   = (fHead+chunk)%fBuffer.size();
+            fSize  -= chunk;
+            pulled += chunk;
+        }
+        if(pulled>0) fNotFull.notify_one();
+        return pulled;
+    }
+
+    int StreamReader::Read(void *buf, int count) {
+        if(!fCurl) return -1;
+        int n = 0;
+        if(fCompressed) {
+            n = ReadInflated(buf, count);
+        } else {
+            while(n<count) {
+                std::size_t pulled = Pull((unsigned char *)buf+n, count-n);
+                if(pulled==0) break;
+                n += pulled;
+            }
+        }
+        if(n<0) return n;
+
+        std::lock_guard<std::mutex> lock(fMutex);
+        fStats.read += n;
+        if(n<count && fDone && !fDownloadError.empty()) {
+            fError = true;
+            fErrorString = "s3::StreamReader: download of "+fURL+" failed: "+fDownloadError;
+            return -1;
+        }
+        if(fTruncated) {
+            fError = true;
+            fErrorString = "s3::StreamReader: "+fURL+" is truncated";
+            return -1;
+        }
+        return n;
+    }
+
+    int StreamReader::ReadInflated(void *buf, int count) {
+        fStrm.next_out  = (Bytef *)buf;
+        fStrm.avail_out = count;
+        while(fStrm.avail_out>0 && !fEnd) {
+            if(fStrm.avail_in==0) {
+                fStrm.avail_in = Pull(fInput.data(), fInput.size());
+                fStrm.next_in  = fInput.data();
+                if(fStrm.avail_in==0) {
+                    fEnd = true;
+                    fTruncated = !fMemberStart;
+                    break;
+                }
+            }
+            Bytef *before = fStrm.next_out;
+            int ret = inflate(&fStrm, Z_NO_FLUSH);
+            if(ret==Z_NEED_DICT || ret==Z_DATA_ERROR || ret==Z_MEM_ERROR) {
+                if(fMemberStart) { // trailing garbage after the last member
+                    fEnd = true;
+                    break;
+                }
+                fError = true;
+                fErrorString = "s3::StreamReader: corrupted compressed data in "+fURL;
+                return -1;
+            }
+            if(fStrm.next_out!=before) fMemberStart = false;
+            if(ret==Z_STREAM_END) {
+                inflateReset(&fStrm);
+                fMemberStart = true;
+            }
+        }
+        return count-fStrm.avail_out;
+    }
+
+    int StreamReader::Close() {
+        if(!fCurl) return 0;
+        {
+            std::lock_guard<std::mutex> lock(fMutex);
+            fAbort = true;
+        }
+        fNotFull.notify_all();
+        if(fThread.joinable()) fThread.join();
+        curl_easy_cleanup(fCurl);
+        fCurl = nullptr;
+        if(fInflating) inflateEnd(&fStrm);
+        fInflating = false;
+        return 0;
+    }
+
+    StreamStats StreamReader::GetStats() const {
+        std::lock_guard<std::mutex> lock(fMutex);
+        return fStats;
+    }
+
+    TMReaderInterface *open_stream(std::string fname, std::string path, std::size_t buffersize, bool verbose) {
+        std::string cachename;
+        if(!path.empty()) {
+            std::filesystem::create_directories(path);
+            cachename = path + fname.substr(fname.find_last_of('/')+1);
+            CachedFile file(cachename);
+            if(std::filesystem::exists(cachename) && cache_entry_valid(fname, cachename, verbose)) {
+                if(verbose) std::cout<<"File "<<cachename<<" found in cache."<<std::endl;
+                std::error_code ec;
+                std::filesystem::last_write_time(cachename, std::filesystem::file_time_type::clock::now(), ec);
+                TMReaderInterface *reader = TMNewReader(cachename.c_str());
+                if(reader->fError) {
+                    delete reader;
+                    throw std::runtime_error("s3::open_stream: cannot open "+cachename+".");
+                }
+                return new CachedReader(reader, std::move(file));
+            }
+        }
+        if(verbose) std::cout<<"Streaming "<<fname<<" from cloud..."<<std::endl;
+        return new StreamReader(fname, cachename, buffersize, verbose);
+    }
+
+}
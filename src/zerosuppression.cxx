@@ -0,0 +1,175 @@
+/*
+ * Copyright (C) 2024 CYGNO Collaboration
+ *
+ *
+ * Author: Stefano Piacentini
+ * Created in 2024
+ *
+ */
+
+#include "zerosuppression.h"
+#include "cygnosimd.h"
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <stdexcept>
+#include <string>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+
+namespace cygnolib {
+
+    // the SIMD kernels store whole vectors at the end of the output, of which only the selected
+    // lanes are kept: the output must have this many spare elements after the row
+    static const std::size_t kZeroSuppressSlack = 16;
+
+    void HitList::Reset(unsigned int nrows, unsigned int ncolumns) {
+        fNRows    = nrows;
+        fNColumns = ncolumns;
+        fSize     = 0;
+        fRowOffsets.assign(std::size_t(nrows)+1, 0);
+    }
+
+    AlignedVector<int32_t> HitList::ToDense() const {
+        AlignedVector<int32_t> dense(std::size_t(fNRows)*fNColumns, 0);
+        for(std::size_t i=0; i<fSize; i++) dense[std::size_t(fRows[i])*fNColumns + fColumns[i]] = fValues[i];
+        return dense;
+    }
+
+    AlignedVector<float> ZeroSuppressionThresholds(const PedestalMap &pedestal, float nsigma, float minimum) {
+        Span<const float> rms = pedestal.GetRMS();
+        AlignedVector<float> thresholds(rms.size());
+        for(std::size_t i=0; i<rms.size(); i++) thresholds[i] = std::max(nsigma*rms[i], minimum);
+        return thresholds;
+    }
+
+
+    // ------------------------------------------------------------------------------------------
+    // Row kernels: for i < n, with d = float(in[i]) - mean[i], the pixels with d > threshold[i]
+    // are appended as (first+i, round_to_nearest_even(d)). The SIMD versions compare a vector of
+    // pixels at once and compress the selected lanes to the front of the vector before storing it.
+    // ------------------------------------------------------------------------------------------
+
+    static std::size_t ZeroSuppressRowScalar(const uint16_t *in, const float *mean, const float *threshold,
+                                             uint32_t first, uint32_t *columns, int32_t *values, std::size_t n) {
+        std::size_t count = 0;
+        for(std::size_t i=0; i<n; i++) {
+            float d = float(in[i]) - mean[i];
+            if(d > threshold[i]) {
+                columns[count] = first + i;
+                values[count]  = (int32_t)std::lrintf(d);
+                count++;
+            }
+        }
+        return count;
+    }
+
+#if defined(__x86_64__) || defined(__i386__)
+    // permutations moving the lanes selected by an 8-bit mask to the front of an AVX2 vector
+    static const std::array<std::array<int32_t, 8>, 256> &CompressTable() {
+        static const std::array<std::array<int32_t, 8>, 256> table = [] {
+            std::array<std::array<int32_t, 8>, 256> t{};
+            for(int mask=0; mask<256; mask++) {
+                int k = 0;
+                for(int lane=0; lane<8; lane++) if(mask & (1<<lane)) t[mask][k++] = lane;
+            }
+            return t;
+        }();
+        return table;
+    }
+
+    __attribute__((target("avx2,popcnt")))
+    static std::size_t ZeroSuppressRowAVX2(const uint16_t *in, const float *mean, const float *threshold,
+                                           uint32_t first, uint32_t *columns, int32_t *values, std::size_t n) {
+        const std::array<std::array<int32_t, 8>, 256> &table = CompressTable();
+        const __m256i iota = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+        std::size_t count = 0;
+        std::size_t i = 0;
+        for(; i+8<=n; i+=8) {
+            __m256 x = _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(in+i))));
+            __m256 d = _mm256_sub_ps(x, _mm256_loadu_ps(mean+i));
+            int mask = _mm256_movemask_ps(_mm256_cmp_ps(d, _mm256_loadu_ps(threshold+i), _CMP_GT_OQ));
+            if(mask==0) continue;
+            __m256i perm = _mm256_loadu_si256((const __m256i *)table[mask].data());
+            __m256i col  = _mm256_add_epi32(_mm256_set1_epi32(first+i), iota);
+            _mm256_storeu_si256((__m256i *)(columns+count), _mm256_permutevar8x32_epi32(col, perm));
+            _mm256_storeu_si256((__m256i *)(values+count),  _mm256_permutevar8x32_epi32(_mm256_cvtps_epi32(d), perm));
+            count += _mm_popcnt_u32(mask);
+        }
+        return count + ZeroSuppressRowScalar(in+i, mean+i, threshold+i, first+i, columns+count, values+count, n-i);
+    }
+
+    // GCC 12 warns about the undefined vector passed by the widening and conversion intrinsics
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+    __attribute__((target("avx512f,avx512bw,popcnt")))
+    static std::size_t ZeroSuppressRowAVX512(const uint16_t *in, const float *mean, const float *threshold,
+                                             uint32_t first, uint32_t *columns, int32_t *values, std::size_t n) {
+        const __m512i iota = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+        std::size_t count = 0;
+        std::size_t i = 0;
+        for(; i+16<=n; i+=16) {
+            __m512 x = _mm512_cvtepi32_ps(_mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i *)(in+i))));
+            __m512 d = _mm512_sub_ps(x, _mm512_loadu_ps(mean+i));
+            __mmask16 mask = _mm512_cmp_ps_mask(d, _mm512_loadu_ps(threshold+i), _CMP_GT_OQ);
+            if(mask==0) continue;
+            __m512i col = _mm512_add_epi32(_mm512_set1_epi32(first+i), iota);
+            _mm512_storeu_si512((void *)(columns+count), _mm512_maskz_compress_epi32(mask, col));
+            _mm512_storeu_si512((void *)(values+count),  _mm512_maskz_compress_epi32(mask, _mm512_cvtps_epi32(d)));
+            count += _mm_popcnt_u32(mask);
+        }
+        return count + ZeroSuppressRowAVX2(in+i, mean+i, threshold+i, first+i, columns+count, values+count, n-i);
+    }
+#pragma GCC diagnostic pop
+#endif
+
+    void HitList::Fill(detail::ZeroSuppressRowFunc kernel, ImageView<const uint16_t> frame,
+                       const PedestalMap &pedestal, Span<const float> thresholds) {
+        if(frame.GetNRows()!=pedestal.GetNRows() || frame.GetNColumns()!=pedestal.GetNColumns()) {
+            throw std::invalid_argument("cygnolib::ZeroSuppress: frame is "+std::to_string(frame.GetNRows())+"x"+
+                                        std::to_string(frame.GetNColumns())+", pedestal is "+
+                                        std::to_string(pedestal.GetNRows())+"x"+std::to_string(pedestal.GetNColumns())+".");
+        }
+        if(thresholds.size()!=pedestal.Size()) {
+            throw std::invalid_argument("cygnolib::ZeroSuppress: "+std::to_string(thresholds.size())+
+                                        " thresholds for "+std::to_string(pedestal.Size())+" pixels.");
+        }
+        Reset(frame.GetNRows(), frame.GetNColumns());
+
+        const float *mean = pedestal.GetMean().data();
+        for(unsigned int r=0; r<fNRows; r++) {
+            std::size_t needed = fSize + fNColumns + kZeroSuppressSlack;
+            if(fColumns.size() < needed) {
+                std::size_t capacity = std::max(needed, 2*fColumns.size());
+                fRows.resize(capacity);
+                fColumns.resize(capacity);
+                fValues.resize(capacity);
+            }
+            std::size_t offset = std::size_t(r)*fNColumns;
+            std::size_t n = kernel(frame.Row(r).data(), mean+offset, thresholds.data()+offset, 0,
+                                   fColumns.data()+fSize, fValues.data()+fSize, fNColumns);
+            std::fill(fRows.begin()+fSize, fRows.begin()+fSize+n, r);
+            fSize += n;
+            fRowOffsets[r+1] = fSize;
+        }
+    }
+
+    void ZeroSuppress(ImageView<const uint16_t> frame, const PedestalMap &pedestal, Span<const float> thresholds, HitList &hits) {
+        detail::ZeroSuppressRowFunc kernel = ZeroSuppressRowScalar;
+#if defined(__x86_64__) || defined(__i386__)
+        switch(GetSimdLevel()) {
+            case SimdLevel::AVX512: kernel = ZeroSuppressRowAVX512; break;
+            case SimdLevel::AVX2:   kernel = ZeroSuppressRowAVX2;   break;
+            default: break;
+        }
+#endif
+        hits.Fill(kernel, frame, pedestal, thresholds);
+    }
+
+    void ZeroSuppressScalar(ImageView<const uint16_t> frame, const PedestalMap &pedestal, Span<const float> thresholds, HitList &hits) {
+        hits.Fill(ZeroSuppressRowScalar, frame, pedestal, thresholds);
+    }
+
+}
@@ -0,0 +1,265 @@
+/*
+ * Copyright (C) 2024 CYGNO Collaboration
+ *
+ *
+ * Author: Stefano Piacentini
+ * Created in 2024
+ *
+ */
+
+// Checks the clustering of camera hits of clustering.h and dbscan.h on synthetic frames (noise,
+// blobs and lines):
+//  - DBSCAN gives the labels of a brute-force O(n^2) DBSCAN with the same definition (core
+//    points, border points joining their nearest core point, clusters numbered in row-major
+//    order of their first core point), for several eps and minpts;
+//  - the labels of DBSCAN and ComponentLabeler are the same for any number of threads and
+//    height of the bands, including bands of a single row;
+//  - ComponentLabeler gives the components of a breadth-first search, with 4 and 8 connectivity;
+//  - the hit lists of HitClusters are those of the labels.
+//
+// usage: dbscantest
+// It returns 0 on success and 1 on a failure.
+
+#include "clustering.h"
+#include "dbscan.h"
+#include "zerosuppression.h"
+#include "testutil.h"
+#include <cmath>
+#include <cstdint>
+#include <deque>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace {
+
+    using cygnotest::Check;
+
+    const unsigned int kThreads[]  = {1, 2, 3, 5};
+    const unsigned int kBandRows[] = {1, 7, 16, 64, 1000};
+
+    // the hits of a frame: the non-zero pixels of image
+    void MakeHits(unsigned int rows, unsigned int columns, const std::vector<uint16_t> &image, cygnolib::HitList &hits) {
+        cygnolib::PedestalMap pedestal(rows, columns);
+        cygnolib::AlignedVector<float> thresholds(pedestal.Size(), 0.5f);
+        cygnolib::ZeroSuppressScalar(cygnolib::ImageView<const uint16_t>(image.data(), rows, columns), pedestal,
+                                     cygnolib::Span<const float>(thresholds.data(), thresholds.size()), hits);
+    }
+
+    // sparse noise, round blobs of various densities and straight lines with gaps
+    void MakeFrame(unsigned int rows, unsigned int columns, std::mt19937 &rng, cygnolib::HitList &hits) {
+        std::vector<uint16_t> image(std::size_t(rows)*columns, 0);
+        auto set = [&](int r, int c) { if(r>=0 && r<int(rows) && c>=0 && c<int(columns)) image[r*columns + c] = 1 + rng()%100; };
+        std::uniform_real_distribution<double> uniform(0, 1);
+        for(std::size_t i=0; i<image.size(); i++) if(uniform(rng)<0.01) image[i] = 1 + rng()%100;
+        for(int b=0; b<12; b++) {
+            int r0 = rng()%rows, c0 = rng()%columns, radius = 2 + rng()%10;
+            double density = 0.2 + 0.8*uniform(rng);
+            for(int r=r0-radius; r<=r0+radius; r++) {
+                for(int c=c0-radius; c<=c0+radius; c++) {
+                    if((r-r0)*(r-r0) + (c-c0)*(c-c0)<=radius*radius && uniform(rng)<density) set(r, c);
+                }
+            }
+        }
+        for(int l=0; l<6; l++) {
+            double r = rng()%rows, c = rng()%columns, angle = uniform(rng)*2*M_PI;
+            int length = 20 + rng()%150;
+            for(int s=0; s<length; s++) {
+                if(s%25>=22) continue;
+                set(std::lround(r + s*std::sin(angle)), std::lround(c + s*std::cos(angle)));
+            }
+        }
+        MakeHits(rows, columns, image, hits);
+    }
+
+    // the labels of a brute-force DBSCAN over all the pairs of hits
+    std::vector<int32_t> BruteForceDBSCAN(const cygnolib::HitList &hits, float eps, unsigned int minpts) {
+        std::size_t n = hits.Size();
+        auto neighbours = [&](std::size_t i, std::size_t j) {
+            int dr = int(hits.GetRows()[i])-int(hits.GetRows()[j]), dc = int(hits.GetColumns()[i])-int(hits.GetColumns()[j]);
+            return float(dr*dr + dc*dc)<=eps*eps;
+        };
+        std::vector<uint8_t> core(n, 0);
+        for(std::size_t i=0; i<n; i++) {
+            unsigned int count = 0;
+            for(std::size_t j=0; j<n; j++) count += neighbours(i, j);
+            core[i] = count>=minpts;
+        }
+        // clusters of core points, numbered from their first core point in the order of the hits
+        std::vector<int32_t> labels(n, -1);
+        int32_t nclusters = 0;
+        for(std::size_t i=0; i<n; i++) {
+            if(!core[i] || labels[i]>=0) continue;
+            std::deque<std::size_t> queue = {i};
+            labels[i] = nclusters;
+            while(!queue.empty()) {
+                std::size_t x = queue.front();
+                queue.pop_front();
+                for(std::size_t j=0; j<n; j++) {
+                    if(core[j] && labels[j]<0 && neighbours(x, j)) {
+                        labels[j] = nclusters;
+                        queue.push_back(j);
+                    }
+                }
+            }
+            nclusters++;
+        }
+        // border points join their nearest core point, the first one on a tie
+        for(std::size_t i=0; i<n; i++) {
+            if(core[i]) continue;
+            std::size_t best = n;
+            int best_d2 = 0;
+            for(std::size_t j=0; j<n; j++) {
+                if(!core[j] || !neighbours(i, j)) continue;
+                int dr = int(hits.GetRows()[i])-int(hits.GetRows()[j]), dc = int(hits.GetColumns()[i])-int(hits.GetColumns()[j]);
+                if(best==n || dr*dr + dc*dc<best_d2) {
+                    best    = j;
+                    best_d2 = dr*dr + dc*dc;
+                }
+            }
+            if(best<n) labels[i] = labels[best];
+        }
+        return labels;
+    }
+
+    // the labels of a breadth-first search over adjacent hits
+    std::vector<int32_t> BreadthFirstComponents(const cygnolib::HitList &hits, cygnolib::Connectivity connectivity) {
+        unsigned int rows = hits.GetNRows(), columns = hits.GetNColumns();
+        std::vector<int32_t> hit(std::size_t(rows)*columns, -1);
+        for(std::size_t i=0; i<hits.Size(); i++) hit[hits.GetRows()[i]*columns + hits.GetColumns()[i]] = i;
+        std::vector<int32_t> labels(hits.Size(), -1);
+        int32_t nclusters = 0;
+        for(std::size_t i=0; i<hits.Size(); i++) {
+            if(labels[i]>=0) continue;
+            std::deque<std::size_t> queue = {i};
+            labels[i] = nclusters;
+            while(!queue.empty()) {
+                std::size_t x = queue.front();
+                queue.pop_front();
+                for(int dr=-1; dr<=1; dr++) {
+                    for(int dc=-1; dc<=1; dc++) {
+                        if(connectivity==cygnolib::Connectivity::Four && dr!=0 && dc!=0) continue;
+                        int r = int(hits.GetRows()[x])+dr, c = int(hits.GetColumns()[x])+dc;
+                        if(r<0 || r>=int(rows) || c<0 || c>=int(columns)) continue;
+                        int32_t j = hit[r*columns + c];
+                        if(j>=0 && labels[j]<0) {
+                            labels[j] = nclusters;
+                            queue.push_back(j);
+                        }
+                    }
+                }
+            }
+            nclusters++;
+        }
+        return labels;
+    }
+
+    std::vector<int32_t> Labels(const cygnolib::HitClusters &clusters) {
+        return std::vector<int32_t>(clusters.GetLabels().begin(), clusters.GetLabels().end());
+    }
+
+    // every hit of cluster k has label k, in increasing order, and every labeled hit is listed
+    bool Indexed(const cygnolib::HitClusters &clusters) {
+        cygnolib::Span<const int32_t> labels = clusters.GetLabels();
+        std::size_t nlabeled = 0;
+        for(int32_t label : labels) nlabeled += label>=0;
+        bool ok = clusters.GetHits().size()==nlabeled;
+        for(std::size_t k=0; k<clusters.GetNClusters() && ok; k++) {
+            cygnolib::Span<const uint32_t> cluster = clusters.GetCluster(k);
+            ok = !cluster.empty();
+            for(std::size_t m=0; m<cluster.size() && ok; m++) {
+                ok = labels[cluster[m]]==int32_t(k) && (m==0 || cluster[m]>cluster[m-1]);
+            }
+        }
+        return ok;
+    }
+
+    bool CompareDBSCAN(const std::vector<cygnolib::HitList> &frames) {
+        std::cout<<"DBSCAN"<<std::endl;
+        const float eps[] = {1.f, 1.5f, 2.5f, 4.f, 7.3f};
+        const unsigned int minpts[] = {1, 3, 5, 10};
+        bool ok = true;
+        for(float e : eps) {
+            for(unsigned int m : minpts) {
+                bool brute = true, deterministic = true, indexed = true;
+                std::size_t nclusters = 0;
+                for(const cygnolib::HitList &hits : frames) {
+                    std::vector<int32_t> reference = BruteForceDBSCAN(hits, e, m);
+                    for(unsigned int nthreads : kThreads) {
+                        for(unsigned int band_rows : kBandRows) {
+                            cygnolib::DBSCAN dbscan(e, m, nthreads, band_rows);
+                            cygnolib::HitClusters clusters;
+                            dbscan.Cluster(hits, clusters);
+                            std::vector<int32_t> labels = Labels(clusters);
+                            // against the brute force with one thread and the default bands, and
+                            // against those labels otherwise
+                            if(nthreads==1 && band_rows==64) {
+                                brute = brute && labels==reference;
+                                nclusters += clusters.GetNClusters();
+                            } else {
+                                deterministic = deterministic && labels==reference;
+                            }
+                            indexed = indexed && Indexed(clusters);
+                        }
+                    }
+                }
+                std::string what = "eps "+std::to_string(e).substr(0, 4)+", minpts "+std::to_string(m)+
+                                   " ("+std::to_string(nclusters)+" clusters)";
+                ok = Check(brute, what+" as brute force") && ok;
+                ok = Check(deterministic && indexed, what+" same for any threads and bands") && ok;
+            }
+        }
+        return ok;
+    }
+
+    bool CompareLabeler(const std::vector<cygnolib::HitList> &frames) {
+        std::cout<<"ComponentLabeler"<<std::endl;
+        bool ok = true;
+        for(cygnolib::Connectivity connectivity : {cygnolib::Connectivity::Four, cygnolib::Connectivity::Eight}) {
+            bool bfs = true, indexed = true;
+            std::size_t nclusters = 0;
+            for(const cygnolib::HitList &hits : frames) {
+                std::vector<int32_t> reference = BreadthFirstComponents(hits, connectivity);
+                for(unsigned int nthreads : kThreads) {
+                    for(unsigned int band_rows : kBandRows) {
+                        cygnolib::ComponentLabeler labeler(connectivity, nthreads, band_rows);
+                        cygnolib::HitClusters clusters;
+                        labeler.Label(hits, clusters);
+                        bfs = bfs && Labels(clusters)==reference;
+                        indexed = indexed && Indexed(clusters);
+                        if(nthreads==1 && band_rows==64) nclusters += clusters.GetNClusters();
+                    }
+                }
+            }
+            std::string what = std::to_string(int(connectivity))+"-connectivity ("+std::to_string(nclusters)+" clusters)";
+            ok = Check(bfs && indexed, what+" as breadth-first search, for any threads and bands") && ok;
+        }
+        return ok;
+    }
+
+}
+
+int main() {
+
+    bool ok = true;
+    try {
+        std::mt19937 rng(20240601);
+        std::vector<cygnolib::HitList> frames(6);
+        // an empty frame, a single row, a single column, and frames of a few bands
+        MakeHits(50, 60, std::vector<uint16_t>(50*60, 0), frames[0]);
+        MakeFrame(1, 300, rng, frames[1]);
+        MakeFrame(300, 1, rng, frames[2]);
+        MakeFrame(97, 131, rng, frames[3]);
+        MakeFrame(200, 256, rng, frames[4]);
+        MakeFrame(311, 173, rng, frames[5]);
+        ok = CompareDBSCAN(frames) && ok;
+        ok = CompareLabeler(frames) && ok;
+    } catch(std::exception &e) {
+        std::cerr<<"exception: "<<e.what()<<std::endl;
+        ok = false;
+    }
+
+    std::cout<<(ok ? "OK" : "FAILED")<<std::endl;
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,199 @@
+/*
+ * Copyright (C) 2024 CYGNO Collaboration
+ *
+ *
+ * Author: Stefano Piacentini
+ * Created in 2024
+ *
+ */
+
+// Checks the DRS4 'cell' and 'nsample' corrections of drs4.h at every instruction set level
+// supported by the CPU, for every start index cell:
+//  - DRS4CorrectChannel() gives the same result as DRS4CorrectChannelScalar() and as the loop over
+//    (samp+SIC)%1024 of the original PMTData::ApplyDRS4Corrections, with the result saturated to
+//    [0, 65535] and the combined correction to the int16 range;
+//  - on waveforms which do not saturate, that is the result of the original loop exactly;
+//  - DRS4Calibration::Correct() gives the same result in DRS4Mode::LUT as in DRS4Mode::Rotate,
+//    and GetCombined() holds the combined correction rotated by the start index cell;
+//  - on samples at 0 and 0xFFFF, and tables at the edges of the int16 range.
+//
+// usage: drs4correcttest
+// It returns 0 on success and 1 on a failure.
+
+#include "drs4.h"
+#include "cygnosimd.h"
+#include "testutil.h"
+#include <algorithm>
+#include <cstdint>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace {
+
+    using cygnotest::Check;
+
+    // every start index cell, and a few beyond the number of cells
+    std::vector<unsigned int> StartIndexCells(unsigned int ncells) {
+        std::vector<unsigned int> SIC;
+        for(unsigned int sic=0; sic<ncells; sic++) SIC.push_back(sic);
+        for(unsigned int sic : {ncells, ncells+1, 2*ncells-1, 5*ncells+ncells/3}) SIC.push_back(sic);
+        return SIC;
+    }
+
+    // the correction of a sample, saturated to the int16 range
+    int Combined(const int16_t *cell, const int16_t *nsample, unsigned int ncells, unsigned int samp, unsigned int SIC) {
+        int sic_index = (samp+SIC)%ncells;
+        return std::min<int>(std::max<int>(int(cell[sic_index]) + int(nsample[samp]), std::numeric_limits<int16_t>::min()),
+                             std::numeric_limits<int16_t>::max());
+    }
+
+    // the loop of the original PMTData::ApplyDRS4Corrections, with saturation
+    void ReferenceCorrection(uint16_t *wf, const int16_t *cell, const int16_t *nsample, unsigned int ncells, unsigned int SIC) {
+        for(unsigned int samp=0; samp<ncells; samp++) {
+            int correction = Combined(cell, nsample, ncells, samp, SIC);
+            wf[samp] = uint16_t(std::min(std::max(int(wf[samp]) - correction, 0), 65535));
+        }
+    }
+
+    // the loop of the original PMTData::ApplyDRS4Corrections, as it was: with wrap-around
+    void OriginalCorrection(uint16_t *wf, const int16_t *cell, const int16_t *nsample, unsigned int ncells, unsigned int SIC) {
+        for(unsigned int samp=0; samp<ncells; samp++) {
+            int sic_index = (samp+SIC)%ncells;
+            wf[samp] -= cell[sic_index];
+            wf[samp] -= nsample[samp];
+        }
+    }
+
+    struct Tables {
+        std::string name;
+        std::vector<int16_t> cell, nsample;
+    };
+
+    // tables as those of the digitizers, and tables at the edges of the int16 range, whose sum
+    // saturates
+    std::vector<Tables> MakeTables(unsigned int ncells, std::mt19937 &rng) {
+        const int16_t edges[] = {std::numeric_limits<int16_t>::min(), std::numeric_limits<int16_t>::max(), -1, 0, 1};
+        std::vector<Tables> tables(2);
+        tables[0].name = "calibration-like tables";
+        tables[1].name = "saturating tables";
+        for(unsigned int i=0; i<ncells; i++) {
+            tables[0].cell.push_back(int(rng()%160) - 60);
+            tables[0].nsample.push_back(-int(rng()%6));
+            tables[1].cell.push_back(rng()%2 ? edges[rng()%5] : int16_t(rng()));
+            tables[1].nsample.push_back(rng()%2 ? edges[rng()%5] : int16_t(rng()));
+        }
+        return tables;
+    }
+
+    // waveforms at a typical baseline, and waveforms over the whole range with samples at 0 and
+    // 0xFFFF
+    std::vector<std::vector<uint16_t>> MakeWaveforms(unsigned int ncells, std::mt19937 &rng) {
+        std::vector<std::vector<uint16_t>> wfs(4, std::vector<uint16_t>(ncells));
+        for(unsigned int i=0; i<ncells; i++) {
+            wfs[0][i] = 2000 + rng()%100;
+            wfs[1][i] = rng()%2 ? 0 : 0xFFFF;
+            wfs[2][i] = rng()%4 ? uint16_t(rng()) : (rng()%2 ? 0 : 0xFFFF);
+            wfs[3][i] = i%2 ? 0xFFFF : 0;
+        }
+        return wfs;
+    }
+
+    bool Channels(unsigned int ncells, std::mt19937 &rng) {
+        std::vector<Tables> tables = MakeTables(ncells, rng);
+        std::vector<std::vector<uint16_t>> wfs = MakeWaveforms(ncells, rng);
+        bool ok = true;
+        for(const Tables &t : tables) {
+            uint64_t mismatches = 0, nsaturated = 0, noriginal = 0;
+            for(unsigned int SIC : StartIndexCells(ncells)) {
+                for(const std::vector<uint16_t> &wf : wfs) {
+                    std::vector<uint16_t> out(wf), scalar(wf), ref(wf), original(wf);
+                    cygnolib::DRS4CorrectChannel(out.data(), t.cell.data(), t.nsample.data(), ncells, SIC);
+                    cygnolib::DRS4CorrectChannelScalar(scalar.data(), t.cell.data(), t.nsample.data(), ncells, SIC);
+                    ReferenceCorrection(ref.data(), t.cell.data(), t.nsample.data(), ncells, SIC);
+                    if(out!=ref || scalar!=ref) {
+                        if(mismatches++ < 5) std::cout<<"    SIC "<<SIC<<" differs"<<std::endl;
+                    }
+                    // where nothing saturates, the original loop gives the same samples
+                    OriginalCorrection(original.data(), t.cell.data(), t.nsample.data(), ncells, SIC);
+                    for(unsigned int samp=0; samp<ncells; samp++) {
+                        int correction = int(t.cell[(samp+SIC)%ncells]) + int(t.nsample[samp]);
+                        int x = int(wf[samp]) - correction;
+                        bool saturated = x<0 || x>65535 || correction<std::numeric_limits<int16_t>::min() ||
+                                         correction>std::numeric_limits<int16_t>::max();
+                        nsaturated += saturated;
+                        if(!saturated) {
+                            noriginal++;
+                            if(original[samp]!=out[samp]) mismatches++;
+                        }
+                    }
+                }
+            }
+            std::string what = std::to_string(ncells)+" cells, "+t.name+" ("+std::to_string(nsaturated)+" samples saturated, "+
+                               std::to_string(noriginal)+" as the original loop)";
+            ok = Check(mismatches==0, what) && ok;
+        }
+        return ok;
+    }
+
+    bool Modes(unsigned int ncells, std::mt19937 &rng) {
+        std::vector<Tables> tables = MakeTables(ncells, rng);
+        std::vector<std::vector<uint16_t>> wfs = MakeWaveforms(ncells, rng);
+        // one channel per kind of tables
+        cygnolib::DRS4Calibration calib(tables.size(), ncells);
+        for(unsigned int ch=0; ch<tables.size(); ch++) {
+            std::copy(tables[ch].cell.begin(),    tables[ch].cell.end(),    calib.GetCell(ch).begin());
+            std::copy(tables[ch].nsample.begin(), tables[ch].nsample.end(), calib.GetNSample(ch).begin());
+        }
+        cygnolib::DRS4Calibration lut(calib);
+        lut.SetMode(cygnolib::DRS4Mode::LUT);
+
+        uint64_t mismatches = 0, combined = 0;
+        for(unsigned int ch=0; ch<tables.size(); ch++) {
+            for(unsigned int SIC : StartIndexCells(ncells)) {
+                cygnolib::Span<const int16_t> c = lut.GetCombined(ch, SIC);
+                for(unsigned int samp=0; samp<ncells; samp++) {
+                    combined += c[samp]!=Combined(tables[ch].cell.data(), tables[ch].nsample.data(), ncells, samp, SIC);
+                }
+
+                for(const std::vector<uint16_t> &wf : wfs) {
+                    std::vector<uint16_t> rotated(wf), looked_up(wf);
+                    calib.Correct(rotated.data(), ch, SIC);
+                    lut.Correct(looked_up.data(), ch, SIC);
+                    if(rotated!=looked_up) {
+                        if(mismatches++ < 5) std::cout<<"    channel "<<ch<<", SIC "<<SIC<<" differs"<<std::endl;
+                    }
+                }
+            }
+        }
+        bool ok = Check(combined==0, std::to_string(ncells)+" cells, GetCombined() as the rotated tables");
+        ok = Check(mismatches==0, std::to_string(ncells)+" cells, LUT as rotate") && ok;
+        return ok;
+    }
+
+}
+
+int main() {
+
+    bool ok = true;
+    try {
+        for(int level=int(cygnolib::SimdLevel::Scalar); level<=int(cygnolib::GetSupportedSimdLevel()); level++) {
+            cygnolib::SetSimdLevel(cygnolib::SimdLevel(level));
+            std::cout<<cygnolib::SimdLevelName(cygnolib::GetSimdLevel())<<std::endl;
+            std::mt19937 rng(20240601);
+            // the V1742, and a number of cells which is not a multiple of any vector width
+            ok = Channels(1024, rng) && ok;
+            ok = Channels(37, rng) && ok;
+            ok = Modes(1024, rng) && ok;
+            ok = Modes(37, rng) && ok;
+        }
+    } catch(std::exception &e) {
+        std::cerr<<"exception: "<<e.what()<<std::endl;
+        ok = false;
+    }
+
+    std::cout<<(ok ? "OK" : "FAILED")<<std::endl;
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,241 @@
+/*
+ * Copyright (C) 2024 CYGNO Collaboration
+ *
+ *
+ * Author: Stefano Piacentini
+ * Created in 2024
+ *
+ */
+
+// Checks that the vectorized DRS4PeakCorrection() gives byte-identical results to
+// DRS4PeakCorrectionScalar() on:
+//  - events built from the correction tables of input/ (raw waveforms carrying the DRS4 cell and
+//    nsample patterns, corrected as in PMTData::ApplyDRS4Corrections);
+//  - a drop on 6, 7 and 8 channels, which must be corrected only from 7 channels on ("7 instead
+//    of 8"), at the edge samples 1, 2, 1022, 1023 and in the middle of the waveform;
+//  - randomized synthetic events with spikes, drops and plateaus common to 6, 7 or 8 channels,
+//    at random samples and next to the edges;
+//  - the V1742 events of the MIDAS runs given on the command line, if any.
+//
+// usage: drs4peaktest <input folder> [run.mid.gz ...]
+// It returns 0 on success, 1 on a mismatch and 77 (skipped) if the CPU has no AVX2.
+
+#include "cygnolib.h"
+#include "cygnoreader.h"
+#include "cygnosimd.h"
+#include "drs4.h"
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace {
+
+    const unsigned int kNChannels = 8;
+    const unsigned int kNSamples  = 1024;
+
+    struct Counters {
+        uint64_t events     = 0;
+        uint64_t mismatches = 0;
+        uint64_t corrected  = 0;  // events changed by the correction
+        uint64_t first      = 0;  // events whose samples 0-2 were changed
+        uint64_t last       = 0;  // events whose samples 1021-1023 were changed
+    };
+
+    // runs both implementations on a copy of the event and compares the outputs
+    void Compare(const uint16_t *event, const std::string &what, Counters &counters) {
+        cygnolib::AlignedVector<uint16_t> ref(event, event + kNChannels*kNSamples);
+        cygnolib::AlignedVector<uint16_t> simd(ref);
+        cygnolib::DRS4PeakCorrectionScalar(cygnolib::EventView<uint16_t>(ref.data(), kNChannels, kNSamples, kNSamples));
+        cygnolib::DRS4PeakCorrection(cygnolib::EventView<uint16_t>(simd.data(), kNChannels, kNSamples, kNSamples));
+
+        counters.events++;
+        if(std::memcmp(ref.data(), simd.data(), ref.size()*sizeof(uint16_t))!=0) {
+            if(counters.mismatches++ < 10) {
+                for(std::size_t k=0; k<ref.size(); k++) {
+                    if(ref[k]==simd[k]) continue;
+                    std::cerr<<what<<": first mismatch at channel "<<k/kNSamples<<", sample "<<k%kNSamples
+                             <<": scalar "<<ref[k]<<", "
+                             <<cygnolib::SimdLevelName(cygnolib::GetSimdLevel())<<" "<<simd[k]<<std::endl;
+                    break;
+                }
+            }
+        }
+        bool changed = false, first = false, last = false;
+        for(std::size_t k=0; k<ref.size(); k++) {
+            if(ref[k]==event[k]) continue;
+            changed = true;
+            first = first || k%kNSamples<3;
+            last  = last  || k%kNSamples>=kNSamples-3;
+        }
+        counters.corrected += changed;
+        counters.first     += first;
+        counters.last      += last;
+    }
+
+    // an artifact at sample i on exactly nchannels channels
+    void AddArtifact(uint16_t *event, unsigned int i, unsigned int nchannels, unsigned int type, std::mt19937 &rng) {
+        std::vector<unsigned int> channels(kNChannels);
+        for(unsigned int ch=0; ch<kNChannels; ch++) channels[ch] = ch;
+        std::shuffle(channels.begin(), channels.end(), rng);
+        for(unsigned int k=0; k<nchannels; k++) {
+            uint16_t *wf = event + channels[k]*kNSamples;
+            int step = 31 + rng()%200;
+            auto low = [&](unsigned int s) { if(s<kNSamples) wf[s] = uint16_t(std::max<int>(int(wf[s]) - step, 0)); };
+            auto high = [&](unsigned int s) { if(s<kNSamples) wf[s] = uint16_t(wf[s] + step); };
+            switch(type) {
+                case 0: low(i); break;                         // one-sample drop
+                case 1: low(i); low(i+1); break;               // two-sample drop
+                case 2: low(i); wf[i+1<kNSamples ? i+1 : i] = wf[i]+uint16_t(rng()%5); break; // drop with a flat next sample
+                case 3: for(unsigned int m=0; m<6; m++) high(i+m); break; // plateau above the average
+                default: high(i); break;                       // spike
+            }
+        }
+    }
+
+    // raw waveforms of an event, with the DRS4 patterns of the tables and a residual artifact,
+    // then corrected
+    void TableEvents(const cygnolib::DRS4Calibration &calib, unsigned int nevents, std::mt19937 &rng, Counters &counters) {
+        cygnolib::AlignedVector<uint16_t> event(kNChannels*kNSamples);
+        std::normal_distribution<double> noise(0, 2);
+        for(unsigned int evt=0; evt<nevents; evt++) {
+            unsigned int SIC = rng()%kNSamples;
+            for(unsigned int ch=0; ch<kNChannels; ch++) {
+                uint16_t *wf = event.data() + ch*kNSamples;
+                double baseline = 2800 + rng()%400;
+                for(unsigned int s=0; s<kNSamples; s++) {
+                    double raw = baseline + calib.GetCell(ch)[(s+SIC)%kNSamples] + calib.GetNSample(ch)[s] + noise(rng);
+                    wf[s] = uint16_t(std::min(std::max(raw, 0.), 65535.));
+                }
+                // a negative PMT pulse on some channels
+                if(rng()%2) {
+                    unsigned int t0 = 100 + rng()%800, amplitude = 50 + rng()%1500;
+                    for(unsigned int s=t0; s<t0+40; s++) wf[s] = uint16_t(std::max<int>(int(wf[s]) - int(amplitude*(s-t0)*(t0+40-s)/400), 0));
+                }
+            }
+            // the spikes and drops left by the corrections are common to (almost) all channels
+            if(rng()%2) AddArtifact(event.data(), 1 + rng()%(kNSamples-1), 6 + rng()%3, rng()%5, rng);
+            for(unsigned int ch=0; ch<kNChannels; ch++) calib.Correct(event.data() + ch*kNSamples, ch, SIC);
+            Compare(event.data(), "tables "+calib.GetTag(), counters);
+        }
+    }
+
+    void SyntheticEvents(unsigned int nevents, std::mt19937 &rng, Counters &counters) {
+        cygnolib::AlignedVector<uint16_t> event(kNChannels*kNSamples);
+        const unsigned int edges[] = {1, 2, 3, kNSamples-4, kNSamples-3, kNSamples-2, kNSamples-1};
+        for(unsigned int evt=0; evt<nevents; evt++) {
+            for(unsigned int ch=0; ch<kNChannels; ch++) {
+                uint16_t base = 2900 + rng()%200;
+                for(unsigned int s=0; s<kNSamples; s++) event[ch*kNSamples + s] = base + rng()%8;
+            }
+            unsigned int nartifacts = 1 + rng()%6;
+            for(unsigned int a=0; a<nartifacts; a++) {
+                // samples next to the edges half of the time, 6 to 8 channels around the vote threshold
+                unsigned int i = rng()%2 ? edges[rng()%7] : 1 + rng()%(kNSamples-1);
+                AddArtifact(event.data(), i, 6 + rng()%3, rng()%5, rng);
+            }
+            Compare(event.data(), "synthetic", counters);
+        }
+    }
+
+    // an artifact on 6, 7 or 8 channels must be corrected only from 7 channels on, also at the edges
+    bool VoteEvents(Counters &counters) {
+        bool ok = true;
+        cygnolib::AlignedVector<uint16_t> event(kNChannels*kNSamples);
+        std::mt19937 rng(7);
+        for(unsigned int i : {1u, 2u, 500u, kNSamples-2, kNSamples-1}) {
+            for(unsigned int nchannels : {6u, 7u, 8u}) {
+                std::fill(event.begin(), event.end(), 3000);
+                AddArtifact(event.data(), i, nchannels, 0, rng);
+                uint64_t corrected = counters.corrected;
+                Compare(event.data(), "vote", counters);
+                if((counters.corrected>corrected)!=(nchannels>=7)) {
+                    std::cerr<<"vote: a drop at sample "<<i<<" on "<<nchannels<<" channels is "
+                             <<(nchannels>=7 ? "not " : "")<<"corrected"<<std::endl;
+                    ok = false;
+                }
+            }
+        }
+        return ok;
+    }
+
+    // the V1742 events of a run, after the 'cell' and 'nsample' corrections
+    void RunEvents(const std::string &filename, const cygnolib::DRS4Calibration &calib, Counters &counters) {
+        std::unique_ptr<TMReaderInterface> reader(cygnolib::OpenMidasFile(filename));
+        TMidasEvent event;
+        cygnolib::AlignedVector<char> buffer;
+        cygnolib::EventBanks banks;
+        cygnolib::AlignedVector<uint16_t> copy(kNChannels*kNSamples);
+        while(cygnolib::ReadMidasEvent(reader.get(), event, buffer)) {
+            banks.Index(event);
+            if(!banks.Has("DGH0") || !banks.Has("DIG0")) continue;
+            cygnolib::DGHeader dgh = cygnolib::daq_dgh2head(banks);
+            cygnolib::PMTData pmts = cygnolib::daq_dig2PMTData(banks, &dgh);
+            int board = -1;
+            for(int b=0; b<dgh.nboards; b++) if(dgh.board_model[b]==1742) board = b;
+            if(board<0 || dgh.nsamples[board]!=int(kNSamples)) continue;
+
+            cygnolib::WaveformView<uint16_t> wfs = pmts.GetMutableWaveforms(1742);
+            if(wfs.GetNChannels()<kNChannels) continue;
+            for(unsigned int evt=0; evt<wfs.GetNEvents(); evt++) {
+                for(unsigned int ch=0; ch<kNChannels; ch++) {
+                    uint16_t *wf = copy.data() + ch*kNSamples;
+                    std::memcpy(wf, wfs.Channel(evt, ch).data(), kNSamples*sizeof(uint16_t));
+                    calib.Correct(wf, ch, dgh.SIC[board][evt]);
+                }
+                Compare(copy.data(), filename, counters);
+            }
+        }
+        reader->Close();
+    }
+
+}
+
+int main(int argc, char **argv) {
+
+    if(argc<2) {
+        std::cerr<<"usage: drs4peaktest <input folder> [run.mid.gz ...]"<<std::endl;
+        return 2;
+    }
+    std::string inputdir = argv[1];
+
+    cygnolib::SimdLevel supported = cygnolib::GetSupportedSimdLevel();
+    if(supported<cygnolib::SimdLevel::AVX2) {
+        std::cout<<"no AVX2: the vectorized PeakCorrection is not used, skipped"<<std::endl;
+        return 77;
+    }
+
+    bool ok = true;
+    for(int level=int(cygnolib::SimdLevel::AVX2); level<=int(supported); level++) {
+        cygnolib::SetSimdLevel(cygnolib::SimdLevel(level));
+        std::mt19937 rng(20240601);
+        Counters vote, tables, synthetic, runs;
+
+        ok = VoteEvents(vote) && ok;
+
+        for(std::string tag : {"LNGS", "LNF"}) {
+            TableEvents(cygnolib::LoadDRS4Calibration(inputdir, tag), 500, rng, tables);
+        }
+        SyntheticEvents(20000, rng, synthetic);
+        for(int a=2; a<argc; a++) RunEvents(argv[a], cygnolib::LoadDRS4Calibration(inputdir, "LNGS"), runs);
+
+        std::cout<<cygnolib::SimdLevelName(cygnolib::GetSimdLevel())<<std::endl;
+        for(auto &c : {std::make_pair("vote", &vote), std::make_pair("tables", &tables), std::make_pair("synthetic", &synthetic), std::make_pair("runs", &runs)}) {
+            std::cout<<"  "<<c.first<<": "<<c.second->events<<" events, "<<c.second->corrected<<" corrected ("
+                     <<c.second->first<<" at samples 0-2, "<<c.second->last<<" at samples 1021-1023), "
+                     <<c.second->mismatches<<" mismatches"<<std::endl;
+            ok = ok && c.second->mismatches==0;
+        }
+        // the synthetic events must exercise the corrections, the edge samples included
+        if(synthetic.corrected==0 || synthetic.first==0 || synthetic.last==0) {
+            std::cerr<<"the synthetic events do not trigger the corrections"<<std::endl;
+            ok = false;
+        }
+    }
+
+    std::cout<<(ok ? "OK" : "FAILED")<<std::endl;
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,195 @@
+/*
+ * Copyright (C) 2024 CYGNO Collaboration
+ *
+ *
+ * Author: Stefano Piacentini
+ * Created in 2024
+ *
+ */
+
+// Checks cygnolib::EventRangeRunner against cygnolib::EventPipeline:
+//  - the merged output of a run processed as 1 to 300 event ranges is identical to the output of
+//    a sequential pass, on plain and .mid.gz runs (for the latter on a sample of the numbers of
+//    ranges above 32), from the first event and after the BOR ODB dump as main.cxx does;
+//  - SplitEventRanges() balances the ranges by bytes, also when a large event ends the run.
+//
+// usage: eventrangetest
+// It returns 0 on success and 1 on a failure.
+
+#include "cygnopipeline.h"
+#include "testutil.h"
+#include <cstdint>
+#include <filesystem>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+namespace {
+
+    using cygnotest::Check;
+    using cygnotest::WriteGzip;
+    using cygnotest::WritePlain;
+
+    const unsigned int kMaxRanges = 300;
+
+    // a 32-bit bank of random 32-bit words
+    void AppendBank(std::string &banks, const char *name, std::size_t nwords, std::mt19937 &rng) {
+        uint32_t type = 6, size = nwords*sizeof(uint32_t); // TID_DWORD
+        banks.append(name, 4);
+        banks.append((const char *)&type, sizeof(type));
+        banks.append((const char *)&size, sizeof(size));
+        for(std::size_t w=0; w<nwords; w++) {
+            uint32_t word = rng()%4096;
+            banks.append((const char *)&word, sizeof(word));
+        }
+        banks.append((8 - size%8)%8, '\0'); // the banks are 8-byte aligned
+    }
+
+    // the uncompressed content of a run with a BOR and, unless cut off, an EOR event; the events
+    // have a DIG0 bank, and the sizes of CAM0 banks are given by camera (0 for none)
+    std::string MakeRun(const std::vector<std::size_t> &camera, std::mt19937 &rng, bool eor = true) {
+        std::vector<std::string> events;
+        for(std::size_t evt=0; evt<camera.size(); evt++) {
+            std::string banks;
+            AppendBank(banks, "DIG0", 1 + rng()%250, rng);
+            if(camera[evt]>0) AppendBank(banks, "CAM0", camera[evt], rng);
+            uint32_t bank_header[2] = {(uint32_t)banks.size(), 17}; // BANK_FORMAT_VERSION | BANK_FORMAT_32BIT
+            events.push_back(std::string((const char *)bank_header, sizeof(bank_header))+banks);
+        }
+        return cygnotest::MakeRun("eventrangetest", events, eor);
+    }
+
+    // per-event state: a hash of the banks, computed in the decode stage
+    struct Data {
+        std::size_t nbanks = 0;
+        uint64_t hash = 0;
+    };
+
+    void Decode(const cygnolib::EventBanks &banks, Data &data) {
+        data.nbanks = banks.GetNBanks();
+        data.hash   = 1469598103934665603ull;
+        for(const cygnolib::BankInfo &bank : banks.GetBanks()) {
+            for(uint32_t word : bank.As<uint32_t>()) data.hash = (data.hash ^ word) * 1099511628211ull;
+        }
+    }
+
+    void Output(std::ostream &out, uint64_t n, TMidasEvent &event, const Data &data) {
+        out<<n<<" "<<event.GetSerialNumber()<<" "<<data.nbanks<<" "<<data.hash<<"\n";
+    }
+
+    // the output of a sequential pass, from event first on
+    std::string Sequential(const std::string &filename, uint64_t first) {
+        std::unique_ptr<TMReaderInterface> reader(cygnolib::OpenMidasFile(filename));
+        TMidasEvent event;
+        cygnolib::AlignedVector<char> buffer;
+        for(uint64_t e=0; e<first; e++) cygnolib::ReadMidasEvent(reader.get(), event, buffer);
+
+        std::ostringstream out;
+        cygnolib::EventPipeline<Data> pipeline(2);
+        pipeline.SetDecode(Decode);
+        pipeline.SetOutput([&out](uint64_t n, TMidasEvent &event, Data &data) { Output(out, n, event, data); });
+        pipeline.Run(reader.get(), first);
+        reader->Close();
+        return out.str();
+    }
+
+    bool CompareRanges(const std::string &filename, uint64_t first) {
+        std::cout<<filename<<" from event "<<first<<std::endl;
+        std::string reference = Sequential(filename, first);
+        cygnolib::MidasIndex index = cygnolib::MidasIndex::Build(filename, 64*1024);
+
+        cygnolib::EventRangeRunner<Data, std::ostringstream> runner(3);
+        runner.SetDecode(Decode);
+        runner.SetOutput([](uint64_t n, TMidasEvent &event, Data &data, std::ostringstream &out) { Output(out, n, event, data); });
+        std::string merged;
+        runner.SetMerge([&merged](std::size_t, std::ostringstream &out) { merged += out.str(); });
+
+        // every number of ranges for plain runs; for compressed runs, where every range inflates up
+        // to a span before its first event, every number up to 32 and then a sample
+        unsigned int step = index.IsCompressed() ? 19 : 1;
+        std::vector<unsigned int> differ;
+        for(unsigned int nranges=1; nranges<=kMaxRanges; nranges += nranges<32 ? 1 : step) {
+            merged.clear();
+            runner.Run(filename, index, nranges, first);
+            if(merged!=reference) differ.push_back(nranges);
+        }
+        std::string what = "output identical for 1 to "+std::to_string(kMaxRanges)+" ranges";
+        if(!differ.empty()) what += " (differs for "+std::to_string(differ.size())+", e.g. "+std::to_string(differ.front())+")";
+        return Check(differ.empty(), what);
+    }
+
+    // no range holds more than its share of the data, but for its last event, which starts before
+    // the next boundary; the last range ends with the data and has no such slack. A single event
+    // larger than the share cannot be split: a range over the share then holds only that event
+    bool CheckBalance(const cygnolib::MidasIndex &index, unsigned int nranges) {
+        std::vector<cygnolib::EventRange> ranges = cygnolib::SplitEventRanges(index, nranges);
+        const std::vector<uint64_t> &offsets = index.GetEventOffsets();
+        auto end = [&](std::size_t e) { return e<offsets.size() ? offsets[e] : index.GetDataSize(); };
+        uint64_t share = index.GetDataSize()/nranges + 1;
+        bool ok = ranges.size()==nranges && ranges.front().first==0 && ranges.back().last==offsets.size();
+        for(std::size_t r=0; r<ranges.size(); r++) {
+            uint64_t bytes = end(ranges[r].last) - offsets[ranges[r].first];
+            uint64_t slack = r+1<ranges.size() ? end(ranges[r].last)-offsets[ranges[r].last-1] : 0;
+            bool single = ranges[r].last-ranges[r].first==1;
+            if(!(bytes<=share+slack || single) || (r>0 && ranges[r].first!=ranges[r-1].last)) {
+                std::cout<<"    "<<nranges<<" ranges: range "<<r<<" ["<<ranges[r].first<<","<<ranges[r].last<<") holds "
+                         <<bytes<<" bytes, share "<<share<<", slack "<<slack<<std::endl;
+                ok = false;
+            }
+        }
+        return ok;
+    }
+
+    bool Balance(const std::string &dir, std::mt19937 &rng) {
+        std::cout<<"balanced ranges"<<std::endl;
+        // small events, a few camera ones, and a camera event as large as all the rest at the end
+        // of a run cut off before its EOR
+        std::vector<std::size_t> camera(300, 0);
+        for(std::size_t evt=0; evt<camera.size(); evt+=40) camera[evt] = 5000;
+        std::string body = MakeRun(camera, rng, false);
+        camera.back() = body.size()/sizeof(uint32_t);
+        std::string filename = dir+"tail.mid";
+        WritePlain(filename, MakeRun(camera, rng, false));
+        cygnolib::MidasIndex index = cygnolib::MidasIndex::Build(filename);
+
+        bool ok = Check(index.GetDataSize()==std::filesystem::file_size(filename), "data size recorded");
+        bool balanced = true;
+        for(unsigned int nranges=1; nranges<=8; nranges++) balanced = CheckBalance(index, nranges) && balanced;
+        ok = Check(balanced, "1 to 8 ranges balanced by bytes") && ok;
+        return ok;
+    }
+
+}
+
+int main() {
+
+    std::string dir = (std::filesystem::temp_directory_path()/("eventrangetest-"+std::to_string(getpid()))).string()+"/";
+    std::filesystem::create_directories(dir);
+
+    bool ok = true;
+    try {
+        std::mt19937 rng(20240601);
+        std::vector<std::size_t> camera(400, 0);
+        for(std::size_t evt=0; evt<camera.size(); evt+=20) camera[evt] = 2000 + rng()%4000;
+        std::string content = MakeRun(camera, rng);
+        WritePlain(dir+"run.mid", content);
+        WriteGzip(dir+"run.mid.gz", content);
+        for(std::string filename : {dir+"run.mid", dir+"run.mid.gz"}) {
+            ok = CompareRanges(filename, 0) && ok;
+            ok = CompareRanges(filename, 1) && ok;
+        }
+        ok = Balance(dir, rng) && ok;
+    } catch(std::exception &e) {
+        std::cerr<<"exception: "<<e.what()<<std::endl;
+        ok = false;
+    }
+    std::error_code ec;
+    std::filesystem::remove_all(dir, ec);
+
+    std::cout<<(ok ? "OK" : "FAILED")<<std::endl;
+    return ok ? 0 : 1;
+}
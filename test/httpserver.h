@@ -0,0 +1,217 @@
+/*
+ * Copyright (C) 2024 CYGNO Collaboration
+ *
+ *
+ * Author: Stefano Piacentini
+ * Created in 2024
+ *
+ */
+
+// A minimal HTTP/1.1 server on 127.0.0.1, standing in for the cloud in the s3 tests. It serves
+// the same content at any path, answers HEAD and GET, honours "Range: bytes=a-b" unless told
+// otherwise, and can drop or stall its responses to simulate network failures. Every response
+// closes its connection.
+
+#ifndef __CYGNO_TEST_HTTPSERVER_H__
+#define __CYGNO_TEST_HTTPSERVER_H__
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+
+namespace cygnotest {
+
+    struct HttpServerOptions {
+        bool        ranges        = true;     // announce Accept-Ranges: bytes and answer range requests with 206
+        bool        ignore_ranges = false;    // announce Accept-Ranges, but answer range requests with the whole content
+        std::string etag          = "\"1\"";  // ETag of the content; empty for none
+        uint64_t    drop_after    = 0;        // bytes of body after which a response is cut, 0 for never
+        unsigned    ndrops        = 0;        // number of GET responses cut after drop_after bytes
+        uint64_t    stall_after   = 0;        // bytes of body after which every GET response stalls, 0 for never
+    };
+
+    class HttpServer {
+    public:
+        explicit HttpServer(std::string content, HttpServerOptions options = HttpServerOptions()):
+            fContent(std::move(content)), fOptions(options) {
+            fListen = socket(AF_INET, SOCK_STREAM, 0);
+            if(fListen<0) throw std::runtime_error("HttpServer: cannot create a socket");
+            sockaddr_in addr;
+            std::memset(&addr, 0, sizeof(addr));
+            addr.sin_family      = AF_INET;
+            addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            addr.sin_port        = 0;
+            socklen_t length = sizeof(addr);
+            if(bind(fListen, (sockaddr *)&addr, sizeof(addr))!=0 || listen(fListen, 64)!=0 ||
+               getsockname(fListen, (sockaddr *)&addr, &length)!=0) {
+                close(fListen);
+                throw std::runtime_error("HttpServer: cannot listen on 127.0.0.1");
+            }
+            fPort = ntohs(addr.sin_port);
+            fAccept = std::thread(&HttpServer::Accept, this);
+        }
+
+        ~HttpServer() { Stop(); }
+
+        HttpServer(const HttpServer &) = delete;
+        HttpServer &operator=(const HttpServer &) = delete;
+
+        std::string URL(const std::string &name) const {
+            return "http://127.0.0.1:"+std::to_string(fPort)+"/"+name;
+        }
+
+        void SetContent(std::string content, HttpServerOptions options) {
+            std::lock_guard<std::mutex> lock(fMutex);
+            fContent = std::move(content);
+            fOptions = options;
+        }
+
+        unsigned GetNGets() const { return fNGets; }
+        unsigned GetNRangeGets() const { return fNRangeGets; }
+        uint64_t GetBytesSent() const { return fBytesSent; }
+
+        void Stop() {
+            {
+                std::lock_guard<std::mutex> lock(fMutex);
+                if(fStop) return;
+                fStop = true;
+                for(int fd : fClients) shutdown(fd, SHUT_RDWR);
+            }
+            fStalled.notify_all();
+            shutdown(fListen, SHUT_RDWR);
+            if(fAccept.joinable()) fAccept.join();
+            close(fListen);
+            for(std::thread &t : fConnections) t.join();
+        }
+
+    private:
+        void Accept() {
+            while(true) {
+                int fd = accept(fListen, nullptr, nullptr);
+                if(fd<0) return;
+                std::lock_guard<std::mutex> lock(fMutex);
+                if(fStop) {
+                    close(fd);
+                    return;
+                }
+                fClients.push_back(fd);
+                fConnections.emplace_back(&HttpServer::Serve, this, fd);
+            }
+        }
+
+        static bool SendAll(int fd, const char *data, std::size_t n) {
+            while(n>0) {
+                ssize_t ret = send(fd, data, n, MSG_NOSIGNAL);
+                if(ret<=0) return false;
+                data += ret;
+                n    -= ret;
+            }
+            return true;
+        }
+
+        void Serve(int fd) {
+            std::string request;
+            char buf[4096];
+            while(request.find("\r\n\r\n")==std::string::npos) {
+                ssize_t n = recv(fd, buf, sizeof(buf), 0);
+                if(n<=0) break;
+                request.append(buf, n);
+            }
+            if(request.find("\r\n\r\n")!=std::string::npos) Respond(fd, request);
+            std::lock_guard<std::mutex> lock(fMutex);
+            fClients.erase(std::find(fClients.begin(), fClients.end(), fd));
+            close(fd);
+        }
+
+        void Respond(int fd, const std::string &request) {
+            std::string content;
+            HttpServerOptions options;
+            bool drop = false;
+            bool head = request.compare(0, 5, "HEAD ")==0;
+            {
+                std::lock_guard<std::mutex> lock(fMutex);
+                content = fContent;
+                options = fOptions;
+                if(!head) {
+                    fNGets++;
+                    if(fOptions.drop_after>0 && fOptions.ndrops>0) {
+                        fOptions.ndrops--;
+                        drop = true;
+                    }
+                }
+            }
+
+            uint64_t size = content.size(), begin = 0, end = size;
+            bool partial = false;
+            std::string lower = request;
+            std::transform(lower.begin(), lower.end(), lower.begin(), [](unsigned char c) { return std::tolower(c); });
+            std::size_t range = lower.find("\r\nrange: bytes=");
+            if(!head && options.ranges && !options.ignore_ranges && range!=std::string::npos) {
+                std::size_t first = range + std::strlen("\r\nrange: bytes=");
+                std::size_t dash  = lower.find('-', first);
+                begin = std::stoull(lower.substr(first, dash-first));
+                if(std::isdigit((unsigned char)lower[dash+1])) end = std::min<uint64_t>(std::stoull(lower.substr(dash+1))+1, size);
+                if(begin>=end) {
+                    std::string header = "HTTP/1.1 416 Range Not Satisfiable\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+                    SendAll(fd, header.data(), header.size());
+                    return;
+                }
+                partial = true;
+                fNRangeGets++;
+            }
+
+            std::string header = partial ? "HTTP/1.1 206 Partial Content\r\n" : "HTTP/1.1 200 OK\r\n";
+            header += "Content-Length: "+std::to_string(end-begin)+"\r\n";
+            if(partial) header += "Content-Range: bytes "+std::to_string(begin)+"-"+std::to_string(end-1)+"/"+std::to_string(size)+"\r\n";
+            if(options.ranges) header += "Accept-Ranges: bytes\r\n";
+            if(!options.etag.empty()) header += "ETag: "+options.etag+"\r\n";
+            header += "Connection: close\r\n\r\n";
+            if(!SendAll(fd, header.data(), header.size()) || head) return;
+
+            uint64_t limit = end-begin;
+            if(drop) limit = std::min(limit, options.drop_after);
+            if(options.stall_after>0) limit = std::min(limit, options.stall_after);
+            for(uint64_t sent = 0; sent<limit; ) {
+                std::size_t chunk = std::min<uint64_t>(limit-sent, 64*1024);
+                if(!SendAll(fd, content.data()+begin+sent, chunk)) return;
+                sent += chunk;
+                fBytesSent += chunk;
+            }
+            if(options.stall_after>0 && options.stall_after<end-begin) {
+                // the connection stays open without data until the server is stopped
+                std::unique_lock<std::mutex> lock(fMutex);
+                fStalled.wait(lock, [this] { return fStop; });
+            }
+        }
+
+        std::string fContent;
+        HttpServerOptions fOptions;
+        int fListen = -1;
+        int fPort = 0;
+        bool fStop = false;
+        std::mutex fMutex;
+        std::condition_variable fStalled;
+        std::vector<int> fClients;
+        std::vector<std::thread> fConnections;
+        std::thread fAccept;
+        std::atomic<unsigned> fNGets{0};
+        std::atomic<unsigned> fNRangeGets{0};
+        std::atomic<uint64_t> fBytesSent{0};
+    };
+
+}
+
+#endif
@@ -0,0 +1,188 @@
+/*
+ * Copyright (C) 2024 CYGNO Collaboration
+ *
+ *
+ * Author: Stefano Piacentini
+ * Created in 2024
+ *
+ */
+
+// Checks IDDBSCAN on synthetic frames with long straight tracks broken by gaps larger than the
+// radius of the seeding DBSCAN, over sparse noise:
+//  - the tracks come out in fewer fragments than with a plain DBSCAN of the same radius, and
+//    no cluster holds the hits of two tracks;
+//  - the labels are the same for 1 thread and for several threads;
+//  - the hit lists of HitClusters are those of the labels.
+//
+// usage: iddbscantest
+// It returns 0 on success and 1 on a failure.
+
+#include "dbscan.h"
+#include "iddbscan.h"
+#include "zerosuppression.h"
+#include "testutil.h"
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <map>
+#include <random>
+#include <set>
+#include <string>
+#include <vector>
+
+namespace {
+
+    using cygnotest::Check;
+
+    const unsigned int kNTracks = 6;
+    const unsigned int kStripe  = 100;  // rows of the stripe of each track
+    const unsigned int kColumns = 640;
+
+    struct Frame {
+        cygnolib::HitList hits;
+        std::vector<int> track;  // track of every hit, -1 for noise
+    };
+
+    // one track per stripe of rows, 300 to 500 pixels long, 3 pixels wide, with a gap of 4 to 10
+    // pixels every 25 to 45 pixels; if transposed, the tracks run along the columns instead
+    Frame MakeFrame(bool transposed, std::mt19937 &rng) {
+        unsigned int rows = kNTracks*kStripe, columns = kColumns;
+        std::vector<uint16_t> image(std::size_t(rows)*columns, 0);
+        std::vector<int> truth(image.size(), -1);
+        std::uniform_real_distribution<double> uniform(0, 1);
+        for(std::size_t i=0; i<image.size(); i++) if(uniform(rng)<0.003) image[i] = 1 + rng()%100;
+
+        for(unsigned int t=0; t<kNTracks; t++) {
+            double angle = (uniform(rng)-0.5)*0.2, length = 300 + rng()%200;
+            double r0 = t*kStripe + kStripe/2, c0 = 20 + rng()%(kColumns - 40 - int(length));
+            double next_gap = 25 + rng()%20;
+            for(double s=0; s<length; s+=0.5) {
+                if(s>=next_gap) {
+                    s += 4 + rng()%7;
+                    next_gap = s + 25 + rng()%20;
+                }
+                for(int w=-1; w<=1; w++) {
+                    if(uniform(rng)>0.7) continue;
+                    int r = std::lround(r0 + s*std::sin(angle) + w*std::cos(angle));
+                    int c = std::lround(c0 + s*std::cos(angle) - w*std::sin(angle));
+                    image[r*columns + c] = 100 + rng()%1000;
+                    truth[r*columns + c] = t;
+                }
+            }
+        }
+
+        if(transposed) {
+            std::vector<uint16_t> timage(image.size());
+            std::vector<int> ttruth(truth.size());
+            for(unsigned int r=0; r<rows; r++) {
+                for(unsigned int c=0; c<columns; c++) {
+                    timage[c*rows + r] = image[r*columns + c];
+                    ttruth[c*rows + r] = truth[r*columns + c];
+                }
+            }
+            image.swap(timage);
+            truth.swap(ttruth);
+            std::swap(rows, columns);
+        }
+
+        Frame frame;
+        cygnolib::PedestalMap pedestal(rows, columns);
+        cygnolib::AlignedVector<float> thresholds(pedestal.Size(), 0.5f);
+        cygnolib::ZeroSuppressScalar(cygnolib::ImageView<const uint16_t>(image.data(), rows, columns), pedestal,
+                                     cygnolib::Span<const float>(thresholds.data(), thresholds.size()), frame.hits);
+        for(std::size_t i=0; i<frame.hits.Size(); i++) {
+            frame.track.push_back(truth[std::size_t(frame.hits.GetRows()[i])*columns + frame.hits.GetColumns()[i]]);
+        }
+        return frame;
+    }
+
+    struct Fragments {
+        std::size_t fragments = 0;  // clusters holding hits of a track, summed over the tracks
+        std::size_t mixed = 0;      // clusters holding hits of more than one track
+    };
+
+    Fragments CountFragments(const Frame &frame, const cygnolib::HitClusters &clusters) {
+        std::map<int, std::set<int32_t>> track_clusters;
+        std::map<int32_t, std::set<int>> cluster_tracks;
+        cygnolib::Span<const int32_t> labels = clusters.GetLabels();
+        for(std::size_t i=0; i<frame.track.size(); i++) {
+            if(frame.track[i]<0 || labels[i]<0) continue;
+            track_clusters[frame.track[i]].insert(labels[i]);
+            cluster_tracks[labels[i]].insert(frame.track[i]);
+        }
+        Fragments f;
+        for(auto &t : track_clusters) f.fragments += t.second.size();
+        for(auto &c : cluster_tracks) f.mixed += c.second.size()>1;
+        return f;
+    }
+
+    // every hit of cluster k has label k, in increasing order, and every labeled hit is listed
+    bool Indexed(const cygnolib::HitClusters &clusters) {
+        cygnolib::Span<const int32_t> labels = clusters.GetLabels();
+        std::size_t nlabeled = 0;
+        for(int32_t label : labels) nlabeled += label>=0;
+        bool ok = clusters.GetHits().size()==nlabeled;
+        for(std::size_t k=0; k<clusters.GetNClusters() && ok; k++) {
+            cygnolib::Span<const uint32_t> cluster = clusters.GetCluster(k);
+            ok = !cluster.empty();
+            for(std::size_t m=0; m<cluster.size() && ok; m++) {
+                ok = labels[cluster[m]]==int32_t(k) && (m==0 || cluster[m]>cluster[m-1]);
+            }
+        }
+        return ok;
+    }
+
+    std::vector<int32_t> Labels(const cygnolib::HitClusters &clusters) {
+        return std::vector<int32_t>(clusters.GetLabels().begin(), clusters.GetLabels().end());
+    }
+
+}
+
+int main() {
+
+    bool ok = true;
+    try {
+        std::mt19937 rng(20240601);
+        cygnolib::IDDBSCANParameters parameters;
+        cygnolib::DBSCAN dbscan(parameters.eps, parameters.minpts, 1);
+        cygnolib::IDDBSCAN serial(parameters, 1);
+        cygnolib::IDDBSCAN parallel(parameters, 4);
+
+        Fragments plain, grown;
+        std::size_t ntracks = 0;
+        bool deterministic = true, indexed = true;
+        for(int f=0; f<4; f++) {
+            Frame frame = MakeFrame(f%2==1, rng);
+            cygnolib::HitClusters reference, clusters;
+            dbscan.Cluster(frame.hits, reference);
+            Fragments p = CountFragments(frame, reference);
+            plain.fragments += p.fragments;
+            plain.mixed     += p.mixed;
+
+            serial.Cluster(frame.hits, clusters);
+            Fragments g = CountFragments(frame, clusters);
+            grown.fragments += g.fragments;
+            grown.mixed     += g.mixed;
+            indexed = indexed && Indexed(clusters);
+            std::vector<int32_t> labels = Labels(clusters);
+
+            parallel.Cluster(frame.hits, clusters);
+            deterministic = deterministic && Labels(clusters)==labels;
+            indexed = indexed && Indexed(clusters);
+            ntracks += kNTracks;
+        }
+
+        double plain_per_track = double(plain.fragments)/ntracks, grown_per_track = double(grown.fragments)/ntracks;
+        std::cout<<"  fragments per track: DBSCAN "<<plain_per_track<<", IDDBSCAN "<<grown_per_track<<std::endl;
+        ok = Check(grown_per_track<plain_per_track/2, "fewer fragments per track than DBSCAN") && ok;
+        ok = Check(grown.mixed==0, "no cluster with two tracks") && ok;
+        ok = Check(deterministic, "same labels for 1 and "+std::to_string(parallel.GetNThreads())+" threads") && ok;
+        ok = Check(indexed, "cluster hit lists consistent with the labels") && ok;
+    } catch(std::exception &e) {
+        std::cerr<<"exception: "<<e.what()<<std::endl;
+        ok = false;
+    }
+
+    std::cout<<(ok ? "OK" : "FAILED")<<std::endl;
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,193 @@
+/*
+ * Copyright (C) 2024 CYGNO Collaboration
+ *
+ *
+ * Author: Stefano Piacentini
+ * Created in 2024
+ *
+ */
+
+// Checks cygnolib::MidasIndex and cygnolib::OpenMidasFile(filename, index, event):
+//  - the events read from a reader opened at any event through the index, on plain runs and on
+//    .mid.gz runs made of several gzip members with many checkpoints, are those read sequentially
+//    by cygnolib::OpenMidasFile() from the start of the file;
+//  - an index saved and loaded again gives the same events, and LoadOrBuild() rebuilds a sidecar
+//    which no longer matches its file;
+//  - a run cut off in the middle of its last event is indexed up to the last complete event;
+//  - events without data are read as empty events;
+//  - the same comparison over the MIDAS runs given on the command line, if any.
+//
+// usage: midasindextest [run.mid.gz ...]
+// It returns 0 on success and 1 on a failure.
+
+#include "cygnolib.h"
+#include "cygnoindex.h"
+#include "cygnoreader.h"
+#include "testutil.h"
+#include <algorithm>
+#include <cstdint>
+#include <filesystem>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+namespace {
+
+    using cygnotest::Check;
+    using cygnotest::WriteGzip;
+    using cygnotest::WritePlain;
+
+    // small span, so that the synthetic runs have many checkpoints
+    const uint64_t kSpan = 256*1024;
+
+    // the uncompressed content of a run with a BOR and an EOR event
+    std::string MakeRun(unsigned int nevents, std::mt19937 &rng) {
+        std::vector<std::string> events;
+        for(unsigned int evt=0; evt<nevents; evt++) {
+            // mostly small PMT-like events, a few large camera-like ones and a few without data
+            std::size_t size = evt%25==0 ? 200000 + rng()%100000 : evt%97==50 ? 0 : 1 + rng()%20000;
+            std::string data(size, '\0');
+            for(char &c : data) c = char(rng()%16);
+            events.push_back(std::move(data));
+        }
+        return cygnotest::MakeRun("midasindextest", events);
+    }
+
+    // the events of a reader, header and data, at most max of them
+    std::vector<std::string> Events(TMReaderInterface *reader, std::size_t max = SIZE_MAX) {
+        std::vector<std::string> events;
+        TMidasEvent event;
+        cygnolib::AlignedVector<char> buffer;
+        while(events.size()<max && cygnolib::ReadMidasEvent(reader, event, buffer)) {
+            std::string e((const char *)event.GetEventHeader(), sizeof(TMidasEvent_EVENT_HEADER));
+            e.append(event.GetData(), event.GetDataSize());
+            events.push_back(std::move(e));
+        }
+        return events;
+    }
+
+    std::vector<std::string> SequentialEvents(const std::string &filename) {
+        std::unique_ptr<TMReaderInterface> reader(cygnolib::OpenMidasFile(filename));
+        std::vector<std::string> events = Events(reader.get());
+        reader->Close();
+        return events;
+    }
+
+    // the events read from a reader opened at each of the given events
+    bool CompareRandomAccess(const std::string &filename, const cygnolib::MidasIndex &index,
+                             const std::vector<std::string> &reference, const std::vector<std::size_t> &starts) {
+        for(std::size_t start : starts) {
+            std::unique_ptr<TMReaderInterface> reader(cygnolib::OpenMidasFile(filename, index, start));
+            // a few events from the start, and the whole rest of the file from the first one
+            std::size_t max = start==starts.front() ? SIZE_MAX : 3;
+            std::vector<std::string> events = Events(reader.get(), max);
+            reader->Close();
+            std::size_t expected = std::min(max, reference.size()-start);
+            if(events.size()!=expected || !std::equal(events.begin(), events.end(), reference.begin()+start)) {
+                std::cout<<"    events from "<<start<<" differ"<<std::endl;
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool CompareIndex(const std::string &filename, const std::string &dir, uint64_t span, std::mt19937 &rng) {
+        std::cout<<filename<<std::endl;
+        std::vector<std::string> reference = SequentialEvents(filename);
+        cygnolib::MidasIndex index = cygnolib::MidasIndex::Build(filename, span);
+        bool ok = Check(index.GetNEvents()==reference.size(), std::to_string(index.GetNEvents())+" events indexed");
+        if(index.IsCompressed()) {
+            ok = Check(index.GetNCheckpoints()>1, std::to_string(index.GetNCheckpoints())+" checkpoints") && ok;
+        }
+        if(!ok || reference.empty()) return ok;
+
+        std::vector<std::size_t> starts = {0, reference.size()-1};
+        for(int i=0; i<50; i++) starts.push_back(rng()%reference.size());
+        ok = Check(CompareRandomAccess(filename, index, reference, starts), "events read from the index") && ok;
+
+        // not next to the file, which may be a run with its own sidecar
+        std::string indexfilename = dir+"saved.idx";
+        index.Save(indexfilename);
+        cygnolib::MidasIndex loaded = cygnolib::MidasIndex::Load(indexfilename);
+        ok = Check(loaded.GetEventOffsets()==index.GetEventOffsets() && loaded.GetNCheckpoints()==index.GetNCheckpoints() &&
+                   CompareRandomAccess(filename, loaded, reference, starts), "events read from the saved index") && ok;
+        std::filesystem::remove(indexfilename);
+        return ok;
+    }
+
+    // a sidecar saved for a previous content of the file
+    bool StaleIndex(const std::string &filename, const std::string &content) {
+        std::cout<<"stale sidecar"<<std::endl;
+        std::string shorter = filename+".short";
+        std::string shortcontent = content.substr(0, content.size()/2);
+        WriteGzip(shorter, shortcontent, 1);
+        cygnolib::MidasIndex::Build(shorter, kSpan).Save(cygnolib::GetMidasIndexFilename(filename));
+
+        cygnolib::MidasIndex index = cygnolib::MidasIndex::LoadOrBuild(filename);
+        std::vector<std::string> reference = SequentialEvents(filename);
+        bool ok = Check(index.GetNEvents()==reference.size(), "rebuilt for the current file");
+        ok = Check(cygnolib::MidasIndex::Load(cygnolib::GetMidasIndexFilename(filename)).GetFileSize()==
+                   std::filesystem::file_size(filename), "sidecar saved again") && ok;
+        std::filesystem::remove(shorter);
+        std::filesystem::remove(cygnolib::GetMidasIndexFilename(filename));
+        return ok;
+    }
+
+    // a run cut off by the DAQ in the middle of its last event
+    bool Truncated(const std::string &dir, const std::string &content) {
+        std::cout<<"truncated run"<<std::endl;
+        cygnolib::MidasIndex full = cygnolib::MidasIndex::Build(dir+"run.mid");
+        // half of the data of the event before EOR
+        std::size_t last = full.GetNEvents()-2;
+        std::size_t cut = (full.GetEventOffset(last)+full.GetEventOffset(last+1))/2;
+        std::string shorter = content.substr(0, cut);
+
+        bool ok = true;
+        for(bool compressed : {false, true}) {
+            std::string filename = dir+(compressed ? "truncated.mid.gz" : "truncated.mid");
+            if(compressed) WriteGzip(filename, shorter, 2);
+            else           WritePlain(filename, shorter);
+            cygnolib::MidasIndex index = cygnolib::MidasIndex::Build(filename, kSpan);
+            std::vector<std::string> reference = SequentialEvents(filename);
+            ok = Check(index.GetNEvents()==last && reference.size()==last,
+                       std::string(compressed ? "compressed: " : "plain: ")+std::to_string(index.GetNEvents())+" complete events") && ok;
+            if(index.GetNEvents()>0) {
+                ok = Check(CompareRandomAccess(filename, index, reference, {last-1}), "last complete event read from the index") && ok;
+            }
+        }
+        return ok;
+    }
+
+}
+
+int main(int argc, char **argv) {
+
+    std::string dir = (std::filesystem::temp_directory_path()/("midasindextest-"+std::to_string(getpid()))).string()+"/";
+    std::filesystem::create_directories(dir);
+
+    bool ok = true;
+    try {
+        std::mt19937 rng(20240601);
+        std::string content = MakeRun(400, rng);
+        WritePlain(dir+"run.mid", content);
+        WriteGzip(dir+"run1.mid.gz", content, 1);
+        WriteGzip(dir+"run3.mid.gz", content, 3);
+        ok = CompareIndex(dir+"run.mid", dir, kSpan, rng) && ok;
+        ok = CompareIndex(dir+"run1.mid.gz", dir, kSpan, rng) && ok;
+        ok = CompareIndex(dir+"run3.mid.gz", dir, kSpan, rng) && ok;
+        ok = StaleIndex(dir+"run3.mid.gz", content) && ok;
+        ok = Truncated(dir, content) && ok;
+        for(int a=1; a<argc; a++) ok = CompareIndex(argv[a], dir, cygnolib::kMidasIndexSpan, rng) && ok;
+    } catch(std::exception &e) {
+        std::cerr<<"exception: "<<e.what()<<std::endl;
+        ok = false;
+    }
+    std::error_code ec;
+    std::filesystem::remove_all(dir, ec);
+
+    std::cout<<(ok ? "OK" : "FAILED")<<std::endl;
+    return ok ? 0 : 1;
+}
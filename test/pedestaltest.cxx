@@ -0,0 +1,240 @@
+/*
+ * Copyright (C) 2024 CYGNO Collaboration
+ *
+ *
+ * Author: Stefano Piacentini
+ * Created in 2024
+ *
+ */
+
+// Checks the pedestal maps of pedestal.h at every instruction set level supported by the CPU:
+//  - PedestalSubtract() gives the same result as PedestalSubtractScalar(), on lengths which are
+//    not a multiple of the vector width, at the edges of the pixel range and on ties, and
+//    PedestalMap::Subtract() does so on frames which are views of a wider image;
+//  - the mean and RMS of PedestalBuilder agree with a two-pass computation in double, on
+//    contiguous frames and on views of a wider image;
+//  - a map written by WritePedestalMap() is loaded back unchanged, a map still in use is not
+//    changed when its file is written again, and files with a wrong checksum or truncated are
+//    rejected.
+//
+// usage: pedestaltest
+// It returns 0 on success and 1 on a failure.
+
+#include "pedestal.h"
+#include "cygnosimd.h"
+#include "testutil.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <filesystem>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+namespace {
+
+    using cygnotest::Check;
+
+    // lengths around the SSE4.2, AVX2 and AVX-512 widths, and a camera row
+    const std::size_t kLengths[] = {0, 1, 3, 4, 5, 7, 8, 9, 15, 16, 17, 31, 33, 63, 65, 2304, 2311};
+
+    // pixels over the whole range, the edges included, and means giving ties, negative results and
+    // fractional parts
+    void RandomPixels(uint16_t *in, float *mean, std::size_t n, std::mt19937 &rng) {
+        for(std::size_t i=0; i<n; i++) {
+            switch(rng()%4) {
+                case 0:  in[i] = rng()%2 ? 0 : 65535; break;
+                default: in[i] = uint16_t(rng()); break;
+            }
+            switch(rng()%3) {
+                case 0:  mean[i] = float(rng()%70000) + 0.5f; break;
+                case 1:  mean[i] = float(in[i]) + float(int(rng()%7) - 3); break;
+                default: mean[i] = float(rng()%1000000)/10.f; break;
+            }
+        }
+    }
+
+    bool Kernels(std::mt19937 &rng) {
+        bool ok = true;
+        for(std::size_t n : kLengths) {
+            for(int trial=0; trial<20; trial++) {
+                // misaligned by one element, as a row of a view may be
+                std::vector<uint16_t> in(n+1);
+                std::vector<float> mean(n+1);
+                std::vector<int32_t> ref(n+1), out(n+1);
+                RandomPixels(in.data()+1, mean.data()+1, n, rng);
+                cygnolib::PedestalSubtractScalar(in.data()+1, mean.data()+1, ref.data()+1, n);
+                cygnolib::PedestalSubtract(in.data()+1, mean.data()+1, out.data()+1, n);
+                if(out!=ref) {
+                    std::cout<<"    "<<n<<" pixels differ"<<std::endl;
+                    ok = false;
+                    break;
+                }
+            }
+        }
+        return Check(ok, "PedestalSubtract() as PedestalSubtractScalar()");
+    }
+
+    // a rows x columns frame in the middle of a wider image
+    struct Frame {
+        std::vector<uint16_t> image;
+        cygnolib::ImageView<uint16_t> view;
+        Frame(unsigned int rows, unsigned int columns, unsigned int padding):
+            image(std::size_t(rows)*(columns+padding) + padding, 0),
+            view(image.data() + padding, rows, columns, columns+padding) {}
+    };
+
+    bool MapSubtract(std::mt19937 &rng) {
+        const unsigned int rows = 23, columns = 37;
+        cygnolib::PedestalMap map(rows, columns);
+        Frame frame(rows, columns, 11);
+        std::vector<uint16_t> pixels(map.Size());
+        RandomPixels(pixels.data(), map.GetMean().data(), map.Size(), rng);
+        for(unsigned int r=0; r<rows; r++) {
+            for(unsigned int c=0; c<columns; c++) frame.view(r, c) = pixels[r*columns + c];
+        }
+        cygnolib::AlignedVector<int32_t> out;
+        map.Subtract(cygnolib::ImageView<const uint16_t>(frame.view), out);
+
+        bool ok = out.size()==map.Size();
+        for(unsigned int r=0; r<rows && ok; r++) {
+            for(unsigned int c=0; c<columns; c++) {
+                int32_t ref;
+                cygnolib::PedestalSubtractScalar(&pixels[r*columns + c], map.GetMean().data() + r*columns + c, &ref, 1);
+                ok = ok && out[r*columns + c]==ref;
+            }
+        }
+        return Check(ok, "PedestalMap::Subtract() on a view of a wider image");
+    }
+
+    // the builder against a two-pass computation in double over the same frames
+    bool Welford(unsigned int padding, std::mt19937 &rng) {
+        const unsigned int rows = 19, columns = 45, nframes = 200;
+        std::vector<Frame> frames;
+        std::vector<double> offset(rows*columns), sigma(rows*columns);
+        for(std::size_t i=0; i<offset.size(); i++) {
+            offset[i] = 90 + rng()%30000;
+            sigma[i]  = (rng()%300)/10.;
+        }
+        cygnolib::PedestalBuilder builder(rows, columns);
+        std::normal_distribution<double> noise(0, 1);
+        for(unsigned int f=0; f<nframes; f++) {
+            frames.emplace_back(rows, columns, padding);
+            for(unsigned int r=0; r<rows; r++) {
+                for(unsigned int c=0; c<columns; c++) {
+                    double x = offset[r*columns + c] + sigma[r*columns + c]*noise(rng);
+                    frames.back().view(r, c) = uint16_t(std::lround(std::min(std::max(x, 0.), 65535.)));
+                }
+            }
+            builder.Add(cygnolib::ImageView<const uint16_t>(frames.back().view));
+        }
+        cygnolib::PedestalMap map = builder.GetMap();
+
+        double maxmean = 0, maxrms = 0;
+        for(unsigned int r=0; r<rows; r++) {
+            for(unsigned int c=0; c<columns; c++) {
+                double sum = 0, sum2 = 0;
+                for(const Frame &frame : frames) sum += frame.view(r, c);
+                double mean = sum/nframes;
+                for(const Frame &frame : frames) sum2 += (frame.view(r, c)-mean)*(frame.view(r, c)-mean);
+                double rms = std::sqrt(sum2/nframes);
+                // float accumulation, in ulps of the mean: the rounding errors of the running mean add
+                // up over the frames, and the RMS is as precise as the deviations from that mean
+                double ulp = std::numeric_limits<float>::epsilon()*mean;
+                maxmean = std::max(maxmean, std::abs(map.GetMean()[r*columns + c]-mean)/ulp);
+                maxrms  = std::max(maxrms,  std::abs(map.GetRMS()[r*columns + c]-rms)/ulp);
+            }
+        }
+        std::string what = padding ? "views of a wider image" : "contiguous frames";
+        bool ok = Check(map.GetNFrames()==nframes && maxmean<64, "mean on "+what+" (max deviation "+std::to_string(maxmean)+" ulp)");
+        ok = Check(maxrms<8, "RMS on "+what+" (max deviation "+std::to_string(maxrms)+" ulp of the mean)") && ok;
+        return ok;
+    }
+
+    bool Same(const cygnolib::PedestalMap &a, const cygnolib::PedestalMap &b) {
+        return a.GetNRows()==b.GetNRows() && a.GetNColumns()==b.GetNColumns() && a.GetNFrames()==b.GetNFrames() &&
+               std::equal(a.GetMean().begin(), a.GetMean().end(), b.GetMean().begin()) &&
+               std::equal(a.GetRMS().begin(), a.GetRMS().end(), b.GetRMS().begin());
+    }
+
+    cygnolib::PedestalMap RandomMap(unsigned int rows, unsigned int columns, std::mt19937 &rng) {
+        cygnolib::PedestalMap map(rows, columns);
+        map.SetNFrames(1 + rng()%1000);
+        for(float &m : map.GetMean()) m = float(rng()%4000000)/100.f;
+        for(float &s : map.GetRMS()) s = float(rng()%10000)/100.f;
+        return map;
+    }
+
+    // true if loading the file throws an error mentioning what
+    bool Rejected(const std::string &filename, const std::string &what) {
+        try {
+            cygnolib::LoadPedestalMap(filename);
+        } catch(std::runtime_error &e) {
+            return std::string(e.what()).find(what)!=std::string::npos;
+        }
+        return false;
+    }
+
+    bool File(const std::string &dir, std::mt19937 &rng) {
+        std::cout<<"pedestal file"<<std::endl;
+        std::string filename = dir+"pedestal.bin";
+        // odd dimensions, so that the arrays are padded in the file
+        cygnolib::PedestalMap map = RandomMap(13, 29, rng);
+        cygnolib::WritePedestalMap(map, filename);
+        cygnolib::PedestalMap loaded = cygnolib::LoadPedestalMap(filename);
+        bool ok = Check(loaded.IsExternal() && Same(loaded, map), "loaded unchanged");
+        ok = Check(!std::filesystem::exists(filename+".tmp"), "no .tmp left") && ok;
+
+        // the loaded map still maps the previous file
+        cygnolib::PedestalMap other = RandomMap(13, 29, rng);
+        cygnolib::WritePedestalMap(other, filename);
+        ok = Check(Same(loaded, map), "a loaded map is not changed by writing its file again") && ok;
+        ok = Check(Same(cygnolib::LoadPedestalMap(filename), other), "the new map is loaded") && ok;
+
+        std::string content = cygnotest::ReadFile(filename);
+        std::string corrupted = content;
+        corrupted[64 + corrupted.size()/2] ^= 0x10;
+        cygnotest::WritePlain(dir+"corrupted.bin", corrupted);
+        ok = Check(Rejected(dir+"corrupted.bin", "checksum"), "checksum mismatch rejected") && ok;
+
+        cygnotest::WritePlain(dir+"truncated.bin", content.substr(0, content.size()-64));
+        ok = Check(Rejected(dir+"truncated.bin", "truncated"), "truncated file rejected") && ok;
+        cygnotest::WritePlain(dir+"short.bin", content.substr(0, 32));
+        ok = Check(Rejected(dir+"short.bin", "too short"), "file shorter than its header rejected") && ok;
+        return ok;
+    }
+
+}
+
+int main() {
+
+    std::string dir = (std::filesystem::temp_directory_path()/("pedestaltest-"+std::to_string(getpid()))).string()+"/";
+    std::filesystem::create_directories(dir);
+
+    bool ok = true;
+    try {
+        for(int level=int(cygnolib::SimdLevel::Scalar); level<=int(cygnolib::GetSupportedSimdLevel()); level++) {
+            cygnolib::SetSimdLevel(cygnolib::SimdLevel(level));
+            std::cout<<cygnolib::SimdLevelName(cygnolib::GetSimdLevel())<<std::endl;
+            std::mt19937 rng(20240601);
+            ok = Kernels(rng) && ok;
+            ok = MapSubtract(rng) && ok;
+            ok = Welford(0, rng) && ok;
+            ok = Welford(7, rng) && ok;
+        }
+        std::mt19937 rng(20240601);
+        ok = File(dir, rng) && ok;
+    } catch(std::exception &e) {
+        std::cerr<<"exception: "<<e.what()<<std::endl;
+        ok = false;
+    }
+    std::error_code ec;
+    std::filesystem::remove_all(dir, ec);
+
+    std::cout<<(ok ? "OK" : "FAILED")<<std::endl;
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,207 @@
+/*
+ * Copyright (C) 2024 CYGNO Collaboration
+ *
+ *
+ * Author: Stefano Piacentini
+ * Created in 2024
+ *
+ */
+
+// Checks the local run cache of s3::cache_file against a local HTTP server (see httpserver.h):
+//  - the entries held by a s3::CachedFile, in this or in another process, are not evicted,
+//    and are once released;
+//  - a file changed on the server is downloaded again without its stale .idx, and not while
+//    it is in use;
+//  - s3::RunQueue keeps the run being processed, and its .idx, on disk and the folder within
+//    budget while it fetches the next runs, also while a run is being downloaded.
+//
+// usage: s3cachetest
+// (s3cachetest --hold <file> is the other process holding an entry)
+// It returns 0 on success and 1 on a failure.
+
+#include "s3.h"
+#include "s3queue.h"
+#include "httpserver.h"
+#include "testutil.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace {
+
+    using cygnotest::Check;
+    using cygnotest::RandomContent;
+    using cygnotest::ReadFile;
+
+    const uint64_t kSize = 1024*1024;
+
+    s3::CachedFile Fetch(cygnotest::HttpServer &server, const std::string &name, const std::string &dir, uint64_t budget = 0) {
+        return s3::cache_file(server.URL(name), dir, true, "LNGS", false, s3::kDownloadConnections, budget);
+    }
+
+    bool Eviction(cygnotest::HttpServer &server, const std::string &dir) {
+        std::cout<<"eviction"<<std::endl;
+        // room for two entries and their .meta
+        uint64_t budget = 2*kSize + 1024;
+        s3::CachedFile a = Fetch(server, "a.mid.gz", dir);
+        s3::CachedFile b = Fetch(server, "b.mid.gz", dir);
+        s3::CachedFile c = Fetch(server, "c.mid.gz", dir, budget);
+        bool ok = Check(std::filesystem::exists(a.GetName()), "held entry kept over budget");
+
+        a.Release();
+        s3::CachedFile d = Fetch(server, "d.mid.gz", dir, budget);
+        ok = Check(!std::filesystem::exists(a.GetName()) && std::filesystem::exists(b.GetName()) &&
+                   std::filesystem::exists(c.GetName()), "released entry evicted first") && ok;
+
+        // an entry held by another process, which is this program run with --hold
+        int ready[2], done[2];
+        if(pipe(ready)!=0 || pipe(done)!=0) throw std::runtime_error("cannot create a pipe");
+        b.Release();
+        c.Release();
+        pid_t pid = fork();
+        if(pid==0) {
+            dup2(done[0], 0);
+            dup2(ready[1], 1);
+            execl("/proc/self/exe", "s3cachetest", "--hold", c.GetName().c_str(), (char *)nullptr);
+            _exit(1);
+        }
+        char byte = 0;
+        if(pid<0 || read(ready[0], &byte, 1)!=1) throw std::runtime_error("cannot start the other process");
+        s3::evict_cache(dir, 0);
+        ok = Check(!std::filesystem::exists(b.GetName()) && std::filesystem::exists(c.GetName()) &&
+                   std::filesystem::exists(d.GetName()), "entries held by this and another process kept") && ok;
+        if(write(done[1], &byte, 1)!=1) throw std::runtime_error("cannot stop the other process");
+        waitpid(pid, nullptr, 0);
+        for(int fd : {ready[0], ready[1], done[0], done[1]}) close(fd);
+
+        d.Release();
+        s3::evict_cache(dir, 0);
+        ok = Check(!std::filesystem::exists(c.GetName()) && !std::filesystem::exists(d.GetName()), "released entries evicted") && ok;
+        return ok;
+    }
+
+    bool Replaced(cygnotest::HttpServer &server, const std::string &dir, std::mt19937 &rng) {
+        std::cout<<"file changed on the server"<<std::endl;
+        std::string name = dir+"e.mid.gz";
+        s3::CachedFile e = Fetch(server, "e.mid.gz", dir);
+        std::ofstream(name+".idx")<<"stale index";
+        e.Release();
+
+        // same size, new ETag
+        std::string changed = RandomContent(kSize, rng);
+        cygnotest::HttpServerOptions options;
+        options.etag = "\"2\"";
+        server.SetContent(changed, options);
+        e = Fetch(server, "e.mid.gz", dir);
+        bool ok = Check(ReadFile(name)==changed, "downloaded again");
+        ok = Check(!std::filesystem::exists(name+".idx"), "stale .idx removed") && ok;
+
+        // changed again while in use: replaced only once released
+        std::string latest = RandomContent(kSize, rng);
+        options.etag = "\"3\"";
+        server.SetContent(latest, options);
+        std::atomic<bool> fetched{false};
+        std::thread other([&] {
+            s3::CachedFile f = Fetch(server, "e.mid.gz", dir);
+            fetched = true;
+        });
+        std::this_thread::sleep_for(std::chrono::milliseconds(500));
+        ok = Check(!fetched && ReadFile(name)==changed, "not replaced while in use") && ok;
+        e.Release();
+        other.join();
+        ok = Check(ReadFile(name)==latest, "replaced once released") && ok;
+        return ok;
+    }
+
+    bool Queue(cygnotest::HttpServer &server, const std::string &dir, const std::string &content) {
+        std::cout<<"run queue"<<std::endl;
+        std::string path = dir+"queue/";
+        // room for the current run, its index and one run ahead
+        uint64_t budget = 2*kSize + kSize/2 + 1024;
+        s3::BUCKET_REST_PATH = server.URL("");
+        // the size of the folder sampled while a run is downloaded, whose .part is preallocated to
+        // the size of the file
+        std::atomic<bool> stop(false);
+        std::atomic<uint64_t> peak(0), nsamples(0);
+        std::thread sampler([&] {
+            while(!stop) {
+                uint64_t total = 0;
+                bool downloading = false;
+                std::error_code ec;
+                for(const std::filesystem::directory_entry &file : std::filesystem::directory_iterator(path, ec)) {
+                    total += file.file_size(ec);
+                    downloading = downloading || file.path().extension()==".part";
+                }
+                if(downloading) {
+                    peak = std::max<uint64_t>(peak, total);
+                    nsamples++;
+                }
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+        });
+
+        bool kept = true, within = true;
+        {
+            s3::RunQueue queue({1, 2, 3, 4, 5, 6}, "LNGS", path, 2, budget);
+            int run = 0;
+            std::string filename;
+            while(queue.Next(run, filename)) {
+                // as MidasIndex::LoadOrBuild
+                std::ofstream(filename+".idx")<<std::string(kSize/2, 'x');
+                std::this_thread::sleep_for(std::chrono::milliseconds(300));
+                kept   = kept && ReadFile(filename)==content;
+                // the previous run is evicted when a run is fetched, i.e. not after the last one
+                if(run!=6) within = within && s3::evict_cache(path, UINT64_MAX)<=budget;
+            }
+        }
+        stop = true;
+        sampler.join();
+        bool ok = Check(kept, "runs kept while processed");
+        ok = Check(within, "folder within budget") && ok;
+        ok = Check(nsamples>0 && peak<=budget, "folder within budget during the downloads (peak "+std::to_string(peak)+
+                                               " bytes, budget "+std::to_string(budget)+")") && ok;
+        return ok;
+    }
+
+}
+
+int main(int argc, char **argv) {
+
+    if(argc==3 && std::string(argv[1])=="--hold") {
+        // holds the entry until a byte is read from stdin
+        s3::CachedFile held(argv[2]);
+        char byte = 0;
+        return write(1, &byte, 1)==1 && read(0, &byte, 1)==1 ? 0 : 1;
+    }
+
+    std::string dir = (std::filesystem::temp_directory_path()/("s3cachetest-"+std::to_string(getpid()))).string()+"/";
+    std::filesystem::create_directories(dir);
+
+    bool ok = true;
+    try {
+        std::mt19937 rng(20240601);
+        std::string content = RandomContent(kSize, rng);
+        cygnotest::HttpServer server(content);
+        ok = Eviction(server, dir) && ok;
+        ok = Queue(server, dir, content) && ok;
+        ok = Replaced(server, dir, rng) && ok;
+    } catch(std::exception &e) {
+        std::cerr<<"exception: "<<e.what()<<std::endl;
+        ok = false;
+    }
+    std::error_code ec;
+    std::filesystem::remove_all(dir, ec);
+
+    std::cout<<(ok ? "OK" : "FAILED")<<std::endl;
+    return ok ? 0 : 1;
+}
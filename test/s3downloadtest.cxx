@@ -0,0 +1,161 @@
+/*
+ * Copyright (C) 2024 CYGNO Collaboration
+ *
+ *
+ * Author: Stefano Piacentini
+ * Created in 2024
+ *
+ */
+
+// Checks s3::download_file against a local HTTP server (see httpserver.h):
+//  - a download split into range requests over several connections;
+//  - a download whose connections are cut until it fails, then resumed from its .part.state
+//    without downloading again what is already on disk;
+//  - an interrupted download whose file changed on the server, which starts over;
+//  - a server without range requests, and one announcing them but sending the whole file.
+//
+// usage: s3downloadtest
+// It returns 0 on success and 1 on a failure.
+
+#include "s3.h"
+#include "httpserver.h"
+#include "testutil.h"
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <unistd.h>
+
+namespace {
+
+    using cygnotest::Check;
+    using cygnotest::RandomContent;
+    using cygnotest::ReadFile;
+
+    const uint64_t kSize = 8*1024*1024 + 12345;
+    const unsigned int kConnections = 4;
+
+    // the downloaded file is complete and nothing else is left but its .meta
+    bool CheckComplete(const std::string &filename, const std::string &content) {
+        bool ok = Check(ReadFile(filename)==content, "file identical");
+        ok = Check(!std::filesystem::exists(filename+".part") && !std::filesystem::exists(filename+".part.state"), "no .part left") && ok;
+        std::ifstream meta(filename+".meta");
+        uint64_t size = 0;
+        ok = Check(bool(meta>>size) && size==content.size(), ".meta records the size") && ok;
+        return ok;
+    }
+
+    void Remove(const std::string &filename) {
+        for(std::string suffix : {"", ".meta", ".part", ".part.state"}) std::filesystem::remove(filename+suffix);
+    }
+
+    bool Segmented(const std::string &dir, const std::string &content) {
+        std::cout<<"segmented download"<<std::endl;
+        cygnotest::HttpServer server(content);
+        std::string filename = dir+"segmented.bin";
+        s3::download_file(server.URL("segmented.bin"), filename, kConnections);
+        bool ok = Check(server.GetNRangeGets()==kConnections, std::to_string(server.GetNRangeGets())+" range requests");
+        ok = Check(server.GetBytesSent()==content.size(), "each byte sent once") && ok;
+        ok = CheckComplete(filename, content) && ok;
+        Remove(filename);
+        return ok;
+    }
+
+    // every response cut after drop_after bytes: each segment fails after its retries
+    bool Resumed(const std::string &dir, const std::string &content) {
+        std::cout<<"interrupted and resumed download"<<std::endl;
+        cygnotest::HttpServerOptions cut;
+        cut.drop_after = 100*1024;
+        cut.ndrops     = 1000;
+        cygnotest::HttpServer server(content, cut);
+        std::string filename = dir+"resumed.bin";
+
+        bool failed = false;
+        try {
+            s3::download_file(server.URL("resumed.bin"), filename, kConnections);
+        } catch(std::exception &) {
+            failed = true;
+        }
+        bool ok = Check(failed, "download fails");
+        ok = Check(!std::filesystem::exists(filename) && std::filesystem::exists(filename+".part.state"), ".part.state left") && ok;
+        uint64_t first = server.GetBytesSent();
+
+        server.SetContent(content, cygnotest::HttpServerOptions());
+        s3::download_file(server.URL("resumed.bin"), filename, kConnections);
+        uint64_t second = server.GetBytesSent()-first;
+        // what was in flight when the first call gave up is sent again
+        ok = Check(second<content.size() && first+second>=content.size(),
+                   "resumed: "+std::to_string(second)+" bytes sent after "+std::to_string(first)) && ok;
+        ok = CheckComplete(filename, content) && ok;
+        Remove(filename);
+        return ok;
+    }
+
+    // the state of an interrupted download is not used for a different file
+    bool Changed(const std::string &dir, const std::string &content, const std::string &changed) {
+        std::cout<<"interrupted download of a file changed on the server"<<std::endl;
+        cygnotest::HttpServerOptions cut;
+        cut.drop_after = 100*1024;
+        cut.ndrops     = 1000;
+        cygnotest::HttpServer server(content, cut);
+        std::string filename = dir+"changed.bin";
+        try {
+            s3::download_file(server.URL("changed.bin"), filename, kConnections);
+        } catch(std::exception &) {
+            // resumed below from the .part.state
+        }
+        uint64_t first = server.GetBytesSent();
+
+        cygnotest::HttpServerOptions options;
+        options.etag = "\"2\"";
+        server.SetContent(changed, options);
+        s3::download_file(server.URL("changed.bin"), filename, kConnections);
+        bool ok = Check(server.GetBytesSent()-first==changed.size(), "downloaded from the start");
+        ok = CheckComplete(filename, changed) && ok;
+        Remove(filename);
+        return ok;
+    }
+
+    bool NoRanges(const std::string &dir, const std::string &content, bool announced) {
+        std::cout<<(announced ? "server ignoring range requests" : "server without range requests")<<std::endl;
+        cygnotest::HttpServerOptions options;
+        options.ranges        = announced;
+        options.ignore_ranges = announced;
+        cygnotest::HttpServer server(content, options);
+        std::string filename = dir+"noranges.bin";
+        s3::download_file(server.URL("noranges.bin"), filename, kConnections);
+        bool ok = Check(server.GetNRangeGets()==0, "no partial responses");
+        ok = CheckComplete(filename, content) && ok;
+        Remove(filename);
+        return ok;
+    }
+
+}
+
+int main() {
+
+    std::string dir = (std::filesystem::temp_directory_path()/("s3downloadtest-"+std::to_string(getpid()))).string()+"/";
+    std::filesystem::create_directories(dir);
+
+    bool ok = true;
+    try {
+        std::mt19937 rng(20240601);
+        std::string content = RandomContent(kSize, rng);
+        std::string changed = RandomContent(kSize, rng);
+        ok = Segmented(dir, content) && ok;
+        ok = Resumed(dir, content) && ok;
+        ok = Changed(dir, content, changed) && ok;
+        ok = NoRanges(dir, content, false) && ok;
+        ok = NoRanges(dir, content, true) && ok;
+    } catch(std::exception &e) {
+        std::cerr<<"exception: "<<e.what()<<std::endl;
+        ok = false;
+    }
+    std::error_code ec;
+    std::filesystem::remove_all(dir, ec);
+
+    std::cout<<(ok ? "OK" : "FAILED")<<std::endl;
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,178 @@
+/*
+ * Copyright (C) 2024 CYGNO Collaboration
+ *
+ *
+ * Author: Stefano Piacentini
+ * Created in 2024
+ *
+ */
+
+// Checks s3::StreamReader and s3::open_stream against a local HTTP server (see httpserver.h):
+//  - the events streamed from a .mid.gz made of two gzip members are the same as those read by
+//    cygnolib::OpenMidasFile() from the file itself, with a buffer much smaller than the file;
+//  - the file is cached while streamed, and read from the cache by the next open_stream;
+//  - a connection cut in the middle makes the reading fail and leaves nothing in the cache;
+//  - Close() returns promptly while the server stalls;
+//  - the same comparison over the MIDAS runs given on the command line, if any.
+//
+// usage: s3streamtest [run.mid.gz ...]
+// It returns 0 on success and 1 on a failure.
+
+#include "cygnolib.h"
+#include "cygnoreader.h"
+#include "s3stream.h"
+#include "httpserver.h"
+#include "testutil.h"
+#include <chrono>
+#include <filesystem>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+
+namespace {
+
+    using cygnotest::Check;
+    using cygnotest::ReadFile;
+    using cygnotest::WriteGzip;
+
+    // a run with a BOR and an EOR event, compressed in two gzip members as the DAQ may write it
+    void WriteRun(const std::string &filename, unsigned int nevents, std::mt19937 &rng) {
+        std::vector<std::string> events;
+        for(unsigned int evt=0; evt<nevents; evt++) {
+            std::string data(1 + rng()%60000, '\0');
+            // somewhat compressible, as camera and digitizer data
+            for(char &c : data) c = char(rng()%16);
+            events.push_back(std::move(data));
+        }
+        WriteGzip(filename, cygnotest::MakeRun("s3streamtest", events), 2);
+    }
+
+    // the events of a reader, header and data
+    std::vector<std::string> Events(TMReaderInterface *reader) {
+        std::vector<std::string> events;
+        TMidasEvent event;
+        cygnolib::AlignedVector<char> buffer;
+        while(cygnolib::ReadMidasEvent(reader, event, buffer)) {
+            std::string e((const char *)event.GetEventHeader(), sizeof(TMidasEvent_EVENT_HEADER));
+            e.append(event.GetData(), event.GetDataSize());
+            events.push_back(std::move(e));
+        }
+        return events;
+    }
+
+    // the events streamed from a local server, without and with a cache, against the file itself
+    bool CompareStream(const std::string &filename, const std::string &cachedir) {
+        std::cout<<filename<<std::endl;
+        std::unique_ptr<TMReaderInterface> file(cygnolib::OpenMidasFile(filename));
+        std::vector<std::string> reference = Events(file.get());
+        file->Close();
+
+        std::string name = std::filesystem::path(filename).filename().string();
+        std::string content = ReadFile(filename);
+        cygnotest::HttpServer server(content);
+        bool ok = true;
+
+        {
+            s3::StreamReader reader(server.URL(name), "", 256*1024);
+            ok = Check(Events(&reader)==reference, std::to_string(reference.size())+" events streamed") && ok;
+            s3::StreamStats stats = reader.GetStats();
+            ok = Check(stats.downloaded==content.size(), "whole file downloaded") && ok;
+        }
+
+        std::string cachename = cachedir+name;
+        {
+            std::unique_ptr<TMReaderInterface> reader(s3::open_stream(server.URL(name), cachedir, 256*1024));
+            ok = Check(dynamic_cast<s3::StreamReader *>(reader.get())!=nullptr, "streamed when not cached") && ok;
+            ok = Check(Events(reader.get())==reference, "events streamed and cached") && ok;
+            reader->Close();
+        }
+        ok = Check(ReadFile(cachename)==content, "cached file identical") && ok;
+
+        unsigned int ngets = server.GetNGets();
+        {
+            std::unique_ptr<TMReaderInterface> reader(s3::open_stream(server.URL(name), cachedir, 256*1024));
+            ok = Check(dynamic_cast<s3::StreamReader *>(reader.get())==nullptr && server.GetNGets()==ngets, "read from the cache") && ok;
+            ok = Check(Events(reader.get())==reference, "events read from the cache") && ok;
+            reader->Close();
+        }
+        std::filesystem::remove(cachename);
+        std::filesystem::remove(cachename+".meta");
+        return ok;
+    }
+
+    // a connection cut in the middle of the file
+    bool DroppedStream(const std::string &filename, const std::string &cachedir) {
+        std::cout<<"connection cut"<<std::endl;
+        std::string name = std::filesystem::path(filename).filename().string();
+        std::string content = ReadFile(filename);
+        cygnotest::HttpServerOptions options;
+        options.drop_after = content.size()/2;
+        options.ndrops     = 1;
+        cygnotest::HttpServer server(content, options);
+
+        bool failed = false;
+        std::string cachename = cachedir+name;
+        {
+            s3::StreamReader reader(server.URL(name), cachename, 256*1024);
+            try {
+                Events(&reader);
+            } catch(std::exception &e) {
+                failed = true;
+            }
+            reader.Close();
+        }
+        bool ok = Check(failed, "reading fails");
+        ok = Check(!std::filesystem::exists(cachename) && !std::filesystem::exists(cachename+".part"), "nothing cached") && ok;
+        return ok;
+    }
+
+    // Close() while the server sends nothing
+    bool StalledStream(const std::string &filename) {
+        typedef std::chrono::steady_clock clock;
+        std::cout<<"stalled server"<<std::endl;
+        std::string name = std::filesystem::path(filename).filename().string();
+        std::string content = ReadFile(filename);
+        cygnotest::HttpServerOptions options;
+        options.stall_after = content.size()/4;
+        cygnotest::HttpServer server(content, options);
+
+        s3::StreamReader reader(server.URL(name));
+        while(reader.GetStats().downloaded<options.stall_after) std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+        clock::time_point start = clock::now();
+        reader.Close();
+        double seconds = std::chrono::duration<double>(clock::now()-start).count();
+        return Check(seconds<5, "Close() returns in "+std::to_string(seconds)+" s");
+    }
+
+}
+
+int main(int argc, char **argv) {
+
+    std::string dir = (std::filesystem::temp_directory_path()/("s3streamtest-"+std::to_string(getpid()))).string()+"/";
+    std::string cachedir = dir+"cache/";
+    std::filesystem::create_directories(cachedir);
+
+    bool ok = true;
+    try {
+        std::mt19937 rng(20240601);
+        std::string run = dir+"run00001.mid.gz";
+        WriteRun(run, 300, rng);
+        ok = CompareStream(run, cachedir) && ok;
+        ok = DroppedStream(run, cachedir) && ok;
+        ok = StalledStream(run) && ok;
+        for(int a=1; a<argc; a++) ok = CompareStream(argv[a], cachedir) && ok;
+    } catch(std::exception &e) {
+        std::cerr<<"exception: "<<e.what()<<std::endl;
+        ok = false;
+    }
+    std::error_code ec;
+    std::filesystem::remove_all(dir, ec);
+
+    std::cout<<(ok ? "OK" : "FAILED")<<std::endl;
+    return ok ? 0 : 1;
+}
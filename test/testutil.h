@@ -0,0 +1,93 @@
+/*
+ * Copyright (C) 2024 CYGNO Collaboration
+ *
+ *
+ * Author: Stefano Piacentini
+ * Created in 2024
+ *
+ */
+
+// Helpers shared by the tests: the printout of the checks, files written and read back whole, and
+// synthetic MIDAS runs (a BOR event with an ODB dump, the given events and an EOR event).
+
+#ifndef __CYGNO_TEST_TESTUTIL_H__
+#define __CYGNO_TEST_TESTUTIL_H__
+
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <zlib.h>
+#include "TMidasEvent.h"
+
+
+namespace cygnotest {
+
+    // prints the outcome of a check and returns it
+    inline bool Check(bool condition, const std::string &what) {
+        std::cout<<"  "<<what<<": "<<(condition ? "ok" : "FAILED")<<std::endl;
+        return condition;
+    }
+
+    inline std::string ReadFile(const std::string &filename) {
+        std::ifstream in(filename, std::ios::binary);
+        std::stringstream ss;
+        ss<<in.rdbuf();
+        return ss.str();
+    }
+
+    inline void WritePlain(const std::string &filename, const std::string &content) {
+        std::ofstream out(filename, std::ios::binary | std::ios::trunc);
+        out.write(content.data(), content.size());
+        if(!out) throw std::runtime_error("cannot write "+filename);
+    }
+
+    // compressed in nmembers gzip members, as the DAQ may write it
+    inline void WriteGzip(const std::string &filename, const std::string &content, unsigned int nmembers = 1) {
+        std::size_t step = content.size()/nmembers + 1;
+        for(std::size_t begin=0; begin<content.size(); begin+=step) {
+            std::size_t n = std::min(step, content.size()-begin);
+            gzFile gz = gzopen(filename.c_str(), begin==0 ? "wb" : "ab");
+            if(!gz || gzwrite(gz, content.data()+begin, n)!=int(n) || gzclose(gz)!=Z_OK) {
+                throw std::runtime_error("cannot write "+filename);
+            }
+        }
+    }
+
+    inline std::string RandomContent(uint64_t size, std::mt19937 &rng) {
+        std::string content(size, '\0');
+        for(char &c : content) c = char(rng());
+        return content;
+    }
+
+    inline void AppendEvent(std::string &out, uint16_t id, uint32_t serial, const std::string &data) {
+        TMidasEvent_EVENT_HEADER header;
+        header.fEventId      = id;
+        header.fTriggerMask  = 0;
+        header.fSerialNumber = serial;
+        header.fTimeStamp    = 1700000000 + serial;
+        header.fDataSize     = data.size();
+        out.append((const char *)&header, sizeof(header));
+        out += data;
+    }
+
+    // the uncompressed content of a run: a BOR event, the data of events as events of id 1 and
+    // serial numbers from 1 on, and, unless cut off, an EOR event; BOR and EOR carry an ODB dump,
+    // as those of the DAQ do
+    inline std::string MakeRun(const std::string &name, const std::vector<std::string> &events, bool eor = true) {
+        std::string run;
+        std::string odb = "<odb name=\""+name+"\"></odb>\n";
+        AppendEvent(run, 0x8000, 0, odb);
+        for(std::size_t evt=0; evt<events.size(); evt++) AppendEvent(run, 1, evt+1, events[evt]);
+        if(eor) AppendEvent(run, 0x8001, events.size()+1, odb);
+        return run;
+    }
+
+}
+
+#endif
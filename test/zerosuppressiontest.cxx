@@ -0,0 +1,152 @@
+/*
+ * Copyright (C) 2024 CYGNO Collaboration
+ *
+ *
+ * Author: Stefano Piacentini
+ * Created in 2024
+ *
+ */
+
+// Checks ZeroSuppress() against ZeroSuppressScalar() at every instruction set level supported by
+// the CPU:
+//  - on frames whose rows are not a multiple of 8 or 16 pixels wide, from empty to fully above
+//    threshold, with pixels exactly at their threshold and views of a wider image;
+//  - with one HitList reused across frames of growing and shrinking sizes and occupancies, so
+//    that the kernels write up to the end of the storage and its slack;
+//  - the hits read row by row through GetRowOffsets() are those of ToDense(), which are those of
+//    PedestalMap::Subtract() above the thresholds.
+//
+// usage: zerosuppressiontest
+// It returns 0 on success and 1 on a failure.
+
+#include "zerosuppression.h"
+#include "cygnosimd.h"
+#include "testutil.h"
+#include <algorithm>
+#include <cstdint>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace {
+
+    using cygnotest::Check;
+
+    struct Frame {
+        std::vector<uint16_t> image;
+        cygnolib::ImageView<const uint16_t> view;
+        cygnolib::PedestalMap pedestal;
+        cygnolib::AlignedVector<float> thresholds;
+        Frame(unsigned int rows, unsigned int columns): pedestal(rows, columns) {}
+        cygnolib::Span<const float> GetThresholds() const { return cygnolib::Span<const float>(thresholds.data(), thresholds.size()); }
+    };
+
+    // a frame in which a fraction occupancy of the pixels is above threshold, a few exactly at it,
+    // in an image padding pixels wider
+    Frame MakeFrame(unsigned int rows, unsigned int columns, double occupancy, unsigned int padding, std::mt19937 &rng) {
+        Frame frame(rows, columns);
+        for(float &m : frame.pedestal.GetMean()) m = 90 + float(rng()%2000)/100.f;
+        for(float &s : frame.pedestal.GetRMS())  s = float(rng()%400)/100.f;
+        frame.thresholds = cygnolib::ZeroSuppressionThresholds(frame.pedestal, 3, 1);
+
+        std::size_t stride = columns+padding;
+        frame.image.assign(std::size_t(rows)*stride, 0);
+        std::uniform_real_distribution<double> uniform(0, 1);
+        for(unsigned int r=0; r<rows; r++) {
+            for(unsigned int c=0; c<columns; c++) {
+                std::size_t i = std::size_t(r)*columns + c;
+                float mean = frame.pedestal.GetMean()[i], threshold = frame.thresholds[i];
+                float level;
+                if(uniform(rng)<occupancy) level = threshold + 1 + float(rng()%3000);
+                else if(rng()%50==0)       level = threshold;
+                else                       level = float(rng()%100)/100.f*threshold - float(rng()%40);
+                frame.image[r*stride + c] = uint16_t(std::min(std::max(std::lrint(mean + level), 0L), 65535L));
+            }
+        }
+        frame.view = cygnolib::ImageView<const uint16_t>(frame.image.data(), rows, columns, stride);
+        return frame;
+    }
+
+    bool Same(const cygnolib::HitList &a, const cygnolib::HitList &b) {
+        auto equal = [](auto x, auto y) { return x.size()==y.size() && std::equal(x.begin(), x.end(), y.begin()); };
+        return a.GetNRows()==b.GetNRows() && a.GetNColumns()==b.GetNColumns() && a.Size()==b.Size() &&
+               equal(a.GetRows(), b.GetRows()) && equal(a.GetColumns(), b.GetColumns()) &&
+               equal(a.GetValues(), b.GetValues()) && equal(a.GetRowOffsets(), b.GetRowOffsets());
+    }
+
+    // the hits read row by row against ToDense(), and ToDense() against the subtracted frame
+    bool Consistent(const cygnolib::HitList &hits, const Frame &frame) {
+        std::size_t rows = hits.GetNRows(), columns = hits.GetNColumns();
+        cygnolib::AlignedVector<int32_t> dense = hits.ToDense();
+        cygnolib::AlignedVector<int32_t> byrow(rows*columns, 0);
+        bool ok = hits.GetRowOffsets().size()==rows+1 && hits.GetRowOffsets()[0]==0 && hits.GetRowOffsets()[rows]==hits.Size();
+        for(unsigned int r=0; r<rows && ok; r++) {
+            cygnolib::Span<const uint32_t> cols = hits.GetRowColumns(r);
+            cygnolib::Span<const int32_t> values = hits.GetRowValues(r);
+            for(std::size_t k=0; k<cols.size(); k++) {
+                // increasing columns, and every hit of the row in the row
+                ok = ok && cols[k]<columns && (k==0 || cols[k]>cols[k-1]) && hits.GetRows()[hits.GetRowOffsets()[r]+k]==r;
+                if(ok) byrow[r*columns + cols[k]] = values[k];
+            }
+        }
+        ok = ok && byrow==dense;
+
+        cygnolib::AlignedVector<int32_t> subtracted;
+        frame.pedestal.Subtract(frame.view, subtracted);
+        for(std::size_t i=0; i<rows*columns && ok; i++) {
+            uint16_t pixel = frame.view(i/columns, i%columns);
+            bool above = float(pixel) - frame.pedestal.GetMean()[i] > frame.thresholds[i];
+            ok = dense[i]==(above ? subtracted[i] : 0);
+        }
+        return ok;
+    }
+
+    bool Frames(std::mt19937 &rng) {
+        const unsigned int widths[] = {1, 5, 7, 8, 9, 13, 15, 16, 17, 23, 31, 33, 47, 100, 257};
+        const double occupancies[] = {0, 0.001, 0.05, 0.5, 0.97, 1};
+        // one list reused across all the frames, as in the reconstruction
+        cygnolib::HitList reused;
+        uint64_t nframes = 0, nhits = 0, mismatches = 0, inconsistent = 0;
+        for(int pass=0; pass<3; pass++) {
+            for(unsigned int width : widths) {
+                for(double occupancy : occupancies) {
+                    unsigned int rows = 1 + rng()%40;
+                    Frame frame = MakeFrame(rows, width, occupancy, pass==1 ? 1 + rng()%9 : 0, rng);
+                    cygnolib::HitList ref;
+                    cygnolib::ZeroSuppressScalar(frame.view, frame.pedestal, frame.GetThresholds(), ref);
+                    cygnolib::ZeroSuppress(frame.view, frame.pedestal, frame.GetThresholds(), reused);
+                    nframes++;
+                    nhits += ref.Size();
+                    if(!Same(reused, ref)) {
+                        if(mismatches++ < 5) std::cout<<"    "<<rows<<"x"<<width<<" at occupancy "<<occupancy<<" differs"<<std::endl;
+                    }
+                    if(!Consistent(reused, frame)) inconsistent++;
+                }
+            }
+        }
+        bool ok = Check(mismatches==0, std::to_string(nframes)+" frames, "+std::to_string(nhits)+" hits as ZeroSuppressScalar()");
+        ok = Check(inconsistent==0, "rows, ToDense() and PedestalMap::Subtract() consistent") && ok;
+        return ok;
+    }
+
+}
+
+int main() {
+
+    bool ok = true;
+    try {
+        for(int level=int(cygnolib::SimdLevel::Scalar); level<=int(cygnolib::GetSupportedSimdLevel()); level++) {
+            cygnolib::SetSimdLevel(cygnolib::SimdLevel(level));
+            std::cout<<cygnolib::SimdLevelName(cygnolib::GetSimdLevel())<<std::endl;
+            std::mt19937 rng(20240601);
+            ok = Frames(rng) && ok;
+        }
+    } catch(std::exception &e) {
+        std::cerr<<"exception: "<<e.what()<<std::endl;
+        ok = false;
+    }
+
+    std::cout<<(ok ? "OK" : "FAILED")<<std::endl;
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,59 @@
+/*
+ * Copyright (C) 2024 CYGNO Collaboration
+ *
+ *
+ * Author: Stefano Piacentini
+ * Created in 2024
+ *
+ */
+
+// Converts the DRS4 text correction tables to the binary calibration format read by
+// cygnolib::LoadDRS4CalibrationBinary().
+//
+// usage: drs4convert <tag> [input dir] [output file]
+//
+// The input dir defaults to $RECOPPSYS/input and the output file to <input dir>/table_<tag>.bin,
+// which is where cygnolib::InitializePMTReadout looks for it.
+
+#include "drs4.h"
+#include <cstdlib>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+
+int main(int argc, char **argv) {
+    
+    if(argc < 2) {
+        std::cerr<<"usage: "<<argv[0]<<" <tag> [input dir] [output file]"<<std::endl;
+        return 1;
+    }
+    
+    std::string tag(argv[1]);
+    std::string inputdir;
+    if(argc > 2) {
+        inputdir = argv[2];
+    } else {
+        const char *recoppsys = getenv("RECOPPSYS");
+        if(!recoppsys) {
+            std::cerr<<"RECOPPSYS is not set: please give the input dir explicitly"<<std::endl;
+            return 1;
+        }
+        inputdir = std::string(recoppsys)+"/input";
+    }
+    std::string output = argc > 3 ? std::string(argv[3]) : inputdir+"/table_"+tag+".bin";
+    
+    try {
+        cygnolib::DRS4Calibration calib = cygnolib::LoadDRS4CalibrationText(inputdir+"/table_cell_"+tag+".txt",
+                                                                            inputdir+"/table_nsample_"+tag+".txt",
+                                                                            tag);
+        cygnolib::WriteDRS4CalibrationBinary(calib, output);
+        cygnolib::LoadDRS4CalibrationBinary(output); // validate what has been written
+        std::cout<<"Written "<<output<<" ("<<calib.GetNChannels()<<" channels, "
+                 <<calib.GetNCells()<<" cells)"<<std::endl;
+    } catch(std::exception &e) {
+        std::cerr<<e.what()<<std::endl;
+        return 1;
+    }
+    
+    return 0;
+}
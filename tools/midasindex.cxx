@@ -0,0 +1,43 @@
+/*
+ * Copyright (C) 2024 CYGNO Collaboration
+ *
+ *
+ * Author: Stefano Piacentini
+ * Created in 2024
+ *
+ */
+
+// Builds the random-access index of a MIDAS file and writes it next to the file, where
+// cygnolib::MidasIndex::LoadOrBuild() looks for it.
+//
+// usage: midasindex <file.mid.gz> [span in MB]
+
+#include "cygnoindex.h"
+#include <cstdlib>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+
+int main(int argc, char **argv) {
+    
+    if(argc < 2) {
+        std::cerr<<"usage: "<<argv[0]<<" <file.mid.gz> [span in MB]"<<std::endl;
+        return 1;
+    }
+    
+    std::string filename(argv[1]);
+    uint64_t span = argc > 2 ? std::strtoull(argv[2], nullptr, 10)*1024*1024 : cygnolib::kMidasIndexSpan;
+    
+    try {
+        cygnolib::MidasIndex index = cygnolib::MidasIndex::Build(filename, span);
+        std::string output = cygnolib::GetMidasIndexFilename(filename);
+        index.Save(output);
+        std::cout<<"Written "<<output<<" ("<<index.GetNEvents()<<" events, "
+                 <<index.GetNCheckpoints()<<" checkpoints)"<<std::endl;
+    } catch(std::exception &e) {
+        std::cerr<<e.what()<<std::endl;
+        return 1;
+    }
+    
+    return 0;
+}